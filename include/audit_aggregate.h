@@ -0,0 +1,167 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_aggregate.h
+ *
+ * Aggregation mode (audit_aggregate_cmds). Events of the selected
+ * commands are not logged one by one: they are accumulated per user, db,
+ * query digest (see audit_digest.h) and command, and every
+ * audit_aggregate_interval seconds a "summary" record per key is logged
+ * through the enabled handlers and the accumulators start over.
+ *
+ * An accumulator holds the number of events, the sum of their rows and a
+ * histogram of their execution time, from which the summary reports
+ * percentiles.
+ */
+
+#ifndef AUDIT_AGGREGATE_H_
+#define AUDIT_AGGREGATE_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Log linear histogram (as HdrHistogram) of microseconds. Values below
+ * 2 * AUDIT_HIST_HALF are counted exactly. Above, each power of 2 range
+ * is split in AUDIT_HIST_HALF buckets, so a value is known within 1/32
+ * (3%). Values from 2^AUDIT_HIST_MAX_BITS us (19 hours) are counted in
+ * the last bucket.
+ */
+#define AUDIT_HIST_SUB_BITS 6
+#define AUDIT_HIST_HALF (1 << (AUDIT_HIST_SUB_BITS - 1))
+#define AUDIT_HIST_MAX_BITS 36
+#define AUDIT_HIST_BUCKETS ((AUDIT_HIST_MAX_BITS - AUDIT_HIST_SUB_BITS + 2) * AUDIT_HIST_HALF)
+
+struct Audit_histogram {
+	unsigned int counts[AUDIT_HIST_BUCKETS];
+
+	void add(unsigned long long val)
+	{
+		counts[index(val)]++;
+	}
+
+	static int index(unsigned long long val);
+	// highest value counted in the bucket
+	static unsigned long long bucket_max(int index);
+	/**
+	 * Value which per_mille / 1000 of the total values are at or below.
+	 * The highest value of its bucket, so the error is on the high side.
+	 */
+	unsigned long long percentile(unsigned long long total, unsigned int per_mille) const;
+};
+
+// accumulated events of a key for an interval
+struct Audit_summary {
+	// the key. user and db may be NULL
+	const char *user;
+	const char *db;
+	const char *cmd;
+	unsigned long long digest;
+	// normalized query of the first event (truncated to AUDIT_SUMMARY_MAX_QUERY)
+	const char *query;
+	size_t query_len;
+	// interval, milliseconds since the epoch (as the record date)
+	unsigned long long start;
+	unsigned long long end;
+	unsigned long long count;
+	unsigned long long rows;
+	// events with an execution time (in hist)
+	unsigned long long timed;
+	// execution time sum and max. microseconds
+	unsigned long long time_sum;
+	unsigned long long time_max;
+	Audit_histogram hist;
+};
+
+#define AUDIT_SUMMARY_MAX_QUERY 1024
+
+struct Audit_aggregate_entry;
+
+class Audit_aggregator {
+public:
+	static const unsigned int DEF_INTERVAL = 60;
+	static const unsigned int DEF_MAX_ENTRIES = 4096;
+
+	Audit_aggregator()
+		: m_interval(DEF_INTERVAL), m_max_entries(DEF_MAX_ENTRIES),
+		m_initialized(false), m_thread_started(false), m_stop(false),
+		m_num_entries(0), m_overflow(0), m_interval_start(0)
+	{
+	}
+
+	/**
+	 * Init the locks and start the flush thread.
+	 * Return 0 on success.
+	 */
+	int init();
+
+	// stop the flush thread and log what was accumulated
+	void deinit();
+
+	/**
+	 * Accumulate an event. exec_time is in microseconds, with timed false
+	 * if it wasn't measured.
+	 * Return false if the event couldn't be accumulated (the table is full
+	 * or out of memory). The event should be logged instead.
+	 */
+	bool add(const char *user, const char *db, const char *cmd,
+			const char *query, size_t query_len, unsigned long long rows,
+			unsigned long long exec_time, bool timed);
+
+	/**
+	 * Log a summary of each key accumulated since the last flush and start
+	 * a new interval.
+	 */
+	void flush();
+
+	/**
+	 * Seconds between summaries. Read at the start of each interval.
+	 * Public for sysvar.
+	 */
+	unsigned int m_interval;
+
+	/**
+	 * Max number of keys accumulated in an interval. Events of new keys
+	 * beyond it are logged as usual. Public for sysvar.
+	 */
+	unsigned int m_max_entries;
+
+protected:
+	Audit_aggregator & operator=(const Audit_aggregator&);
+	Audit_aggregator(const Audit_aggregator&);
+
+	static const size_t NUM_BUCKETS = 4096;
+	// buckets are locked in stripes: bucket b uses m_locks[b % NUM_LOCKS]
+	static const size_t NUM_LOCKS = 64;
+
+	void flush_run();
+	static void *flush_thread_func(void *arg);
+
+	Audit_aggregate_entry *m_buckets[NUM_BUCKETS];
+	pthread_mutex_t m_locks[NUM_LOCKS];
+	bool m_initialized;
+	bool m_thread_started;
+	volatile bool m_stop;
+	volatile int m_num_entries;
+	// events logged as the table was full, since the last flush
+	volatile unsigned long long m_overflow;
+	volatile unsigned long long m_interval_start;
+	pthread_t m_flush_thread;
+	pthread_mutex_t LOCK_flush;
+	pthread_cond_t COND_flush;
+};
+
+#endif /* AUDIT_AGGREGATE_H_ */
@@ -0,0 +1,49 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_atomic.h
+ *
+ * Minimal atomic helpers based upon the gcc __sync builtins.
+ * We don't use my_atomic as its interface changed between MySQL versions.
+ *
+ * The plugin only runs on x86 (see hot_patch.cc), so plain loads have
+ * acquire semantics and plain stores have release semantics. We only
+ * need to stop the compiler from reordering, except where a store must
+ * be ordered before a following load, which requires a full barrier.
+ */
+
+#ifndef AUDIT_ATOMIC_H_
+#define AUDIT_ATOMIC_H_
+
+// compiler only barrier
+#define audit_compiler_barrier() __asm__ __volatile__("" ::: "memory")
+
+// full memory barrier (store-load ordering)
+#define audit_mb() __sync_synchronize()
+
+#define audit_atomic_cas(ptr, old_val, new_val) \
+	__sync_bool_compare_and_swap((ptr), (old_val), (new_val))
+
+#define audit_atomic_add(ptr, val) __sync_fetch_and_add((ptr), (val))
+
+#define audit_atomic_sub(ptr, val) __sync_fetch_and_sub((ptr), (val))
+
+// atomically set *ptr to val and return the previous value
+#define audit_atomic_swap(ptr, val) __sync_lock_test_and_set((ptr), (val))
+
+// size of a cache line. Used for padding hot shared variables.
+#define AUDIT_CACHE_LINE_SIZE 64
+
+#endif /* AUDIT_ATOMIC_H_ */
@@ -0,0 +1,220 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_bench.h
+ *
+ * Helpers for the standalone benchmark programs (audit_bench_*.cc):
+ * a nanosecond clock and a query corpus, read from a file with one
+ * query per line or the built in sample below.
+ */
+
+#ifndef AUDIT_BENCH_H_
+#define AUDIT_BENCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static inline unsigned long long audit_bench_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// keeps the compiler from optimizing away a result
+static volatile unsigned long long audit_bench_sink;
+
+static const char *const audit_bench_sample[] = {
+	"SELECT 1",
+	"select @@version_comment limit 1",
+	"SELECT id, name, email FROM customers WHERE id = 42",
+	"SELECT c.id, c.name, SUM(o.total) FROM customers c JOIN orders o ON o.customer_id = c.id "
+		"WHERE o.created_at >= '2016-01-01 00:00:00' AND c.country IN ('US', 'CA', 'GB') "
+		"GROUP BY c.id, c.name ORDER BY 3 DESC LIMIT 100",
+	"INSERT INTO events (user_id, kind, payload) VALUES (17, 'login', '{\"ip\":\"10.0.0.7\",\"agent\":\"Mozilla/5.0\"}')",
+	"INSERT INTO t1 VALUES (1, 'a'), (2, 'b'), (3, 'c'), (4, 'd'), (5, 'e'), (6, 'f'), (7, 'g'), (8, 'h')",
+	"UPDATE accounts SET balance = balance - 100.50, updated_at = NOW() WHERE id = 9001 AND balance >= 100.50",
+	"DELETE FROM sessions WHERE last_seen < DATE_SUB(NOW(), INTERVAL 30 DAY)",
+	"CREATE TABLE IF NOT EXISTS audit_test (id INT PRIMARY KEY AUTO_INCREMENT, note VARCHAR(255) NOT NULL DEFAULT '') ENGINE=InnoDB",
+	"ALTER TABLE orders ADD INDEX idx_created (created_at), ALGORITHM=INPLACE, LOCK=NONE",
+	"CREATE USER 'app'@'%' IDENTIFIED BY 'S3cr3t!pass'",
+	"SET PASSWORD FOR 'app'@'%' = PASSWORD('n3w\\'pass')",
+	"GRANT SELECT, INSERT ON shop.* TO 'report'@'10.%' IDENTIFIED BY 'r3port'",
+	"SELECT * FROM products WHERE name LIKE '%caf\xc3\xa9%' AND description LIKE '%\xe6\x97\xa5\xe6\x9c\xac%'",
+	"SELECT /* app:checkout */ p.sku, p.price FROM products p WHERE p.sku IN ('A-1', 'A-2', 'A-3', 'B-17', 'C-99') -- trailing comment",
+	"CALL process_batch(1024, 'nightly', @result)"
+};
+
+/**
+ * Queries to run a benchmark over.
+ */
+class Audit_bench_corpus {
+public:
+	Audit_bench_corpus() : m_queries(NULL), m_lens(NULL), m_count(0), m_data(NULL)
+	{
+	}
+
+	~Audit_bench_corpus()
+	{
+		free(m_queries);
+		free(m_lens);
+		free(m_data);
+	}
+
+	/**
+	 * Load one query per line from path (newlines in queries can be
+	 * written as \n). NULL loads the built in sample. Return false on failure.
+	 */
+	bool load(const char *path)
+	{
+		if (! path)
+		{
+			size_t count = sizeof(audit_bench_sample) / sizeof(audit_bench_sample[0]);
+			if (! alloc(count))
+			{
+				return false;
+			}
+			for (size_t i = 0; i < count; i++)
+			{
+				add(audit_bench_sample[i], strlen(audit_bench_sample[i]));
+			}
+			return true;
+		}
+		FILE *in = fopen(path, "rb");
+		if (! in)
+		{
+			fprintf(stderr, "%s: can't open\n", path);
+			return false;
+		}
+		size_t size = 0;
+		size_t len = 0;
+		for (;;)
+		{
+			if (len == size)
+			{
+				size = size ? size * 2 : 64 * 1024;
+				char *data = (char *) realloc(m_data, size + 1);
+				if (! data)
+				{
+					fclose(in);
+					return false;
+				}
+				m_data = data;
+			}
+			size_t n = fread(m_data + len, 1, size - len, in);
+			if (n == 0)
+			{
+				break;
+			}
+			len += n;
+		}
+		fclose(in);
+		if (! m_data)
+		{
+			return false;
+		}
+		m_data[len] = '\n';
+		size_t lines = 0;
+		for (size_t i = 0; i <= len; i++)
+		{
+			lines += (m_data[i] == '\n');
+		}
+		if (! alloc(lines))
+		{
+			return false;
+		}
+		size_t start = 0;
+		for (size_t i = 0; i <= len; i++)
+		{
+			if (m_data[i] != '\n')
+			{
+				continue;
+			}
+			// unescape \n in place
+			size_t out = start;
+			for (size_t j = start; j < i; j++)
+			{
+				if (m_data[j] == '\\' && j + 1 < i && m_data[j + 1] == 'n')
+				{
+					m_data[out++] = '\n';
+					j++;
+				}
+				else
+				{
+					m_data[out++] = m_data[j];
+				}
+			}
+			if (out > start)
+			{
+				add(m_data + start, out - start);
+			}
+			start = i + 1;
+		}
+		return m_count > 0;
+	}
+
+	size_t count() const
+	{
+		return m_count;
+	}
+
+	const char *query(size_t i) const
+	{
+		return m_queries[i];
+	}
+
+	size_t length(size_t i) const
+	{
+		return m_lens[i];
+	}
+
+	// total length of the queries
+	size_t bytes() const
+	{
+		size_t total = 0;
+		for (size_t i = 0; i < m_count; i++)
+		{
+			total += m_lens[i];
+		}
+		return total;
+	}
+
+private:
+	bool alloc(size_t count)
+	{
+		m_queries = (const char **) calloc(count > 0 ? count : 1, sizeof(const char *));
+		m_lens = (size_t *) calloc(count > 0 ? count : 1, sizeof(size_t));
+		return m_queries && m_lens;
+	}
+
+	void add(const char *query, size_t len)
+	{
+		m_queries[m_count] = query;
+		m_lens[m_count] = len;
+		m_count++;
+	}
+
+	Audit_bench_corpus(const Audit_bench_corpus&);
+	Audit_bench_corpus &operator =(const Audit_bench_corpus&);
+
+	const char **m_queries;
+	size_t *m_lens;
+	size_t m_count;
+	char *m_data;
+};
+
+#endif /* AUDIT_BENCH_H_ */
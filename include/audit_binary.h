@@ -0,0 +1,318 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_binary.h
+ *
+ * Compact binary audit record format. Used by Audit_binary_formatter
+ * and by the audit_decode tool which converts it back to json lines.
+ *
+ * Stream:  AUDIT_BIN_MAGIC followed by varint schema version, then
+ *          records. The magic is written each time a handler opens its
+ *          destination, and resets the session dictionary. Its first
+ *          byte is 0, which can't be the start of a record.
+ * Record:  varint payload length, payload.
+ * Payload: record type byte, varint field presence bitmap, the present
+ *          fields in bit order.
+ *
+ * Integers are unsigned LEB128 varints. Strings are a varint length
+ * followed by the bytes (utf8, not escaped). Lists whose size isn't known
+ * in advance (objects, connect attributes) end with a 0 byte.
+ *
+ * Session dictionary: the session part of the activity record (user till
+ * client_port) is sent in full (AUDIT_BIN_ACT_SESSION_DEF) only in the
+ * first record of a session in the stream, or when it changed. Records
+ * with the AUDIT_BIN_ACT_SESSION flag store the definition they carry
+ * under their thread-id, or use the one stored. A definition without
+ * the flag applies to its record only.
+ *
+ * Records are formatted with the definition, as a record may be shared
+ * by several streams and is written long after being formatted by
+ * asynchronous handlers. The writer of each stream drops it when the
+ * stream already has it (Audit_bin_stream_dict).
+ */
+
+#ifndef AUDIT_BINARY_H_
+#define AUDIT_BINARY_H_
+
+#include "audit_buffer.h"
+
+#define AUDIT_BIN_MAGIC "\0MYAUDIT"
+#define AUDIT_BIN_MAGIC_LEN 8
+// 2: the session definition is prefixed by its length
+#define AUDIT_BIN_VERSION 2
+
+// max bytes of a 64 bit varint
+#define AUDIT_BIN_MAX_VARINT 10
+
+// record types
+enum {
+	AUDIT_BIN_REC_HEADER = 1,
+	AUDIT_BIN_REC_ACTIVITY = 2,
+	AUDIT_BIN_REC_LOST = 3,
+	AUDIT_BIN_REC_SUMMARY = 4
+};
+
+// header record fields
+enum {
+	AUDIT_BIN_HDR_DATE = 0,
+	AUDIT_BIN_HDR_AUDIT_VERSION,
+	AUDIT_BIN_HDR_PROTOCOL_VERSION,
+	AUDIT_BIN_HDR_HOSTNAME,
+	AUDIT_BIN_HDR_MYSQL_VERSION,
+	AUDIT_BIN_HDR_MYSQL_PROGRAM,
+	AUDIT_BIN_HDR_MYSQL_SOCKET,
+	AUDIT_BIN_HDR_MYSQL_PORT,
+	AUDIT_BIN_HDR_SERVER_PID
+};
+
+// activity record fields
+enum {
+	AUDIT_BIN_ACT_DATE = 0,
+	AUDIT_BIN_ACT_THREAD_ID,
+	AUDIT_BIN_ACT_QUERY_ID,
+	AUDIT_BIN_ACT_SESSION,		// flag (no data): session of thread-id is in the dictionary
+	AUDIT_BIN_ACT_SESSION_DEF,	// varint length, session fields (below) with their own bitmap
+	AUDIT_BIN_ACT_ROWS,
+	AUDIT_BIN_ACT_CMD,
+	AUDIT_BIN_ACT_OBJECTS,		// per object a bitmap byte (below) and fields
+	AUDIT_BIN_ACT_QUERY,
+	AUDIT_BIN_ACT_DIGEST,		// varint
+	AUDIT_BIN_ACT_NORMALIZED_QUERY,
+	AUDIT_BIN_ACT_EXEC_TIME		// microseconds
+};
+
+// session fields
+enum {
+	AUDIT_BIN_SES_USER = 0,
+	AUDIT_BIN_SES_PRIV_USER,
+	AUDIT_BIN_SES_IP,
+	AUDIT_BIN_SES_HOST,
+	AUDIT_BIN_SES_CAPABILITIES,
+	AUDIT_BIN_SES_CONNECT_ATTRS,	// name/value string pairs. Names are never empty
+	AUDIT_BIN_SES_PID,
+	AUDIT_BIN_SES_OS_USER,
+	AUDIT_BIN_SES_APPNAME,
+	AUDIT_BIN_SES_CLIENT_PORT
+};
+
+// object fields
+enum {
+	AUDIT_BIN_OBJ_DB = 0,
+	AUDIT_BIN_OBJ_NAME,
+	AUDIT_BIN_OBJ_TYPE
+};
+// always set in the bitmap byte of an object, so it isn't the list end
+#define AUDIT_BIN_OBJ_ENTRY 0x80
+
+// events lost record fields
+enum {
+	AUDIT_BIN_LOST_DATE = 0,
+	AUDIT_BIN_LOST_COUNT
+};
+
+// summary record fields
+enum {
+	AUDIT_BIN_SUM_DATE = 0,
+	AUDIT_BIN_SUM_START,
+	AUDIT_BIN_SUM_USER,
+	AUDIT_BIN_SUM_DB,
+	AUDIT_BIN_SUM_CMD,
+	AUDIT_BIN_SUM_DIGEST,
+	AUDIT_BIN_SUM_NORMALIZED_QUERY,
+	AUDIT_BIN_SUM_COUNT,
+	AUDIT_BIN_SUM_ROWS,
+	AUDIT_BIN_SUM_TIMED	// varints: timed count, exec time avg, p50, p95, p99, max
+};
+
+#define AUDIT_BIN_BIT(field) (1ULL << (field))
+
+// encode a varint to dst (at least AUDIT_BIN_MAX_VARINT bytes). Returns the length
+static inline size_t audit_bin_encode_varint(unsigned char *dst, unsigned long long val)
+{
+	size_t len = 0;
+	while (val >= 0x80)
+	{
+		dst[len++] = (unsigned char) (val | 0x80);
+		val >>= 7;
+	}
+	dst[len++] = (unsigned char) val;
+	return len;
+}
+
+/**
+ * Decode a varint at *pos. Advances *pos.
+ * Returns false if the data is truncated or the varint is too long.
+ */
+static inline bool audit_bin_decode_varint(const unsigned char **pos,
+		const unsigned char *end, unsigned long long *val)
+{
+	unsigned long long res = 0;
+	const unsigned char *p = *pos;
+	for (unsigned int shift = 0; shift < 64 && p < end; shift += 7)
+	{
+		unsigned char b = *p++;
+		res |= ((unsigned long long) (b & 0x7F)) << shift;
+		if (! (b & 0x80))
+		{
+			*pos = p;
+			*val = res;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Writes binary fields to a buffer.
+ */
+class Audit_bin_writer {
+public:
+	Audit_bin_writer(Audit_buffer *buf) : m_buf(buf)
+	{
+	}
+
+	inline void byte(unsigned char b)
+	{
+		m_buf->append((const char *) &b, 1);
+	}
+
+	inline void varint(unsigned long long val)
+	{
+		unsigned char tmp[AUDIT_BIN_MAX_VARINT];
+		m_buf->append((const char *) tmp, audit_bin_encode_varint(tmp, val));
+	}
+
+	inline void string(const char *str, size_t len)
+	{
+		varint(len);
+		m_buf->append(str, len);
+	}
+
+	inline void string(const char *str)
+	{
+		string(str, strlen(str));
+	}
+
+	inline void raw(const char *data, size_t len)
+	{
+		m_buf->append(data, len);
+	}
+
+protected:
+	Audit_buffer *m_buf;
+};
+
+/**
+ * Session definitions written to a stream, by thread-id. Used by the
+ * writer of the stream to drop definitions the stream already has.
+ * Direct mapped: a thread whose slot was taken sends its definition again.
+ * Not thread safe. Reset when the stream starts.
+ */
+class Audit_bin_stream_dict {
+public:
+	// max length of the record head returned by strip():
+	// length, type, bitmap, date, thread-id and query-id
+	static const size_t MAX_HEAD = 1 + 5 * AUDIT_BIN_MAX_VARINT;
+
+	Audit_bin_stream_dict()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		memset(m_slots, 0, sizeof(m_slots));
+	}
+
+	/**
+	 * Check the record (with its length) about to be written. If it is an
+	 * activity record carrying a session definition which the stream
+	 * already has, returns the length of the record head without the
+	 * definition, written to head. The record continues at data + *tail.
+	 * Otherwise notes the definition and returns 0: the record is written
+	 * as is.
+	 */
+	size_t strip(const char *data, size_t size, unsigned char *head, size_t *tail)
+	{
+		const unsigned char *p = (const unsigned char *) data;
+		const unsigned char *end = p + size;
+		unsigned long long len;
+		if (! audit_bin_decode_varint(&p, end, &len) || len != (unsigned long long) (end - p)
+			|| len == 0 || *p != AUDIT_BIN_REC_ACTIVITY)
+		{
+			return 0;
+		}
+		p++;
+		unsigned long long bits;
+		const unsigned long long session_bits = AUDIT_BIN_BIT(AUDIT_BIN_ACT_THREAD_ID)
+			| AUDIT_BIN_BIT(AUDIT_BIN_ACT_SESSION) | AUDIT_BIN_BIT(AUDIT_BIN_ACT_SESSION_DEF);
+		if (! audit_bin_decode_varint(&p, end, &bits) || (bits & session_bits) != session_bits)
+		{
+			return 0;
+		}
+		// the fields before the definition
+		const unsigned char *fields = p;
+		unsigned long long thread_id;
+		unsigned long long val;
+		if (((bits & AUDIT_BIN_BIT(AUDIT_BIN_ACT_DATE)) && ! audit_bin_decode_varint(&p, end, &val))
+			|| ! audit_bin_decode_varint(&p, end, &thread_id)
+			|| ((bits & AUDIT_BIN_BIT(AUDIT_BIN_ACT_QUERY_ID)) && ! audit_bin_decode_varint(&p, end, &val)))
+		{
+			return 0;
+		}
+		size_t fields_len = p - fields;
+		unsigned long long def_len;
+		if (! audit_bin_decode_varint(&p, end, &def_len) || def_len > (unsigned long long) (end - p))
+		{
+			return 0;
+		}
+		// 64 bit FNV-1a. Never 0, so empty slots don't match
+		unsigned long long hash = 0xcbf29ce484222325ULL;
+		for (const unsigned char *c = p; c < p + def_len; c++)
+		{
+			hash = (hash ^ *c) * 0x100000001b3ULL;
+		}
+		hash |= 1;
+		Slot *slot = &m_slots[(thread_id * 0x9E3779B97F4A7C15ULL) >> (64 - SLOTS_BITS)];
+		if (slot->thread_id != thread_id || slot->def_hash != hash)
+		{
+			slot->thread_id = thread_id;
+			slot->def_hash = hash;
+			return 0;
+		}
+		p += def_len;
+		unsigned char bits_enc[AUDIT_BIN_MAX_VARINT];
+		size_t bits_len = audit_bin_encode_varint(bits_enc,
+				bits & ~AUDIT_BIN_BIT(AUDIT_BIN_ACT_SESSION_DEF));
+		size_t head_len = audit_bin_encode_varint(head, 1 + bits_len + fields_len + (end - p));
+		head[head_len++] = AUDIT_BIN_REC_ACTIVITY;
+		memcpy(head + head_len, bits_enc, bits_len);
+		head_len += bits_len;
+		memcpy(head + head_len, fields, fields_len);
+		head_len += fields_len;
+		*tail = (const char *) p - data;
+		return head_len;
+	}
+
+private:
+	static const unsigned int SLOTS_BITS = 12;
+	struct Slot {
+		unsigned long long thread_id;
+		unsigned long long def_hash;
+	};
+	Slot m_slots[1 << SLOTS_BITS];
+};
+
+#endif /* AUDIT_BINARY_H_ */
@@ -0,0 +1,123 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+
+/*
+ * audit_bitstack.h
+ *
+ * Stack of bits, one per nesting level of executing statements. Used to
+ * log a statement once, though it may be audited several times.
+ *
+ * Zero filled memory is a valid empty stack, so it can be embedded in
+ * structs allocated with calloc (call release() before freeing them).
+ */
+
+#ifndef AUDIT_BITSTACK_H_
+#define AUDIT_BITSTACK_H_
+
+#include <stdlib.h>
+
+class Audit_bitstack {
+public:
+	Audit_bitstack() : m_inline(0), m_words(NULL), m_num_words(0), m_depth(0)
+	{
+	}
+
+	~Audit_bitstack()
+	{
+		free(m_words);
+	}
+
+	// enter a level, with its bit clear
+	inline void push()
+	{
+		unsigned long long *w = word(m_depth);
+		if (w == NULL && grow(m_depth))
+		{
+			w = word(m_depth);
+		}
+		// on out of memory the level isn't tracked
+		if (w)
+		{
+			*w &= ~bit(m_depth);
+		}
+		m_depth++;
+	}
+
+	inline void pop()
+	{
+		if (m_depth > 0)
+		{
+			m_depth--;
+		}
+	}
+
+	// number of levels. 0 if not in a statement
+	unsigned int depth() const
+	{
+		return m_depth;
+	}
+
+	/**
+	 * Set the bit of the current level (there must be one).
+	 * Return its previous value, false if the level isn't tracked.
+	 */
+	inline bool test_and_set()
+	{
+		unsigned int level = m_depth - 1;
+		unsigned long long *w = word(level);
+		if (w == NULL)
+		{
+			return false;
+		}
+		bool was_set = (*w & bit(level)) != 0;
+		*w |= bit(level);
+		return was_set;
+	}
+
+	// free the memory for levels beyond the first 64
+	void release();
+
+private:
+	Audit_bitstack & operator=(const Audit_bitstack&);
+	Audit_bitstack(const Audit_bitstack&);
+
+	static unsigned long long bit(unsigned int level)
+	{
+		return 1ULL << (level % 64);
+	}
+
+	// word holding the bit of level. NULL if not allocated
+	inline unsigned long long *word(unsigned int level)
+	{
+		if (level < 64)
+		{
+			return &m_inline;
+		}
+		unsigned int index = level / 64 - 1;
+		return index < m_num_words ? &m_words[index] : NULL;
+	}
+
+	bool grow(unsigned int level);
+
+	// levels 0 - 63
+	unsigned long long m_inline;
+	// levels from 64, allocated when nesting gets that deep
+	unsigned long long *m_words;
+	unsigned int m_num_words;
+	unsigned int m_depth;
+};
+
+#endif /* AUDIT_BITSTACK_H_ */
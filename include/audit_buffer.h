@@ -0,0 +1,113 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_buffer.h
+ *
+ * Growable output buffer. Used to format records into memory which is
+ * kept and reused across events.
+ *
+ * Zero filled memory is a valid empty buffer, so it can be embedded in
+ * structs allocated with calloc (call release() before freeing them).
+ */
+
+#ifndef AUDIT_BUFFER_H_
+#define AUDIT_BUFFER_H_
+
+#include <stdlib.h>
+#include <string.h>
+
+class Audit_buffer {
+public:
+	Audit_buffer() : m_data(NULL), m_len(0), m_size(0), m_error(false)
+	{
+	}
+
+	~Audit_buffer()
+	{
+		free(m_data);
+	}
+
+	/**
+	 * Make sure there is room for len additional bytes.
+	 * @return false on out of memory (and marks the buffer as failed)
+	 */
+	inline bool reserve(size_t len)
+	{
+		if (m_len + len <= m_size)
+		{
+			return true;
+		}
+		return grow(m_len + len);
+	}
+
+	inline bool append(const char *data, size_t len)
+	{
+		if (! reserve(len))
+		{
+			return false;
+		}
+		memcpy(m_data + m_len, data, len);
+		m_len += len;
+		return true;
+	}
+
+	/**
+	 * Empty the buffer. The allocated memory is kept for the next use
+	 * unless it is larger than high_water (0 means no limit).
+	 */
+	void reset(size_t high_water);
+
+	// free the memory
+	void release();
+
+	char *data() const
+	{
+		return m_data;
+	}
+
+	size_t length() const
+	{
+		return m_len;
+	}
+
+	// drop the data after the first len bytes
+	void truncate(size_t len)
+	{
+		if (len < m_len)
+		{
+			m_len = len;
+		}
+	}
+
+	// true if an append failed since the last reset
+	bool is_error() const
+	{
+		return m_error;
+	}
+
+protected:
+	Audit_buffer & operator=(const Audit_buffer&);
+	Audit_buffer(const Audit_buffer&);
+
+	bool grow(size_t min_size);
+
+	char *m_data;
+	size_t m_len;
+	size_t m_size;
+	bool m_error;
+};
+
+#endif /* AUDIT_BUFFER_H_ */
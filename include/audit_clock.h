@@ -0,0 +1,36 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_clock.h
+ */
+
+#ifndef AUDIT_CLOCK_H_
+#define AUDIT_CLOCK_H_
+
+#include <time.h>
+
+/**
+ * Monotonic time in microseconds, for measuring durations.
+ * clock_gettime is served by the vDSO so this doesn't enter the kernel.
+ */
+static inline unsigned long long audit_clock_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+#endif /* AUDIT_CLOCK_H_ */
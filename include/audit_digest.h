@@ -0,0 +1,47 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_digest.h
+ *
+ * Query digest: the query is normalized in one pass of the SQL tokenizer
+ * and hashed (64 bit FNV-1a) so queries of the same shape get the same
+ * digest. Normalization:
+ *   - comments and white space are dropped, tokens are separated by
+ *     one space (none around . and inside parens)
+ *   - keywords and identifiers are lower cased (not `quoted` ones)
+ *   - strings and numbers become ?
+ *   - a list of literals in parens becomes (...), so IN (1, 2) and
+ *     IN (1, 2, 3) are the same
+ *
+ *   SELECT * FROM t WHERE id IN (1,2,3) AND name = 'x'
+ *   select * from t where id in (...) and name = ?
+ */
+
+#ifndef AUDIT_DIGEST_H_
+#define AUDIT_DIGEST_H_
+
+#include "audit_buffer.h"
+
+/**
+ * Digest of the query. If normalized isn't NULL the normalized query is
+ * appended to it (without \0). The normalized query is at most twice
+ * the size of the query, and the space is reserved up front, so a
+ * buffer reused across calls doesn't allocate in steady state.
+ * Check normalized->is_error() for out of memory.
+ */
+unsigned long long audit_query_digest(const char *query, size_t len, Audit_buffer *normalized);
+
+#endif /* AUDIT_DIGEST_H_ */
@@ -0,0 +1,96 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_epoch.h
+ *
+ * Epoch based read side protection (similar to sleepable RCU).
+ * Readers only touch a counter in a per cpu stripe, so the hot path
+ * doesn't bounce a shared cache line between cpus. A writer calls
+ * synchronize() to wait for all readers which entered before it.
+ */
+
+#ifndef AUDIT_EPOCH_H_
+#define AUDIT_EPOCH_H_
+
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "audit_atomic.h"
+
+class Audit_epoch {
+public:
+	// number of reader stripes. readers are spread by the cpu they run on
+	static const unsigned int NUM_STRIPES = 64;
+
+	Audit_epoch() : m_idx(0)
+	{
+		memset(m_stripes, 0, sizeof(m_stripes));
+		pthread_mutex_init(&LOCK_sync, NULL);
+	}
+
+	~Audit_epoch()
+	{
+		pthread_mutex_destroy(&LOCK_sync);
+	}
+
+	/**
+	 * Enter a read side section.
+	 * @return token which should be passed to exit()
+	 */
+	inline unsigned int enter()
+	{
+		int cpu = sched_getcpu();
+		unsigned int stripe = cpu < 0 ? 0 : ((unsigned int) cpu) % NUM_STRIPES;
+		unsigned int idx = m_idx;
+		// full barrier: the increment is visible before any reads done in the section
+		audit_atomic_add(&m_stripes[stripe].count[idx], 1);
+		return (stripe << 1) | idx;
+	}
+
+	/**
+	 * Exit a read side section. May be called from a different cpu than enter().
+	 */
+	inline void exit(unsigned int token)
+	{
+		audit_atomic_sub(&m_stripes[token >> 1].count[token & 1], 1);
+	}
+
+	/**
+	 * Wait till all readers which entered before the call have exited.
+	 * Readers entering after the call aren't waited for.
+	 */
+	void synchronize();
+
+protected:
+	Audit_epoch & operator=(const Audit_epoch&);
+	Audit_epoch(const Audit_epoch&);
+
+	// wait till there are no readers in the epoch idx
+	void wait_readers(unsigned int idx);
+
+	struct Stripe {
+		volatile long count[2];
+		char pad[AUDIT_CACHE_LINE_SIZE - 2 * sizeof(long)];
+	};
+
+	Stripe m_stripes[NUM_STRIPES];
+	// current epoch index (0 or 1) for readers entering
+	volatile unsigned int m_idx;
+	// serialize writers
+	pthread_mutex_t LOCK_sync;
+};
+
+#endif /* AUDIT_EPOCH_H_ */
@@ -0,0 +1,308 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_filter.h
+ *
+ * Compiled forms of the filter lists (record_objs, whitelist_users). Lists are
+ * compiled when set, so checking an event costs a few hash lookups
+ * regardless of the list size.
+ */
+
+#ifndef AUDIT_FILTER_H_
+#define AUDIT_FILTER_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include "audit_atomic.h"
+
+/**
+ * Match str against a lower case host pattern, where % matches any
+ * sequence of chars and _ a single char (same as in mysql.user).
+ */
+bool audit_wild_match(const char *pattern, const char *str);
+
+/**
+ * Set of db objects (audit_record_objs). Entries are: db.name, *.name
+ * (the object in any db), db.* (any object in the db) and {} (the empty
+ * set of objects). An entry without a dot is a db, same as db.*, and
+ * * or *.* is any object. Matching is case insensitive.
+ */
+class Audit_obj_set {
+public:
+	Audit_obj_set()
+		: m_buckets(NULL), m_mask(0), m_count(0), m_empty(false), m_all(false), m_refs(1)
+	{
+	}
+
+	~Audit_obj_set()
+	{
+		clear();
+	}
+
+	/**
+	 * Allocate an empty set holding a single reference. NULL on out of
+	 * memory. Zero filled memory is an empty set, so we don't need new.
+	 */
+	static Audit_obj_set *create()
+	{
+		Audit_obj_set *set = (Audit_obj_set *) calloc(1, sizeof(Audit_obj_set));
+		if (set)
+		{
+			set->m_refs = 1;
+		}
+		return set;
+	}
+
+	/**
+	 * Sets are shared by the filter configurations which use them.
+	 * Add a reference and return the set.
+	 */
+	Audit_obj_set *ref()
+	{
+		audit_atomic_add(&m_refs, 1);
+		return this;
+	}
+
+	// drop a reference. The set is freed with the last one
+	static void release(Audit_obj_set *set)
+	{
+		if (set && audit_atomic_sub(&set->m_refs, 1) == 1)
+		{
+			set->clear();
+			free(set);
+		}
+	}
+
+	// remove all entries
+	void clear();
+
+	/**
+	 * Add the entries of a list separated by commas or new lines.
+	 * White space around entries is trimmed. # starts a comment till the
+	 * end of the line.
+	 * @return false on out of memory
+	 */
+	bool add_list(const char *list, size_t len);
+
+	// check if db.name matches one of the entries
+	bool match(const char *db, const char *name) const
+	{
+		if (m_all)
+		{
+			return true;
+		}
+		size_t db_len = strlen(db);
+		size_t name_len = strlen(name);
+		return contains(db, db_len, name, name_len)
+			|| contains("*", 1, name, name_len)
+			|| contains(db, db_len, "*", 1);
+	}
+
+	// true if the list has the {} entry
+	bool match_empty() const
+	{
+		return m_empty;
+	}
+
+	// number of entries
+	size_t count() const
+	{
+		return m_count;
+	}
+
+protected:
+	Audit_obj_set & operator=(const Audit_obj_set&);
+	Audit_obj_set(const Audit_obj_set&);
+
+	struct Entry {
+		Entry *next;
+		size_t hash;
+		size_t len;
+		char key[1];	// lower case db.name
+	};
+
+	// lookup of the key: first.second
+	bool contains(const char *first, size_t first_len,
+			const char *second, size_t second_len) const;
+	bool add(const char *entry, size_t len);
+	static bool add_entry(void *set, const char *entry, size_t len);
+	bool grow();
+
+	Entry **m_buckets;
+	size_t m_mask;
+	size_t m_count;
+	bool m_empty;
+	// the list has the *.* entry
+	bool m_all;
+	volatile int m_refs;
+};
+
+/**
+ * Set of users (audit_whitelist_users). Entries are: user (from any
+ * host) or user@host where host may have the % and _ wildcards, as in
+ * mysql.user. The names may be quoted. {} is the empty user.
+ * Matching is case insensitive.
+ */
+class Audit_user_set {
+public:
+	Audit_user_set()
+		: m_buckets(NULL), m_mask(0), m_count(0), m_generation(0), m_refs(1)
+	{
+	}
+
+	~Audit_user_set()
+	{
+		clear();
+	}
+
+	// allocate an empty set holding a single reference. NULL on out of memory
+	static Audit_user_set *create()
+	{
+		Audit_user_set *set = (Audit_user_set *) calloc(1, sizeof(Audit_user_set));
+		if (set)
+		{
+			set->m_refs = 1;
+		}
+		return set;
+	}
+
+	// add a reference and return the set
+	Audit_user_set *ref()
+	{
+		audit_atomic_add(&m_refs, 1);
+		return this;
+	}
+
+	// drop a reference. The set is freed with the last one
+	static void release(Audit_user_set *set)
+	{
+		if (set && audit_atomic_sub(&set->m_refs, 1) == 1)
+		{
+			set->clear();
+			free(set);
+		}
+	}
+
+	void clear();
+
+	/**
+	 * Add the entries of a list (same format as Audit_obj_set::add_list).
+	 * @return false on out of memory
+	 */
+	bool add_list(const char *list, size_t len);
+
+	/**
+	 * Check if the user connected from host/ip matches one of the entries.
+	 * host and ip may be NULL.
+	 */
+	bool match(const char *user, const char *host, const char *ip) const;
+
+	size_t count() const
+	{
+		return m_count;
+	}
+
+	/**
+	 * Unique id of the set. Used by sessions to know if their cached
+	 * match result is for the current set.
+	 */
+	unsigned long generation() const
+	{
+		return m_generation;
+	}
+
+	void set_generation(unsigned long generation)
+	{
+		m_generation = generation;
+	}
+
+protected:
+	Audit_user_set & operator=(const Audit_user_set&);
+	Audit_user_set(const Audit_user_set&);
+
+	struct Entry {
+		Entry *next;
+		size_t hash;	// of the user
+		size_t user_len;
+		char *host;	// lower case host pattern in key. NULL for any host
+		char key[1];	// lower case user
+	};
+
+	bool add(const char *entry, size_t len);
+	static bool add_entry(void *set, const char *entry, size_t len);
+	bool grow();
+
+	Entry **m_buckets;
+	size_t m_mask;
+	size_t m_count;
+	unsigned long m_generation;
+	volatile int m_refs;
+};
+
+/**
+ * Set of words to search for in a text (case insensitive). Used as a
+ * cheap check before running a regex: e.g. the password masking regex
+ * can only match queries which contain "password" or "identified".
+ */
+class Audit_word_set {
+public:
+	// allocate an empty set. NULL on out of memory
+	static Audit_word_set *create()
+	{
+		return (Audit_word_set *) calloc(1, sizeof(Audit_word_set));
+	}
+
+	static void destroy(Audit_word_set *set)
+	{
+		if (set)
+		{
+			free(set->m_words);
+			free(set);
+		}
+	}
+
+	/**
+	 * Add the words of a list (same format as Audit_obj_set::add_list).
+	 * @return false on out of memory
+	 */
+	bool add_list(const char *list, size_t len);
+
+	// check if text contains one of the words
+	bool search(const char *text, size_t len) const;
+
+	size_t count() const
+	{
+		return m_count;
+	}
+
+protected:
+	Audit_word_set & operator=(const Audit_word_set&);
+	Audit_word_set(const Audit_word_set&);
+
+	bool add(const char *word, size_t len);
+	static bool add_entry(void *set, const char *entry, size_t len);
+
+	// lower case words. each ends with \0
+	char *m_words;
+	size_t m_words_len;
+	size_t m_count;
+	// length of the shortest word
+	size_t m_min_len;
+	// non zero for the first char of a word (both cases)
+	unsigned char m_first[256];
+};
+
+#endif /* AUDIT_FILTER_H_ */
@@ -9,6 +9,13 @@
 #define AUDIT_HANDLER_H_
 
 #include "mysql_inc.h"
+#include "audit_queue.h"
+#include "audit_epoch.h"
+#include "audit_buffer.h"
+#include "audit_bitstack.h"
+#include "audit_json.h"
+#include "audit_binary.h"
+#include "audit_filter.h"
 #include <yajl/yajl_gen.h>
 
 #ifndef PCRE_STATIC
@@ -33,6 +40,9 @@
 #endif
 
 class THD;
+struct Audit_thread_buffers;
+struct Audit_peer_request;
+struct Audit_summary;
 
 #define MAX_NUM_QUERY_TABLE_ELEM 100
 typedef struct _QueryTableInf {
@@ -42,11 +52,6 @@ typedef struct _QueryTableInf {
 	const char *object_type[MAX_NUM_QUERY_TABLE_ELEM];
 } QueryTableInf;
 
-#define MAX_NUM_QUEUE_ELEM 1024
-typedef struct _THDPRINTED {
-	size_t cur_index;
-	char is_thd_printed_queue[MAX_NUM_QUEUE_ELEM];
-} THDPRINTED;
 
 struct PeerInfo {
 	unsigned long pid;
@@ -59,19 +64,92 @@ struct PeerInfo {
 	}
 };
 
-PeerInfo *retrieve_peerinfo(THD *thd);
+// Builds which get a hook on disconnect keep the per session state in
+// malloc'ed memory (freed on disconnect), so it can also cache formatted
+// output. MySQL 5.6+ notifies the disconnect to the audit plugin and in
+// MariaDB we hook end_connection. Older builds keep it in the memory of a
+// THDVAR_STR, which the server frees with the THD.
+#if defined(MARIADB_BASE_VERSION) || MYSQL_VERSION_ID >= 50600
+#define HAVE_AUDIT_SESSION 1
+#endif
+
+#define AUDIT_SESSION_MAGIC 0x41534553
+
+/**
+ * Per session plugin state, reached with one THDVAR read.
+ * Allocated on connect (or first use, for sessions which connected before
+ * the plugin was installed) and freed on disconnect.
+ */
+struct Audit_session {
+	// set once the struct is initialized (see Audit_formatter::thd_session)
+	unsigned int magic;
+	// peer credentials of a Unix domain socket client. Read on first use
+	PeerInfo peer;
+	bool peer_set;
+	// set while the peer names are resolved (peer has the uid and pid)
+	Audit_peer_request *peer_request;
+	/**
+	 * Printed flags of the statements being executed, one level per
+	 * nesting in stored programs. Empty when not executing.
+	 */
+	Audit_bitstack printed;
+	/**
+	 * Tables of a query cache hit. Allocated in the statement mem root
+	 * and only set while it executes.
+	 */
+	QueryTableInf *query_cache_tables;
+	/**
+	 * Result of matching the session user against whitelist_users, and
+	 * the generation of the list it is for (0 if not matched yet).
+	 */
+	bool user_whitelisted;
+	unsigned long user_filter_gen;
+	/**
+	 * Session part of the activity record (user till client_port) already
+	 * formatted. Rebuilt on connect/change user and when the formatter
+	 * options change. Only used with HAVE_AUDIT_SESSION.
+	 */
+	Audit_buffer prefix;
+	bool prefix_valid;
+	// formatter options generation the prefix was built for
+	unsigned long prefix_gen;
+	// session definition encoded by the binary formatter
+	Audit_buffer bin_prefix;
+	bool bin_prefix_valid;
+	unsigned long bin_prefix_gen;
+};
+
+/**
+ * The session if it can cache formatted output (which needs memory that
+ * is freed on disconnect), else NULL.
+ */
+static inline Audit_session *audit_session_cache(Audit_session *session)
+{
+#ifdef HAVE_AUDIT_SESSION
+	return session;
+#else
+	return NULL;
+#endif
+}
+
+PeerInfo *retrieve_peerinfo(THD *thd, Audit_session *session);
 
-const char *retrieve_command(THD *thd, bool& is_sql_cmd);
 typedef size_t OFFSET;
 
 #define MAX_COMMAND_CHAR_NUMBERS 40
 #define MAX_COM_STATUS_VARS_RECORDS 512
 
-// mysql max identifier is 64 so 2*64 + . and null
-#define MAX_OBJECT_CHAR_NUMBERS 131
-#define MAX_USER_CHAR_NUMBERS 20
-#define MAX_NUM_OBJECT_ELEM 256
-#define MAX_NUM_USER_ELEM 256
+/**
+ * Command ids. Used to check the command filters with a bit test.
+ * Sql commands (SQLCOM_xxx) come first, then server commands (COM_xxx),
+ * then commands which are only named by the plugin.
+ */
+#define AUDIT_CMD_SERVER_BASE MAX_COM_STATUS_VARS_RECORDS
+#define AUDIT_CMD_FAILED_LOGIN (AUDIT_CMD_SERVER_BASE + COM_END + 1)
+#define AUDIT_CMD_COUNT (AUDIT_CMD_FAILED_LOGIN + 1)
+
+const char *retrieve_command(THD *thd, bool& is_sql_cmd, int *cmd_id);
+
 
 /**
  * The struct used to hold offsets. We should have one per version.
@@ -124,6 +202,15 @@ public:
 	// return negative on fail
 	virtual ssize_t write(const char *data, size_t size) = 0;
 	virtual ssize_t write_no_lock(const char *str, size_t size) = 0;
+	// write head and then data as one write
+	virtual ssize_t write_parts_no_lock(const char *head, size_t head_len, const char *data, size_t size)
+	{
+		if (write_no_lock(head, head_len) < 0)
+		{
+			return -1;
+		}
+		return write_no_lock(data, size);
+	}
 	// return 0 on success
 	virtual int open(const char *io_dest, bool log_errors) = 0;
 	virtual void close() = 0;
@@ -135,16 +222,59 @@ public:
 	enum ObjectIterType { OBJ_NONE, OBJ_DB, OBJ_QUERY_CACHE, OBJ_TABLE_LIST };
 	// enum indicating source of statement
 	typedef enum { SOURCE_GENERAL, SOURCE_QUERY_CACHE } StatementSource;
+	/**
+	 * Construction is cheap: command, user and peer info are only
+	 * retrieved from the THD on first access and then kept.
+	 */
 	ThdSesData(THD *pTHD, StatementSource source = SOURCE_GENERAL);
 	THD *getTHD() const { return m_pThd;}
-	const char *getCmdName() const { return m_CmdName; }
-	void setCmdName(const char *cmd) { m_CmdName = cmd; }
-	const char *getUserName() { return m_UserName; }
+	const char *getCmdName() const
+	{
+		if (! m_CmdName)
+		{
+			resolve_command();
+		}
+		return m_CmdName;
+	}
+	// command id (AUDIT_CMD_xxx numbering) of the command name
+	int getCmdId() const
+	{
+		if (! m_CmdName)
+		{
+			resolve_command();
+		}
+		return m_cmdId;
+	}
+	void setCmdName(const char *cmd, int cmd_id) { m_CmdName = cmd; m_cmdId = cmd_id; }
+	const char *getUserName()
+	{
+		if (! m_UserName)
+		{
+			resolve_user();
+		}
+		return m_UserName;
+	}
+	// plugin state of the session. NULL on out of memory
+	Audit_session *getSession() const { return m_session; }
 	const unsigned long getPeerPid() const;
 	const char *getAppName() const;
 	const char *getOsUser() const;
-	const int getPort() const { return m_port; }
+	const int getPort() const
+	{
+		if (! m_peerResolved)
+		{
+			resolve_peer();
+		}
+		return m_port;
+	}
 	const StatementSource getStatementSource() const { return m_source; }
+	// should passwords in the query be masked. Set by the command filters
+	bool getPasswordMasking() const { return m_passwordMasking; }
+	void setPasswordMasking(bool val) { m_passwordMasking = val; }
+	// execution time of the statement in microseconds. Set after it executed
+	bool hasExecTime() const { return m_hasExecTime; }
+	unsigned long long getExecTime() const { return m_execTime; }
+	void setExecTime(unsigned long long us) { m_execTime = us; m_hasExecTime = true; }
 	/**
 	 * Start fetching objects. Return true if there are objects available.
 	 */
@@ -158,10 +288,17 @@ public:
 	bool getNextObject(const char **db_name, const char **obj_name, const char **obj_type);
 
 private:
+	void resolve_command() const;
+	void resolve_user();
+	void resolve_peer() const;
+
 	THD *m_pThd;
-	const char *m_CmdName;
+	Audit_session *m_session;
+	// lazily resolved. NULL until first access
+	mutable const char *m_CmdName;
+	mutable int m_cmdId;
 	const char *m_UserName;
-	bool m_isSqlCmd;
+	mutable bool m_isSqlCmd;
 	enum ObjectIterType m_objIterType;
 	// pointer for iterating tables
 	TABLE_LIST *m_tables;
@@ -174,9 +311,15 @@ private:
 	// Statement source
 	StatementSource m_source;
 
-	PeerInfo *m_peerInfo;
+	mutable bool m_peerResolved;
+	mutable PeerInfo *m_peerInfo;
 
-	int m_port;	// TCP port of remote side
+	mutable int m_port;	// TCP port of remote side
+
+	bool m_passwordMasking;
+
+	bool m_hasExecTime;
+	unsigned long long m_execTime;
 
 protected:
 	ThdSesData(const ThdSesData&);
@@ -213,9 +356,39 @@ public:
 	 * @return -1 on a failure
 	 */
 	virtual ssize_t stop_msg_format(IWriter *writer) { return 0; }
+	/**
+	 * Format a message reporting that records were dropped by the
+	 * asynchronous writer (queue overflow or io failure)
+	 * @return -1 on a failure
+	 */
+	virtual ssize_t lost_msg_format(IWriter *writer, ulonglong lost) { return 0; }
+	/**
+	 * Format a summary of aggregated events (see audit_aggregate.h)
+	 * @return -1 on a failure
+	 */
+	virtual ssize_t summary_format(IWriter *writer, const Audit_summary *summary) { return 0; }
+	/**
+	 * Write a record formatted by this formatter to a stream. Called by
+	 * the handler with the io lock held, in stream order. dict is the
+	 * state of the stream for the binary format.
+	 * @return -1 on a failure
+	 */
+	virtual ssize_t stream_write(IWriter *writer, Audit_bin_stream_dict *dict,
+			const char *data, size_t size)
+	{
+		return writer->write_no_lock(data, size);
+	}
 
 	static const char *retrieve_object_type(TABLE_LIST *pObj);
-	static QueryTableInf *getQueryCacheTableList1(THD *thd);
+	/**
+	 * Session state of the thd. Allocated on first call.
+	 * NULL on out of memory.
+	 */
+	static Audit_session *thd_session(THD *thd);
+	// number of rows to report for the event. 0 if none
+	static ulonglong thd_event_rows(ThdSesData *pThdData);
+	// text of the query. NULL (and 0 len) if there is none
+	static const char *thd_query(THD *thd, size_t *len);
 
 	// utility functions for fetching thd stuff
 	static inline my_thread_id thd_inst_thread_id(THD *thd)
@@ -569,6 +742,13 @@ static inline const CHARSET_INFO * pfs_connect_attrs_cs(void * pfs)
 class Audit_json_formatter: public Audit_formatter {
 public:
 	static const char *DEF_MSG_DELIMITER;
+	static const unsigned long DEF_BUFFER_HIGH_WATER = 1024 * 1024;
+
+	// how passwords are masked (audit_password_masking_method)
+	enum Password_masking_method {
+		PASSWORD_MASKING_LEXER = 0,	// audit_mask_secrets(): all secrets
+		PASSWORD_MASKING_REGEX	// audit_password_masking_regex: first match
+	};
 
 	Audit_json_formatter()
 		: m_msg_delimiter(NULL),
@@ -576,25 +756,28 @@ public:
 		m_write_sess_connect_attrs(true),
 		m_write_client_capabilities(false),
 		m_write_socket_creds(true),
-		m_password_mask_regex_preg(NULL),
-		m_password_mask_regex_compiled(false),
-		m_perform_password_masking(NULL)
+		m_write_digest(false),
+		m_write_normalized_query(false),
+		m_password_masking_method(PASSWORD_MASKING_REGEX),
+		m_password_mask_regex(NULL),
+		m_password_mask_prefilter(NULL),
+		m_buffer_high_water(DEF_BUFFER_HIGH_WATER),
+		m_validate_utf8(false),
+		m_session_gen(0)
 	{
 
 	}
 
 	virtual ~Audit_json_formatter()
 	{
-		if (m_password_mask_regex_preg)
-		{
-			m_password_mask_regex_compiled = false;
-			pcre_free(m_password_mask_regex_preg);
-			m_password_mask_regex_preg = NULL;
-		}
+		password_regex_free(m_password_mask_regex);
+		Audit_word_set::destroy(m_password_mask_prefilter);
 	}
 
 	virtual ssize_t event_format(ThdSesData *pThdData, IWriter *writer);
 	virtual ssize_t start_msg_format(IWriter *writer);
+	virtual ssize_t lost_msg_format(IWriter *writer, ulonglong lost);
+	virtual ssize_t summary_format(IWriter *writer, const Audit_summary *summary);
 
 	/**
 	 * Utility method used to compile a regex program.
@@ -609,6 +792,13 @@ public:
 	 */
 	bool compile_password_masking_regex(const char *str);
 
+	/**
+	 * Set the words a query must contain for the password masking regex
+	 * to run on it. NULL runs the regex on all queries. The formatter
+	 * takes ownership of the set.
+	 */
+	void set_password_masking_prefilter(Audit_word_set *words);
+
 	/**
 	 * Boolean indicating if to log start msg.
 	 * Public so sysvar can update.
@@ -634,9 +824,74 @@ public:
 	my_bool m_write_socket_creds;
 
 	/**
-	 * Callback function to determine if password masking should be performed
+	 * include the digest of the query (see audit_digest.h)
+	 * Public for sysvar
+	 */
+	my_bool m_write_digest;
+
+	/**
+	 * include the normalized query (literals replaced with ?)
+	 * Public for sysvar
+	 */
+	my_bool m_write_normalized_query;
+
+	/**
+	 * Password_masking_method.
+	 * Public for sysvar
+	 */
+	ulong m_password_masking_method;
+
+	/**
+	 * Events are formatted into a per thread buffer which is kept for the
+	 * next event. A buffer which grew larger than this size (in bytes) is
+	 * freed after use. 0 means buffers are always kept.
+	 * Public for sysvar.
+	 */
+	ulong m_buffer_high_water;
+
+	/**
+	 * Replace malformed utf8 in logged values with U+FFFD.
+	 * Public for sysvar.
+	 */
+	my_bool m_validate_utf8;
+
+	/**
+	 * Called when an option affecting the session part of the record
+	 * changes. Sessions will rebuild their cached prefix.
+	 */
+	void invalidate_sessions()
+	{
+		audit_atomic_add(&m_session_gen, 1);
+	}
+
+	unsigned long session_gen() const
+	{
+		return m_session_gen;
+	}
+
+	/**
+	 * Create/delete the key of the per thread buffers. Called at plugin
+	 * init/deinit. Deinit frees the buffers of all threads.
+	 * Return 0 on success.
+	 */
+	static int thread_buffers_init();
+	static void thread_buffers_deinit();
+
+	/**
+	 * Query text to log for the event: converted to utf8 and password
+	 * masked. If there is no query, the command name.
+	 * Return false if the query couldn't be masked (out of memory).
 	 */
-	my_bool (*m_perform_password_masking)(const char *cmd);
+	bool event_query(ThdSesData *pThdData, Audit_thread_buffers *tb,
+			const char *query, size_t qlen, const char **text, size_t *len);
+
+	/**
+	 * Digest and normalized query of the query text (as returned by
+	 * event_query), if enabled. normalized is NULL if not enabled.
+	 * Return false if neither is enabled.
+	 */
+	bool event_digest(Audit_thread_buffers *tb, const char *text, size_t len,
+			unsigned long long *digest, const char **normalized, size_t *normalized_len);
 
 	/**
 	 * Message delimiter. Should point to a valid json string
@@ -653,14 +908,76 @@ protected:
 	Audit_json_formatter(const Audit_json_formatter& );
 
 	/**
-	 * Boolean indicating if password masking regex is compiled
+	 * Compiled password masking regex. Replaced as a whole, so a reader
+	 * never pairs a regex with the study data of another one.
+	 */
+	struct Password_regex {
+		pcre *preg;
+		// pcre_study result (with the JIT code if supported) of the regex
+		pcre_extra *extra;
+	};
+
+	static void password_regex_free(Password_regex *regex);
+
+	/**
+	 * Mask the password in the query with the regex.
+	 * Return false if out of memory.
 	 */
-	my_bool m_password_mask_regex_compiled;
+	bool password_regex_mask(Audit_thread_buffers *tb, const Password_regex *regex,
+			const char **text, size_t *len);
+
+	// regex used for password masking. NULL if not compiled
+	Password_regex *volatile m_password_mask_regex;
+
+	// words checked before running the regex. NULL if not set
+	Audit_word_set *volatile m_password_mask_prefilter;
+	// readers of m_password_mask_regex and m_password_mask_prefilter.
+	// The replaced ones are freed after a grace period
+	Audit_epoch m_prefilter_epoch;
 
 	/**
-	 * Regex used for password masking
+	 * Generation of the options affecting the session part of the record
 	 */
-	pcre *m_password_mask_regex_preg;
+	volatile unsigned long m_session_gen;
+
+	// write the session part of the activity record (user till client_port)
+	void session_format(Audit_json_writer *w, ThdSesData *pThdData);
+};
+
+/**
+ * Format the audit event in the compact binary format (see audit_binary.h).
+ * Options (header message, session fields, password masking) are taken
+ * from the json formatter, so both formats log the same data.
+ */
+class Audit_binary_formatter: public Audit_formatter {
+public:
+	Audit_binary_formatter(Audit_json_formatter *json)
+		: m_json(json)
+	{
+	}
+
+	virtual ~Audit_binary_formatter()
+	{
+	}
+
+	virtual ssize_t event_format(ThdSesData *pThdData, IWriter *writer);
+	virtual ssize_t start_msg_format(IWriter *writer);
+	virtual ssize_t lost_msg_format(IWriter *writer, ulonglong lost);
+	virtual ssize_t summary_format(IWriter *writer, const Audit_summary *summary);
+	// drops the session definition if the stream already has it
+	virtual ssize_t stream_write(IWriter *writer, Audit_bin_stream_dict *dict,
+			const char *data, size_t size);
+
+protected:
+	Audit_binary_formatter& operator =(const Audit_binary_formatter& b);
+	Audit_binary_formatter(const Audit_binary_formatter& );
+
+	Audit_json_formatter *m_json;
+
+	// write the session definition (with its bitmap)
+	void session_format(Audit_bin_writer *w, ThdSesData *pThdData);
+	// write the record to the writer, prefixed by its length
+	ssize_t record_write(Audit_buffer *buf, IWriter *writer, bool lock);
 };
 
 /**
@@ -679,14 +996,29 @@ public:
 	 */
 	static void log_audit_all(ThdSesData *pThdData);
 
+	/**
+	 * Log a summary of aggregated events using each handler
+	 */
+	static void log_summary_all(const Audit_summary *summary);
+
 	/**
 	 * Will iterate the handler list and stop all handlers
 	 */
 	static void stop_all();
 
+	/**
+	 * Cheap check used by the hooks to skip capturing events when no
+	 * handler is enabled.
+	 */
+	static inline bool is_any_enabled()
+	{
+		return m_num_enabled > 0;
+	}
+
 	Audit_handler() :
 		m_initialized(false), m_enabled(false), m_print_offset_err(true),
-		m_formatter(NULL), m_failed(false), m_log_io_errors(true)
+		m_formatter(NULL), m_failed(false), m_log_io_errors(true),
+		m_gate_open(true)
 	{
 	}
 
@@ -694,7 +1026,7 @@ public:
 	{
 		if (m_initialized)
 		{
-			rwlock_destroy(&LOCK_audit);
+			pthread_mutex_destroy(&LOCK_gate);
 			pthread_mutex_destroy(&LOCK_io);
 		}
 	}
@@ -716,7 +1048,7 @@ public:
 			return 0;
 		}
 
-		int res = my_rwlock_init(&LOCK_audit, NULL);
+		int res = pthread_mutex_init(&LOCK_gate, MY_MUTEX_INIT_SLOW);
 		if (res)
 		{
 			return res;
@@ -739,6 +1071,12 @@ public:
 
 	void set_enable(bool val);
 
+	/**
+	 * Change the formatter. If enabled, the handler is restarted so the
+	 * new format starts with its header.
+	 */
+	void set_formatter(Audit_formatter *frmt);
+
 	bool is_enabled()
 	{
 		return m_enabled;
@@ -754,6 +1092,12 @@ public:
 	 */
 	void log_audit(ThdSesData *pThdData);
 
+	/**
+	 * Writer to use when the event is formatted once and shared between
+	 * handlers using the same formatter. NULL if not supported.
+	 */
+	virtual IWriter *get_writer() { return NULL; }
+
 	/**
 	 * Public so can be configured via sysvar
 	 */
@@ -768,6 +1112,14 @@ protected:
 	virtual bool handler_start_internal() = 0;
 	virtual void handler_stop_internal() = 0;
 	virtual bool handler_log_audit(ThdSesData *pThdData) = 0;
+	/**
+	 * Enter the gate and check that we should log.
+	 * If returns true log_audit_end must be called with the returned token.
+	 * pThdData is NULL for records which aren't about an event.
+	 */
+	bool log_audit_begin(ThdSesData *pThdData, unsigned int *token);
+	// exit the gate. on failure will set the handler as failed
+	void log_audit_end(bool success, unsigned int token);
 	bool m_initialized;
 	bool m_enabled;
 	bool m_failed;
@@ -793,19 +1145,49 @@ protected:
 private:
 	// bool indicating if to print offset errors to log or not
 	bool m_print_offset_err;	
-	// audit (enable) lock
-	rw_lock_t LOCK_audit;
-	inline void lock_shared()
+	// number of enabled handlers. updated by set_enable
+	static volatile int m_num_enabled;
+	/**
+	 * Enable gate. Logging threads enter an epoch read section (which only
+	 * touches a per cpu counter) and check the gate is open.
+	 * set_enable/flush close the gate, wait for the current readers to exit
+	 * and only then start/stop the handler.
+	 */
+	Audit_epoch m_epoch;
+	volatile bool m_gate_open;
+	// held while the gate is closed. serializes set_enable/flush
+	pthread_mutex_t LOCK_gate;
+	inline unsigned int gate_enter()
+	{
+		for (;;)
+		{
+			unsigned int token = m_epoch.enter();
+			if (m_gate_open)
+			{
+				return token;
+			}
+			m_epoch.exit(token);
+			// wait for the enable/flush in progress to complete
+			pthread_mutex_lock(&LOCK_gate);
+			pthread_mutex_unlock(&LOCK_gate);
+		}
+	}
+	inline void gate_exit(unsigned int token)
 	{
-		rw_rdlock(&LOCK_audit);
+		m_epoch.exit(token);
 	}
-	inline void lock_exclusive()
+	inline void gate_close()
 	{
-		rw_wrlock(&LOCK_audit);
+		pthread_mutex_lock(&LOCK_gate);
+		m_gate_open = false;
+		audit_mb();
+		m_epoch.synchronize();
 	}
-	inline void unlock()
+	inline void gate_open()
 	{
-		rw_unlock(&LOCK_audit);
+		audit_compiler_barrier();
+		m_gate_open = true;
+		pthread_mutex_unlock(&LOCK_gate);
 	}
 };
 
@@ -814,8 +1196,20 @@ private:
  */
 class Audit_io_handler: public Audit_handler, public IWriter {
 public:
+	// what to do when the asynchronous queue is full
+	enum AsyncOverflow {
+		ASYNC_OVERFLOW_BLOCK = 0,	// wait for the writer thread
+		ASYNC_OVERFLOW_DROP_NEWEST,	// drop the record being added
+		ASYNC_OVERFLOW_DROP_OLDEST	// drop the oldest queued record
+	};
+	static const unsigned int DEF_ASYNC_QUEUE_SIZE = 16384;
+
 	Audit_io_handler()
-		: m_io_dest(NULL), m_io_type(NULL)
+		: m_io_dest(NULL), m_async(FALSE),
+		m_async_queue_size(DEF_ASYNC_QUEUE_SIZE),
+		m_async_overflow(ASYNC_OVERFLOW_BLOCK), m_io_type(NULL),
+		m_async_active(false), m_writer_stop(false), m_writer_waiting(0),
+		m_producers_waiting(0), m_async_lost(0)
 	{
 	}
 
@@ -828,37 +1222,108 @@ public:
 	 * target we write to (socket/file). Public so we update via sysvar
 	 */
 	char *m_io_dest;
+
+	/**
+	 * Asynchronous delivery: client threads queue the formatted record
+	 * and a background thread writes it out. Checked when the handler
+	 * is started. Public so we update via sysvar.
+	 */
+	my_bool m_async;
+
+	/**
+	 * Max number of records queued in asynchronous mode. Checked when
+	 * the handler is started. Public so we update via sysvar.
+	 */
+	unsigned int m_async_queue_size;
+
+	/**
+	 * AsyncOverflow policy. Public so we update via sysvar.
+	 */
+	ulong m_async_overflow;
 	
+	virtual IWriter *get_writer()
+	{
+		return this;
+	}
+
 	inline ssize_t write(const char *data, size_t size) 
 	{
+		if (m_async_active)
+		{
+			return async_write(data, size);
+		}
 		pthread_mutex_lock(&LOCK_io);
-		ssize_t res = write_no_lock(data, size);
+		ssize_t res = record_write_no_lock(data, size);
 		pthread_mutex_unlock(&LOCK_io);	//release the IO lock
 		return res;
 	}		
 
 protected:
+	// write a record passed to write(). Called with LOCK_io
+	inline ssize_t record_write_no_lock(const char *data, size_t size)
+	{
+		return m_formatter->stream_write(this, &m_bin_dict, data, size);
+	}
+
 	/**
 	 * Will format using the writer
 	 */
 	virtual bool handler_log_audit(ThdSesData *pThdData);
 	virtual bool handler_start_internal();
 	virtual void handler_stop_internal();
+	// start/stop also the asynchronous writer if needed
+	virtual void handler_start();
+	virtual void handler_stop();
 	// used for logging messages
 	const char *m_io_type;
+
+	bool is_async_active() const
+	{
+		return m_async_active;
+	}
+
+private:
+	ssize_t async_write(const char *data, size_t size);
+	bool async_start();
+	void async_stop();
+	void async_wake_writer();
+	// write out the lost events message (if there are lost events). Called with LOCK_io
+	void async_write_lost_nolock();
+	void writer_run();
+	static void *writer_thread_func(void *arg);
+
+	// session definitions written to the stream. Protected by LOCK_io
+	Audit_bin_stream_dict m_bin_dict;
+	Audit_record_queue m_queue;
+	bool m_async_active;
+	volatile bool m_writer_stop;
+	volatile int m_writer_waiting;
+	volatile int m_producers_waiting;
+	// number of records dropped since the last lost events message
+	volatile ulonglong m_async_lost;
+	pthread_t m_writer_thread;
+	pthread_mutex_t LOCK_async;
+	pthread_cond_t COND_async_data;
+	pthread_cond_t COND_async_space;
 };
 
 class Audit_file_handler: public Audit_io_handler {
 public:
 
 	Audit_file_handler() :
-		m_sync_period(0), m_log_file(NULL), m_sync_counter(0), m_bufsize(0)
+		m_sync_period(0), m_bufsize(0), m_group_commit(FALSE), m_sync_delay(0),
+		m_log_file(NULL), m_sync_counter(0), m_write_seq(0), m_synced_seq(0),
+		m_sync_failed_seq(0), m_sync_leader(false)
 	{
 		m_io_type = "file";
+		pthread_mutex_init(&LOCK_sync, MY_MUTEX_INIT_FAST);
+		pthread_cond_init(&COND_sync, NULL);
 	}
 
 	virtual ~Audit_file_handler()
 	{
+		pthread_cond_destroy(&COND_sync);
+		pthread_mutex_destroy(&LOCK_sync);
 	}
 
 	/**
@@ -875,10 +1340,33 @@ public:
 	 */
 	long m_bufsize;
 
+	/**
+	 * Group commit of syncs. When enabled and m_sync_period is 1, the
+	 * writing thread doesn't sync under LOCK_io. Instead it waits till a
+	 * single sync done by one of the waiting threads (the leader) covers
+	 * its write. Not used with asynchronous writes.
+	 *
+	 * Public so we update via sysvar.
+	 */
+	my_bool m_group_commit;
+
+	/**
+	 * Max time in microseconds the group commit leader waits for
+	 * additional writes before syncing. Public so we update via sysvar.
+	 */
+	ulong m_sync_delay;
+
+	/**
+	 * Write function we pass to formatter. With group commit waits for
+	 * the write to be synced after releasing LOCK_io.
+	 */
+	ssize_t write(const char *data, size_t size);
+
 	/**
 	 * Write function we pass to formatter
 	 */
 	ssize_t write_no_lock(const char *data, size_t size);
+	ssize_t write_parts_no_lock(const char *head, size_t head_len, const char *data, size_t size);
 
 	void close();
 
@@ -889,10 +1377,29 @@ protected:
 	// additional instances
 	Audit_file_handler & operator=(const Audit_file_handler&);
 	Audit_file_handler(const Audit_file_handler&);
+
+	inline bool is_group_commit()
+	{
+		return m_group_commit && m_sync_period == 1 && ! is_async_active();
+	}
+
+	// wait till a sync covering write seq is done. return false if the sync failed
+	bool group_commit_wait(ulonglong seq);
+	// mark all writes up to seq as synced (res true) or failed to sync
+	void group_commit_done(ulonglong seq, bool res);
 	
 	FILE *m_log_file;
 	// the period to use for syncing
 	unsigned int m_sync_counter;
+	// group commit: sequence of the last write. protected by LOCK_io
+	ulonglong m_write_seq;
+	// group commit: last synced and last failed seq. protected by LOCK_sync
+	ulonglong m_synced_seq;
+	ulonglong m_sync_failed_seq;
+	// group commit: is there a thread currently doing a sync
+	bool m_sync_leader;
+	pthread_mutex_t LOCK_sync;
+	pthread_cond_t COND_sync;
 };
 
 class Audit_socket_handler: public Audit_io_handler {
@@ -0,0 +1,106 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_json.h
+ *
+ * Direct serializer for the audit json records. Keys and punctuation
+ * are written as precomputed fragments and only values are escaped.
+ * Output is the same as the one produced by yajl (without beautify,
+ * utf8 validation and solidus escaping). Escaping scans the values in
+ * 16/32 byte blocks using SSE2/AVX2 when available.
+ */
+
+#ifndef AUDIT_JSON_H_
+#define AUDIT_JSON_H_
+
+#include "audit_buffer.h"
+
+/**
+ * Fragment for a key of a string value which isn't the first member of
+ * the map. For example AUDIT_JSON_KEY("user") is: ,"user":"
+ * Expands to the string and its length.
+ */
+#define AUDIT_JSON_KEY(key) ",\"" key "\":\"", sizeof(",\"" key "\":\"") - 1
+
+// Constant fragment. Expands to the string and its length.
+#define AUDIT_JSON_LIT(str) str, sizeof(str) - 1
+
+class Audit_json_writer {
+public:
+	/**
+	 * @validate_utf8 if true, malformed utf8 in escaped values is replaced
+	 * with U+FFFD
+	 */
+	Audit_json_writer(Audit_buffer *buf, bool validate_utf8 = false)
+		: m_buf(buf), m_validate_utf8(validate_utf8)
+	{
+	}
+
+	// append a fragment as is
+	inline void raw(const char *str, size_t len)
+	{
+		m_buf->append(str, len);
+	}
+
+	// append the string escaped (without quotes)
+	void escape(const char *str, size_t len);
+
+	// append a number in decimal
+	void number(unsigned long long num);
+
+	/**
+	 * Escape using the scan named name instead of the fastest one the
+	 * cpu supports. For tests and benchmarks, not thread safe.
+	 * Return false if the scan isn't available.
+	 */
+	static bool scan_select(const char *name);
+
+	// name of the i-th scan (which may not be supported by the cpu). NULL after the last
+	static const char *scan_name(size_t i);
+
+	/**
+	 * Append a string member. key is an AUDIT_JSON_KEY fragment.
+	 * NULL values are skipped (same as we do with yajl).
+	 */
+	inline void string_field(const char *key, size_t key_len, const char *val)
+	{
+		if (val != NULL)
+		{
+			string_field(key, key_len, val, strlen(val));
+		}
+	}
+
+	inline void string_field(const char *key, size_t key_len, const char *val, size_t val_len)
+	{
+		raw(key, key_len);
+		escape(val, val_len);
+		raw("\"", 1);
+	}
+
+	// numbers are written as strings
+	inline void number_field(const char *key, size_t key_len, unsigned long long num)
+	{
+		raw(key, key_len);
+		number(num);
+		raw("\"", 1);
+	}
+
+protected:
+	Audit_buffer *m_buf;
+	bool m_validate_utf8;
+};
+
+#endif /* AUDIT_JSON_H_ */
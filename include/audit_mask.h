@@ -0,0 +1,66 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_mask.h
+ *
+ * Password masking using a SQL tokenizer. The query is scanned once,
+ * skipping comments and quoted text, and every secret string literal is
+ * replaced with '***':
+ *
+ *   IDENTIFIED [WITH plugin] BY|AS [PASSWORD] 'secret'
+ *   PASSWORD [FOR user] [=] 'secret'   (also MASTER_PASSWORD)
+ *   PASSWORD('secret'), OLD_PASSWORD('secret')
+ *   AES_ENCRYPT(str, 'key') and the other encryption functions with a key
+ *   argument (AES_DECRYPT, DES_ENCRYPT, DES_DECRYPT, ENCODE, DECODE)
+ */
+
+#ifndef AUDIT_MASK_H_
+#define AUDIT_MASK_H_
+
+#include "audit_buffer.h"
+
+/**
+ * Mask the secrets of query. If there are any, the masked query (ending
+ * with \0) is appended to out. Otherwise out is not changed.
+ *
+ * @return the number of masked secrets, or -1 on out of memory
+ */
+int audit_mask_secrets(const char *query, size_t len, Audit_buffer *out);
+
+/*
+ * Default regex of the regex masking method (password_masking_regex).
+ * The secret is the named subpattern psw.
+ */
+#define _COMMENT_SPACE_ "(?:/\\*.*?\\*/|\\s)*?"
+#define _QUOTED_PSW_ "[\'|\"](?<psw>.*?)(?<!\\\\)[\'|\"]"
+
+#define AUDIT_PW_MASKING_DEFAULT_REGEX \
+	/* identified by [password] '***' */ \
+	"identified" _COMMENT_SPACE_ "by" _COMMENT_SPACE_ "(?:password)?" _COMMENT_SPACE_ _QUOTED_PSW_ \
+	/* password function */ \
+	"|password" _COMMENT_SPACE_ "\\(" _COMMENT_SPACE_ _QUOTED_PSW_ _COMMENT_SPACE_ "\\)" \
+	/* Used at: CHANGE MASTER TO MASTER_PASSWORD='new3cret', SET PASSWORD [FOR user] = 'hash', password 'user_pass'; */ \
+	"|password" _COMMENT_SPACE_ "(?:for" _COMMENT_SPACE_ "\\S+?)?" _COMMENT_SPACE_ "=" _COMMENT_SPACE_ _QUOTED_PSW_ \
+	"|password" _COMMENT_SPACE_ _QUOTED_PSW_
+	/* federated engine create table with connection. See: http://dev.mysql.com/doc/refman/5.5/en/federated-create-connection.html
+	 * not included as federated engine is disabled by default:
+	 * "|ENGINE"_COMMENT_SPACE_"="_COMMENT_SPACE_"FEDERATED"_COMMENT_SPACE_".*CONNECTION"_COMMENT_SPACE_"="_COMMENT_SPACE_"[\'|\"]\\S+?://\\S+?:(?<psw>.*)@\\S+[\'|\"]"
+	 */
+
+// words the default regex requires (password_masking_prefilter)
+#define AUDIT_PW_MASKING_DEFAULT_PREFILTER "identified,password,passwd"
+
+#endif /* AUDIT_MASK_H_ */
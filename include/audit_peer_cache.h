@@ -0,0 +1,94 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+
+/*
+ * audit_peer_cache.h
+ *
+ * Process wide caches of the names resolved for Unix domain socket peers:
+ * uid -> OS user name (getpwuid_r may go to NSS/LDAP) and pid -> program
+ * name (/proc/<pid>/cmdline). Pool reconnects then cost a lookup.
+ */
+
+#ifndef AUDIT_PEER_CACHE_H_
+#define AUDIT_PEER_CACHE_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+// max length of a cached value (as PeerInfo names)
+#define AUDIT_PEER_CACHE_VALUE_LEN 128
+
+struct Audit_peer_cache_shard;
+
+/**
+ * Bounded LRU cache of key -> string, with a time to live. A key may be
+ * cached as having no value (negative caching). Entries are split in
+ * shards with a lock each, so lookups of different keys rarely contend.
+ *
+ * Each entry has a stamp, which must match on lookup. The pid cache uses
+ * the process start time, so a reused pid isn't taken for the old process.
+ */
+class Audit_peer_cache {
+public:
+	static const unsigned int DEF_MAX_ENTRIES = 1024;
+	static const unsigned int DEF_TTL = 300;
+
+	Audit_peer_cache()
+		: m_max_entries(DEF_MAX_ENTRIES), m_ttl(DEF_TTL), m_shards(NULL)
+	{
+	}
+
+	/**
+	 * Allocate m_max_entries entries. With 0 nothing is cached.
+	 * Return 0 on success.
+	 */
+	int init();
+
+	void deinit();
+
+	enum { MISS = -1, NEGATIVE = 0, FOUND = 1 };
+
+	/**
+	 * Look up key. On FOUND the value is copied to value (which holds
+	 * AUDIT_PEER_CACHE_VALUE_LEN + 1 chars).
+	 * Return FOUND, NEGATIVE if cached as having no value, or MISS.
+	 */
+	int get(unsigned long key, unsigned long long stamp, char *value);
+
+	/**
+	 * Cache the value of key (truncated to AUDIT_PEER_CACHE_VALUE_LEN).
+	 * value NULL caches it as having no value. Evicts the least
+	 * recently used entry of the shard if it is full.
+	 */
+	void put(unsigned long key, unsigned long long stamp, const char *value);
+
+	// number of entries. Public for sysvar, read on init
+	unsigned int m_max_entries;
+	// seconds an entry is valid. Public for sysvar
+	unsigned int m_ttl;
+
+protected:
+	Audit_peer_cache & operator=(const Audit_peer_cache&);
+	Audit_peer_cache(const Audit_peer_cache&);
+
+	static const unsigned int NUM_SHARDS = 16;
+
+	Audit_peer_cache_shard *shard(unsigned long key, unsigned int *hash);
+
+	Audit_peer_cache_shard *m_shards;
+};
+
+#endif /* AUDIT_PEER_CACHE_H_ */
@@ -0,0 +1,113 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+
+/*
+ * audit_peer_resolver.h
+ *
+ * Resolves the OS user and program names of Unix domain socket peers.
+ * The uid and pid are taken on connect, which is cheap, and the names
+ * are looked up by resolver threads, so a slow NSS (LDAP) lookup doesn't
+ * hold up the login.
+ */
+
+#ifndef AUDIT_PEER_RESOLVER_H_
+#define AUDIT_PEER_RESOLVER_H_
+
+#include "audit_peer_cache.h"
+#include <sys/types.h>
+
+struct PeerInfo;
+struct Audit_peer_request;
+
+class Audit_peer_resolver {
+public:
+	static const unsigned int DEF_THREADS = 2;
+	static const unsigned int DEF_TIMEOUT = 50;
+
+	Audit_peer_resolver()
+		: m_threads(DEF_THREADS), m_timeout(DEF_TIMEOUT),
+		m_initialized(false), m_stop(false), m_num_started(0),
+		m_queue_head(NULL), m_queue_tail(NULL)
+	{
+	}
+
+	/**
+	 * Allocate the caches and start m_threads resolver threads.
+	 * Return 0 on success. Names are resolved in the calling thread if
+	 * no thread could be started.
+	 */
+	int init();
+
+	// stop the threads. Queued requests are completed with no names
+	void deinit();
+
+	/**
+	 * Set the names of the peer with pid and uid (peer->pid is set).
+	 * They come from the caches or, if async, the resolver threads, waiting
+	 * for them up to m_timeout milliseconds.
+	 *
+	 * @return NULL if peer has the names. Else the peer has the uid and
+	 * "pid:<pid>" for names and the request is returned, to poll() on
+	 * the following events.
+	 */
+	Audit_peer_request *resolve(uid_t uid, pid_t pid, PeerInfo *peer, bool async);
+
+	/**
+	 * Copy the names to peer if they are resolved and release the request.
+	 * Return false if not resolved yet (lock free).
+	 */
+	static bool poll(Audit_peer_request *req, PeerInfo *peer);
+
+	// release a request which won't be polled any more
+	static void release(Audit_peer_request *req);
+
+	Audit_peer_cache m_uid_cache;
+	Audit_peer_cache m_pid_cache;
+
+	// number of resolver threads. Public for sysvar, read on init
+	unsigned int m_threads;
+
+	// milliseconds an event waits for the names. Public for sysvar
+	unsigned int m_timeout;
+
+protected:
+	Audit_peer_resolver & operator=(const Audit_peer_resolver&);
+	Audit_peer_resolver(const Audit_peer_resolver&);
+
+	static const unsigned int MAX_THREADS = 16;
+
+	// look up the names (through the caches)
+	void os_user(uid_t uid, char *name);
+	void app_name(pid_t pid, char *name);
+
+	void resolve_run();
+	static void *resolve_thread_func(void *arg);
+
+	bool m_initialized;
+	bool m_stop;
+	unsigned int m_num_started;
+	// pending requests, in order
+	Audit_peer_request *m_queue_head;
+	Audit_peer_request *m_queue_tail;
+	pthread_t m_resolve_threads[MAX_THREADS];
+	pthread_mutex_t LOCK_resolve;
+	// signaled on a new request and on stop
+	pthread_cond_t COND_request;
+	// broadcast when a request is resolved
+	pthread_cond_t COND_resolved;
+};
+
+#endif /* AUDIT_PEER_RESOLVER_H_ */
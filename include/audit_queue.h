@@ -0,0 +1,108 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_queue.h
+ *
+ * Bounded lock-free queue used to pass formatted records from client
+ * threads to the background writer of an io handler.
+ */
+
+#ifndef AUDIT_QUEUE_H_
+#define AUDIT_QUEUE_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "audit_atomic.h"
+
+/**
+ * A formatted record waiting to be written out.
+ * Allocated as a single block holding the data right after the header.
+ */
+struct AuditRecord {
+	size_t len;
+	char data[1];
+
+	static AuditRecord *create(const char *data, size_t len);
+	static void destroy(AuditRecord *rec);
+};
+
+/**
+ * Bounded multi-producer queue (based upon Dmitry Vyukov's bounded MPMC
+ * queue). Each slot carries a sequence number which tells producers and
+ * consumers whether the slot is free for the current lap, so push/pop only
+ * need a single CAS on the tail/head position.
+ *
+ * Normally there is a single consumer (the writer thread), but producers
+ * may also pop in order to implement the drop-oldest overflow policy.
+ */
+class Audit_record_queue {
+public:
+	Audit_record_queue()
+		: m_slots(NULL), m_mask(0), m_tail(0), m_head(0)
+	{
+	}
+
+	~Audit_record_queue()
+	{
+		destroy();
+	}
+
+	/**
+	 * Allocate the slots. Size is rounded up to a power of 2.
+	 * @return 0 on success
+	 */
+	int init(size_t size);
+
+	/**
+	 * Free the slots. Queue should be empty and no threads should access it.
+	 */
+	void destroy();
+
+	/**
+	 * Add a record. Return false if the queue is full.
+	 */
+	bool push(AuditRecord *rec);
+
+	/**
+	 * Remove the oldest record. Return NULL if the queue is empty.
+	 */
+	AuditRecord *pop();
+
+	bool is_empty() const
+	{
+		return m_head == m_tail;
+	}
+
+protected:
+	Audit_record_queue & operator=(const Audit_record_queue&);
+	Audit_record_queue(const Audit_record_queue&);
+
+	struct Slot {
+		volatile size_t seq;
+		AuditRecord *rec;
+	};
+
+	Slot *m_slots;
+	size_t m_mask;
+	// producers and the consumer each get their own cache line
+	char m_pad0[AUDIT_CACHE_LINE_SIZE];
+	volatile size_t m_tail;
+	char m_pad1[AUDIT_CACHE_LINE_SIZE - sizeof(size_t)];
+	volatile size_t m_head;
+	char m_pad2[AUDIT_CACHE_LINE_SIZE - sizeof(size_t)];
+};
+
+#endif /* AUDIT_QUEUE_H_ */
@@ -0,0 +1,165 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_rules.h
+ *
+ * Filter rules (audit_rules_file). The rules are read from a JSON file:
+ *
+ * {
+ *   "default": "skip",
+ *   "rules": [
+ *     {"cmds": ["alter", "create", "drop", "truncate", "rename"], "action": "log"},
+ *     {"cmds": ["insert", "update", "delete"], "objs": ["pii.*"], "action": "log"},
+ *     {"cmds": ["select"], "users": ["etl", "backup@10.0.%"], "action": "skip"},
+ *     {"cmds": ["select"], "action": "log"}
+ *   ]
+ * }
+ *
+ * The first rule whose conditions all match decides if the event is
+ * logged ("action": "log", the default) or skipped ("skip"). If no rule
+ * matches, "default" decides ("skip" if not set). Conditions:
+ *   cmds     - command name prefixes (as in audit_record_cmds)
+ *   users    - user or user@host (as in audit_whitelist_users)
+ *   hosts    - host or ip of the client. % and _ are wildcards
+ *   dbs      - current database of the session
+ *   objs     - one of the objects (as in audit_record_objs)
+ *   min_rows - number of rows of the event is at least this
+ *   max_rows - number of rows of the event is at most this
+ *   query    - perl regex matched against the query (case insensitive)
+ *
+ * The rules are compiled into a program. For each command there is a
+ * list of the rules which may apply to it, so cmds costs nothing at
+ * run time, and the other conditions of a rule are checked cheapest
+ * first. A query regex only runs if all other conditions of the rule
+ * matched.
+ */
+
+#ifndef AUDIT_RULES_H_
+#define AUDIT_RULES_H_
+
+#include "audit_filter.h"
+#include <pcre.h>
+
+// returns the name of a command id, or NULL if there is no such command
+typedef const char *(*audit_cmd_name_func)(int cmd_id);
+
+/**
+ * Values of an event checked by the conditions. Only fetched by the
+ * conditions which need them.
+ */
+class Audit_rules_event {
+public:
+	virtual ~Audit_rules_event() {}
+	virtual unsigned long long rows() = 0;
+	// current database. NULL if none
+	virtual const char *db() = 0;
+	virtual const char *user() = 0;
+	virtual const char *host() = 0;
+	virtual const char *ip() = 0;
+	// iterate the objects. start_objects returns false if there are none
+	virtual bool start_objects() = 0;
+	virtual bool next_object(const char **db_name, const char **obj_name) = 0;
+	virtual const char *query(size_t *len) = 0;
+};
+
+class Audit_rules {
+public:
+	/**
+	 * Compile the JSON rules text. Commands of the cmds conditions are
+	 * resolved to the ids 0 .. num_cmds - 1 using cmd_name.
+	 * Return NULL on failure, with a message in error.
+	 */
+	static Audit_rules *create(const char *json, size_t len,
+			audit_cmd_name_func cmd_name, int num_cmds,
+			char *error, size_t error_len);
+
+	// add a reference and return the rules
+	Audit_rules *ref()
+	{
+		audit_atomic_add(&m_refs, 1);
+		return this;
+	}
+
+	// drop a reference. The rules are freed with the last one
+	static void release(Audit_rules *rules);
+
+	/**
+	 * Run the rules for the event of command cmd_id.
+	 * Return true if the event should be logged.
+	 */
+	bool match(Audit_rules_event *ev, int cmd_id) const;
+
+	// number of rules
+	size_t count() const
+	{
+		return m_num_rules;
+	}
+
+	/**
+	 * Condition codes. The conditions of a rule are checked in the order
+	 * of their codes, so cheaper checks come first.
+	 */
+	enum Op_code {
+		OP_LOG = 0,	// end of rule: log the event
+		OP_SKIP,	// end of rule: skip the event
+		OP_MIN_ROWS,
+		OP_MAX_ROWS,
+		OP_DBS,
+		OP_USERS,
+		OP_HOSTS,
+		OP_OBJS,
+		OP_QUERY
+	};
+
+	struct Op {
+		int code;	// Op_code
+		union {
+			unsigned long long rows;
+			Audit_obj_set *objs;	// OP_DBS and OP_OBJS
+			Audit_user_set *users;
+			char *hosts;	// lower case patterns, each ends with \0. ends with an empty one
+			struct {
+				pcre *re;
+				pcre_extra *extra;
+			} query;
+		} arg;
+	};
+
+protected:
+	Audit_rules & operator=(const Audit_rules&);
+	Audit_rules(const Audit_rules&);
+
+	// free the argument of an op
+	static void op_free(Op *op);
+
+	friend struct Audit_rules_parser;
+
+	// ops of all rules. Each rule ends with OP_LOG or OP_SKIP
+	Op *m_ops;
+	size_t m_num_ops;
+	size_t m_num_rules;
+	/**
+	 * m_cmd_rules[m_cmd_index[cmd_id]] is the first of the offsets in m_ops
+	 * of the rules for the command. The list ends with -1.
+	 */
+	size_t *m_cmd_index;
+	long *m_cmd_rules;
+	int m_num_cmds;
+	bool m_default_log;
+	volatile int m_refs;
+};
+
+#endif /* AUDIT_RULES_H_ */
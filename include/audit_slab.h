@@ -0,0 +1,81 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+
+/*
+ * audit_slab.h
+ *
+ * Pool of fixed size objects, allocated up front in one region.
+ */
+
+#ifndef AUDIT_SLAB_H_
+#define AUDIT_SLAB_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct Audit_slab_shard;
+
+/**
+ * Fixed size object pool. Free objects are kept in shards, each with a
+ * lock. A thread allocates from and frees to the shard picked by its id,
+ * so threads rarely contend, and takes from the other shards when its
+ * own is empty. When the pool is exhausted objects are calloc'ed.
+ */
+class Audit_slab {
+public:
+	Audit_slab(size_t obj_size)
+		: m_size(0), m_used(0), m_high_water(0), m_obj_size(obj_size),
+		m_region(NULL), m_region_end(NULL), m_shards(NULL)
+	{
+	}
+
+	/**
+	 * Allocate count objects. Return 0 on success. Without init (or on
+	 * failure) all objects are calloc'ed.
+	 */
+	int init(size_t count);
+
+	// free the region, unless objects are still in use
+	void deinit();
+
+	// zeroed object. NULL on out of memory
+	void *alloc();
+
+	void release(void *obj);
+
+	/**
+	 * Status: objects in the pool, objects in use (including calloc'ed
+	 * ones) and the most in use at once. Public for status vars.
+	 */
+	long m_size;
+	volatile long m_used;
+	volatile long m_high_water;
+
+protected:
+	Audit_slab & operator=(const Audit_slab&);
+	Audit_slab(const Audit_slab&);
+
+	static const unsigned int NUM_SHARDS = 16;
+
+	Audit_slab_shard *thread_shard();
+
+	size_t m_obj_size;
+	char *m_region;
+	char *m_region_end;
+	Audit_slab_shard *m_shards;
+};
+
+#endif /* AUDIT_SLAB_H_ */
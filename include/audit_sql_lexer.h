@@ -0,0 +1,72 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_sql_lexer.h
+ *
+ * Minimal SQL tokenizer used for password masking and query digests.
+ * It only needs to know where strings, identifiers and comments start
+ * and end, so it doesn't know keywords or multi char operators.
+ */
+
+#ifndef AUDIT_SQL_LEXER_H_
+#define AUDIT_SQL_LEXER_H_
+
+#include <stddef.h>
+
+enum Audit_sql_token_type {
+	AUDIT_TOK_END = 0,
+	AUDIT_TOK_WORD,	// keyword or identifier
+	AUDIT_TOK_NUMBER,	// 12, 1.5e-3, 0x1F, .5
+	AUDIT_TOK_IDENT,	// `quoted identifier`
+	AUDIT_TOK_STRING,	// 'string' or "string", with an optional introducer (_utf8'..', N'..', x'..')
+	AUDIT_TOK_CHAR	// any other char
+};
+
+struct Audit_sql_token {
+	int type;
+	const char *start;
+	size_t len;
+	// contents of a AUDIT_TOK_STRING or AUDIT_TOK_IDENT (between the quotes)
+	const char *text;
+	size_t text_len;
+};
+
+/**
+ * Splits a query into tokens, skipping white space and comments.
+ * The text of executable comments (/ *! ... * /) is returned as tokens,
+ * as the server runs it.
+ */
+class Audit_sql_lexer {
+public:
+	Audit_sql_lexer(const char *query, size_t len)
+		: m_pos(query), m_end(query + len), m_exec_comment(false)
+	{
+	}
+
+	// read the next token. type is AUDIT_TOK_END at the end of the query
+	void next(Audit_sql_token *tok);
+
+private:
+	void skip_space();
+	// scan a quoted string starting at the quote. return the end
+	const char *skip_quoted(const char *pos, Audit_sql_token *tok);
+
+	const char *m_pos;
+	const char *m_end;
+	bool m_exec_comment;
+};
+
+#endif /* AUDIT_SQL_LEXER_H_ */
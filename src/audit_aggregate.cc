@@ -0,0 +1,355 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_aggregate.cc
+ */
+
+#include "audit_handler.h"
+#include "audit_aggregate.h"
+#include "audit_digest.h"
+
+int Audit_histogram::index(unsigned long long val)
+{
+	if (val < 2 * AUDIT_HIST_HALF)
+	{
+		return (int) val;
+	}
+	int msb = 63 - __builtin_clzll(val);
+	if (msb >= AUDIT_HIST_MAX_BITS)
+	{
+		return AUDIT_HIST_BUCKETS - 1;
+	}
+	// keep the AUDIT_HIST_SUB_BITS top bits. The top one is always set
+	int shift = msb - AUDIT_HIST_SUB_BITS + 1;
+	return shift * AUDIT_HIST_HALF + (int) (val >> shift);
+}
+
+unsigned long long Audit_histogram::bucket_max(int index)
+{
+	if (index < 2 * AUDIT_HIST_HALF)
+	{
+		return index;
+	}
+	int shift = index / AUDIT_HIST_HALF - 1;
+	unsigned long long sub = index % AUDIT_HIST_HALF + AUDIT_HIST_HALF;
+	return ((sub + 1) << shift) - 1;
+}
+
+unsigned long long Audit_histogram::percentile(unsigned long long total, unsigned int per_mille) const
+{
+	// number of values at or below the percentile (rounded up)
+	unsigned long long rank = (total * per_mille + 999) / 1000;
+	if (rank == 0)
+	{
+		rank = 1;
+	}
+	unsigned long long seen = 0;
+	for (int i = 0; i < AUDIT_HIST_BUCKETS; i++)
+	{
+		seen += counts[i];
+		if (seen >= rank)
+		{
+			return bucket_max(i);
+		}
+	}
+	return bucket_max(AUDIT_HIST_BUCKETS - 1);
+}
+
+/**
+ * Accumulator of a key. Allocated with the key strings following it.
+ */
+struct Audit_aggregate_entry {
+	Audit_aggregate_entry *next;
+	unsigned long long hash;
+	Audit_summary summary;
+};
+
+static inline bool str_equal(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+	{
+		return a == b;
+	}
+	return strcmp(a, b) == 0;
+}
+
+// 64 bit FNV-1a of a string, continuing from hash
+static inline unsigned long long str_hash(unsigned long long hash, const char *str)
+{
+	if (str)
+	{
+		for (; *str; str++)
+		{
+			hash = (hash ^ (unsigned char) *str) * 0x100000001b3ULL;
+		}
+	}
+	// separator, so ("ab", "c") and ("a", "bc") differ
+	return (hash ^ 0xff) * 0x100000001b3ULL;
+}
+
+// copy str to pos (with \0) and return the copy. NULL stays NULL
+static inline const char *str_copy(char **pos, const char *str, size_t len)
+{
+	if (str == NULL)
+	{
+		return NULL;
+	}
+	char *res = *pos;
+	memcpy(res, str, len);
+	res[len] = '\0';
+	*pos += len + 1;
+	return res;
+}
+
+static Audit_aggregate_entry *entry_create(unsigned long long hash, unsigned long long digest,
+		const char *user, const char *db, const char *cmd,
+		const char *query, size_t query_len)
+{
+	size_t user_len = user ? strlen(user) : 0;
+	size_t db_len = db ? strlen(db) : 0;
+	size_t cmd_len = strlen(cmd);
+	// the normalized query is at most twice the query
+	Audit_buffer normalized;
+	audit_query_digest(query, query_len < AUDIT_SUMMARY_MAX_QUERY ? query_len : AUDIT_SUMMARY_MAX_QUERY,
+			&normalized);
+	size_t norm_len = normalized.is_error() ? 0 : normalized.length();
+	if (norm_len > AUDIT_SUMMARY_MAX_QUERY)
+	{
+		norm_len = AUDIT_SUMMARY_MAX_QUERY;
+	}
+	Audit_aggregate_entry *entry = (Audit_aggregate_entry *) calloc(1,
+			sizeof(Audit_aggregate_entry) + user_len + db_len + cmd_len + norm_len + 4);
+	if (! entry)
+	{
+		return NULL;
+	}
+	char *pos = (char *) (entry + 1);
+	entry->hash = hash;
+	entry->summary.digest = digest;
+	entry->summary.user = str_copy(&pos, user, user_len);
+	entry->summary.db = str_copy(&pos, db, db_len);
+	entry->summary.cmd = str_copy(&pos, cmd, cmd_len);
+	entry->summary.query = str_copy(&pos, norm_len ? normalized.data() : "", norm_len);
+	entry->summary.query_len = norm_len;
+	return entry;
+}
+
+// find the entry of the key in the list of a bucket. NULL if there is none
+static Audit_aggregate_entry *entry_find(Audit_aggregate_entry *entry, unsigned long long hash,
+		unsigned long long digest, const char *user, const char *db, const char *cmd)
+{
+	while (entry && ! (entry->hash == hash && entry->summary.digest == digest
+			&& str_equal(entry->summary.cmd, cmd) && str_equal(entry->summary.user, user)
+			&& str_equal(entry->summary.db, db)))
+	{
+		entry = entry->next;
+	}
+	return entry;
+}
+
+int Audit_aggregator::init()
+{
+	if (m_initialized)
+	{
+		return 0;
+	}
+	memset(m_buckets, 0, sizeof(m_buckets));
+	for (size_t i = 0; i < NUM_LOCKS; i++)
+	{
+		pthread_mutex_init(&m_locks[i], MY_MUTEX_INIT_FAST);
+	}
+	pthread_mutex_init(&LOCK_flush, MY_MUTEX_INIT_FAST);
+	pthread_cond_init(&COND_flush, NULL);
+	m_interval_start = my_getsystime() / 10000;
+	m_stop = false;
+	m_initialized = true;
+	int res = pthread_create(&m_flush_thread, NULL, flush_thread_func, this);
+	if (res != 0)
+	{
+		return res;
+	}
+	m_thread_started = true;
+	return 0;
+}
+
+void Audit_aggregator::deinit()
+{
+	if (! m_initialized)
+	{
+		return;
+	}
+	if (m_thread_started)
+	{
+		pthread_mutex_lock(&LOCK_flush);
+		m_stop = true;
+		pthread_cond_signal(&COND_flush);
+		pthread_mutex_unlock(&LOCK_flush);
+		pthread_join(m_flush_thread, NULL);
+		m_thread_started = false;
+	}
+	flush();
+	pthread_cond_destroy(&COND_flush);
+	pthread_mutex_destroy(&LOCK_flush);
+	for (size_t i = 0; i < NUM_LOCKS; i++)
+	{
+		pthread_mutex_destroy(&m_locks[i]);
+	}
+	m_initialized = false;
+}
+
+bool Audit_aggregator::add(const char *user, const char *db, const char *cmd,
+		const char *query, size_t query_len, unsigned long long rows,
+		unsigned long long exec_time, bool timed)
+{
+	// without the flush thread nothing would be logged
+	if (! m_thread_started || m_stop)
+	{
+		return false;
+	}
+	unsigned long long digest = query ? audit_query_digest(query, query_len, NULL) : 0;
+	unsigned long long hash = str_hash(str_hash(str_hash(digest, user), db), cmd);
+	size_t bucket = (hash ^ (hash >> 32)) % NUM_BUCKETS;
+	pthread_mutex_t *lock = &m_locks[bucket % NUM_LOCKS];
+
+	pthread_mutex_lock(lock);
+	Audit_aggregate_entry *entry = entry_find(m_buckets[bucket], hash, digest, user, db, cmd);
+	Audit_aggregate_entry *created = NULL;
+	if (! entry)
+	{
+		// normalizing the query and allocating are done without the lock.
+		// Another thread may add the same key meanwhile, so look again after
+		pthread_mutex_unlock(lock);
+		if (audit_atomic_add(&m_num_entries, 1) >= (int) m_max_entries)
+		{
+			audit_atomic_sub(&m_num_entries, 1);
+			audit_atomic_add(&m_overflow, 1ULL);
+			return false;
+		}
+		created = entry_create(hash, digest, user, db, cmd, query, query_len);
+		if (! created)
+		{
+			audit_atomic_sub(&m_num_entries, 1);
+			return false;
+		}
+		pthread_mutex_lock(lock);
+		entry = entry_find(m_buckets[bucket], hash, digest, user, db, cmd);
+		if (! entry)
+		{
+			entry = created;
+			created = NULL;
+			entry->summary.start = m_interval_start;
+			entry->next = m_buckets[bucket];
+			m_buckets[bucket] = entry;
+		}
+	}
+	Audit_summary *summary = &entry->summary;
+	summary->count++;
+	summary->rows += rows;
+	if (timed)
+	{
+		summary->timed++;
+		summary->time_sum += exec_time;
+		if (exec_time > summary->time_max)
+		{
+			summary->time_max = exec_time;
+		}
+		summary->hist.add(exec_time);
+	}
+	pthread_mutex_unlock(lock);
+	if (created)
+	{
+		// lost the race to add the key
+		audit_atomic_sub(&m_num_entries, 1);
+		free(created);
+	}
+	return true;
+}
+
+void Audit_aggregator::flush()
+{
+	unsigned long long now = my_getsystime() / 10000;
+	m_interval_start = now;
+	for (size_t l = 0; l < NUM_LOCKS; l++)
+	{
+		// detach the lists of the stripe so the logging is done without the lock
+		Audit_aggregate_entry *list = NULL;
+		pthread_mutex_lock(&m_locks[l]);
+		for (size_t b = l; b < NUM_BUCKETS; b += NUM_LOCKS)
+		{
+			Audit_aggregate_entry *entry = m_buckets[b];
+			while (entry)
+			{
+				Audit_aggregate_entry *next = entry->next;
+				entry->next = list;
+				list = entry;
+				entry = next;
+			}
+			m_buckets[b] = NULL;
+		}
+		pthread_mutex_unlock(&m_locks[l]);
+
+		while (list)
+		{
+			Audit_aggregate_entry *next = list->next;
+			list->summary.end = now;
+			Audit_handler::log_summary_all(&list->summary);
+			audit_atomic_sub(&m_num_entries, 1);
+			free(list);
+			list = next;
+		}
+	}
+	unsigned long long overflow = audit_atomic_swap(&m_overflow, 0ULL);
+	if (overflow > 0)
+	{
+		sql_print_information("%s aggregate table full (audit_aggregate_max_entries: %u). %llu events were logged instead.",
+				AUDIT_LOG_PREFIX, m_max_entries, overflow);
+	}
+}
+
+void *Audit_aggregator::flush_thread_func(void *arg)
+{
+	// needed for using mysys functions in our thread
+	my_thread_init();
+	((Audit_aggregator *) arg)->flush_run();
+	my_thread_end();
+	return NULL;
+}
+
+void Audit_aggregator::flush_run()
+{
+	pthread_mutex_lock(&LOCK_flush);
+	while (! m_stop)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += m_interval > 0 ? m_interval : 1;
+		while (! m_stop)
+		{
+			if (pthread_cond_timedwait(&COND_flush, &LOCK_flush, &deadline) == ETIMEDOUT)
+			{
+				break;
+			}
+		}
+		if (m_stop)
+		{
+			break;
+		}
+		pthread_mutex_unlock(&LOCK_flush);
+		flush();
+		pthread_mutex_lock(&LOCK_flush);
+	}
+	pthread_mutex_unlock(&LOCK_flush);
+}
@@ -0,0 +1,237 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_bench_binary.cc
+ *
+ * Bytes per event and ns per event of the binary record format against
+ * the json one. Builds activity records with the same fields and writers
+ * as the formatters (which need a THD, so aren't used directly), for
+ * events of several sessions over a query corpus. Binary records go
+ * through the stream session dictionary as done by the handlers.
+ *
+ * usage: audit_bench_binary [-n events] [-s sessions] [-o file] [corpus]
+ * -o writes the binary stream to file, for checking with audit_decode.
+ */
+
+#include "audit_binary.h"
+#include "audit_json.h"
+#include "audit_bench.h"
+#include <unistd.h>
+
+struct Bench_session {
+	unsigned long long thread_id;
+	char user[32];
+	char ip[32];
+	char host[64];
+	unsigned long long port;
+};
+
+static void session_init(Bench_session *s, unsigned int i)
+{
+	s->thread_id = 1000 + i;
+	snprintf(s->user, sizeof(s->user), "app_user_%u", i % 7);
+	snprintf(s->ip, sizeof(s->ip), "10.1.%u.%u", (i / 200) % 256, i % 200 + 10);
+	snprintf(s->host, sizeof(s->host), "app-%u.dc1.example.com", i);
+	s->port = 40000 + i;
+}
+
+static void json_format(Audit_buffer *buf, const Bench_session *s, unsigned long long date,
+		unsigned long long query_id, const char *query, size_t query_len)
+{
+	Audit_json_writer w(buf);
+	w.raw(AUDIT_JSON_LIT("{\"msg-type\":\"activity\""));
+	w.number_field(AUDIT_JSON_KEY("date"), date);
+	w.number_field(AUDIT_JSON_KEY("thread-id"), s->thread_id);
+	w.number_field(AUDIT_JSON_KEY("query-id"), query_id);
+	w.string_field(AUDIT_JSON_KEY("user"), s->user);
+	w.string_field(AUDIT_JSON_KEY("priv_user"), s->user);
+	w.string_field(AUDIT_JSON_KEY("ip"), s->ip);
+	w.string_field(AUDIT_JSON_KEY("host"), s->host);
+	w.raw(AUDIT_JSON_LIT(",\"connect_attrs\":{\"_client_name\":\"libmysql\",\"_client_version\":\"5.6.36\",\"_os\":\"linux-glibc2.5\",\"_pid\":\"4242\"}"));
+	w.number_field(AUDIT_JSON_KEY("client_port"), s->port);
+	w.number_field(AUDIT_JSON_KEY("rows"), 1);
+	w.string_field(AUDIT_JSON_KEY("cmd"), "select");
+	w.raw(AUDIT_JSON_LIT(",\"objects\":[{\"db\":\""));
+	w.escape(AUDIT_JSON_LIT("shop"));
+	w.raw(AUDIT_JSON_LIT("\""));
+	w.string_field(AUDIT_JSON_KEY("name"), "orders");
+	w.string_field(AUDIT_JSON_KEY("obj_type"), "TABLE");
+	w.raw(AUDIT_JSON_LIT("}]"));
+	w.string_field(AUDIT_JSON_KEY("query"), query, query_len);
+	w.raw(AUDIT_JSON_LIT("}\n"));
+}
+
+static void bin_session_format(Audit_bin_writer *w, const Bench_session *s)
+{
+	w->varint(AUDIT_BIN_BIT(AUDIT_BIN_SES_USER) | AUDIT_BIN_BIT(AUDIT_BIN_SES_PRIV_USER)
+			| AUDIT_BIN_BIT(AUDIT_BIN_SES_IP) | AUDIT_BIN_BIT(AUDIT_BIN_SES_HOST)
+			| AUDIT_BIN_BIT(AUDIT_BIN_SES_CONNECT_ATTRS) | AUDIT_BIN_BIT(AUDIT_BIN_SES_CLIENT_PORT));
+	w->string(s->user);
+	w->string(s->user);
+	w->string(s->ip);
+	w->string(s->host);
+	w->string("_client_name");
+	w->string("libmysql");
+	w->string("_client_version");
+	w->string("5.6.36");
+	w->string("_os");
+	w->string("linux-glibc2.5");
+	w->string("_pid");
+	w->string("4242");
+	w->byte(0);
+	w->varint(s->port);
+}
+
+// same layout as Audit_binary_formatter::event_format with a cached session.
+// Returns the offset of the record in buf
+static size_t bin_format(Audit_buffer *buf, const Audit_buffer *def, const Bench_session *s,
+		unsigned long long date, unsigned long long query_id, const char *query, size_t query_len)
+{
+	static const char len_space[AUDIT_BIN_MAX_VARINT] = { 0 };
+	buf->append(len_space, sizeof(len_space));
+	Audit_bin_writer w(buf);
+	w.byte(AUDIT_BIN_REC_ACTIVITY);
+	w.varint(AUDIT_BIN_BIT(AUDIT_BIN_ACT_DATE) | AUDIT_BIN_BIT(AUDIT_BIN_ACT_THREAD_ID)
+			| AUDIT_BIN_BIT(AUDIT_BIN_ACT_QUERY_ID) | AUDIT_BIN_BIT(AUDIT_BIN_ACT_SESSION)
+			| AUDIT_BIN_BIT(AUDIT_BIN_ACT_SESSION_DEF) | AUDIT_BIN_BIT(AUDIT_BIN_ACT_ROWS)
+			| AUDIT_BIN_BIT(AUDIT_BIN_ACT_CMD) | AUDIT_BIN_BIT(AUDIT_BIN_ACT_OBJECTS)
+			| AUDIT_BIN_BIT(AUDIT_BIN_ACT_QUERY));
+	w.varint(date);
+	w.varint(s->thread_id);
+	w.varint(query_id);
+	w.varint(def->length());
+	w.raw(def->data(), def->length());
+	w.varint(1);
+	w.string("select");
+	w.byte(AUDIT_BIN_OBJ_ENTRY | AUDIT_BIN_BIT(AUDIT_BIN_OBJ_DB)
+			| AUDIT_BIN_BIT(AUDIT_BIN_OBJ_NAME) | AUDIT_BIN_BIT(AUDIT_BIN_OBJ_TYPE));
+	w.string("shop");
+	w.string("orders");
+	w.string("TABLE");
+	w.byte(0);
+	w.string(query, query_len);
+	// length right before the payload, as in record_write
+	unsigned char len[AUDIT_BIN_MAX_VARINT];
+	size_t len_len = audit_bin_encode_varint(len, buf->length() - AUDIT_BIN_MAX_VARINT);
+	memcpy(buf->data() + AUDIT_BIN_MAX_VARINT - len_len, len, len_len);
+	return AUDIT_BIN_MAX_VARINT - len_len;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long events = 1000000;
+	unsigned int sessions = 64;
+	const char *out_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			events = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			sessions = (unsigned int) strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n events] [-s sessions] [-o file] [corpus]\n", argv[0]);
+			return 2;
+		}
+	}
+	Audit_bench_corpus corpus;
+	if (! corpus.load(optind < argc ? argv[optind] : NULL) || sessions == 0 || events == 0)
+	{
+		return 1;
+	}
+	Bench_session *ses = (Bench_session *) calloc(sessions, sizeof(Bench_session));
+	Audit_buffer *defs = new Audit_buffer[sessions];
+	for (unsigned int i = 0; i < sessions; i++)
+	{
+		session_init(&ses[i], i);
+		Audit_bin_writer w(&defs[i]);
+		bin_session_format(&w, &ses[i]);
+	}
+	FILE *out = NULL;
+	if (out_path)
+	{
+		out = fopen(out_path, "wb");
+		if (! out)
+		{
+			fprintf(stderr, "%s: can't open\n", out_path);
+			return 1;
+		}
+		fwrite(AUDIT_BIN_MAGIC, 1, AUDIT_BIN_MAGIC_LEN, out);
+		fputc(AUDIT_BIN_VERSION, out);
+	}
+
+	Audit_buffer buf;
+	unsigned long long date = 1500000000000ULL;
+	unsigned long long json_bytes = 0;
+	unsigned long long start = audit_bench_ns();
+	for (unsigned long i = 0; i < events; i++)
+	{
+		buf.reset(0);
+		json_format(&buf, &ses[i % sessions], date + i, i,
+				corpus.query(i % corpus.count()), corpus.length(i % corpus.count()));
+		json_bytes += buf.length();
+	}
+	unsigned long long json_ns = audit_bench_ns() - start;
+
+	Audit_bin_stream_dict *dict = new Audit_bin_stream_dict();
+	unsigned long long bin_bytes = 0;
+	start = audit_bench_ns();
+	for (unsigned long i = 0; i < events; i++)
+	{
+		const Bench_session *s = &ses[i % sessions];
+		buf.reset(0);
+		size_t offset = bin_format(&buf, &defs[i % sessions], s, date + i, i,
+				corpus.query(i % corpus.count()), corpus.length(i % corpus.count()));
+		// what the handler writes
+		const char *rec = buf.data() + offset;
+		size_t size = buf.data() + buf.length() - rec;
+		unsigned char head[Audit_bin_stream_dict::MAX_HEAD];
+		size_t tail = 0;
+		size_t head_len = dict->strip(rec, size, head, &tail);
+		if (head_len == 0)
+		{
+			tail = 0;
+		}
+		bin_bytes += head_len + size - tail;
+		if (out)
+		{
+			fwrite(head, 1, head_len, out);
+			fwrite(rec + tail, 1, size - tail, out);
+		}
+	}
+	unsigned long long bin_ns = audit_bench_ns() - start;
+	if (out)
+	{
+		fclose(out);
+	}
+
+	printf("events: %lu, sessions: %u, queries: %zu (avg %zu bytes)\n", events, sessions,
+			corpus.count(), corpus.bytes() / corpus.count());
+	printf("json:   %8.1f bytes/event %8.1f ns/event\n",
+			(double) json_bytes / events, (double) json_ns / events);
+	printf("binary: %8.1f bytes/event %8.1f ns/event\n",
+			(double) bin_bytes / events, (double) bin_ns / events);
+	delete dict;
+	delete [] defs;
+	free(ses);
+	return 0;
+}
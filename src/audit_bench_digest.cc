@@ -0,0 +1,130 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_bench_digest.cc
+ *
+ * Cost of the query digest and of the lexer password masking by query
+ * size, from 50 bytes to 1 MB. The query of each size is made of the
+ * corpus queries one after the other, cut at the size. Each query ends
+ * with ; and a newline, so a -- comment doesn't hide the queries after it.
+ *
+ * usage: audit_bench_digest [-m megabytes] [corpus]
+ * -m is the amount of query text run for each size (default 64).
+ */
+
+#include "audit_digest.h"
+#include "audit_mask.h"
+#include "audit_bench.h"
+#include <unistd.h>
+
+static const size_t bench_sizes[] = {
+	50, 200, 1024, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024
+};
+
+// query of size bytes made of the corpus queries
+static bool query_build(Audit_buffer *query, const Audit_bench_corpus *corpus, size_t size)
+{
+	query->reset(0);
+	for (size_t i = 0; query->length() < size; i++)
+	{
+		size_t q = i % corpus->count();
+		if (i > 0)
+		{
+			query->append(";\n", 2);
+		}
+		query->append(corpus->query(q), corpus->length(q));
+	}
+	return ! query->is_error();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long megabytes = 64;
+	int opt;
+	while ((opt = getopt(argc, argv, "m:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			megabytes = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m megabytes] [corpus]\n", argv[0]);
+			return 2;
+		}
+	}
+	Audit_bench_corpus corpus;
+	if (! corpus.load(optind < argc ? argv[optind] : NULL) || megabytes == 0)
+	{
+		return 1;
+	}
+
+	printf("%8s %8s %12s %12s %12s %11s %10s\n", "size", "rounds", "digest ns",
+			"+normal ns", "mask ns", "normal MB/s", "mask MB/s");
+	Audit_buffer query;
+	Audit_buffer normalized;
+	Audit_buffer masked;
+	for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++)
+	{
+		size_t size = bench_sizes[s];
+		if (! query_build(&query, &corpus, size))
+		{
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		unsigned long rounds = (unsigned long) (megabytes * 1024 * 1024 / size);
+		if (rounds == 0)
+		{
+			rounds = 1;
+		}
+
+		unsigned long long digest = 0;
+		unsigned long long start = audit_bench_ns();
+		for (unsigned long r = 0; r < rounds; r++)
+		{
+			digest += audit_query_digest(query.data(), size, NULL);
+		}
+		unsigned long long digest_ns = audit_bench_ns() - start;
+
+		start = audit_bench_ns();
+		for (unsigned long r = 0; r < rounds; r++)
+		{
+			normalized.reset(0);
+			digest += audit_query_digest(query.data(), size, &normalized);
+		}
+		unsigned long long normal_ns = audit_bench_ns() - start;
+
+		int secrets = 0;
+		start = audit_bench_ns();
+		for (unsigned long r = 0; r < rounds; r++)
+		{
+			masked.reset(0);
+			secrets += audit_mask_secrets(query.data(), size, &masked);
+		}
+		unsigned long long mask_ns = audit_bench_ns() - start;
+		audit_bench_sink = digest + secrets;
+		if (normalized.is_error() || secrets < 0)
+		{
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+
+		printf("%8zu %8lu %12.1f %12.1f %12.1f %11.1f %10.1f\n", size, rounds,
+				(double) digest_ns / rounds, (double) normal_ns / rounds, (double) mask_ns / rounds,
+				(double) size * rounds / 1.048576 / normal_ns * 1000,
+				(double) size * rounds / 1.048576 / mask_ns * 1000);
+	}
+	return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_bench_escape.cc
+ *
+ * ns per query of json escaping over a query corpus, for each escape
+ * scan (scalar, sse2, avx2) the cpu supports, with and without utf8
+ * validation, against yajl_gen_string and a plain copy.
+ *
+ * usage: audit_bench_escape [-n rounds] [corpus]
+ */
+
+#include "audit_json.h"
+#include "audit_bench.h"
+#include <yajl/yajl_gen.h>
+#include <unistd.h>
+
+static unsigned long rounds = 100000;
+
+static void result_print(const char *name, const Audit_bench_corpus *corpus, unsigned long long ns)
+{
+	double per_query = (double) ns / ((double) rounds * corpus->count());
+	printf("%-22s %8.1f ns/query %8.1f MB/s\n", name, per_query,
+			corpus->bytes() / (per_query * corpus->count()) * 1e9 / 1048576);
+}
+
+static unsigned long long escape_run(const Audit_bench_corpus *corpus, bool validate)
+{
+	Audit_buffer buf;
+	unsigned long long bytes = 0;
+	unsigned long long start = audit_bench_ns();
+	for (unsigned long r = 0; r < rounds; r++)
+	{
+		for (size_t i = 0; i < corpus->count(); i++)
+		{
+			buf.reset(0);
+			Audit_json_writer w(&buf, validate);
+			w.escape(corpus->query(i), corpus->length(i));
+			bytes += buf.length();
+		}
+	}
+	unsigned long long ns = audit_bench_ns() - start;
+	audit_bench_sink = bytes;
+	return ns;
+}
+
+static unsigned long long copy_run(const Audit_bench_corpus *corpus)
+{
+	Audit_buffer buf;
+	unsigned long long bytes = 0;
+	unsigned long long start = audit_bench_ns();
+	for (unsigned long r = 0; r < rounds; r++)
+	{
+		for (size_t i = 0; i < corpus->count(); i++)
+		{
+			buf.reset(0);
+			buf.append(corpus->query(i), corpus->length(i));
+			bytes += buf.length();
+		}
+	}
+	unsigned long long ns = audit_bench_ns() - start;
+	audit_bench_sink = bytes;
+	return ns;
+}
+
+static void yajl_print(void *ctx, const char *str, size_t len)
+{
+	((Audit_buffer *) ctx)->append(str, len);
+}
+
+static unsigned long long yajl_run(const Audit_bench_corpus *corpus)
+{
+	Audit_buffer buf;
+	yajl_gen gen = yajl_gen_alloc(NULL);
+	yajl_gen_config(gen, yajl_gen_print_callback, yajl_print, &buf);
+	unsigned long long bytes = 0;
+	unsigned long long start = audit_bench_ns();
+	for (unsigned long r = 0; r < rounds; r++)
+	{
+		for (size_t i = 0; i < corpus->count(); i++)
+		{
+			buf.reset(0);
+			yajl_gen_reset(gen, NULL);
+			yajl_gen_string(gen, (const unsigned char *) corpus->query(i), corpus->length(i));
+			bytes += buf.length();
+		}
+	}
+	unsigned long long ns = audit_bench_ns() - start;
+	yajl_gen_free(gen);
+	audit_bench_sink = bytes;
+	return ns;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			rounds = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n rounds] [corpus]\n", argv[0]);
+			return 2;
+		}
+	}
+	Audit_bench_corpus corpus;
+	if (! corpus.load(optind < argc ? argv[optind] : NULL) || rounds == 0)
+	{
+		return 1;
+	}
+	printf("queries: %zu (avg %zu bytes), rounds: %lu\n", corpus.count(),
+			corpus.bytes() / corpus.count(), rounds);
+	result_print("copy", &corpus, copy_run(&corpus));
+	result_print("yajl_gen_string", &corpus, yajl_run(&corpus));
+	const char *name;
+	for (size_t i = 0; (name = Audit_json_writer::scan_name(i)) != NULL; i++)
+	{
+		char label[64];
+		if (! Audit_json_writer::scan_select(name))
+		{
+			printf("%-22s not supported by the cpu\n", name);
+			continue;
+		}
+		snprintf(label, sizeof(label), "escape %s", name);
+		result_print(label, &corpus, escape_run(&corpus, false));
+		snprintf(label, sizeof(label), "escape %s utf8", name);
+		result_print(label, &corpus, escape_run(&corpus, true));
+	}
+	return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_bench_json.cc
+ *
+ * ns per activity record of the direct json serializer against yajl,
+ * generating the same record as the formatter did with yajl (into a
+ * reused buffer through a print callback) over a query corpus. The
+ * outputs are checked to be the same.
+ *
+ * usage: audit_bench_json [-n records] [corpus]
+ */
+
+#include "audit_json.h"
+#include "audit_bench.h"
+#include <yajl/yajl_gen.h>
+#include <unistd.h>
+
+struct Bench_record {
+	unsigned long long date;
+	unsigned long long thread_id;
+	unsigned long long query_id;
+	const char *user;
+	const char *host;
+	const char *ip;
+	const char *cmd;
+	const char *db;
+	const char *table;
+	const char *query;
+	size_t query_len;
+};
+
+static void json_format(Audit_buffer *buf, const Bench_record *r)
+{
+	Audit_json_writer w(buf);
+	w.raw(AUDIT_JSON_LIT("{\"msg-type\":\"activity\""));
+	w.number_field(AUDIT_JSON_KEY("date"), r->date);
+	w.number_field(AUDIT_JSON_KEY("thread-id"), r->thread_id);
+	w.number_field(AUDIT_JSON_KEY("query-id"), r->query_id);
+	w.string_field(AUDIT_JSON_KEY("user"), r->user);
+	w.string_field(AUDIT_JSON_KEY("priv_user"), r->user);
+	w.string_field(AUDIT_JSON_KEY("ip"), r->ip);
+	w.string_field(AUDIT_JSON_KEY("host"), r->host);
+	w.number_field(AUDIT_JSON_KEY("rows"), 1);
+	w.string_field(AUDIT_JSON_KEY("cmd"), r->cmd);
+	w.raw(AUDIT_JSON_LIT(",\"objects\":[{\"db\":\""));
+	w.escape(r->db, strlen(r->db));
+	w.raw(AUDIT_JSON_LIT("\""));
+	w.string_field(AUDIT_JSON_KEY("name"), r->table);
+	w.string_field(AUDIT_JSON_KEY("obj_type"), "TABLE");
+	w.raw(AUDIT_JSON_LIT("}]"));
+	w.string_field(AUDIT_JSON_KEY("query"), r->query, r->query_len);
+	w.raw(AUDIT_JSON_LIT("}\n"));
+}
+
+static void yajl_print(void *ctx, const char *str, size_t len)
+{
+	((Audit_buffer *) ctx)->append(str, len);
+}
+
+static void yajl_add_string(yajl_gen gen, const char *str)
+{
+	yajl_gen_string(gen, (const unsigned char *) str, strlen(str));
+}
+
+static void yajl_add_string_val(yajl_gen gen, const char *name, const char *val, size_t val_len)
+{
+	yajl_add_string(gen, name);
+	yajl_gen_string(gen, (const unsigned char *) val, val_len);
+}
+
+static void yajl_add_uint64(yajl_gen gen, const char *name, unsigned long long num)
+{
+	char buf[22];
+	int len = snprintf(buf, sizeof(buf), "%llu", num);
+	yajl_add_string_val(gen, name, buf, len);
+}
+
+// the same record the way the formatter generated it with yajl
+static void yajl_format(yajl_gen gen, const Bench_record *r)
+{
+	yajl_gen_reset(gen, NULL);
+	yajl_gen_map_open(gen);
+	yajl_add_string_val(gen, "msg-type", "activity", 8);
+	yajl_add_uint64(gen, "date", r->date);
+	yajl_add_uint64(gen, "thread-id", r->thread_id);
+	yajl_add_uint64(gen, "query-id", r->query_id);
+	yajl_add_string_val(gen, "user", r->user, strlen(r->user));
+	yajl_add_string_val(gen, "priv_user", r->user, strlen(r->user));
+	yajl_add_string_val(gen, "ip", r->ip, strlen(r->ip));
+	yajl_add_string_val(gen, "host", r->host, strlen(r->host));
+	yajl_add_uint64(gen, "rows", 1);
+	yajl_add_string_val(gen, "cmd", r->cmd, strlen(r->cmd));
+	yajl_add_string(gen, "objects");
+	yajl_gen_array_open(gen);
+	yajl_gen_map_open(gen);
+	yajl_add_string_val(gen, "db", r->db, strlen(r->db));
+	yajl_add_string_val(gen, "name", r->table, strlen(r->table));
+	yajl_add_string_val(gen, "obj_type", "TABLE", 5);
+	yajl_gen_map_close(gen);
+	yajl_gen_array_close(gen);
+	yajl_add_string_val(gen, "query", r->query, r->query_len);
+	yajl_gen_map_close(gen);
+	yajl_gen_reset(gen, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long records = 1000000;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			records = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n records] [corpus]\n", argv[0]);
+			return 2;
+		}
+	}
+	Audit_bench_corpus corpus;
+	if (! corpus.load(optind < argc ? argv[optind] : NULL) || records == 0)
+	{
+		return 1;
+	}
+	Bench_record rec;
+	rec.thread_id = 4242;
+	rec.user = "app_user";
+	rec.host = "app-1.dc1.example.com";
+	rec.ip = "10.1.0.17";
+	rec.cmd = "select";
+	rec.db = "shop";
+	rec.table = "orders";
+
+	Audit_buffer buf;
+	Audit_buffer yajl_buf;
+	yajl_gen gen = yajl_gen_alloc(NULL);
+	yajl_gen_config(gen, yajl_gen_print_callback, yajl_print, &yajl_buf);
+
+	// same output
+	for (size_t i = 0; i < corpus.count(); i++)
+	{
+		rec.date = 1500000000000ULL + i;
+		rec.query_id = i;
+		rec.query = corpus.query(i);
+		rec.query_len = corpus.length(i);
+		buf.reset(0);
+		json_format(&buf, &rec);
+		yajl_buf.reset(0);
+		yajl_format(gen, &rec);
+		if (buf.length() != yajl_buf.length() || memcmp(buf.data(), yajl_buf.data(), buf.length()))
+		{
+			fprintf(stderr, "output differs for query %zu:\n%.*s%.*s", i,
+					(int) buf.length(), buf.data(), (int) yajl_buf.length(), yajl_buf.data());
+			return 1;
+		}
+	}
+
+	unsigned long long bytes = 0;
+	unsigned long long start = audit_bench_ns();
+	for (unsigned long i = 0; i < records; i++)
+	{
+		rec.date = 1500000000000ULL + i;
+		rec.query_id = i;
+		rec.query = corpus.query(i % corpus.count());
+		rec.query_len = corpus.length(i % corpus.count());
+		buf.reset(0);
+		json_format(&buf, &rec);
+		bytes += buf.length();
+	}
+	unsigned long long json_ns = audit_bench_ns() - start;
+
+	start = audit_bench_ns();
+	for (unsigned long i = 0; i < records; i++)
+	{
+		rec.date = 1500000000000ULL + i;
+		rec.query_id = i;
+		rec.query = corpus.query(i % corpus.count());
+		rec.query_len = corpus.length(i % corpus.count());
+		yajl_buf.reset(0);
+		yajl_format(gen, &rec);
+	}
+	unsigned long long yajl_ns = audit_bench_ns() - start;
+	yajl_gen_free(gen);
+
+	printf("records: %lu (avg %llu bytes), queries: %zu\n", records, bytes / records,
+			corpus.count());
+	printf("json writer: %8.1f ns/record\n", (double) json_ns / records);
+	printf("yajl:        %8.1f ns/record\n", (double) yajl_ns / records);
+	return 0;
+}
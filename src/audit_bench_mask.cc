@@ -0,0 +1,159 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_bench_mask.cc
+ *
+ * Cost of password masking per query over a mixed corpus: the masking
+ * regex interpreted, JIT compiled, JIT compiled behind the literal
+ * prefilter, and the lexer method.
+ *
+ * usage: audit_bench_mask [-n rounds] [-r regex] [-p prefilter] [corpus]
+ */
+
+#include "audit_mask.h"
+#include "audit_filter.h"
+#include "audit_bench.h"
+#include <pcre.h>
+#include <unistd.h>
+
+static unsigned long rounds = 20000;
+
+// run the regex on each query of the corpus. return ns per query
+static double bench_regex(const Audit_bench_corpus *corpus, pcre *re, pcre_extra *extra,
+		const Audit_word_set *prefilter, unsigned long *matched)
+{
+	int ovector[90];
+	unsigned long long hits = 0;
+	unsigned long long start = audit_bench_ns();
+	for (unsigned long r = 0; r < rounds; r++)
+	{
+		for (size_t i = 0; i < corpus->count(); i++)
+		{
+			const char *query = corpus->query(i);
+			size_t len = corpus->length(i);
+			if (prefilter && ! prefilter->search(query, len))
+			{
+				continue;
+			}
+			hits += pcre_exec(re, extra, query, (int) len, 0, 0, ovector, 90) >= 0;
+		}
+	}
+	unsigned long long ns = audit_bench_ns() - start;
+	*matched = (unsigned long) (hits / rounds);
+	return (double) ns / (rounds * corpus->count());
+}
+
+static double bench_lexer(const Audit_bench_corpus *corpus, unsigned long *matched)
+{
+	Audit_buffer out;
+	unsigned long long hits = 0;
+	unsigned long long start = audit_bench_ns();
+	for (unsigned long r = 0; r < rounds; r++)
+	{
+		for (size_t i = 0; i < corpus->count(); i++)
+		{
+			out.reset(0);
+			hits += audit_mask_secrets(corpus->query(i), corpus->length(i), &out) > 0;
+		}
+	}
+	unsigned long long ns = audit_bench_ns() - start;
+	*matched = (unsigned long) (hits / rounds);
+	return (double) ns / (rounds * corpus->count());
+}
+
+int main(int argc, char **argv)
+{
+	const char *regex = AUDIT_PW_MASKING_DEFAULT_REGEX;
+	const char *words = AUDIT_PW_MASKING_DEFAULT_PREFILTER;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:r:p:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			rounds = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			regex = optarg;
+			break;
+		case 'p':
+			words = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n rounds] [-r regex] [-p prefilter] [corpus]\n", argv[0]);
+			return 2;
+		}
+	}
+	Audit_bench_corpus corpus;
+	if (! corpus.load(optind < argc ? argv[optind] : NULL) || rounds == 0)
+	{
+		return 1;
+	}
+	// same options as Audit_json_formatter::regex_compile
+	const char *error;
+	int error_offset;
+	pcre *re = pcre_compile(regex, PCRE_DOTALL | PCRE_UTF8 | PCRE_CASELESS | PCRE_DUPNAMES,
+			&error, &error_offset, NULL);
+	if (! re)
+	{
+		fprintf(stderr, "regex compile failed at %d: %s\n", error_offset, error);
+		return 1;
+	}
+	Audit_word_set *prefilter = Audit_word_set::create();
+	if (! prefilter || ! prefilter->add_list(words, strlen(words)))
+	{
+		return 1;
+	}
+	pcre_extra *studied = pcre_study(re, 0, &error);
+	pcre_extra *jit = pcre_study(re, PCRE_STUDY_JIT_COMPILE, &error);
+	int has_jit = 0;
+	pcre_jit_stack *stack = NULL;
+	if (jit && pcre_fullinfo(re, jit, PCRE_INFO_JIT, &has_jit) == 0 && has_jit)
+	{
+		stack = pcre_jit_stack_alloc(32 * 1024, 512 * 1024);
+		pcre_assign_jit_stack(jit, NULL, stack);
+	}
+
+	printf("queries: %zu (avg %zu bytes), rounds: %lu\n", corpus.count(),
+			corpus.bytes() / corpus.count(), rounds);
+	unsigned long matched;
+	double ns = bench_regex(&corpus, re, studied, NULL, &matched);
+	printf("regex:             %8.1f ns/query, %lu masked\n", ns, matched);
+	if (has_jit)
+	{
+		ns = bench_regex(&corpus, re, jit, NULL, &matched);
+		printf("regex jit:         %8.1f ns/query, %lu masked\n", ns, matched);
+		ns = bench_regex(&corpus, re, jit, prefilter, &matched);
+		printf("regex jit+filter:  %8.1f ns/query, %lu masked\n", ns, matched);
+	}
+	else
+	{
+		printf("regex jit:         not supported by the pcre build\n");
+	}
+	ns = bench_regex(&corpus, re, studied, prefilter, &matched);
+	printf("regex filter:      %8.1f ns/query, %lu masked\n", ns, matched);
+	ns = bench_lexer(&corpus, &matched);
+	printf("lexer:             %8.1f ns/query, %lu masked\n", ns, matched);
+
+	if (stack)
+	{
+		pcre_jit_stack_free(stack);
+	}
+	pcre_free_study(jit);
+	pcre_free_study(studied);
+	pcre_free(re);
+	Audit_word_set::destroy(prefilter);
+	return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_bench_queue.cc
+ *
+ * Scaling with the number of client threads of:
+ *   - the handler enable gate: Audit_epoch enter/exit against the read
+ *     lock of a rwlock, which the handlers took for every event before
+ *   - the async writer queue: client threads push records (allocated as
+ *     done by the handlers) into an Audit_record_queue drained by one
+ *     writer thread. A producer finding the queue full yields and retries.
+ *
+ * usage: audit_bench_queue [-t max threads] [-n ops per thread] [-q queue size]
+ * Thread counts run are 1, 2, 4, ... up to max threads.
+ */
+
+#include "audit_queue.h"
+#include "audit_epoch.h"
+#include "audit_bench.h"
+#include <unistd.h>
+
+static unsigned long ops = 2000000;
+
+struct Bench_run {
+	pthread_barrier_t start;
+	Audit_epoch epoch;
+	pthread_rwlock_t rwlock;
+	volatile int enabled;
+	Audit_record_queue queue;
+	volatile int producers_done;
+	unsigned long long full;	// times a producer found the queue full
+};
+
+static void *gate_epoch_thread(void *arg)
+{
+	Bench_run *run = (Bench_run *) arg;
+	unsigned long long sum = 0;
+	pthread_barrier_wait(&run->start);
+	for (unsigned long i = 0; i < ops; i++)
+	{
+		unsigned int token = run->epoch.enter();
+		sum += run->enabled;
+		run->epoch.exit(token);
+	}
+	audit_bench_sink = sum;
+	return NULL;
+}
+
+static void *gate_rwlock_thread(void *arg)
+{
+	Bench_run *run = (Bench_run *) arg;
+	unsigned long long sum = 0;
+	pthread_barrier_wait(&run->start);
+	for (unsigned long i = 0; i < ops; i++)
+	{
+		pthread_rwlock_rdlock(&run->rwlock);
+		sum += run->enabled;
+		pthread_rwlock_unlock(&run->rwlock);
+	}
+	audit_bench_sink = sum;
+	return NULL;
+}
+
+static void *producer_thread(void *arg)
+{
+	Bench_run *run = (Bench_run *) arg;
+	static const char record[] = "{\"msg-type\":\"activity\",\"date\":\"1500000000000\","
+		"\"thread-id\":\"42\",\"query-id\":\"1\",\"user\":\"app\",\"cmd\":\"select\","
+		"\"query\":\"SELECT id, name FROM customers WHERE id = 42\"}\n";
+	unsigned long long full = 0;
+	pthread_barrier_wait(&run->start);
+	for (unsigned long i = 0; i < ops; i++)
+	{
+		AuditRecord *rec = AuditRecord::create(record, sizeof(record) - 1);
+		while (! run->queue.push(rec))
+		{
+			full++;
+			sched_yield();
+		}
+	}
+	audit_atomic_add(&run->full, full);
+	return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+	Bench_run *run = (Bench_run *) arg;
+	unsigned long long bytes = 0;
+	for (;;)
+	{
+		AuditRecord *rec = run->queue.pop();
+		if (rec)
+		{
+			bytes += rec->len;
+			AuditRecord::destroy(rec);
+			continue;
+		}
+		if (run->producers_done && run->queue.is_empty())
+		{
+			break;
+		}
+		sched_yield();
+	}
+	audit_bench_sink = bytes;
+	return NULL;
+}
+
+// run func on threads threads. Return ns per op over all threads
+static double run_threads(Bench_run *run, void *(*func)(void *), unsigned int threads)
+{
+	pthread_t *ids = (pthread_t *) calloc(threads, sizeof(pthread_t));
+	pthread_barrier_init(&run->start, NULL, threads + 1);
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		pthread_create(&ids[i], NULL, func, run);
+	}
+	// before releasing the threads, which may run to the end before we get the cpu back
+	unsigned long long start = audit_bench_ns();
+	pthread_barrier_wait(&run->start);
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		pthread_join(ids[i], NULL);
+	}
+	unsigned long long ns = audit_bench_ns() - start;
+	pthread_barrier_destroy(&run->start);
+	free(ids);
+	return (double) ns / ((double) ops * threads);
+}
+
+int main(int argc, char **argv)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int max_threads = cpus > 0 ? (unsigned int) cpus * 2 : 8;
+	size_t queue_size = 16384;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:n:q:")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			max_threads = (unsigned int) strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			ops = strtoul(optarg, NULL, 10);
+			break;
+		case 'q':
+			queue_size = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t max threads] [-n ops per thread] [-q queue size]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (max_threads == 0 || ops == 0)
+	{
+		return 1;
+	}
+	Bench_run *run = new Bench_run();
+	pthread_rwlock_init(&run->rwlock, NULL);
+	run->enabled = 1;
+
+	printf("cpus: %ld, ops per thread: %lu, queue size: %zu\n", cpus, ops, queue_size);
+	printf("%8s %12s %12s %12s %12s %12s\n", "threads", "epoch ns", "rwlock ns",
+			"push ns", "Mrec/s", "full/rec");
+	for (unsigned int threads = 1; threads <= max_threads; threads *= 2)
+	{
+		double epoch_ns = run_threads(run, gate_epoch_thread, threads);
+		double rwlock_ns = run_threads(run, gate_rwlock_thread, threads);
+
+		if (run->queue.init(queue_size))
+		{
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		run->producers_done = 0;
+		run->full = 0;
+		pthread_t writer;
+		pthread_create(&writer, NULL, writer_thread, run);
+		double push_ns = run_threads(run, producer_thread, threads);
+		run->producers_done = 1;
+		pthread_join(writer, NULL);
+		run->queue.destroy();
+
+		printf("%8u %12.1f %12.1f %12.1f %12.2f %12.3f\n", threads, epoch_ns, rwlock_ns,
+				push_ns, 1000.0 / push_ns, (double) run->full / ((double) ops * threads));
+	}
+	pthread_rwlock_destroy(&run->rwlock);
+	delete run;
+	return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_bench_rules.cc
+ *
+ * Compile and match time of audit_rules_file rules. Generates a rules
+ * file with the given number of rules, mixing all the conditions, and
+ * matches events of several users and commands over a query corpus.
+ *
+ * usage: audit_bench_rules [-r rules] [-n events] [-o file] [corpus]
+ * -o writes the generated rules to file.
+ */
+
+#include "audit_rules.h"
+#include "audit_buffer.h"
+#include "audit_bench.h"
+#include <unistd.h>
+
+static const char *const bench_cmds[] = {
+	"select", "insert", "update", "delete", "create_table", "alter_table",
+	"drop_table", "truncate", "set_option", "grant", "call_procedure", "show_tables"
+};
+static const int bench_num_cmds = sizeof(bench_cmds) / sizeof(bench_cmds[0]);
+
+static const char *bench_cmd_name(int cmd_id)
+{
+	return cmd_id >= 0 && cmd_id < bench_num_cmds ? bench_cmds[cmd_id] : NULL;
+}
+
+/**
+ * An event of the benchmark. Every value is fixed up front, so the cost
+ * measured is the one of the rules.
+ */
+class Bench_event: public Audit_rules_event {
+public:
+	Bench_event() : m_rows(0), m_db(NULL), m_query(NULL), m_query_len(0), m_obj(0)
+	{
+		m_user[0] = m_host[0] = m_ip[0] = m_obj_name[0] = 0;
+	}
+
+	void set(unsigned long i, const char *query, size_t query_len)
+	{
+		snprintf(m_user, sizeof(m_user), "user_%lu", i % 50);
+		snprintf(m_host, sizeof(m_host), "app-%lu.dc1.example.com", i % 300);
+		snprintf(m_ip, sizeof(m_ip), "10.0.%lu.%lu", (i / 7) % 256, i % 250);
+		snprintf(m_obj_name, sizeof(m_obj_name), "t_%lu", i % 400);
+		m_db = (i % 5) ? "shop" : NULL;
+		m_rows = i % 2000;
+		m_query = query;
+		m_query_len = query_len;
+	}
+
+	virtual unsigned long long rows()
+	{
+		return m_rows;
+	}
+
+	virtual const char *db()
+	{
+		return m_db;
+	}
+
+	virtual const char *user()
+	{
+		return m_user;
+	}
+
+	virtual const char *host()
+	{
+		return m_host;
+	}
+
+	virtual const char *ip()
+	{
+		return m_ip;
+	}
+
+	virtual bool start_objects()
+	{
+		m_obj = 0;
+		return true;
+	}
+
+	virtual bool next_object(const char **db_name, const char **obj_name)
+	{
+		if (m_obj++ > 0)
+		{
+			return false;
+		}
+		*db_name = "shop";
+		*obj_name = m_obj_name;
+		return true;
+	}
+
+	virtual const char *query(size_t *len)
+	{
+		*len = m_query_len;
+		return m_query;
+	}
+
+private:
+	unsigned long long m_rows;
+	const char *m_db;
+	const char *m_query;
+	size_t m_query_len;
+	int m_obj;
+	char m_user[32];
+	char m_host[64];
+	char m_ip[32];
+	char m_obj_name[32];
+};
+
+// rule i of the generated rules. Most rules don't match most events
+static void rule_format(Audit_buffer *json, unsigned long i)
+{
+	char rule[512];
+	int len = snprintf(rule, sizeof(rule), "%s\n    {\"cmds\": [\"%s\", \"%s\"]",
+			i ? "," : "", bench_cmds[i % bench_num_cmds], bench_cmds[(i * 7 + 3) % bench_num_cmds]);
+	json->append(rule, len);
+	switch (i % 6)
+	{
+	case 0:
+		len = snprintf(rule, sizeof(rule), ", \"users\": [\"user_%lu\", \"etl_%lu@10.1.%%\"]",
+				i % 97, i);
+		break;
+	case 1:
+		len = snprintf(rule, sizeof(rule), ", \"hosts\": [\"app-%lu.dc1.%%\", \"10.9.%lu.%%\"]",
+				i % 311, i % 256);
+		break;
+	case 2:
+		len = snprintf(rule, sizeof(rule), ", \"objs\": [\"shop.t_%lu\", \"pii_%lu.*\"]",
+				i % 419, i);
+		break;
+	case 3:
+		len = snprintf(rule, sizeof(rule), ", \"dbs\": [\"db_%lu\"], \"min_rows\": %lu",
+				i, i % 3000);
+		break;
+	case 4:
+		len = snprintf(rule, sizeof(rule), ", \"min_rows\": %lu, \"max_rows\": %lu",
+				i % 2000, i % 2000 + 10);
+		break;
+	default:
+		len = snprintf(rule, sizeof(rule), ", \"users\": [\"user_%lu\"], \"query\": \"\\\\bt_%lu\\\\b\"",
+				i % 53, i % 401);
+		break;
+	}
+	json->append(rule, len);
+	len = snprintf(rule, sizeof(rule), ", \"action\": \"%s\"}", (i % 3) ? "log" : "skip");
+	json->append(rule, len);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long num_rules = 5000;
+	unsigned long events = 200000;
+	const char *out_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:n:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'r':
+			num_rules = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			events = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r rules] [-n events] [-o file] [corpus]\n", argv[0]);
+			return 2;
+		}
+	}
+	Audit_bench_corpus corpus;
+	if (! corpus.load(optind < argc ? argv[optind] : NULL) || events == 0)
+	{
+		return 1;
+	}
+
+	static const char head[] = "{\n  \"default\": \"skip\",\n  \"rules\": [";
+	static const char tail[] = "\n  ]\n}\n";
+	Audit_buffer json;
+	json.append(head, sizeof(head) - 1);
+	for (unsigned long i = 0; i < num_rules; i++)
+	{
+		rule_format(&json, i);
+	}
+	json.append(tail, sizeof(tail) - 1);
+	if (json.is_error())
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	if (out_path)
+	{
+		FILE *out = fopen(out_path, "wb");
+		if (! out)
+		{
+			fprintf(stderr, "%s: can't open\n", out_path);
+			return 1;
+		}
+		fwrite(json.data(), 1, json.length(), out);
+		fclose(out);
+	}
+
+	char error[256];
+	unsigned long long start = audit_bench_ns();
+	Audit_rules *rules = Audit_rules::create(json.data(), json.length(), bench_cmd_name,
+			bench_num_cmds, error, sizeof(error));
+	unsigned long long compile_ns = audit_bench_ns() - start;
+	if (! rules)
+	{
+		fprintf(stderr, "compile failed: %s\n", error);
+		return 1;
+	}
+
+	// a set of distinct events, matched over and over
+	const unsigned long num_events = 4096;
+	Bench_event *evs = new Bench_event[num_events];
+	for (unsigned long i = 0; i < num_events; i++)
+	{
+		size_t q = i % corpus.count();
+		evs[i].set(i, corpus.query(q), corpus.length(q));
+	}
+	unsigned long long logged = 0;
+	start = audit_bench_ns();
+	for (unsigned long i = 0; i < events; i++)
+	{
+		logged += rules->match(&evs[i % num_events], (int) (i % bench_num_cmds));
+	}
+	unsigned long long match_ns = audit_bench_ns() - start;
+	audit_bench_sink = logged;
+
+	printf("rules: %lu (%zu bytes of json), events: %lu, queries: %zu\n", num_rules,
+			json.length(), events, corpus.count());
+	printf("compile: %10.3f ms\n", compile_ns / 1e6);
+	printf("match:   %10.1f ns/event, %.1f%% logged\n", (double) match_ns / events,
+			100.0 * logged / events);
+	delete [] evs;
+	Audit_rules::release(rules);
+	return 0;
+}
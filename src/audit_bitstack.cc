@@ -0,0 +1,45 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+
+/*
+ * audit_bitstack.cc
+ */
+
+#include "audit_bitstack.h"
+
+bool Audit_bitstack::grow(unsigned int level)
+{
+	unsigned int num_words = m_num_words > 0 ? m_num_words : 1;
+	while (num_words <= level / 64 - 1)
+	{
+		num_words *= 2;
+	}
+	unsigned long long *words = (unsigned long long *) realloc(m_words, num_words * sizeof(unsigned long long));
+	if (! words)
+	{
+		return false;
+	}
+	m_words = words;
+	m_num_words = num_words;
+	return true;
+}
+
+void Audit_bitstack::release()
+{
+	free(m_words);
+	m_words = NULL;
+	m_num_words = 0;
+}
@@ -0,0 +1,59 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_buffer.cc
+ */
+
+#include "audit_buffer.h"
+
+// initial allocation. Large enough for most records without a query
+static const size_t AUDIT_BUFFER_MIN_SIZE = 1024;
+
+bool Audit_buffer::grow(size_t min_size)
+{
+	size_t new_size = m_size > 0 ? m_size : AUDIT_BUFFER_MIN_SIZE;
+	while (new_size < min_size)
+	{
+		new_size *= 2;
+	}
+	char *new_data = (char *) realloc(m_data, new_size);
+	if (! new_data)
+	{
+		m_error = true;
+		return false;
+	}
+	m_data = new_data;
+	m_size = new_size;
+	return true;
+}
+
+void Audit_buffer::reset(size_t high_water)
+{
+	m_len = 0;
+	m_error = false;
+	if (high_water > 0 && m_size > high_water)
+	{
+		release();
+	}
+}
+
+void Audit_buffer::release()
+{
+	free(m_data);
+	m_data = NULL;
+	m_len = 0;
+	m_size = 0;
+}
@@ -0,0 +1,749 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_decode.cc
+ *
+ * Converts audit logs written in the binary record format (see
+ * audit_binary.h) to json lines, the same as written by the json formatter.
+ *
+ * usage: audit_decode [-u] [file ...]
+ * Reads stdin if no file is passed. -u replaces malformed utf8 with U+FFFD.
+ */
+
+#include "audit_binary.h"
+#include "audit_json.h"
+#include <stdio.h>
+#include <errno.h>
+
+// amount read from the input at a time
+static const size_t READ_SIZE = 64 * 1024;
+
+static bool validate_utf8 = false;
+// number of records whose session definition wasn't found
+static unsigned long long unknown_sessions = 0;
+// schema version of the current stream
+static unsigned long long stream_version = AUDIT_BIN_VERSION;
+
+/**
+ * Session definitions seen in the stream by thread-id.
+ * Chained hash table which doubles when full.
+ */
+struct Session_entry {
+	unsigned long long id;
+	char *def;
+	size_t len;
+	Session_entry *next;
+};
+
+struct Session_dict {
+	Session_entry **buckets;
+	size_t mask;
+	size_t count;
+};
+
+static inline size_t session_hash(unsigned long long id)
+{
+	return (size_t) (id * 0x9E3779B97F4A7C15ULL >> 16);
+}
+
+static void session_dict_clear(Session_dict *dict)
+{
+	for (size_t i = 0; dict->buckets && i <= dict->mask; i++)
+	{
+		Session_entry *entry = dict->buckets[i];
+		while (entry)
+		{
+			Session_entry *next = entry->next;
+			free(entry->def);
+			free(entry);
+			entry = next;
+		}
+		dict->buckets[i] = NULL;
+	}
+	dict->count = 0;
+}
+
+static Session_entry *session_dict_find(Session_dict *dict, unsigned long long id)
+{
+	if (! dict->buckets)
+	{
+		return NULL;
+	}
+	Session_entry *entry = dict->buckets[session_hash(id) & dict->mask];
+	while (entry && entry->id != id)
+	{
+		entry = entry->next;
+	}
+	return entry;
+}
+
+static bool session_dict_grow(Session_dict *dict)
+{
+	size_t size = dict->buckets ? (dict->mask + 1) * 2 : 1024;
+	Session_entry **buckets = (Session_entry **) calloc(size, sizeof(Session_entry *));
+	if (! buckets)
+	{
+		return false;
+	}
+	for (size_t i = 0; dict->buckets && i <= dict->mask; i++)
+	{
+		Session_entry *entry = dict->buckets[i];
+		while (entry)
+		{
+			Session_entry *next = entry->next;
+			size_t idx = session_hash(entry->id) & (size - 1);
+			entry->next = buckets[idx];
+			buckets[idx] = entry;
+			entry = next;
+		}
+	}
+	free(dict->buckets);
+	dict->buckets = buckets;
+	dict->mask = size - 1;
+	return true;
+}
+
+static bool session_dict_put(Session_dict *dict, unsigned long long id,
+		const unsigned char *def, size_t len)
+{
+	char *copy = (char *) malloc(len > 0 ? len : 1);
+	if (! copy)
+	{
+		return false;
+	}
+	memcpy(copy, def, len);
+	Session_entry *entry = session_dict_find(dict, id);
+	if (entry)
+	{
+		free(entry->def);
+		entry->def = copy;
+		entry->len = len;
+		return true;
+	}
+	if ((! dict->buckets || dict->count > dict->mask) && ! session_dict_grow(dict))
+	{
+		free(copy);
+		return false;
+	}
+	entry = (Session_entry *) malloc(sizeof(Session_entry));
+	if (! entry)
+	{
+		free(copy);
+		return false;
+	}
+	entry->id = id;
+	entry->def = copy;
+	entry->len = len;
+	size_t idx = session_hash(id) & dict->mask;
+	entry->next = dict->buckets[idx];
+	dict->buckets[idx] = entry;
+	dict->count++;
+	return true;
+}
+
+/**
+ * Reads fields of a record. Once a read fails (the record is shorter
+ * than its fields), all following reads fail.
+ */
+class Record_reader {
+public:
+	Record_reader(const unsigned char *data, size_t len)
+		: m_pos(data), m_end(data + len), m_ok(true)
+	{
+	}
+
+	bool varint(unsigned long long *val)
+	{
+		m_ok = m_ok && audit_bin_decode_varint(&m_pos, m_end, val);
+		return m_ok;
+	}
+
+	bool byte(unsigned char *val)
+	{
+		m_ok = m_ok && m_pos < m_end;
+		if (m_ok)
+		{
+			*val = *m_pos++;
+		}
+		return m_ok;
+	}
+
+	bool string(const char **str, size_t *len)
+	{
+		unsigned long long slen;
+		m_ok = varint(&slen) && slen <= (unsigned long long) (m_end - m_pos);
+		if (m_ok)
+		{
+			*str = (const char *) m_pos;
+			*len = (size_t) slen;
+			m_pos += slen;
+		}
+		return m_ok;
+	}
+
+	const unsigned char *pos() const
+	{
+		return m_pos;
+	}
+
+	bool ok() const
+	{
+		return m_ok;
+	}
+
+protected:
+	const unsigned char *m_pos;
+	const unsigned char *m_end;
+	bool m_ok;
+};
+
+// copy a string field to the output if present
+static bool string_field(Record_reader *r, Audit_json_writer *w,
+		unsigned long long bits, int field, const char *key, size_t key_len)
+{
+	if (! (bits & AUDIT_BIN_BIT(field)))
+	{
+		return true;
+	}
+	const char *str;
+	size_t len;
+	if (! r->string(&str, &len))
+	{
+		return false;
+	}
+	w->string_field(key, key_len, str, len);
+	return true;
+}
+
+// copy a number field to the output if present
+static bool number_field(Record_reader *r, Audit_json_writer *w,
+		unsigned long long bits, int field, const char *key, size_t key_len)
+{
+	if (! (bits & AUDIT_BIN_BIT(field)))
+	{
+		return true;
+	}
+	unsigned long long num;
+	if (! r->varint(&num))
+	{
+		return false;
+	}
+	w->number_field(key, key_len, num);
+	return true;
+}
+
+// digests are written as 16 hex digits
+static bool digest_field(Record_reader *r, Audit_json_writer *w,
+		unsigned long long bits, int field)
+{
+	if (! (bits & AUDIT_BIN_BIT(field)))
+	{
+		return true;
+	}
+	unsigned long long digest;
+	if (! r->varint(&digest))
+	{
+		return false;
+	}
+	char digest_str[17];
+	snprintf(digest_str, sizeof(digest_str), "%016llx", digest);
+	w->string_field(AUDIT_JSON_KEY("digest"), digest_str, 16);
+	return true;
+}
+
+static bool known_fields(unsigned long long bits, int last_field)
+{
+	return (bits >> (last_field + 1)) == 0;
+}
+
+static bool session_decode(Record_reader *r, Audit_json_writer *w)
+{
+	unsigned long long bits;
+	if (! r->varint(&bits) || ! known_fields(bits, AUDIT_BIN_SES_CLIENT_PORT))
+	{
+		return false;
+	}
+	if (! string_field(r, w, bits, AUDIT_BIN_SES_USER, AUDIT_JSON_KEY("user"))
+		|| ! string_field(r, w, bits, AUDIT_BIN_SES_PRIV_USER, AUDIT_JSON_KEY("priv_user"))
+		|| ! string_field(r, w, bits, AUDIT_BIN_SES_IP, AUDIT_JSON_KEY("ip"))
+		|| ! string_field(r, w, bits, AUDIT_BIN_SES_HOST, AUDIT_JSON_KEY("host"))
+		|| ! number_field(r, w, bits, AUDIT_BIN_SES_CAPABILITIES, AUDIT_JSON_KEY("capabilities")))
+	{
+		return false;
+	}
+	if (bits & AUDIT_BIN_BIT(AUDIT_BIN_SES_CONNECT_ATTRS))
+	{
+		bool array_start = false;
+		for (;;)
+		{
+			const char *name, *value;
+			size_t name_len, value_len;
+			if (! r->string(&name, &name_len))
+			{
+				return false;
+			}
+			if (name_len == 0)
+			{
+				break;
+			}
+			if (! r->string(&value, &value_len))
+			{
+				return false;
+			}
+			if (! array_start)
+			{
+				w->raw(AUDIT_JSON_LIT(",\"connect_attrs\":{\""));
+				array_start = true;
+			}
+			else
+			{
+				w->raw(AUDIT_JSON_LIT(",\""));
+			}
+			w->escape(name, name_len);
+			w->raw(AUDIT_JSON_LIT("\":\""));
+			w->escape(value, value_len);
+			w->raw(AUDIT_JSON_LIT("\""));
+		}
+		if (array_start)
+		{
+			w->raw(AUDIT_JSON_LIT("}"));
+		}
+	}
+	return number_field(r, w, bits, AUDIT_BIN_SES_PID, AUDIT_JSON_KEY("pid"))
+		&& string_field(r, w, bits, AUDIT_BIN_SES_OS_USER, AUDIT_JSON_KEY("os_user"))
+		&& string_field(r, w, bits, AUDIT_BIN_SES_APPNAME, AUDIT_JSON_KEY("appname"))
+		&& number_field(r, w, bits, AUDIT_BIN_SES_CLIENT_PORT, AUDIT_JSON_KEY("client_port"));
+}
+
+static bool header_decode(Record_reader *r, Audit_json_writer *w)
+{
+	unsigned long long bits;
+	if (! r->varint(&bits) || ! known_fields(bits, AUDIT_BIN_HDR_SERVER_PID))
+	{
+		return false;
+	}
+	w->raw(AUDIT_JSON_LIT("{\"msg-type\":\"header\""));
+	return number_field(r, w, bits, AUDIT_BIN_HDR_DATE, AUDIT_JSON_KEY("date"))
+		&& string_field(r, w, bits, AUDIT_BIN_HDR_AUDIT_VERSION, AUDIT_JSON_KEY("audit-version"))
+		&& string_field(r, w, bits, AUDIT_BIN_HDR_PROTOCOL_VERSION, AUDIT_JSON_KEY("audit-protocol-version"))
+		&& string_field(r, w, bits, AUDIT_BIN_HDR_HOSTNAME, AUDIT_JSON_KEY("hostname"))
+		&& string_field(r, w, bits, AUDIT_BIN_HDR_MYSQL_VERSION, AUDIT_JSON_KEY("mysql-version"))
+		&& string_field(r, w, bits, AUDIT_BIN_HDR_MYSQL_PROGRAM, AUDIT_JSON_KEY("mysql-program"))
+		&& string_field(r, w, bits, AUDIT_BIN_HDR_MYSQL_SOCKET, AUDIT_JSON_KEY("mysql-socket"))
+		&& number_field(r, w, bits, AUDIT_BIN_HDR_MYSQL_PORT, AUDIT_JSON_KEY("mysql-port"))
+		&& number_field(r, w, bits, AUDIT_BIN_HDR_SERVER_PID, AUDIT_JSON_KEY("server_pid"));
+}
+
+static bool lost_decode(Record_reader *r, Audit_json_writer *w)
+{
+	unsigned long long bits;
+	if (! r->varint(&bits) || ! known_fields(bits, AUDIT_BIN_LOST_COUNT))
+	{
+		return false;
+	}
+	w->raw(AUDIT_JSON_LIT("{\"msg-type\":\"events-lost\""));
+	return number_field(r, w, bits, AUDIT_BIN_LOST_DATE, AUDIT_JSON_KEY("date"))
+		&& number_field(r, w, bits, AUDIT_BIN_LOST_COUNT, AUDIT_JSON_KEY("lost-events"));
+}
+
+static bool summary_decode(Record_reader *r, Audit_json_writer *w)
+{
+	unsigned long long bits;
+	if (! r->varint(&bits) || ! known_fields(bits, AUDIT_BIN_SUM_TIMED))
+	{
+		return false;
+	}
+	w->raw(AUDIT_JSON_LIT("{\"msg-type\":\"summary\""));
+	if (! (number_field(r, w, bits, AUDIT_BIN_SUM_DATE, AUDIT_JSON_KEY("date"))
+		&& number_field(r, w, bits, AUDIT_BIN_SUM_START, AUDIT_JSON_KEY("start"))
+		&& string_field(r, w, bits, AUDIT_BIN_SUM_USER, AUDIT_JSON_KEY("user"))
+		&& string_field(r, w, bits, AUDIT_BIN_SUM_DB, AUDIT_JSON_KEY("db"))
+		&& string_field(r, w, bits, AUDIT_BIN_SUM_CMD, AUDIT_JSON_KEY("cmd"))
+		&& digest_field(r, w, bits, AUDIT_BIN_SUM_DIGEST)
+		&& string_field(r, w, bits, AUDIT_BIN_SUM_NORMALIZED_QUERY, AUDIT_JSON_KEY("normalized_query"))
+		&& number_field(r, w, bits, AUDIT_BIN_SUM_COUNT, AUDIT_JSON_KEY("count"))
+		&& number_field(r, w, bits, AUDIT_BIN_SUM_ROWS, AUDIT_JSON_KEY("rows"))))
+	{
+		return false;
+	}
+	if (bits & AUDIT_BIN_BIT(AUDIT_BIN_SUM_TIMED))
+	{
+		static const struct {
+			const char *key;
+			size_t key_len;
+		} time_keys[] = {
+			{ AUDIT_JSON_KEY("timed") },
+			{ AUDIT_JSON_KEY("exec_time_us_avg") },
+			{ AUDIT_JSON_KEY("exec_time_us_p50") },
+			{ AUDIT_JSON_KEY("exec_time_us_p95") },
+			{ AUDIT_JSON_KEY("exec_time_us_p99") },
+			{ AUDIT_JSON_KEY("exec_time_us_max") }
+		};
+		for (size_t i = 0; i < sizeof(time_keys) / sizeof(time_keys[0]); i++)
+		{
+			unsigned long long num;
+			if (! r->varint(&num))
+			{
+				return false;
+			}
+			w->number_field(time_keys[i].key, time_keys[i].key_len, num);
+		}
+	}
+	return true;
+}
+
+static bool activity_decode(Record_reader *r, Audit_json_writer *w, Session_dict *dict)
+{
+	unsigned long long bits;
+	if (! r->varint(&bits) || ! known_fields(bits, AUDIT_BIN_ACT_EXEC_TIME))
+	{
+		return false;
+	}
+	unsigned long long thread_id = 0;
+	w->raw(AUDIT_JSON_LIT("{\"msg-type\":\"activity\""));
+	if (! number_field(r, w, bits, AUDIT_BIN_ACT_DATE, AUDIT_JSON_KEY("date")))
+	{
+		return false;
+	}
+	if (bits & AUDIT_BIN_BIT(AUDIT_BIN_ACT_THREAD_ID))
+	{
+		if (! r->varint(&thread_id))
+		{
+			return false;
+		}
+		w->number_field(AUDIT_JSON_KEY("thread-id"), thread_id);
+	}
+	if (! number_field(r, w, bits, AUDIT_BIN_ACT_QUERY_ID, AUDIT_JSON_KEY("query-id")))
+	{
+		return false;
+	}
+	bool in_dict = bits & AUDIT_BIN_BIT(AUDIT_BIN_ACT_SESSION);
+	if (bits & AUDIT_BIN_BIT(AUDIT_BIN_ACT_SESSION_DEF))
+	{
+		unsigned long long def_len = 0;
+		if (stream_version >= 2 && ! r->varint(&def_len))
+		{
+			return false;
+		}
+		const unsigned char *def = r->pos();
+		if (! session_decode(r, w)
+			|| (stream_version >= 2 && (unsigned long long) (r->pos() - def) != def_len))
+		{
+			return false;
+		}
+		if (in_dict && ! session_dict_put(dict, thread_id, def, r->pos() - def))
+		{
+			fprintf(stderr, "audit_decode: out of memory\n");
+			exit(1);
+		}
+	}
+	else if (in_dict)
+	{
+		Session_entry *entry = session_dict_find(dict, thread_id);
+		if (entry)
+		{
+			Record_reader def((const unsigned char *) entry->def, entry->len);
+			session_decode(&def, w);
+		}
+		else
+		{
+			// definition was in a lost record. log without the session fields
+			unknown_sessions++;
+		}
+	}
+	if (! number_field(r, w, bits, AUDIT_BIN_ACT_ROWS, AUDIT_JSON_KEY("rows"))
+		|| ! string_field(r, w, bits, AUDIT_BIN_ACT_CMD, AUDIT_JSON_KEY("cmd")))
+	{
+		return false;
+	}
+	if (bits & AUDIT_BIN_BIT(AUDIT_BIN_ACT_OBJECTS))
+	{
+		w->raw(AUDIT_JSON_LIT(",\"objects\":["));
+		bool first = true;
+		for (;;)
+		{
+			unsigned char obj_bits;
+			if (! r->byte(&obj_bits))
+			{
+				return false;
+			}
+			if (obj_bits == 0)
+			{
+				break;
+			}
+			w->raw(first ? "{" : ",{", first ? 1 : 2);
+			first = false;
+			// keys of the first member have no leading comma
+			bool member = false;
+			static const struct {
+				int field;
+				const char *key;
+				size_t key_len;
+			} obj_keys[] = {
+				{ AUDIT_BIN_OBJ_DB, AUDIT_JSON_KEY("db") },
+				{ AUDIT_BIN_OBJ_NAME, AUDIT_JSON_KEY("name") },
+				{ AUDIT_BIN_OBJ_TYPE, AUDIT_JSON_KEY("obj_type") }
+			};
+			for (size_t i = 0; i < sizeof(obj_keys) / sizeof(obj_keys[0]); i++)
+			{
+				if (obj_bits & AUDIT_BIN_BIT(obj_keys[i].field))
+				{
+					const char *str;
+					size_t len;
+					if (! r->string(&str, &len))
+					{
+						return false;
+					}
+					w->string_field(obj_keys[i].key + (member ? 0 : 1),
+							obj_keys[i].key_len - (member ? 0 : 1), str, len);
+					member = true;
+				}
+			}
+			w->raw(AUDIT_JSON_LIT("}"));
+		}
+		w->raw(AUDIT_JSON_LIT("]"));
+	}
+	if (! string_field(r, w, bits, AUDIT_BIN_ACT_QUERY, AUDIT_JSON_KEY("query")))
+	{
+		return false;
+	}
+	return digest_field(r, w, bits, AUDIT_BIN_ACT_DIGEST)
+		&& string_field(r, w, bits, AUDIT_BIN_ACT_NORMALIZED_QUERY, AUDIT_JSON_KEY("normalized_query"))
+		&& number_field(r, w, bits, AUDIT_BIN_ACT_EXEC_TIME, AUDIT_JSON_KEY("exec_time_us"));
+}
+
+/**
+ * Decode one record payload and write its json line.
+ * Return false if the record is malformed.
+ */
+static bool record_decode(const unsigned char *data, size_t len, Audit_buffer *out,
+		Session_dict *dict)
+{
+	Record_reader r(data, len);
+	Audit_json_writer w(out, validate_utf8);
+	unsigned char type;
+	if (! r.byte(&type))
+	{
+		return false;
+	}
+	bool res;
+	out->reset(0);
+	switch (type)
+	{
+	case AUDIT_BIN_REC_HEADER:
+		res = header_decode(&r, &w);
+		break;
+	case AUDIT_BIN_REC_ACTIVITY:
+		res = activity_decode(&r, &w, dict);
+		break;
+	case AUDIT_BIN_REC_LOST:
+		res = lost_decode(&r, &w);
+		break;
+	case AUDIT_BIN_REC_SUMMARY:
+		res = summary_decode(&r, &w);
+		break;
+	default:
+		// record type from a newer schema. skip it
+		return true;
+	}
+	if (! res)
+	{
+		return false;
+	}
+	w.raw(AUDIT_JSON_LIT("}\n"));
+	if (out->is_error())
+	{
+		fprintf(stderr, "audit_decode: out of memory\n");
+		exit(1);
+	}
+	fwrite(out->data(), 1, out->length(), stdout);
+	return true;
+}
+
+/**
+ * Decode records from data. Return the number of bytes consumed, which
+ * is less than len when the last record is incomplete.
+ * Sets *error on a stream which isn't valid.
+ */
+static size_t stream_decode(const unsigned char *data, size_t len, unsigned long long offset,
+		const char *name, Audit_buffer *out, Session_dict *dict, bool *started, bool *error)
+{
+	size_t pos = 0;
+	while (pos < len && ! *error)
+	{
+		const unsigned char *p = data + pos;
+		const unsigned char *end = data + len;
+		if (*p == 0 || ! *started)
+		{
+			// stream start: magic and version
+			if (len - pos < AUDIT_BIN_MAGIC_LEN + 1)
+			{
+				break;
+			}
+			unsigned long long version;
+			if (memcmp(p, AUDIT_BIN_MAGIC, AUDIT_BIN_MAGIC_LEN) != 0)
+			{
+				fprintf(stderr, "audit_decode: %s: not a binary audit log at offset %llu\n",
+						name, offset + pos);
+				*error = true;
+				break;
+			}
+			p += AUDIT_BIN_MAGIC_LEN;
+			if (! audit_bin_decode_varint(&p, end, &version))
+			{
+				break;
+			}
+			if (version > AUDIT_BIN_VERSION)
+			{
+				fprintf(stderr, "audit_decode: %s: unsupported version %llu at offset %llu\n",
+						name, version, offset + pos);
+				*error = true;
+				break;
+			}
+			// a new stream. sessions send their definitions again
+			session_dict_clear(dict);
+			stream_version = version;
+			*started = true;
+			pos = p - data;
+			continue;
+		}
+		unsigned long long rec_len;
+		if (! audit_bin_decode_varint(&p, end, &rec_len))
+		{
+			if (end - p >= AUDIT_BIN_MAX_VARINT)
+			{
+				fprintf(stderr, "audit_decode: %s: bad record length at offset %llu\n",
+						name, offset + pos);
+				*error = true;
+			}
+			break;
+		}
+		if (rec_len > (unsigned long long) (end - p))
+		{
+			break;
+		}
+		if (! record_decode(p, (size_t) rec_len, out, dict))
+		{
+			// we know its length, so continue with the next one
+			fprintf(stderr, "audit_decode: %s: malformed record at offset %llu\n",
+					name, offset + pos);
+		}
+		pos = (p - data) + (size_t) rec_len;
+	}
+	return pos;
+}
+
+static bool file_decode(FILE *in, const char *name, Session_dict *dict)
+{
+	Audit_buffer out;
+	char *data = NULL;
+	size_t size = 0;
+	size_t len = 0;
+	unsigned long long offset = 0;
+	bool started = false;
+	bool error = false;
+	for (;;)
+	{
+		if (size - len < READ_SIZE)
+		{
+			// record larger than the buffer
+			size_t new_size = size > 0 ? size * 2 : READ_SIZE * 2;
+			char *new_data = (char *) realloc(data, new_size);
+			if (! new_data)
+			{
+				fprintf(stderr, "audit_decode: out of memory\n");
+				error = true;
+				break;
+			}
+			data = new_data;
+			size = new_size;
+		}
+		size_t n = fread(data + len, 1, READ_SIZE, in);
+		if (n == 0)
+		{
+			if (ferror(in))
+			{
+				fprintf(stderr, "audit_decode: %s: read error: %s\n", name, strerror(errno));
+				error = true;
+			}
+			break;
+		}
+		len += n;
+		size_t pos = stream_decode((const unsigned char *) data, len, offset,
+				name, &out, dict, &started, &error);
+		if (error)
+		{
+			break;
+		}
+		// keep the incomplete record for the next read
+		memmove(data, data + pos, len - pos);
+		len -= pos;
+		offset += pos;
+	}
+	if (! error && len > 0)
+	{
+		fprintf(stderr, "audit_decode: %s: truncated record at offset %llu\n",
+				name, offset);
+		error = true;
+	}
+	free(data);
+	return ! error;
+}
+
+int main(int argc, char **argv)
+{
+	int first = 1;
+	if (argc > 1 && strcmp(argv[1], "-u") == 0)
+	{
+		validate_utf8 = true;
+		first++;
+	}
+	else if (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0')
+	{
+		fprintf(stderr, "usage: %s [-u] [file ...]\n", argv[0]);
+		return 2;
+	}
+
+	Session_dict dict = { NULL, 0, 0 };
+	bool res = true;
+	if (first >= argc)
+	{
+		res = file_decode(stdin, "stdin", &dict);
+	}
+	for (int i = first; i < argc; i++)
+	{
+		FILE *in = fopen(argv[i], "rb");
+		if (! in)
+		{
+			fprintf(stderr, "audit_decode: %s: %s\n", argv[i], strerror(errno));
+			res = false;
+			continue;
+		}
+		// each file starts a new stream
+		session_dict_clear(&dict);
+		res = file_decode(in, argv[i], &dict) && res;
+		fclose(in);
+	}
+	session_dict_clear(&dict);
+	free(dict.buckets);
+	if (unknown_sessions > 0)
+	{
+		fprintf(stderr, "audit_decode: %llu records without their session definition (lost records)\n",
+				unknown_sessions);
+	}
+	fflush(stdout);
+	return res ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_digest.cc
+ */
+
+#include "audit_digest.h"
+#include "audit_sql_lexer.h"
+
+// 64 bit FNV-1a
+#define DIGEST_FNV_OFFSET 0xcbf29ce484222325ULL
+#define DIGEST_FNV_PRIME 0x100000001b3ULL
+
+/**
+ * Hashes the normalized query, and appends it to the buffer if there
+ * is one.
+ */
+class Digest_writer {
+public:
+	Digest_writer(Audit_buffer *buf)
+		: m_buf(buf), m_hash(DIGEST_FNV_OFFSET)
+	{
+	}
+
+	void put(const char *str, size_t len, bool lower)
+	{
+		char *dst = NULL;
+		if (m_buf && m_buf->append(str, len))
+		{
+			dst = m_buf->data() + m_buf->length() - len;
+		}
+		unsigned long long hash = m_hash;
+		for (size_t i = 0; i < len; i++)
+		{
+			unsigned char c = str[i];
+			if (lower && c >= 'A' && c <= 'Z')
+			{
+				c += 'a' - 'A';
+				if (dst)
+				{
+					dst[i] = c;
+				}
+			}
+			hash = (hash ^ c) * DIGEST_FNV_PRIME;
+		}
+		m_hash = hash;
+	}
+
+	size_t length() const
+	{
+		return m_buf ? m_buf->length() : 0;
+	}
+
+	unsigned long long hash() const
+	{
+		return m_hash;
+	}
+
+	// go back to an earlier length() and hash()
+	void rewind(size_t len, unsigned long long hash)
+	{
+		if (m_buf)
+		{
+			m_buf->truncate(len);
+		}
+		m_hash = hash;
+	}
+
+private:
+	Audit_buffer *m_buf;
+	unsigned long long m_hash;
+};
+
+// where we are in a possible list of literals: (1, 'a', 2)
+enum digest_list_state {
+	LIST_NONE = 0,
+	LIST_START,	// after (
+	LIST_LITERAL,	// after a literal
+	LIST_COMMA	// after a literal and ,
+};
+
+unsigned long long audit_query_digest(const char *query, size_t len, Audit_buffer *normalized)
+{
+	if (normalized)
+	{
+		// a space per token and literal lists never grow the text
+		normalized->reserve(len * 2);
+	}
+	Digest_writer w(normalized);
+	Audit_sql_lexer lexer(query, len);
+	Audit_sql_token tok;
+	bool first = true;
+	// the previous token if it is a char, else 0
+	char prev_char = 0;
+	const char *prev_end = NULL;
+	int list = LIST_NONE;
+	size_t list_len = 0;
+	unsigned long long list_hash = 0;
+
+	for (lexer.next(&tok); tok.type != AUDIT_TOK_END; lexer.next(&tok))
+	{
+		char c = tok.type == AUDIT_TOK_CHAR ? *tok.start : 0;
+		bool literal = tok.type == AUDIT_TOK_NUMBER || tok.type == AUDIT_TOK_STRING;
+
+		if (c == ')' && list == LIST_LITERAL)
+		{
+			// replace the literals with ...
+			w.rewind(list_len, list_hash);
+			w.put("...)", 4, false);
+			list = LIST_NONE;
+			prev_char = c;
+			prev_end = tok.start + tok.len;
+			continue;
+		}
+
+		if (! first && prev_char != '(' && prev_char != '.' && prev_char != '@'
+			&& c != ')' && c != ',' && c != '.' && c != ';'
+			// operators like <= and !=, function calls and user@host
+			&& ! (prev_end == tok.start && ((prev_char && c) || c == '(' || c == '@')))
+		{
+			w.put(" ", 1, false);
+		}
+		switch (tok.type)
+		{
+		case AUDIT_TOK_WORD:
+			w.put(tok.start, tok.len, true);
+			break;
+		case AUDIT_TOK_NUMBER:
+		case AUDIT_TOK_STRING:
+			w.put("?", 1, false);
+			break;
+		default:
+			w.put(tok.start, tok.len, false);
+			break;
+		}
+
+		if (c == '(')
+		{
+			list = LIST_START;
+			list_len = w.length();
+			list_hash = w.hash();
+		}
+		else if (literal && (list == LIST_START || list == LIST_COMMA))
+		{
+			list = LIST_LITERAL;
+		}
+		else if (c == ',' && list == LIST_LITERAL)
+		{
+			list = LIST_COMMA;
+		}
+		else
+		{
+			list = LIST_NONE;
+		}
+		first = false;
+		prev_char = c;
+		prev_end = tok.start + tok.len;
+	}
+	return w.hash();
+}
@@ -0,0 +1,64 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_epoch.cc
+ */
+
+#include "audit_epoch.h"
+#include <unistd.h>
+
+void Audit_epoch::wait_readers(unsigned int idx)
+{
+	for (unsigned int spins = 0; ; spins++)
+	{
+		long sum = 0;
+		for (unsigned int i = 0; i < NUM_STRIPES; i++)
+		{
+			sum += m_stripes[i].count[idx];
+		}
+		if (sum == 0)
+		{
+			return;
+		}
+		if (spins < 100)
+		{
+			sched_yield();
+		}
+		else
+		{
+			usleep(1000);
+		}
+	}
+}
+
+void Audit_epoch::synchronize()
+{
+	pthread_mutex_lock(&LOCK_sync);
+	// Readers whose increment we see are waited for. A reader incrementing
+	// only after we checked its counter sees all stores done before the
+	// call (the increment is a full barrier). Flipping the index moves new
+	// readers to the other counter so the old one drains under constant
+	// load. The second flip handles readers which took the old index just
+	// before the first flip.
+	for (int i = 0; i < 2; i++)
+	{
+		unsigned int old_idx = m_idx;
+		m_idx = old_idx ^ 1;
+		audit_mb();
+		wait_readers(old_idx);
+	}
+	pthread_mutex_unlock(&LOCK_sync);
+}
@@ -0,0 +1,474 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_filter.cc
+ */
+
+#include "audit_filter.h"
+#include <ctype.h>
+
+// initial number of buckets of the hash sets
+static const size_t OBJ_SET_MIN_BUCKETS = 64;
+
+// FNV-1a over lower case bytes
+static inline size_t hash_lower(size_t hash, const char *str, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char) tolower((unsigned char) str[i]);
+		hash *= (size_t) 1099511628211ULL;
+	}
+	return hash;
+}
+
+static inline size_t hash_obj(const char *first, size_t first_len,
+		const char *second, size_t second_len)
+{
+	size_t hash = (size_t) 14695981039346656037ULL;
+	hash = hash_lower(hash, first, first_len);
+	hash = hash_lower(hash, ".", 1);
+	return hash_lower(hash, second, second_len);
+}
+
+// compare str with lower case key
+static inline bool equal_lower(const char *key, const char *str, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		if (key[i] != tolower((unsigned char) str[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Split a list separated by commas or new lines and pass each entry to
+ * func. White space around entries is trimmed. # starts a comment till
+ * the end of the line.
+ */
+static bool parse_list(const char *list, size_t len,
+		bool (*func)(void *arg, const char *entry, size_t len), void *arg)
+{
+	size_t pos = 0;
+	while (pos < len)
+	{
+		while (pos < len && isspace((unsigned char) list[pos]))
+		{
+			pos++;
+		}
+		// comment till the end of the line
+		bool comment = pos < len && list[pos] == '#';
+		size_t end = pos;
+		while (end < len && list[end] != '\n' && (comment || list[end] != ','))
+		{
+			end++;
+		}
+		size_t stop = end;
+		while (stop > pos && isspace((unsigned char) list[stop - 1]))
+		{
+			stop--;
+		}
+		if (! comment && stop > pos && ! func(arg, list + pos, stop - pos))
+		{
+			return false;
+		}
+		pos = end + 1;
+	}
+	return true;
+}
+
+void Audit_obj_set::clear()
+{
+	for (size_t i = 0; m_buckets && i <= m_mask; i++)
+	{
+		Entry *entry = m_buckets[i];
+		while (entry)
+		{
+			Entry *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+	free(m_buckets);
+	m_buckets = NULL;
+	m_mask = 0;
+	m_count = 0;
+	m_empty = false;
+	m_all = false;
+}
+
+bool Audit_obj_set::contains(const char *first, size_t first_len,
+		const char *second, size_t second_len) const
+{
+	if (! m_buckets)
+	{
+		return false;
+	}
+	size_t hash = hash_obj(first, first_len, second, second_len);
+	size_t len = first_len + 1 + second_len;
+	for (Entry *entry = m_buckets[hash & m_mask]; entry; entry = entry->next)
+	{
+		if (entry->hash == hash && entry->len == len
+			&& equal_lower(entry->key, first, first_len)
+			&& entry->key[first_len] == '.'
+			&& equal_lower(entry->key + first_len + 1, second, second_len))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Audit_obj_set::grow()
+{
+	size_t size = m_buckets ? (m_mask + 1) * 2 : OBJ_SET_MIN_BUCKETS;
+	Entry **buckets = (Entry **) calloc(size, sizeof(Entry *));
+	if (! buckets)
+	{
+		return false;
+	}
+	for (size_t i = 0; m_buckets && i <= m_mask; i++)
+	{
+		Entry *entry = m_buckets[i];
+		while (entry)
+		{
+			Entry *next = entry->next;
+			entry->next = buckets[entry->hash & (size - 1)];
+			buckets[entry->hash & (size - 1)] = entry;
+			entry = next;
+		}
+	}
+	free(m_buckets);
+	m_buckets = buckets;
+	m_mask = size - 1;
+	return true;
+}
+
+bool Audit_obj_set::add(const char *str, size_t len)
+{
+	if (len == 2 && str[0] == '{' && str[1] == '}')
+	{
+		if (! m_empty)
+		{
+			m_empty = true;
+			m_count++;
+		}
+		return true;
+	}
+	// split at the first dot. An entry without one is a db (db.*)
+	const char *dot = (const char *) memchr(str, '.', len);
+	size_t first_len = dot ? (size_t) (dot - str) : len;
+	const char *second = dot ? dot + 1 : "*";
+	size_t second_len = dot ? len - first_len - 1 : 1;
+	if (first_len == 1 && str[0] == '*' && second_len == 1 && second[0] == '*')
+	{
+		if (! m_all)
+		{
+			m_all = true;
+			m_count++;
+		}
+		return true;
+	}
+	if (contains(str, first_len, second, second_len))
+	{
+		return true;
+	}
+	if ((! m_buckets || m_count > m_mask) && ! grow())
+	{
+		return false;
+	}
+	size_t key_len = first_len + 1 + second_len;
+	Entry *entry = (Entry *) malloc(sizeof(Entry) + key_len);
+	if (! entry)
+	{
+		return false;
+	}
+	for (size_t i = 0; i < first_len; i++)
+	{
+		entry->key[i] = tolower((unsigned char) str[i]);
+	}
+	entry->key[first_len] = '.';
+	for (size_t i = 0; i < second_len; i++)
+	{
+		entry->key[first_len + 1 + i] = tolower((unsigned char) second[i]);
+	}
+	entry->key[key_len] = '\0';
+	entry->len = key_len;
+	entry->hash = hash_obj(str, first_len, second, second_len);
+	entry->next = m_buckets[entry->hash & m_mask];
+	m_buckets[entry->hash & m_mask] = entry;
+	m_count++;
+	return true;
+}
+
+bool Audit_obj_set::add_entry(void *set, const char *entry, size_t len)
+{
+	return ((Audit_obj_set *) set)->add(entry, len);
+}
+
+bool Audit_obj_set::add_list(const char *list, size_t len)
+{
+	return parse_list(list, len, add_entry, this);
+}
+
+void Audit_user_set::clear()
+{
+	for (size_t i = 0; m_buckets && i <= m_mask; i++)
+	{
+		Entry *entry = m_buckets[i];
+		while (entry)
+		{
+			Entry *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+	free(m_buckets);
+	m_buckets = NULL;
+	m_mask = 0;
+	m_count = 0;
+}
+
+bool audit_wild_match(const char *pattern, const char *str)
+{
+	const char *star = NULL;	// position after the last %
+	const char *star_str = NULL;	// str position the last % matches till
+	while (*str)
+	{
+		if (*pattern == '%')
+		{
+			star = ++pattern;
+			star_str = str;
+		}
+		else if (*pattern == '_' || *pattern == tolower((unsigned char) *str))
+		{
+			pattern++;
+			str++;
+		}
+		else if (star)
+		{
+			// let the last % match one more char
+			pattern = star;
+			str = ++star_str;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	while (*pattern == '%')
+	{
+		pattern++;
+	}
+	return *pattern == '\0';
+}
+
+bool Audit_user_set::match(const char *user, const char *host, const char *ip) const
+{
+	if (! m_buckets)
+	{
+		return false;
+	}
+	if (! user)
+	{
+		user = "";
+	}
+	size_t len = strlen(user);
+	size_t hash = hash_lower((size_t) 14695981039346656037ULL, user, len);
+	for (Entry *entry = m_buckets[hash & m_mask]; entry; entry = entry->next)
+	{
+		if (entry->hash != hash || entry->user_len != len
+			|| ! equal_lower(entry->key, user, len))
+		{
+			continue;
+		}
+		if (! entry->host
+			|| (host && audit_wild_match(entry->host, host))
+			|| (ip && audit_wild_match(entry->host, ip)))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Audit_user_set::grow()
+{
+	size_t size = m_buckets ? (m_mask + 1) * 2 : OBJ_SET_MIN_BUCKETS;
+	Entry **buckets = (Entry **) calloc(size, sizeof(Entry *));
+	if (! buckets)
+	{
+		return false;
+	}
+	for (size_t i = 0; m_buckets && i <= m_mask; i++)
+	{
+		Entry *entry = m_buckets[i];
+		while (entry)
+		{
+			Entry *next = entry->next;
+			entry->next = buckets[entry->hash & (size - 1)];
+			buckets[entry->hash & (size - 1)] = entry;
+			entry = next;
+		}
+	}
+	free(m_buckets);
+	m_buckets = buckets;
+	m_mask = size - 1;
+	return true;
+}
+
+// strip quotes around a user or host name
+static void unquote(const char **str, size_t *len)
+{
+	if (*len >= 2 && ((*str)[0] == '\'' || (*str)[0] == '"' || (*str)[0] == '`')
+		&& (*str)[*len - 1] == (*str)[0])
+	{
+		(*str)++;
+		*len -= 2;
+	}
+}
+
+bool Audit_user_set::add(const char *str, size_t len)
+{
+	const char *user = str;
+	size_t user_len = len;
+	const char *host = NULL;
+	size_t host_len = 0;
+	const char *at = (const char *) memchr(str, '@', len);
+	if (at)
+	{
+		user_len = at - str;
+		host = at + 1;
+		host_len = len - user_len - 1;
+		unquote(&host, &host_len);
+	}
+	unquote(&user, &user_len);
+	if (user_len == 2 && user[0] == '{' && user[1] == '}')
+	{
+		// empty user
+		user_len = 0;
+	}
+	// user@% is the same as any host
+	if (host && host_len == 1 && host[0] == '%')
+	{
+		host = NULL;
+	}
+	if ((! m_buckets || m_count > m_mask) && ! grow())
+	{
+		return false;
+	}
+	// user and host are kept in key, each null terminated
+	Entry *entry = (Entry *) malloc(sizeof(Entry) + user_len + 1 + host_len);
+	if (! entry)
+	{
+		return false;
+	}
+	for (size_t i = 0; i < user_len; i++)
+	{
+		entry->key[i] = tolower((unsigned char) user[i]);
+	}
+	entry->key[user_len] = '\0';
+	entry->user_len = user_len;
+	entry->host = NULL;
+	if (host)
+	{
+		entry->host = entry->key + user_len + 1;
+		for (size_t i = 0; i < host_len; i++)
+		{
+			entry->host[i] = tolower((unsigned char) host[i]);
+		}
+		entry->host[host_len] = '\0';
+	}
+	entry->hash = hash_lower((size_t) 14695981039346656037ULL, user, user_len);
+	entry->next = m_buckets[entry->hash & m_mask];
+	m_buckets[entry->hash & m_mask] = entry;
+	m_count++;
+	return true;
+}
+
+bool Audit_user_set::add_entry(void *set, const char *entry, size_t len)
+{
+	return ((Audit_user_set *) set)->add(entry, len);
+}
+
+bool Audit_user_set::add_list(const char *list, size_t len)
+{
+	return parse_list(list, len, add_entry, this);
+}
+
+bool Audit_word_set::add(const char *word, size_t len)
+{
+	// keep room for the \0 which ends the list
+	char *words = (char *) realloc(m_words, m_words_len + len + 2);
+	if (! words)
+	{
+		return false;
+	}
+	m_words = words;
+	for (size_t i = 0; i < len; i++)
+	{
+		m_words[m_words_len + i] = tolower((unsigned char) word[i]);
+	}
+	m_words_len += len;
+	m_words[m_words_len++] = '\0';
+	m_words[m_words_len] = '\0';
+	m_first[(unsigned char) tolower((unsigned char) word[0])] = 1;
+	m_first[(unsigned char) toupper((unsigned char) word[0])] = 1;
+	if (m_count == 0 || len < m_min_len)
+	{
+		m_min_len = len;
+	}
+	m_count++;
+	return true;
+}
+
+bool Audit_word_set::add_entry(void *set, const char *entry, size_t len)
+{
+	return ((Audit_word_set *) set)->add(entry, len);
+}
+
+bool Audit_word_set::add_list(const char *list, size_t len)
+{
+	return parse_list(list, len, add_entry, this);
+}
+
+bool Audit_word_set::search(const char *text, size_t len) const
+{
+	if (m_count == 0 || len < m_min_len)
+	{
+		return false;
+	}
+	const size_t last = len - m_min_len;
+	for (size_t i = 0; i <= last; i++)
+	{
+		if (! m_first[(unsigned char) text[i]])
+		{
+			continue;
+		}
+		for (const char *word = m_words; *word; )
+		{
+			size_t word_len = strlen(word);
+			if (word_len <= len - i && equal_lower(word, text + i, word_len))
+			{
+				return true;
+			}
+			word += word_len + 1;
+		}
+	}
+	return false;
+}
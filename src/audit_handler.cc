@@ -20,6 +20,10 @@
  */
 
 #include "audit_handler.h"
+#include "audit_mask.h"
+#include "audit_digest.h"
+#include "audit_aggregate.h"
+#include "audit_peer_resolver.h"
 // for definition of sockaddr_un
 #include <sys/un.h>
 #include <stdio_ext.h>
@@ -52,6 +56,7 @@ extern "C" void vio_timeout(Vio *vio,uint which, uint timeout);
 // initialize static stuff
 ThdOffsets Audit_formatter::thd_offsets = { 0 };
 Audit_handler *Audit_handler::m_audit_handler_list[Audit_handler::MAX_AUDIT_HANDLERS_NUM];
+volatile int Audit_handler::m_num_enabled = 0;
 
 #if MYSQL_VERSION_ID < 50709
 #define C_STRING_WITH_LEN(X) ((char *) (X)), ((size_t) (sizeof(X) - 1))
@@ -59,113 +64,212 @@ Audit_handler *Audit_handler::m_audit_handler_list[Audit_handler::MAX_AUDIT_HAND
 
 //////////////////////////////////////////////
 // Yajl alloc funcs based upon thd_alloc
-static void * yajl_thd_malloc(void *ctx, size_t sz)
+//////////////////////////////////////////////
+
+const char *Audit_formatter::retrieve_object_type(TABLE_LIST *pObj)
 {
-	THD *thd = (THD*) ctx;
-	// we allocate plus sizeof(size_t) and stored the alloced size
-	// at the start of the pointer (for support of realloc)
-	size_t *ptr = (size_t *) thd_alloc(thd, sz + sizeof(size_t));
-	if (ptr) 
+	if (table_is_view(pObj))
 	{
-		*ptr = sz; //set the size at the start of the memory
-		ptr++;
+		return "VIEW";
 	}
-	return ptr;
+	return "TABLE";
 }
 
-static void * yajl_thd_realloc(void *ctx, void * previous,
-		size_t sz)
+void Audit_handler::stop_all()
 {
-	THD *thd = (THD*)ctx;
-	void *ptr;
-	if ((ptr = yajl_thd_malloc(thd,sz)))
+	for (size_t i = 0; i < MAX_AUDIT_HANDLERS_NUM; ++i)
 	{
-		if (previous)
+		if (m_audit_handler_list[i] != NULL)
 		{
-			// copy only the previous allocated size (which is
-			// stored just before the pointer passed in)
-			size_t prev_sz = *(((size_t *)previous) - 1);			
-			memcpy(ptr,previous, prev_sz);
+			m_audit_handler_list[i]->set_enable(false);
 		}
 	}
-	return ptr;
 }
 
-static void yajl_thd_free(void *ctx, void * ptr)
-{
-	//do nothing as thd_alloc deosn't require free
-	return;
-}
+/**
+ * Writer used to fan out a formatted event to several handlers.
+ * The formatter writes the event once and we pass the same buffer
+ * to each of the handler writers, keeping the result per handler.
+ */
+class Audit_fanout_writer: public IWriter {
+public:
+	Audit_fanout_writer() : m_num(0)
+	{
+	}
 
-static void yajl_set_thd_alloc_funcs(THD * thd, yajl_alloc_funcs * yaf)
-{
-	yaf->malloc = yajl_thd_malloc;
-	yaf->free = yajl_thd_free;
-	yaf->realloc = yajl_thd_realloc;
-	yaf->ctx = thd;
-}
+	void add(IWriter *writer)
+	{
+		m_writers[m_num] = writer;
+		m_res[m_num] = 0;
+		m_num++;
+	}
 
-//////////////////////////////////////////////
+	size_t size() const
+	{
+		return m_num;
+	}
 
-const char *Audit_formatter::retrieve_object_type(TABLE_LIST *pObj)
-{
-	if (table_is_view(pObj))
+	// result of the writes for the writer at idx. negative on failure
+	ssize_t result(size_t idx) const
 	{
-		return "VIEW";
+		return m_res[idx];
 	}
-	return "TABLE";
-}
 
-void Audit_handler::stop_all()
+	ssize_t write(const char *data, size_t size)
+	{
+		for (size_t i = 0; i < m_num; i++)
+		{
+			if (m_res[i] >= 0)
+			{
+				m_res[i] = m_writers[i]->write(data, size);
+			}
+		}
+		return size;
+	}
+
+	ssize_t write_no_lock(const char *data, size_t size)
+	{
+		for (size_t i = 0; i < m_num; i++)
+		{
+			if (m_res[i] >= 0)
+			{
+				m_res[i] = m_writers[i]->write_no_lock(data, size);
+			}
+		}
+		return size;
+	}
+
+	int open(const char *io_dest, bool log_errors)
+	{
+		return -1;
+	}
+
+	void close()
+	{
+	}
+
+private:
+	IWriter *m_writers[Audit_handler::MAX_AUDIT_HANDLERS_NUM];
+	ssize_t m_res[Audit_handler::MAX_AUDIT_HANDLERS_NUM];
+	size_t m_num;
+};
+
+void Audit_handler::log_audit_all(ThdSesData *pThdData)
 {
+	// handlers which are enabled (we are in their gate till log_audit_end)
+	Audit_handler *active[MAX_AUDIT_HANDLERS_NUM];
+	unsigned int tokens[MAX_AUDIT_HANDLERS_NUM];
+	size_t num_active = 0;
 	for (size_t i = 0; i < MAX_AUDIT_HANDLERS_NUM; ++i)
 	{
-		if (m_audit_handler_list[i] != NULL)
+		if (m_audit_handler_list[i] != NULL &&
+			m_audit_handler_list[i]->log_audit_begin(pThdData, &tokens[num_active]))
 		{
-			m_audit_handler_list[i]->set_enable(false);
+			active[num_active++] = m_audit_handler_list[i];
+		}
+	}
+
+	// format the event once per formatter and hand the output to all
+	// handlers sharing the formatter
+	bool done[MAX_AUDIT_HANDLERS_NUM] = { false };
+	for (size_t i = 0; i < num_active; ++i)
+	{
+		if (done[i])
+		{
+			continue;
+		}
+		if (active[i]->get_writer() == NULL)
+		{
+			// handler doesn't support sharing. format on its own
+			active[i]->log_audit_end(active[i]->handler_log_audit(pThdData), tokens[i]);
+			done[i] = true;
+			continue;
+		}
+		Audit_formatter *formatter = active[i]->m_formatter;
+		size_t targets[MAX_AUDIT_HANDLERS_NUM];
+		Audit_fanout_writer writer;
+		for (size_t j = i; j < num_active; ++j)
+		{
+			if (! done[j] && active[j]->m_formatter == formatter && active[j]->get_writer() != NULL)
+			{
+				targets[writer.size()] = j;
+				writer.add(active[j]->get_writer());
+				done[j] = true;
+			}
+		}
+		bool format_ok = (formatter->event_format(pThdData, &writer) >= 0);
+		for (size_t k = 0; k < writer.size(); ++k)
+		{
+			active[targets[k]]->log_audit_end(format_ok && writer.result(k) >= 0, tokens[targets[k]]);
 		}
 	}
 }
 
-void Audit_handler::log_audit_all(ThdSesData *pThdData)
+void Audit_handler::log_summary_all(const Audit_summary *summary)
 {
 	for (size_t i = 0; i < MAX_AUDIT_HANDLERS_NUM; ++i)
 	{
-		if (m_audit_handler_list[i] != NULL)
+		Audit_handler *handler = m_audit_handler_list[i];
+		unsigned int token;
+		if (handler != NULL && handler->get_writer() != NULL
+			&& handler->log_audit_begin(NULL, &token))
 		{
-			m_audit_handler_list[i]->log_audit(pThdData);
+			ssize_t res = handler->m_formatter->summary_format(handler->get_writer(), summary);
+			handler->log_audit_end(res >= 0, token);
 		}
 	}
 }
 
 void Audit_handler::set_enable(bool val)
 {
-	lock_exclusive();
+	gate_close();
 	if (m_enabled == val) // we are already enabled simply return
 	{
-		unlock();
+		gate_open();
 		return;
 	}
 	m_enabled = val;
 	if (m_enabled)
 	{
+		audit_atomic_add(&m_num_enabled, 1);
 		// call the startup of the handler
 		handler_start();
 	}
 	else
 	{
+		audit_atomic_sub(&m_num_enabled, 1);
 		// call the cleanup of the handler
 		handler_stop();
 	}
-	unlock();
+	gate_open();
+}
+
+void Audit_handler::set_formatter(Audit_formatter *frmt)
+{
+	gate_close();
+	if (m_formatter == frmt)
+	{
+		gate_open();
+		return;
+	}
+	if (m_enabled)
+	{
+		handler_stop();
+	}
+	m_formatter = frmt;
+	if (m_enabled)
+	{
+		handler_start();
+	}
+	gate_open();
 }
 
 void Audit_handler::flush()
 {
-	lock_exclusive();
+	gate_close();
 	if (! m_enabled) // if not running we don't flush
 	{
-		unlock();
+		gate_open();
 		return;
 	}
 	// call the cleanup of the handler
@@ -173,96 +277,246 @@ void Audit_handler::flush()
 	// call the startup of the handler
 	handler_start();
 	sql_print_information("%s Log flush complete.", AUDIT_LOG_PREFIX);
-	unlock();
+	gate_open();
 }
 
-void Audit_handler::log_audit(ThdSesData *pThdData)
+bool Audit_handler::log_audit_begin(ThdSesData *pThdData, unsigned int *token)
 {
-	lock_shared();
+	// fast path for a disabled handler: no need to enter the gate
 	if (! m_enabled)
 	{
-		unlock();
-		return;
+		return false;
+	}
+	*token = gate_enter();
+	if (! m_enabled)
+	{
+		gate_exit(*token);
+		return false;
 	}
 	// sanity check that offsets match
 	// we can also consider using security context function to do some sanity checks
 	//  char buffer[2048];
 	//  thd_security_context(thd, buffer, 2048, 2000);
 	//  fprintf(log_file, "info from security context: %s\n", buffer);
-	unsigned long inst_thread_id = Audit_formatter::thd_inst_thread_id(pThdData->getTHD());
-	unsigned long plug_thread_id = thd_get_thread_id(pThdData->getTHD());
-	if (inst_thread_id != plug_thread_id)
+	if (pThdData)
 	{
-		if (m_print_offset_err)
+		unsigned long inst_thread_id = Audit_formatter::thd_inst_thread_id(pThdData->getTHD());
+		unsigned long plug_thread_id = thd_get_thread_id(pThdData->getTHD());
+		if (inst_thread_id != plug_thread_id)
 		{
-			m_print_offset_err = false;
-			sql_print_error(
-					"%s Thread id from thd_get_thread_id doesn't match calculated value from offset %lu <> %lu. Aborting!",
-					AUDIT_LOG_PREFIX, inst_thread_id, plug_thread_id);
+			if (m_print_offset_err)
+			{
+				m_print_offset_err = false;
+				sql_print_error(
+						"%s Thread id from thd_get_thread_id doesn't match calculated value from offset %lu <> %lu. Aborting!",
+						AUDIT_LOG_PREFIX, inst_thread_id, plug_thread_id);
+			}
+			gate_exit(*token);
+			return false;
 		}
+		// offsets are good
+		m_print_offset_err = true; // mark to print offset err to log in case we encounter in the future
 	}
-	else
+	// check if failed
+	bool do_log = true;
+	if (m_failed)
 	{
-		// offsets are good
-		m_print_offset_err = true; // mark to print offset err to log in case we encounter in the future		
-		// check if failed
-		bool do_log = true;
-		if (m_failed)
-		{
-			do_log = false;
-			bool retry = m_retry_interval > 0 &&
-				difftime(time(NULL), m_last_retry_sec_ts) > m_retry_interval;
-			if (retry)
+		do_log = false;
+		bool retry = m_retry_interval > 0 &&
+			difftime(time(NULL), m_last_retry_sec_ts) > m_retry_interval;
+		if (retry)
+		{
+			pthread_mutex_lock(&LOCK_io);
+			//get the io lock. After acquiring the lock do another check that we really need to start (maybe another thread did this already)
+			if (!m_failed)
 			{
-				pthread_mutex_lock(&LOCK_io);
-				//get the io lock. After acquiring the lock do another check that we really need to start (maybe another thread did this already)
-				if (!m_failed)
-				{
-					do_log = true;
-				}
-				else if (m_retry_interval > 0 &&
-					difftime(time(NULL), m_last_retry_sec_ts) > m_retry_interval)
-				{
-					do_log = handler_start_nolock();
-				}
-				pthread_mutex_unlock(&LOCK_io);
-				
+				do_log = true;
 			}
-		}
-		if (do_log)
-		{
-			if (! handler_log_audit(pThdData))
+			else if (m_retry_interval > 0 &&
+				difftime(time(NULL), m_last_retry_sec_ts) > m_retry_interval)
 			{
-				//failure - acquire io lock to set failed and do stop
-				pthread_mutex_lock(&LOCK_io);
-				if(!m_failed) //make sure someone else didn't set this already 
-				{
-					set_failed();
-					handler_stop_internal();
-				}
-				pthread_mutex_unlock(&LOCK_io);
+				do_log = handler_start_nolock();
 			}
-		}		
+			pthread_mutex_unlock(&LOCK_io);
+		}
+	}
+	if (! do_log)
+	{
+		gate_exit(*token);
+	}
+	return do_log;
+}
+
+void Audit_handler::log_audit_end(bool success, unsigned int token)
+{
+	if (! success)
+	{
+		//failure - acquire io lock to set failed and do stop
+		pthread_mutex_lock(&LOCK_io);
+		if(!m_failed) //make sure someone else didn't set this already
+		{
+			set_failed();
+			handler_stop_internal();
+		}
+		pthread_mutex_unlock(&LOCK_io);
+	}
+	gate_exit(token);
+}
+
+void Audit_handler::log_audit(ThdSesData *pThdData)
+{
+	unsigned int token;
+	if (log_audit_begin(pThdData, &token))
+	{
+		log_audit_end(handler_log_audit(pThdData), token);
 	}
-	unlock();
 }
 
 void Audit_file_handler::close()
 {
 	if (m_log_file)
 	{
+		// group commit waiters of unsynced writes can't be covered by a
+		// leader once the file is closed. sync them here.
+		pthread_mutex_lock(&LOCK_sync);
+		bool pending = m_synced_seq < m_write_seq;
+		pthread_mutex_unlock(&LOCK_sync);
+		if (pending)
+		{
+			bool res = (fflush(m_log_file) == 0) &&
+				(my_sync(fileno(m_log_file), MYF(MY_WME)) == 0);
+			group_commit_done(m_write_seq, res);
+		}
 		my_fclose(m_log_file, MYF(0));
 	}
 	m_log_file = NULL;
 }
 
+ssize_t Audit_file_handler::write(const char *data, size_t size)
+{
+	if (! is_group_commit())
+	{
+		return Audit_io_handler::write(data, size);
+	}
+	pthread_mutex_lock(&LOCK_io);
+	ssize_t res = record_write_no_lock(data, size);
+	ulonglong seq = m_write_seq;
+	pthread_mutex_unlock(&LOCK_io);
+	if (res >= 0 && ! group_commit_wait(seq))
+	{
+		res = -1;
+	}
+	return res;
+}
+
+void Audit_file_handler::group_commit_done(ulonglong seq, bool res)
+{
+	pthread_mutex_lock(&LOCK_sync);
+	if (res)
+	{
+		if (seq > m_synced_seq)
+		{
+			m_synced_seq = seq;
+		}
+	}
+	else if (seq > m_sync_failed_seq)
+	{
+		m_sync_failed_seq = seq;
+	}
+	pthread_cond_broadcast(&COND_sync);
+	pthread_mutex_unlock(&LOCK_sync);
+}
+
+bool Audit_file_handler::group_commit_wait(ulonglong seq)
+{
+	pthread_mutex_lock(&LOCK_sync);
+	for (;;)
+	{
+		if (m_synced_seq >= seq)
+		{
+			pthread_mutex_unlock(&LOCK_sync);
+			return true;
+		}
+		if (m_sync_failed_seq >= seq)
+		{
+			pthread_mutex_unlock(&LOCK_sync);
+			return false;
+		}
+		if (m_sync_leader)
+		{
+			// the current leader may cover our write. wait for it to finish
+			pthread_cond_wait(&COND_sync, &LOCK_sync);
+			continue;
+		}
+		// become the leader and sync everything written so far
+		m_sync_leader = true;
+		pthread_mutex_unlock(&LOCK_sync);
+		if (m_sync_delay > 0)
+		{
+			// let more threads write so they share the sync
+			my_sleep(m_sync_delay);
+		}
+		pthread_mutex_lock(&LOCK_io);
+		ulonglong target = m_write_seq;
+		int fd = -1;
+		// errno of the failed step, saved before other calls change it
+		int err = EBADF;
+		// flush the user space buffers under the io lock. The sync itself is
+		// done on a duplicate fd so writers can continue appending meanwhile.
+		if (m_log_file)
+		{
+			if (fflush(m_log_file) == 0)
+			{
+				fd = dup(fileno(m_log_file));
+			}
+			err = errno;
+		}
+		pthread_mutex_unlock(&LOCK_io);
+		bool res = false;
+		if (fd >= 0)
+		{
+			res = (my_sync(fd, MYF(MY_WME)) == 0);
+			err = errno;
+			::close(fd);
+		}
+		if (! res)
+		{
+			sql_print_error("%s failed syncing file: %s. Err: %s",
+					AUDIT_LOG_PREFIX, m_io_dest, strerror(err));
+		}
+		pthread_mutex_lock(&LOCK_sync);
+		m_sync_leader = false;
+		pthread_mutex_unlock(&LOCK_sync);
+		group_commit_done(target, res);
+		pthread_mutex_lock(&LOCK_sync);
+	}
+}
+
 ssize_t Audit_file_handler::write_no_lock(const char *data, size_t size)
+{
+	return write_parts_no_lock(NULL, 0, data, size);
+}
+
+ssize_t Audit_file_handler::write_parts_no_lock(const char *head, size_t head_len, const char *data, size_t size)
 {	
 	ssize_t res = -1;
 	if(m_log_file)
 	{
-		res = my_fwrite(m_log_file, (uchar *) data, size, MYF(0));
-		if (res && m_sync_period && ++m_sync_counter >= m_sync_period)
+		res = 0;
+		if (head_len > 0)
+		{
+			res = my_fwrite(m_log_file, (uchar *) head, head_len, MYF(0));
+		}
+		if (res >= 0)
+		{
+			res = my_fwrite(m_log_file, (uchar *) data, size, MYF(0));
+		}
+		if (res && is_group_commit())
+		{
+			// sync is done by the group commit leader after releasing LOCK_io
+			m_write_seq++;
+		}
+		else if (res && m_sync_period && ++m_sync_counter >= m_sync_period)
 		{
 			m_sync_counter = 0;
 			// Note fflush() only flushes the user space buffers provided by the C library.
@@ -349,6 +603,8 @@ bool Audit_io_handler::handler_start_internal()
 		// open failed
 		return false;
 	}
+	// a new stream. sessions send their definitions again
+	m_bin_dict.reset();
 	ssize_t res = m_formatter->start_msg_format(this);
 	/*
 	 * Sanity check of writing to the log. If we fail, we print an
@@ -413,90 +669,333 @@ void Audit_handler::handler_stop()
 	pthread_mutex_unlock(&LOCK_io);
 }
 
-/////////////////// Audit_socket_handler //////////////////////////////////
+/////////////////// Audit_io_handler async writer //////////////////////////
 
-void Audit_socket_handler::close()
+void Audit_io_handler::handler_start()
 {
-	if (m_vio)
+	Audit_handler::handler_start();
+	// we start the writer even if the open failed so it is ready once a retry succeeds
+	if (m_async)
 	{
-		// no need for vio_close as is called by delete (additionally close changed its name to vio_shutdown in 5.6.11)
-		vio_delete((Vio*)m_vio);
+		async_start();
 	}
-	m_vio = NULL;
 }
 
-ssize_t Audit_socket_handler::write_no_lock(const char *data, size_t size)
-{	
-	ssize_t res = -1;
-	if (m_vio)
-	{
-		res = vio_write((Vio*)m_vio, (const uchar *) data, size);
-		if (res < 0) // log the error
-		{
-			sql_print_error("%s failed writing to socket: %s. Err: %s",
-					AUDIT_LOG_PREFIX, m_io_dest, strerror(vio_errno((Vio*)m_vio)));
-		}
-	}
-	return res;
+void Audit_io_handler::handler_stop()
+{
+	// drain the queue before the stop message and close
+	async_stop();
+	Audit_handler::handler_stop();
 }
 
-int Audit_socket_handler::open(const char *io_dest, bool log_errors)
+bool Audit_io_handler::async_start()
 {
-	// open the socket
-	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (sock < 0)
+	if (m_queue.init(m_async_queue_size) != 0)
 	{
-		if (log_errors)
-		{
-			sql_print_error(
-					"%s unable to create unix socket: %s.",
-					AUDIT_LOG_PREFIX, strerror(errno));
-		}
-		return -1;
+		sql_print_error("%s %s: unable to allocate async queue of size %u. Using synchronous writes.",
+				AUDIT_LOG_PREFIX, m_io_type, m_async_queue_size);
+		return false;
+	}
+	pthread_mutex_init(&LOCK_async, MY_MUTEX_INIT_FAST);
+	pthread_cond_init(&COND_async_data, NULL);
+	pthread_cond_init(&COND_async_space, NULL);
+	m_writer_stop = false;
+	m_writer_waiting = 0;
+	m_producers_waiting = 0;
+	m_async_lost = 0;
+	int res = pthread_create(&m_writer_thread, NULL, writer_thread_func, this);
+	if (res != 0)
+	{
+		sql_print_error("%s %s: unable to create async writer thread: %s. Using synchronous writes.",
+				AUDIT_LOG_PREFIX, m_io_type, strerror(res));
+		pthread_cond_destroy(&COND_async_space);
+		pthread_cond_destroy(&COND_async_data);
+		pthread_mutex_destroy(&LOCK_async);
+		m_queue.destroy();
+		return false;
 	}
+	m_async_active = true;
+	sql_print_information("%s %s: async writer started. Queue size: %u.",
+			AUDIT_LOG_PREFIX, m_io_type, m_async_queue_size);
+	return true;
+}
 
-	// connect the socket
-	m_vio = vio_new(sock, VIO_TYPE_SOCKET, VIO_LOCALHOST);
-	struct sockaddr_un UNIXaddr;
-	UNIXaddr.sun_family = AF_UNIX;
-	strmake(UNIXaddr.sun_path, io_dest, sizeof(UNIXaddr.sun_path)-1);
-#if MYSQL_VERSION_ID < 50600
-	if (my_connect(sock,(struct sockaddr *) &UNIXaddr, sizeof(UNIXaddr),
-				m_connect_timeout))
-#else
-	// in 5.6 timeout is in ms
-	if (vio_socket_connect((Vio*)m_vio,(struct sockaddr *) &UNIXaddr, sizeof(UNIXaddr),
-				m_connect_timeout * 1000))
-#endif
+void Audit_io_handler::async_stop()
+{
+	if (! m_async_active)
 	{
-		if (log_errors)
-		{
-			sql_print_error(
-				"%s unable to connect to socket: %s. err: %s.",
-				AUDIT_LOG_PREFIX, m_io_dest, strerror(errno));
-		}
-		close();
-		return -2;
+		return;
 	}
+	// called with the enable gate closed (gate_close) so no one is adding records
+	pthread_mutex_lock(&LOCK_async);
+	m_writer_stop = true;
+	pthread_cond_signal(&COND_async_data);
+	pthread_mutex_unlock(&LOCK_async);
+	pthread_join(m_writer_thread, NULL);
+	m_async_active = false;
+	m_queue.destroy();
+	pthread_cond_destroy(&COND_async_space);
+	pthread_cond_destroy(&COND_async_data);
+	pthread_mutex_destroy(&LOCK_async);
+}
 
-	if (m_write_timeout > 0)
+void Audit_io_handler::async_wake_writer()
+{
+	// pairs with the barrier in writer_run() so either we see the writer
+	// waiting or the writer sees the new record
+	audit_mb();
+	if (m_writer_waiting)
 	{
-		int timeout = m_write_timeout / 1000;	// milliseconds to seconds, integer dvision
-		if (timeout == 0)
-		{
-			timeout = 1;	// round up to 1 second
-		}
-		// we don't check the result of this call since in earlier
-		// versions it returns void
-		//
-		// 1 as the 2nd argument means write timeout
-		vio_timeout((Vio*)m_vio, 1, timeout);
+		pthread_mutex_lock(&LOCK_async);
+		pthread_cond_signal(&COND_async_data);
+		pthread_mutex_unlock(&LOCK_async);
 	}
-
-	return 0;
 }
 
-//////////////////////// Audit Socket handler end ///////////////////////////////////////////
+// utility to set an absolute timeout for pthread_cond_timedwait
+static void set_timeout_usec(struct timespec *ts, long usec)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_nsec += usec * 1000;
+	ts->tv_sec += ts->tv_nsec / 1000000000;
+	ts->tv_nsec %= 1000000000;
+}
+
+ssize_t Audit_io_handler::async_write(const char *data, size_t size)
+{
+	AuditRecord *rec = AuditRecord::create(data, size);
+	if (! rec)
+	{
+		sql_print_error("%s %s: failed allocating %zu bytes for async record.",
+				AUDIT_LOG_PREFIX, m_io_type, size);
+		return -1;
+	}
+	while (! m_queue.push(rec))
+	{
+		switch (m_async_overflow)
+		{
+		case ASYNC_OVERFLOW_DROP_NEWEST:
+			AuditRecord::destroy(rec);
+			audit_atomic_add(&m_async_lost, 1);
+			return size;
+		case ASYNC_OVERFLOW_DROP_OLDEST:
+		{
+			AuditRecord *oldest = m_queue.pop();
+			if (oldest)
+			{
+				AuditRecord::destroy(oldest);
+				audit_atomic_add(&m_async_lost, 1);
+			}
+			break;
+		}
+		default:
+		{
+			// block until the writer makes room. we use a timed wait
+			// so a missed signal only delays us a bit.
+			async_wake_writer();
+			struct timespec ts;
+			set_timeout_usec(&ts, 10000);
+			pthread_mutex_lock(&LOCK_async);
+			m_producers_waiting++;
+			audit_mb();
+			if (! m_queue.push(rec))
+			{
+				pthread_cond_timedwait(&COND_async_space, &LOCK_async, &ts);
+				m_producers_waiting--;
+				pthread_mutex_unlock(&LOCK_async);
+				continue;
+			}
+			m_producers_waiting--;
+			pthread_mutex_unlock(&LOCK_async);
+			async_wake_writer();
+			return size;
+		}
+		}
+	}
+	async_wake_writer();
+	return size;
+}
+
+void Audit_io_handler::async_write_lost_nolock()
+{
+	if (m_async_lost == 0 || m_failed)
+	{
+		return;
+	}
+	ulonglong lost = audit_atomic_swap(&m_async_lost, 0);
+	if (lost > 0 && m_formatter->lost_msg_format(this, lost) < 0)
+	{
+		// we will report them with the next message
+		audit_atomic_add(&m_async_lost, lost);
+	}
+}
+
+void *Audit_io_handler::writer_thread_func(void *arg)
+{
+	// needed for using mysys functions (my_fwrite and co) in our thread
+	my_thread_init();
+	((Audit_io_handler *) arg)->writer_run();
+	my_thread_end();
+	return NULL;
+}
+
+void Audit_io_handler::writer_run()
+{
+	// write records in batches to reduce locking of LOCK_io
+	const int max_batch = 64;
+	AuditRecord *batch[max_batch];
+	for (;;)
+	{
+		int n = 0;
+		while (n < max_batch && (batch[n] = m_queue.pop()) != NULL)
+		{
+			n++;
+		}
+		if (n > 0)
+		{
+			if (m_producers_waiting)
+			{
+				pthread_mutex_lock(&LOCK_async);
+				pthread_cond_broadcast(&COND_async_space);
+				pthread_mutex_unlock(&LOCK_async);
+			}
+			pthread_mutex_lock(&LOCK_io);
+			async_write_lost_nolock();
+			for (int i = 0; i < n; i++)
+			{
+				if (m_failed)
+				{
+					// will retry to open on next client event. Till then we lose the record.
+					audit_atomic_add(&m_async_lost, 1);
+				}
+				else if (record_write_no_lock(batch[i]->data, batch[i]->len) < 0)
+				{
+					audit_atomic_add(&m_async_lost, 1);
+					set_failed();
+					handler_stop_internal();
+				}
+			}
+			pthread_mutex_unlock(&LOCK_io);
+			for (int i = 0; i < n; i++)
+			{
+				AuditRecord::destroy(batch[i]);
+			}
+			continue;
+		}
+		// queue is empty
+		if (m_async_lost > 0 && ! m_failed)
+		{
+			pthread_mutex_lock(&LOCK_io);
+			async_write_lost_nolock();
+			pthread_mutex_unlock(&LOCK_io);
+		}
+		if (m_writer_stop)
+		{
+			break;
+		}
+		struct timespec ts;
+		set_timeout_usec(&ts, 100000);
+		pthread_mutex_lock(&LOCK_async);
+		m_writer_waiting = 1;
+		audit_mb();
+		if (m_queue.is_empty() && ! m_writer_stop)
+		{
+			pthread_cond_timedwait(&COND_async_data, &LOCK_async, &ts);
+		}
+		m_writer_waiting = 0;
+		pthread_mutex_unlock(&LOCK_async);
+	}
+	if (m_async_lost > 0)
+	{
+		sql_print_information("%s %s: async writer stopped with %llu unreported lost records.",
+				AUDIT_LOG_PREFIX, m_io_type, (ulonglong) m_async_lost);
+	}
+}
+
+/////////////////// Audit_socket_handler //////////////////////////////////
+
+void Audit_socket_handler::close()
+{
+	if (m_vio)
+	{
+		// no need for vio_close as is called by delete (additionally close changed its name to vio_shutdown in 5.6.11)
+		vio_delete((Vio*)m_vio);
+	}
+	m_vio = NULL;
+}
+
+ssize_t Audit_socket_handler::write_no_lock(const char *data, size_t size)
+{	
+	ssize_t res = -1;
+	if (m_vio)
+	{
+		res = vio_write((Vio*)m_vio, (const uchar *) data, size);
+		if (res < 0) // log the error
+		{
+			sql_print_error("%s failed writing to socket: %s. Err: %s",
+					AUDIT_LOG_PREFIX, m_io_dest, strerror(vio_errno((Vio*)m_vio)));
+		}
+	}
+	return res;
+}
+
+int Audit_socket_handler::open(const char *io_dest, bool log_errors)
+{
+	// open the socket
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+	{
+		if (log_errors)
+		{
+			sql_print_error(
+					"%s unable to create unix socket: %s.",
+					AUDIT_LOG_PREFIX, strerror(errno));
+		}
+		return -1;
+	}
+
+	// connect the socket
+	m_vio = vio_new(sock, VIO_TYPE_SOCKET, VIO_LOCALHOST);
+	struct sockaddr_un UNIXaddr;
+	UNIXaddr.sun_family = AF_UNIX;
+	strmake(UNIXaddr.sun_path, io_dest, sizeof(UNIXaddr.sun_path)-1);
+#if MYSQL_VERSION_ID < 50600
+	if (my_connect(sock,(struct sockaddr *) &UNIXaddr, sizeof(UNIXaddr),
+				m_connect_timeout))
+#else
+	// in 5.6 timeout is in ms
+	if (vio_socket_connect((Vio*)m_vio,(struct sockaddr *) &UNIXaddr, sizeof(UNIXaddr),
+				m_connect_timeout * 1000))
+#endif
+	{
+		if (log_errors)
+		{
+			sql_print_error(
+				"%s unable to connect to socket: %s. err: %s.",
+				AUDIT_LOG_PREFIX, m_io_dest, strerror(errno));
+		}
+		close();
+		return -2;
+	}
+
+	if (m_write_timeout > 0)
+	{
+		int timeout = m_write_timeout / 1000;	// milliseconds to seconds, integer dvision
+		if (timeout == 0)
+		{
+			timeout = 1;	// round up to 1 second
+		}
+		// we don't check the result of this call since in earlier
+		// versions it returns void
+		//
+		// 1 as the 2nd argument means write timeout
+		vio_timeout((Vio*)m_vio, 1, timeout);
+	}
+
+	return 0;
+}
+
+//////////////////////// Audit Socket handler end ///////////////////////////////////////////
 
 
 
@@ -515,12 +1014,6 @@ static void yajl_add_string_val(yajl_gen hand, const char *name, const char *val
 	yajl_add_string(hand, val);
 }
 
-static void yajl_add_string_val(yajl_gen hand, const char *name, const char *val, size_t val_len)
-{
-	yajl_add_string(hand, name);
-	yajl_gen_string(hand, (const unsigned char*)val, val_len);
-}
-
 static void yajl_add_uint64(yajl_gen gen, const char *name, uint64 num)
 {
 	const size_t max_int64_str_len = 21;
@@ -529,17 +1022,32 @@ static void yajl_add_uint64(yajl_gen gen, const char *name, uint64 num)
 	yajl_add_string_val(gen, name, buf);
 }
 
-static void yajl_add_obj(yajl_gen gen, const char *db, const char *ptype, const char *name = NULL)
+// members of an object entry. The caller writes the enclosing braces
+static void json_add_obj(Audit_json_writer *w, const char *db, const char *ptype, const char *name = NULL)
 {
 	if (db)
 	{
-		yajl_add_string_val(gen, "db", db);
+		w->string_field(AUDIT_JSON_LIT("\"db\":\""), db);
 	}
 	if (name)
 	{
-		yajl_add_string_val(gen, "name", name);
+		if (db)
+		{
+			w->string_field(AUDIT_JSON_KEY("name"), name);
+		}
+		else
+		{
+			w->string_field(AUDIT_JSON_LIT("\"name\":\""), name);
+		}
+	}
+	if (db || name)
+	{
+		w->string_field(AUDIT_JSON_KEY("obj_type"), ptype);
+	}
+	else
+	{
+		w->string_field(AUDIT_JSON_LIT("\"obj_type\":\""), ptype);
 	}
-	yajl_add_string_val(gen, "obj_type", ptype);
 }
 
 static const char *retrieve_user(THD *thd)
@@ -623,6 +1131,11 @@ static const char *thd_query_str(THD *thd, size_t *len)
 }
 #endif
 
+const char *Audit_formatter::thd_query(THD *thd, size_t *len)
+{
+	return thd_query_str(thd, len);
+}
+
 ssize_t Audit_json_formatter::start_msg_format(IWriter *writer)
 {
 	if (! m_write_start_msg) // disabled
@@ -661,38 +1174,249 @@ ssize_t Audit_json_formatter::start_msg_format(IWriter *writer)
 	return res;
 }
 
+ssize_t Audit_json_formatter::lost_msg_format(IWriter *writer, ulonglong lost)
+{
+	yajl_gen gen = yajl_gen_alloc(NULL);
+	yajl_gen_map_open(gen);
+	yajl_add_string_val(gen, "msg-type", "events-lost");
+	uint64 ts = my_getsystime() / (10000);
+	yajl_add_uint64(gen, "date", ts);
+	yajl_add_uint64(gen, "lost-events", lost);
+	ssize_t res = -2;
+
+	yajl_gen_status stat = yajl_gen_map_close(gen); // close the object
+	if (stat == yajl_gen_status_ok) // all is good write the buffer out
+	{
+		//will add the delimiter to the buffer
+		yajl_gen_reset(gen, "\n");
+		const unsigned char *text = NULL;
+		size_t len = 0;
+		yajl_gen_get_buf(gen, &text, &len);
+		// called by the async writer which holds the io lock
+		res = writer->write_no_lock((const char *)text, len);
+	}
+	yajl_gen_free(gen); // free the generator
+	return res;
+}
+
+ssize_t Audit_json_formatter::summary_format(IWriter *writer, const Audit_summary *summary)
+{
+	Audit_buffer buf;
+	Audit_json_writer w(&buf, m_validate_utf8);
+	w.raw(AUDIT_JSON_LIT("{\"msg-type\":\"summary\",\"date\":\""));
+	w.number(summary->end);
+	w.raw(AUDIT_JSON_LIT("\""));
+	w.number_field(AUDIT_JSON_KEY("start"), summary->start);
+	w.string_field(AUDIT_JSON_KEY("user"), summary->user);
+	w.string_field(AUDIT_JSON_KEY("db"), summary->db);
+	w.string_field(AUDIT_JSON_KEY("cmd"), summary->cmd);
+	char digest_str[17];
+	snprintf(digest_str, sizeof(digest_str), "%016llx", summary->digest);
+	w.string_field(AUDIT_JSON_KEY("digest"), digest_str, 16);
+	w.string_field(AUDIT_JSON_KEY("normalized_query"), summary->query, summary->query_len);
+	w.number_field(AUDIT_JSON_KEY("count"), summary->count);
+	w.number_field(AUDIT_JSON_KEY("rows"), summary->rows);
+	if (summary->timed > 0)
+	{
+		w.number_field(AUDIT_JSON_KEY("timed"), summary->timed);
+		w.number_field(AUDIT_JSON_KEY("exec_time_us_avg"), summary->time_sum / summary->timed);
+		w.number_field(AUDIT_JSON_KEY("exec_time_us_p50"), summary->hist.percentile(summary->timed, 500));
+		w.number_field(AUDIT_JSON_KEY("exec_time_us_p95"), summary->hist.percentile(summary->timed, 950));
+		w.number_field(AUDIT_JSON_KEY("exec_time_us_p99"), summary->hist.percentile(summary->timed, 990));
+		w.number_field(AUDIT_JSON_KEY("exec_time_us_max"), summary->time_max);
+	}
+	w.raw(AUDIT_JSON_LIT("}\n"));
+	if (buf.is_error())
+	{
+		return -2;
+	}
+	return writer->write(buf.data(), buf.length());
+}
+
 // This routine replaces clear text with the string in `replace', leaving the rest of the string intact.
 //
-// thd			- MySQL thread, used for allocating memory
+// buf			- buffer to write the new string to
 // str			- pointer to start of original string
 // str_len		- length thereof
 // cleartext_start	- start of cleartext to replace
 // cleartext_len	- length of cleartext
 // replace		- \0 terminated string with replacement text
-static const char *replace_in_string(THD *thd,
+//
+// Returns NULL if out of memory
+static const char *replace_in_string(Audit_buffer *buf,
 					const char *str, size_t str_len,
 					size_t cleartext_start, size_t cleartext_len,
 					const char *replace)
 {
-	size_t to_alloc = str_len + strlen(replace) + 1;
-	char *new_str = (char *) thd_alloc(thd, to_alloc);
-	memset(new_str, '\0', to_alloc);
-
 	// point to text after clear text
 	const char *trailing = str + cleartext_start + cleartext_len;
 	// how much text after clear text to copy in
 	size_t final_to_move = ((str + str_len) - trailing);
 
-	char *pos = new_str;
-	memcpy(pos, str, cleartext_start);	// copy front of string
-	pos += cleartext_start;
+	buf->reset(0);
+	if (! buf->append(str, cleartext_start) ||	// copy front of string
+		! buf->append(replace, strlen(replace)) ||	// copy replacement text
+		! buf->append(trailing, final_to_move) ||	// copy trailing part of string
+		! buf->append("", 1))
+	{
+		return NULL;
+	}
+	return buf->data();
+}
+
+/**
+ * Per thread formatting buffers. Kept across events so in steady state
+ * formatting an event doesn't allocate memory.
+ * Allocated with calloc (see Audit_buffer).
+ */
+struct Audit_thread_buffers {
+	// the formatted record
+	Audit_buffer out;
+	// query converted to utf8
+	Audit_buffer query;
+	// query after password masking
+	Audit_buffer masked;
+	// normalized query
+	Audit_buffer normalized;
+	// stack for running the JIT compiled masking regex. NULL till needed
+	pcre_jit_stack *jit_stack;
+	// list of the buffers of all threads
+	Audit_thread_buffers *prev;
+	Audit_thread_buffers *next;
+};
+
+static pthread_key_t thread_buffers_key;
+static bool thread_buffers_key_created = false;
+// buffers of all threads, freed at deinit. Protected by LOCK_thread_buffers
+static Audit_thread_buffers *thread_buffers_list = NULL;
+static pthread_mutex_t LOCK_thread_buffers;
+
+static void thread_buffers_release(Audit_thread_buffers *tb)
+{
+	tb->out.release();
+	tb->query.release();
+	tb->masked.release();
+	tb->normalized.release();
+	if (tb->jit_stack)
+	{
+		pcre_jit_stack_free(tb->jit_stack);
+	}
+	free(tb);
+}
+
+// key destructor, called when a thread exits
+static void thread_buffers_free(void *ptr)
+{
+	Audit_thread_buffers *tb = (Audit_thread_buffers *) ptr;
+	pthread_mutex_lock(&LOCK_thread_buffers);
+	// after deinit started the buffers are freed by it
+	if (thread_buffers_key_created)
+	{
+		if (tb->prev)
+		{
+			tb->prev->next = tb->next;
+		}
+		else
+		{
+			thread_buffers_list = tb->next;
+		}
+		if (tb->next)
+		{
+			tb->next->prev = tb->prev;
+		}
+		thread_buffers_release(tb);
+	}
+	pthread_mutex_unlock(&LOCK_thread_buffers);
+}
+
+static Audit_thread_buffers *thread_buffers_get()
+{
+	if (! thread_buffers_key_created)
+	{
+		return NULL;
+	}
+	Audit_thread_buffers *tb = (Audit_thread_buffers *) pthread_getspecific(thread_buffers_key);
+	if (tb)
+	{
+		return tb;
+	}
+	tb = (Audit_thread_buffers *) calloc(1, sizeof(Audit_thread_buffers));
+	if (! tb)
+	{
+		return NULL;
+	}
+	if (pthread_setspecific(thread_buffers_key, tb) != 0)
+	{
+		thread_buffers_release(tb);
+		return NULL;
+	}
+	pthread_mutex_lock(&LOCK_thread_buffers);
+	tb->next = thread_buffers_list;
+	if (tb->next)
+	{
+		tb->next->prev = tb;
+	}
+	thread_buffers_list = tb;
+	pthread_mutex_unlock(&LOCK_thread_buffers);
+	return tb;
+}
+
+// JIT stack sizes. The default 32K machine stack is too small for long queries
+#define AUDIT_JIT_STACK_START (32 * 1024)
+#define AUDIT_JIT_STACK_MAX (1024 * 1024)
 
-	memcpy(pos, replace, strlen(replace));	// copy replacement text
-	pos += strlen(replace);
+/**
+ * Called by pcre_exec to get the JIT stack. Each thread has its own.
+ * Returning NULL makes pcre use a small stack on the machine stack.
+ */
+static pcre_jit_stack *thread_jit_stack(void *data)
+{
+	Audit_thread_buffers *tb = thread_buffers_get();
+	if (! tb)
+	{
+		return NULL;
+	}
+	if (! tb->jit_stack)
+	{
+		tb->jit_stack = pcre_jit_stack_alloc(AUDIT_JIT_STACK_START, AUDIT_JIT_STACK_MAX);
+	}
+	return tb->jit_stack;
+}
 
-	memcpy(pos, trailing, final_to_move);	// copy trailing part of string
+int Audit_json_formatter::thread_buffers_init()
+{
+	pthread_mutex_init(&LOCK_thread_buffers, MY_MUTEX_INIT_FAST);
+	int res = pthread_key_create(&thread_buffers_key, thread_buffers_free);
+	thread_buffers_key_created = (res == 0);
+	if (res != 0)
+	{
+		pthread_mutex_destroy(&LOCK_thread_buffers);
+	}
+	return res;
+}
 
-	return new_str;
+void Audit_json_formatter::thread_buffers_deinit()
+{
+	if (! thread_buffers_key_created)
+	{
+		return;
+	}
+	// We can't have the key destructor called once the plugin is unloaded,
+	// so the buffers of the threads still running are freed here. No events
+	// are formatted anymore.
+	pthread_key_delete(thread_buffers_key);
+	pthread_mutex_lock(&LOCK_thread_buffers);
+	thread_buffers_key_created = false;
+	Audit_thread_buffers *tb = thread_buffers_list;
+	thread_buffers_list = NULL;
+	pthread_mutex_unlock(&LOCK_thread_buffers);
+	while (tb)
+	{
+		Audit_thread_buffers *next = tb->next;
+		thread_buffers_release(tb);
+		tb = next;
+	}
+	pthread_mutex_destroy(&LOCK_thread_buffers);
 }
 
 #ifdef HAVE_SESS_CONNECT_ATTRS
@@ -707,11 +1431,15 @@ bool parse_length_encoded_string(const char **ptr,
 	const CHARSET_INFO *from_cs,
 	uint nchars_max);
 
+// called for each session connect attribute
+typedef void (*connect_attr_func)(void *arg, const char *name, size_t name_len,
+		const char *value, size_t value_len);
+
 /**
  * Code based upon read_nth_attribute of storage/perfschema/table_session_connect.cc
- * Only difference we do once loop and write out the attributes
+ * Only difference we do once loop and pass each attribute to func
  */ 
-static void log_session_connect_attrs(yajl_gen gen, THD *thd)
+static void session_connect_attrs(THD *thd, connect_attr_func func, void *arg)
 {
 	PFS_thread * pfs = PFS_thread::get_current_thread();
 	const char * connect_attrs = Audit_formatter::pfs_connect_attrs(pfs);
@@ -722,7 +1450,6 @@ static void log_session_connect_attrs(yajl_gen gen, THD *thd)
 	const uint max_idx = 32;
 	uint idx;
 	const char *ptr;  
-	bool array_start = false;
 	if(!connect_attrs || !connect_attrs_length || !connect_attrs_cs)
 	{
 		//either offsets are wrong or not set
@@ -768,46 +1495,62 @@ static void log_session_connect_attrs(yajl_gen gen, THD *thd)
 			break;
 		}          
 		attr_value_length= copy_length;
-		if(!array_start)
-		{
-			yajl_add_string(gen, "connect_attrs");
-			yajl_gen_map_open(gen);
-			array_start = true;
-		}
-		yajl_gen_string(gen, (const unsigned char*)attr_name, attr_name_length);
-		yajl_gen_string(gen, (const unsigned char*)attr_value, attr_value_length);
+		func(arg, attr_name, attr_name_length, attr_value, attr_value_length);
 
 	} //close for loop
-	if(array_start)
-	{
-		yajl_gen_map_close(gen);
-	}
 	return;
 }
-#endif
 
-ssize_t Audit_json_formatter::event_format(ThdSesData *pThdData, IWriter *writer)
+struct json_connect_attrs_arg {
+	Audit_json_writer *w;
+	bool array_start;
+};
+
+static void json_connect_attr(void *arg, const char *name, size_t name_len,
+		const char *value, size_t value_len)
 {
-	THD *thd = pThdData->getTHD();
-	unsigned long thdid = thd_get_thread_id(thd);
-	query_id_t qid = thd_inst_query_id(thd);
+	json_connect_attrs_arg *a = (json_connect_attrs_arg *) arg;
+	Audit_json_writer *w = a->w;
+	if(!a->array_start)
+	{
+		w->raw(AUDIT_JSON_LIT(",\"connect_attrs\":{\""));
+		a->array_start = true;
+	}
+	else
+	{
+		w->raw(AUDIT_JSON_LIT(",\""));
+	}
+	w->escape(name, name_len);
+	w->raw(AUDIT_JSON_LIT("\":\""));
+	w->escape(value, value_len);
+	w->raw(AUDIT_JSON_LIT("\""));
+}
 
-	// initialize yajl
-	yajl_alloc_funcs alloc_funcs;
-	yajl_set_thd_alloc_funcs(thd, &alloc_funcs);
-	yajl_gen gen = yajl_gen_alloc(&alloc_funcs);
-	yajl_gen_map_open(gen);
-	yajl_add_string_val(gen, "msg-type", "activity");
-	// TODO: get the start date from THD (but it is not in millis. Need to think about how we handle this)
-	// for now simply use the current time.
-	// my_getsystime() time since epoc in 100 nanosec units. Need to devide by 1000*(1000/100) to reach millis
-	uint64 ts = my_getsystime() / (10000);
-	yajl_add_uint64(gen, "date", ts);
-	yajl_add_uint64(gen, "thread-id", thdid);
-	yajl_add_uint64(gen, "query-id", qid);
-	yajl_add_string_val(gen, "user", pThdData->getUserName());
-	yajl_add_string_val(gen, "priv_user", Audit_formatter::thd_inst_main_security_ctx_priv_user(thd));
-	yajl_add_string_val(gen, "ip", Audit_formatter::thd_inst_main_security_ctx_ip(thd));
+static void log_session_connect_attrs(Audit_json_writer *w, THD *thd)
+{
+	json_connect_attrs_arg arg = { w, false };
+	session_connect_attrs(thd, json_connect_attr, &arg);
+	if(arg.array_start)
+	{
+		w->raw(AUDIT_JSON_LIT("}"));
+	}
+}
+
+static void bin_connect_attr(void *arg, const char *name, size_t name_len,
+		const char *value, size_t value_len)
+{
+	Audit_bin_writer *w = (Audit_bin_writer *) arg;
+	w->string(name, name_len);
+	w->string(value, value_len);
+}
+#endif
+
+void Audit_json_formatter::session_format(Audit_json_writer *w, ThdSesData *pThdData)
+{
+	THD *thd = pThdData->getTHD();
+	w->string_field(AUDIT_JSON_KEY("user"), pThdData->getUserName());
+	w->string_field(AUDIT_JSON_KEY("priv_user"), Audit_formatter::thd_inst_main_security_ctx_priv_user(thd));
+	w->string_field(AUDIT_JSON_KEY("ip"), Audit_formatter::thd_inst_main_security_ctx_ip(thd));
 
 	// For backwards compatibility, we always send "host".
 	// If there is no value, send the IP address
@@ -816,21 +1559,21 @@ ssize_t Audit_json_formatter::event_format(ThdSesData *pThdData, IWriter *writer
 	{
 		host = Audit_formatter::thd_inst_main_security_ctx_ip(thd);
 	}
-	yajl_add_string_val(gen, "host", host);
+	w->string_field(AUDIT_JSON_KEY("host"), host);
 
 	if (m_write_client_capabilities)
 	{
 		ulong caps = Audit_formatter::thd_client_capabilities(thd);
 		if (caps)
 		{
-			yajl_add_uint64(gen, "capabilities", caps);
+			w->number_field(AUDIT_JSON_KEY("capabilities"), caps);
 		}
 	}
 
 #ifdef HAVE_SESS_CONNECT_ATTRS
 	if (m_write_sess_connect_attrs)
 	{
-		log_session_connect_attrs(gen, thd);
+		log_session_connect_attrs(w, thd);
 	}
 #endif
 
@@ -838,22 +1581,20 @@ ssize_t Audit_json_formatter::event_format(ThdSesData *pThdData, IWriter *writer
 	{
 		if (m_write_socket_creds)
 		{
-			yajl_add_uint64(gen, "pid", pThdData->getPeerPid());
-			if (pThdData->getOsUser() != NULL)
-			{
-				yajl_add_string_val(gen, "os_user", pThdData->getOsUser());
-			}
-			if (pThdData->getAppName() != NULL)
-			{
-				yajl_add_string_val(gen, "appname", pThdData->getAppName());
-			}
+			w->number_field(AUDIT_JSON_KEY("pid"), pThdData->getPeerPid());
+			w->string_field(AUDIT_JSON_KEY("os_user"), pThdData->getOsUser());
+			w->string_field(AUDIT_JSON_KEY("appname"), pThdData->getAppName());
 		}
 	}
 	else if (pThdData->getPort() > 0)		// TCP socket
 	{
-		yajl_add_uint64(gen, "client_port", pThdData->getPort());
+		w->number_field(AUDIT_JSON_KEY("client_port"), pThdData->getPort());
 	}
+}
 
+ulonglong Audit_formatter::thd_event_rows(ThdSesData *pThdData)
+{
+	THD *thd = pThdData->getTHD();
 	const char *cmd = pThdData->getCmdName();
 	ulonglong rows = 0;
 
@@ -879,33 +1620,62 @@ ssize_t Audit_json_formatter::event_format(ThdSesData *pThdData, IWriter *writer
 	{
 		rows = thd_sent_row_count(thd);
 	}
+	return rows;
+}
 
-	if (rows != 0UL)
+bool Audit_json_formatter::password_regex_mask(Audit_thread_buffers *tb, const Password_regex *regex,
+		const char **text, size_t *len)
+{
+	const char *query_text = *text;
+	size_t query_len = *len;
+	int matches[90] = { 0 };
+	if (pcre_exec(regex->preg, regex->extra, query_text, query_len, 0, 0, matches, array_elements(matches)) < 0)
 	{
-		yajl_add_uint64(gen, "rows", rows);
+		return true;
 	}
-
-	yajl_add_string_val(gen, "cmd", cmd);
-
-	// get objects
-	if (pThdData->startGetObjects())
+	// search for the first substring that matches with the name psw
+	char *first = NULL, *last = NULL;
+	int entrysize = pcre_get_stringtable_entries(regex->preg, "psw", &first, &last);
+	if (entrysize <= 0)
 	{
-		yajl_add_string(gen, "objects");
-		yajl_gen_array_open(gen);
-		const char *db_name = NULL;
-		const char *obj_name = NULL;
-		const char *obj_type = NULL;
-		while (pThdData->getNextObject(&db_name, &obj_name, &obj_type))
+		return true;
+	}
+	for (unsigned char *entry = (unsigned char *)first; entry <= (unsigned char *)last; entry += entrysize)
+	{
+		// first 2 bytes give us the number
+		int n = (((int)(entry)[0]) << 8) | (entry)[1];
+		if (n > 0 && n < (int)array_elements(matches) && matches[n*2] >= 0)
 		{
-			yajl_gen_map_open(gen);
-			yajl_add_obj (gen, db_name, obj_type, obj_name );
-			yajl_gen_map_close(gen);
+			// We have a match.
+
+			// Starting with MySQL 5.7, we cannot use the String::replace() function.
+			// Doing so causes a crash in the string's destructor. It appears that the
+			// interfaces in MySQL have changed fairly drastically. So we just do the
+			// replacement ourselves.
+			const char *pass_replace = "***";
+			tb->masked.reset(m_buffer_high_water);
+			const char *updated = replace_in_string(&tb->masked,
+							query_text,
+							query_len,
+							matches[n*2],
+							matches[(n*2) + 1] - matches[n*2],
+							pass_replace);
+			if (! updated)
+			{
+				return false;
+			}
+			*text = updated;
+			*len = strlen(updated);
+			break;
 		}
-		yajl_gen_array_close(gen);
 	}
+	return true;
+}
 
-	size_t qlen = 0;
-	const char *query = thd_query_str(pThdData->getTHD(), &qlen);
+bool Audit_json_formatter::event_query(ThdSesData *pThdData, Audit_thread_buffers *tb,
+		const char *query, size_t qlen, const char **text, size_t *len)
+{
+	const char *cmd = pThdData->getCmdName();
 	if (query && qlen > 0)
 	{
 #if MYSQL_VERSION_ID < 50600
@@ -924,102 +1694,687 @@ ssize_t Audit_json_formatter::event_format(ThdSesData *pThdData, IWriter *writer
 		{
 			// max UTF-8 bytes per char is 4.
 			size_t to_amount = (qlen * 4) + 1;
-			char* to = (char *) thd_alloc(thd, to_amount);
+			tb->query.reset(m_buffer_high_water);
+			if (tb->query.reserve(to_amount))
+			{
+				char* to = tb->query.data();
 
-			uint errors = 0;
+				uint errors = 0;
 
-			size_t len = copy_and_convert(to, to_amount,
-					&my_charset_utf8_general_ci,
-					query, qlen,
-					col_connection, & errors);
+				size_t len = copy_and_convert(to, to_amount,
+						&my_charset_utf8_general_ci,
+						query, qlen,
+						col_connection, & errors);
 
-			to[len] = '\0';
+				to[len] = '\0';
 
-			query = to;
-			qlen = len;
+				query = to;
+				qlen = len;
+			}
 		}
 
-		if (m_perform_password_masking
-			&& m_password_mask_regex_compiled
-			&& m_password_mask_regex_preg
-			&& m_perform_password_masking(cmd))
+		if (pThdData->getPasswordMasking()
+			&& m_password_masking_method == PASSWORD_MASKING_LEXER)
 		{
-			// do password masking
-			int matches[90] = { 0 };
-			if (pcre_exec(m_password_mask_regex_preg, NULL, query_text, query_len, 0, 0, matches, array_elements(matches)) >= 0)
+			tb->masked.reset(m_buffer_high_water);
+			int masked = audit_mask_secrets(query_text, query_len, &tb->masked);
+			if (masked < 0)
 			{
-				// search for the first substring that matches with the name psw
-				char *first = NULL, *last = NULL;
-				int entrysize = pcre_get_stringtable_entries(m_password_mask_regex_preg, "psw", &first, &last);
-				if (entrysize > 0)
-				{
-					for (unsigned char *entry = (unsigned char *)first; entry <= (unsigned char *)last; entry += entrysize)
-					{
-						// first 2 bytes give us the number
-						int n = (((int)(entry)[0]) << 8) | (entry)[1];
-						if (n > 0 && n < (int)array_elements(matches) && matches[n*2] >= 0)
-						{
-							// We have a match.
-
-							// Starting with MySQL 5.7, we cannot use the String::replace() function.
-							// Doing so causes a crash in the string's destructor. It appears that the
-							// interfaces in MySQL have changed fairly drastically. So we just do the
-							// replacement ourselves.
-							const char *pass_replace = "***";
-							const char *updated = replace_in_string(thd,
-											query_text,
-											query_len,
-											matches[n*2],
-											matches[(n*2) + 1] - matches[n*2],
-											pass_replace);
-							query_text = updated;
-							query_len = strlen(query_text);
-							break;
-						}
-					}
-				}
+				return false;
+			}
+			if (masked > 0)
+			{
+				query_text = tb->masked.data();
+				query_len = tb->masked.length() - 1;
+			}
+		}
+		else if (pThdData->getPasswordMasking())
+		{
+			// the regex and the prefilter aren't freed till we exit the epoch
+			unsigned int token = m_prefilter_epoch.enter();
+			const Password_regex *regex = m_password_mask_regex;
+			Audit_word_set *prefilter = m_password_mask_prefilter;
+			bool res = ! regex
+				|| (prefilter && ! prefilter->search(query_text, query_len))
+				|| password_regex_mask(tb, regex, &query_text, &query_len);
+			m_prefilter_epoch.exit(token);
+			if (! res)
+			{
+				return false;
 			}
 		}
-		yajl_add_string_val(gen, "query", query_text, query_len);
+		*text = query_text;
+		*len = query_len;
 	}
 	else
 	{
 		if (cmd != NULL && strlen(cmd) != 0)
 		{
-			yajl_add_string_val(gen, "query", cmd, strlen(cmd));
+			*text = cmd;
+			*len = strlen(cmd);
 		}
 		else
 		{
-			yajl_add_string_val(gen, "query", "n/a", strlen("n/a"));
+			*text = "n/a";
+			*len = strlen("n/a");
+		}
+	}
+	return true;
+}
+
+bool Audit_json_formatter::event_digest(Audit_thread_buffers *tb, const char *text, size_t len,
+		unsigned long long *digest, const char **normalized, size_t *normalized_len)
+{
+	*normalized = NULL;
+	*normalized_len = 0;
+	if (m_write_normalized_query)
+	{
+		tb->normalized.reset(m_buffer_high_water);
+		*digest = audit_query_digest(text, len, &tb->normalized);
+		if (! tb->normalized.is_error())
+		{
+			*normalized = tb->normalized.data();
+			*normalized_len = tb->normalized.length();
+		}
+		return true;
+	}
+	if (m_write_digest)
+	{
+		*digest = audit_query_digest(text, len, NULL);
+		return true;
+	}
+	return false;
+}
+
+ssize_t Audit_json_formatter::event_format(ThdSesData *pThdData, IWriter *writer)
+{
+	THD *thd = pThdData->getTHD();
+	unsigned long thdid = thd_get_thread_id(thd);
+	query_id_t qid = thd_inst_query_id(thd);
+
+	Audit_thread_buffers *tb = thread_buffers_get();
+	if (! tb)
+	{
+		return -2;
+	}
+	size_t qlen = 0;
+	const char *query = thd_query_str(pThdData->getTHD(), &qlen);
+	// pre size the buffer so the query is copied in without growing
+	tb->out.reset(0);
+	tb->out.reserve(qlen + 1024);
+	Audit_json_writer w(&tb->out, m_validate_utf8);
+	w.raw(AUDIT_JSON_LIT("{\"msg-type\":\"activity\",\"date\":\""));
+	// TODO: get the start date from THD (but it is not in millis. Need to think about how we handle this)
+	// for now simply use the current time.
+	// my_getsystime() time since epoc in 100 nanosec units. Need to devide by 1000*(1000/100) to reach millis
+	uint64 ts = my_getsystime() / (10000);
+	w.number(ts);
+	w.raw(AUDIT_JSON_LIT("\""));
+	w.number_field(AUDIT_JSON_KEY("thread-id"), thdid);
+	w.number_field(AUDIT_JSON_KEY("query-id"), qid);
+	Audit_session *session = audit_session_cache(pThdData->getSession());
+	unsigned long session_gen = m_session_gen;
+	if (session && session->prefix_valid && session->prefix_gen == session_gen)
+	{
+		w.raw(session->prefix.data(), session->prefix.length());
+	}
+	else
+	{
+		size_t start = tb->out.length();
+		session_format(&w, pThdData);
+		if (session && ! tb->out.is_error())
+		{
+			session->prefix.reset(0);
+			session->prefix.append(tb->out.data() + start, tb->out.length() - start);
+			session->prefix_valid = ! session->prefix.is_error();
+			session->prefix_gen = session_gen;
+		}
+	}
+
+	const char *cmd = pThdData->getCmdName();
+	ulonglong rows = Audit_formatter::thd_event_rows(pThdData);
+
+	if (rows != 0UL)
+	{
+		w.number_field(AUDIT_JSON_KEY("rows"), rows);
+	}
+
+	w.string_field(AUDIT_JSON_KEY("cmd"), cmd);
+
+	// get objects
+	if (pThdData->startGetObjects())
+	{
+		w.raw(AUDIT_JSON_LIT(",\"objects\":["));
+		const char *db_name = NULL;
+		const char *obj_name = NULL;
+		const char *obj_type = NULL;
+		bool first = true;
+		while (pThdData->getNextObject(&db_name, &obj_name, &obj_type))
+		{
+			w.raw(first ? "{" : ",{", first ? 1 : 2);
+			first = false;
+			json_add_obj(&w, db_name, obj_type, obj_name);
+			w.raw(AUDIT_JSON_LIT("}"));
 		}
+		w.raw(AUDIT_JSON_LIT("]"));
 	}
 
+	const char *query_text = NULL;
+	size_t query_len = 0;
+	if (! event_query(pThdData, tb, query, qlen, &query_text, &query_len))
+	{
+		// don't log the query without masking
+		return -2;
+	}
+	w.string_field(AUDIT_JSON_KEY("query"), query_text, query_len);
+
+	unsigned long long digest = 0;
+	const char *normalized = NULL;
+	size_t normalized_len = 0;
+	if (query && qlen > 0
+		&& event_digest(tb, query_text, query_len, &digest, &normalized, &normalized_len))
+	{
+		if (m_write_digest)
+		{
+			char digest_str[17];
+			snprintf(digest_str, sizeof(digest_str), "%016llx", digest);
+			w.string_field(AUDIT_JSON_KEY("digest"), digest_str, 16);
+		}
+		if (normalized)
+		{
+			w.string_field(AUDIT_JSON_KEY("normalized_query"), normalized, normalized_len);
+		}
+	}
+	if (pThdData->hasExecTime())
+	{
+		w.number_field(AUDIT_JSON_KEY("exec_time_us"), pThdData->getExecTime());
+	}
+
+	// close the object and add the delimiter
+	w.raw(AUDIT_JSON_LIT("}\n"));
 	ssize_t res = -2;
-	yajl_gen_status stat = yajl_gen_map_close(gen); // close the object
-	if (stat == yajl_gen_status_ok) // all is good write the buffer out
+	if (! tb->out.is_error()) // all is good write the buffer out
 	{
-		//will add the delimiter to the buffer
-		yajl_gen_reset(gen, "\n");
-		const unsigned char *text = NULL;
-		size_t len = 0;
-		yajl_gen_get_buf(gen, &text, &len);
 		// print the json
-		res = writer->write((const char *)text, len);		
+		res = writer->write(tb->out.data(), tb->out.length());
 	}
-	yajl_gen_free(gen); // free the generator
+	tb->out.reset(m_buffer_high_water);
 	return res;
 }
 
+//////////////////////// Audit binary formatter ///////////////////////////////////////////
+
+// start a record. Room is left for the length, written by record_write
+static inline void bin_record_begin(Audit_buffer *buf, unsigned char type)
+{
+	static const char len_space[AUDIT_BIN_MAX_VARINT] = { 0 };
+	buf->append(len_space, sizeof(len_space));
+	buf->append((const char *) &type, 1);
+}
+
+ssize_t Audit_binary_formatter::record_write(Audit_buffer *buf, IWriter *writer, bool lock)
+{
+	if (buf->is_error())
+	{
+		return -2;
+	}
+	// put the length right before the payload, so we don't need to copy it
+	unsigned char len[AUDIT_BIN_MAX_VARINT];
+	size_t len_len = audit_bin_encode_varint(len, buf->length() - AUDIT_BIN_MAX_VARINT);
+	char *start = buf->data() + AUDIT_BIN_MAX_VARINT - len_len;
+	memcpy(start, len, len_len);
+	size_t size = buf->length() - (AUDIT_BIN_MAX_VARINT - len_len);
+	return lock ? writer->write(start, size) : writer->write_no_lock(start, size);
+}
+
+ssize_t Audit_binary_formatter::start_msg_format(IWriter *writer)
+{
+	Audit_buffer buf;
+	Audit_bin_writer w(&buf);
+	w.raw(AUDIT_BIN_MAGIC, AUDIT_BIN_MAGIC_LEN);
+	w.varint(AUDIT_BIN_VERSION);
+	if (buf.is_error())
+	{
+		return -2;
+	}
+	// no need for lock as it was acquired before as part of the connect
+	ssize_t res = writer->write_no_lock(buf.data(), buf.length());
+	if (res < 0 || ! m_json->m_write_start_msg)
+	{
+		return res;
+	}
+
+	buf.reset(0);
+	bin_record_begin(&buf, AUDIT_BIN_REC_HEADER);
+	unsigned long long bits = AUDIT_BIN_BIT(AUDIT_BIN_HDR_DATE)
+		| AUDIT_BIN_BIT(AUDIT_BIN_HDR_AUDIT_VERSION)
+		| AUDIT_BIN_BIT(AUDIT_BIN_HDR_PROTOCOL_VERSION)
+		| AUDIT_BIN_BIT(AUDIT_BIN_HDR_HOSTNAME)
+		| AUDIT_BIN_BIT(AUDIT_BIN_HDR_MYSQL_VERSION)
+		| AUDIT_BIN_BIT(AUDIT_BIN_HDR_MYSQL_PORT)
+		| AUDIT_BIN_BIT(AUDIT_BIN_HDR_SERVER_PID);
+	if (my_progname)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_HDR_MYSQL_PROGRAM);
+	}
+	if (mysqld_unix_port)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_HDR_MYSQL_SOCKET);
+	}
+	w.varint(bits);
+	w.varint(my_getsystime() / (10000));
+	w.string(MYSQL_AUDIT_PLUGIN_VERSION"-"MYSQL_AUDIT_PLUGIN_REVISION);
+	w.string(AUDIT_PROTOCOL_VERSION);
+	w.string(glob_hostname);
+	w.string(server_version);
+	if (my_progname)
+	{
+		w.string(my_progname);
+	}
+	if (mysqld_unix_port)
+	{
+		w.string(mysqld_unix_port);
+	}
+	w.varint(mysqld_port);
+	w.varint(getpid());
+	return record_write(&buf, writer, false);
+}
+
+ssize_t Audit_binary_formatter::lost_msg_format(IWriter *writer, ulonglong lost)
+{
+	Audit_buffer buf;
+	Audit_bin_writer w(&buf);
+	bin_record_begin(&buf, AUDIT_BIN_REC_LOST);
+	w.varint(AUDIT_BIN_BIT(AUDIT_BIN_LOST_DATE) | AUDIT_BIN_BIT(AUDIT_BIN_LOST_COUNT));
+	w.varint(my_getsystime() / (10000));
+	w.varint(lost);
+	// called by the async writer which holds the io lock
+	return record_write(&buf, writer, false);
+}
+
+ssize_t Audit_binary_formatter::summary_format(IWriter *writer, const Audit_summary *summary)
+{
+	Audit_buffer buf;
+	Audit_bin_writer w(&buf);
+	bin_record_begin(&buf, AUDIT_BIN_REC_SUMMARY);
+	unsigned long long bits = AUDIT_BIN_BIT(AUDIT_BIN_SUM_DATE)
+		| AUDIT_BIN_BIT(AUDIT_BIN_SUM_START)
+		| AUDIT_BIN_BIT(AUDIT_BIN_SUM_CMD)
+		| AUDIT_BIN_BIT(AUDIT_BIN_SUM_DIGEST)
+		| AUDIT_BIN_BIT(AUDIT_BIN_SUM_NORMALIZED_QUERY)
+		| AUDIT_BIN_BIT(AUDIT_BIN_SUM_COUNT)
+		| AUDIT_BIN_BIT(AUDIT_BIN_SUM_ROWS);
+	if (summary->user)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_SUM_USER);
+	}
+	if (summary->db)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_SUM_DB);
+	}
+	if (summary->timed > 0)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_SUM_TIMED);
+	}
+	w.varint(bits);
+	w.varint(summary->end);
+	w.varint(summary->start);
+	if (summary->user)
+	{
+		w.string(summary->user);
+	}
+	if (summary->db)
+	{
+		w.string(summary->db);
+	}
+	w.string(summary->cmd);
+	w.varint(summary->digest);
+	w.string(summary->query, summary->query_len);
+	w.varint(summary->count);
+	w.varint(summary->rows);
+	if (summary->timed > 0)
+	{
+		// timed, then avg, p50, p95, p99 and max
+		w.varint(summary->timed);
+		w.varint(summary->time_sum / summary->timed);
+		w.varint(summary->hist.percentile(summary->timed, 500));
+		w.varint(summary->hist.percentile(summary->timed, 950));
+		w.varint(summary->hist.percentile(summary->timed, 990));
+		w.varint(summary->time_max);
+	}
+	return record_write(&buf, writer, true);
+}
+
+void Audit_binary_formatter::session_format(Audit_bin_writer *w, ThdSesData *pThdData)
+{
+	THD *thd = pThdData->getTHD();
+	const char *user = pThdData->getUserName();
+	const char *priv_user = Audit_formatter::thd_inst_main_security_ctx_priv_user(thd);
+	const char *ip = Audit_formatter::thd_inst_main_security_ctx_ip(thd);
+	// same as json: if there is no host, send the IP address
+	const char *host = Audit_formatter::thd_inst_main_security_ctx_host(thd);
+	if (host == NULL || *host == '\0')
+	{
+		host = ip;
+	}
+	ulong caps = 0;
+	if (m_json->m_write_client_capabilities)
+	{
+		caps = Audit_formatter::thd_client_capabilities(thd);
+	}
+	unsigned long pid = pThdData->getPeerPid();
+	const char *os_user = NULL;
+	const char *appname = NULL;
+
+	unsigned long long bits = 0;
+	if (user)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_SES_USER);
+	}
+	if (priv_user)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_SES_PRIV_USER);
+	}
+	if (ip)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_SES_IP);
+	}
+	if (host)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_SES_HOST);
+	}
+	if (caps)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_SES_CAPABILITIES);
+	}
+#ifdef HAVE_SESS_CONNECT_ATTRS
+	if (m_json->m_write_sess_connect_attrs)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_SES_CONNECT_ATTRS);
+	}
+#endif
+	if (pid != 0)	// Unix Domain Socket
+	{
+		if (m_json->m_write_socket_creds)
+		{
+			bits |= AUDIT_BIN_BIT(AUDIT_BIN_SES_PID);
+			os_user = pThdData->getOsUser();
+			appname = pThdData->getAppName();
+			if (os_user)
+			{
+				bits |= AUDIT_BIN_BIT(AUDIT_BIN_SES_OS_USER);
+			}
+			if (appname)
+			{
+				bits |= AUDIT_BIN_BIT(AUDIT_BIN_SES_APPNAME);
+			}
+		}
+	}
+	else if (pThdData->getPort() > 0)		// TCP socket
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_SES_CLIENT_PORT);
+	}
+
+	w->varint(bits);
+	if (user)
+	{
+		w->string(user);
+	}
+	if (priv_user)
+	{
+		w->string(priv_user);
+	}
+	if (ip)
+	{
+		w->string(ip);
+	}
+	if (host)
+	{
+		w->string(host);
+	}
+	if (caps)
+	{
+		w->varint(caps);
+	}
+#ifdef HAVE_SESS_CONNECT_ATTRS
+	if (bits & AUDIT_BIN_BIT(AUDIT_BIN_SES_CONNECT_ATTRS))
+	{
+		session_connect_attrs(thd, bin_connect_attr, w);
+		w->byte(0);
+	}
+#endif
+	if (bits & AUDIT_BIN_BIT(AUDIT_BIN_SES_PID))
+	{
+		w->varint(pid);
+	}
+	if (os_user)
+	{
+		w->string(os_user);
+	}
+	if (appname)
+	{
+		w->string(appname);
+	}
+	if (bits & AUDIT_BIN_BIT(AUDIT_BIN_SES_CLIENT_PORT))
+	{
+		w->varint(pThdData->getPort());
+	}
+}
+
+ssize_t Audit_binary_formatter::event_format(ThdSesData *pThdData, IWriter *writer)
+{
+	THD *thd = pThdData->getTHD();
+	Audit_thread_buffers *tb = thread_buffers_get();
+	if (! tb)
+	{
+		return -2;
+	}
+	size_t qlen = 0;
+	const char *query = thd_query_str(thd, &qlen);
+	const char *query_text = NULL;
+	size_t query_len = 0;
+	if (! m_json->event_query(pThdData, tb, query, qlen, &query_text, &query_len))
+	{
+		// don't log the query without masking
+		return -2;
+	}
+
+	// the session definition is always formatted. stream_write drops it
+	// when the stream already has it
+	Audit_session *session = audit_session_cache(pThdData->getSession());
+	unsigned long session_gen = m_json->session_gen();
+	bool cached = session && session->bin_prefix_valid
+		&& session->bin_prefix_gen == session_gen;
+
+	const char *cmd = pThdData->getCmdName();
+	ulonglong rows = Audit_formatter::thd_event_rows(pThdData);
+	bool objects = pThdData->startGetObjects();
+	unsigned long long digest = 0;
+	const char *normalized = NULL;
+	size_t normalized_len = 0;
+	bool has_digest = query && qlen > 0
+		&& m_json->event_digest(tb, query_text, query_len, &digest, &normalized, &normalized_len);
+
+	unsigned long long bits = AUDIT_BIN_BIT(AUDIT_BIN_ACT_DATE)
+		| AUDIT_BIN_BIT(AUDIT_BIN_ACT_THREAD_ID)
+		| AUDIT_BIN_BIT(AUDIT_BIN_ACT_QUERY_ID)
+		| AUDIT_BIN_BIT(AUDIT_BIN_ACT_SESSION_DEF)
+		| AUDIT_BIN_BIT(AUDIT_BIN_ACT_QUERY);
+	if (session)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_ACT_SESSION);
+	}
+	if (rows != 0UL)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_ACT_ROWS);
+	}
+	if (pThdData->hasExecTime())
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_ACT_EXEC_TIME);
+	}
+	if (cmd)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_ACT_CMD);
+	}
+	if (objects)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_ACT_OBJECTS);
+	}
+	if (has_digest && m_json->m_write_digest)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_ACT_DIGEST);
+	}
+	if (normalized)
+	{
+		bits |= AUDIT_BIN_BIT(AUDIT_BIN_ACT_NORMALIZED_QUERY);
+	}
+
+	tb->out.reset(0);
+	tb->out.reserve(query_len + 256);
+	bin_record_begin(&tb->out, AUDIT_BIN_REC_ACTIVITY);
+	Audit_bin_writer w(&tb->out);
+	w.varint(bits);
+	w.varint(my_getsystime() / (10000));
+	w.varint(thd_get_thread_id(thd));
+	w.varint(thd_inst_query_id(thd));
+	if (cached)
+	{
+		w.varint(session->bin_prefix.length());
+		w.raw(session->bin_prefix.data(), session->bin_prefix.length());
+	}
+	else
+	{
+		// room for the length, then move the definition right after it
+		static const char len_space[AUDIT_BIN_MAX_VARINT] = { 0 };
+		size_t len_pos = tb->out.length();
+		w.raw(len_space, sizeof(len_space));
+		session_format(&w, pThdData);
+		if (! tb->out.is_error())
+		{
+			char *def = tb->out.data() + len_pos + AUDIT_BIN_MAX_VARINT;
+			size_t def_len = tb->out.length() - len_pos - AUDIT_BIN_MAX_VARINT;
+			size_t len_len = audit_bin_encode_varint(
+					(unsigned char *) tb->out.data() + len_pos, def_len);
+			memmove(tb->out.data() + len_pos + len_len, def, def_len);
+			tb->out.truncate(len_pos + len_len + def_len);
+			if (session)
+			{
+				session->bin_prefix.reset(0);
+				session->bin_prefix.append(tb->out.data() + len_pos + len_len, def_len);
+				session->bin_prefix_valid = ! session->bin_prefix.is_error();
+				session->bin_prefix_gen = session_gen;
+			}
+		}
+	}
+	if (rows != 0UL)
+	{
+		w.varint(rows);
+	}
+	if (cmd)
+	{
+		w.string(cmd);
+	}
+	if (objects)
+	{
+		const char *db_name = NULL;
+		const char *obj_name = NULL;
+		const char *obj_type = NULL;
+		while (pThdData->getNextObject(&db_name, &obj_name, &obj_type))
+		{
+			unsigned char obj_bits = AUDIT_BIN_OBJ_ENTRY;
+			if (db_name)
+			{
+				obj_bits |= AUDIT_BIN_BIT(AUDIT_BIN_OBJ_DB);
+			}
+			if (obj_name)
+			{
+				obj_bits |= AUDIT_BIN_BIT(AUDIT_BIN_OBJ_NAME);
+			}
+			if (obj_type)
+			{
+				obj_bits |= AUDIT_BIN_BIT(AUDIT_BIN_OBJ_TYPE);
+			}
+			w.byte(obj_bits);
+			if (db_name)
+			{
+				w.string(db_name);
+			}
+			if (obj_name)
+			{
+				w.string(obj_name);
+			}
+			if (obj_type)
+			{
+				w.string(obj_type);
+			}
+		}
+		w.byte(0);
+	}
+	w.string(query_text, query_len);
+	if (bits & AUDIT_BIN_BIT(AUDIT_BIN_ACT_DIGEST))
+	{
+		w.varint(digest);
+	}
+	if (normalized)
+	{
+		w.string(normalized, normalized_len);
+	}
+	if (bits & AUDIT_BIN_BIT(AUDIT_BIN_ACT_EXEC_TIME))
+	{
+		w.varint(pThdData->getExecTime());
+	}
+
+	ssize_t res = record_write(&tb->out, writer, true);
+	tb->out.reset(m_json->m_buffer_high_water);
+	return res;
+}
+
+ssize_t Audit_binary_formatter::stream_write(IWriter *writer, Audit_bin_stream_dict *dict,
+		const char *data, size_t size)
+{
+	unsigned char head[Audit_bin_stream_dict::MAX_HEAD];
+	size_t tail = 0;
+	size_t head_len = dict->strip(data, size, head, &tail);
+	if (head_len == 0)
+	{
+		return writer->write_no_lock(data, size);
+	}
+	return writer->write_parts_no_lock((const char *) head, head_len, data + tail, size - tail);
+}
+
 ThdSesData::ThdSesData(THD *pTHD, StatementSource source)
-      : m_pThd (pTHD), m_CmdName(NULL), m_UserName(NULL),
+      : m_pThd (pTHD), m_session(Audit_formatter::thd_session(pTHD)),
+        m_CmdName(NULL), m_cmdId(0), m_UserName(NULL),
         m_objIterType(OBJ_NONE), m_tables(NULL), m_firstTable(true),
         m_tableInf(NULL), m_index(0), m_isSqlCmd(false),
-	m_port(-1), m_source(source)
+	m_peerResolved(false), m_peerInfo(NULL), m_port(-1), m_source(source),
+	m_passwordMasking(false), m_hasExecTime(false), m_execTime(0)
+{
+	// peer names resolved since the last event
+	if (m_session && m_session->peer_request
+		&& Audit_peer_resolver::poll(m_session->peer_request, &m_session->peer))
+	{
+		m_session->peer_request = NULL;
+		// the formatted session has the uid and pid for names
+		m_session->prefix_valid = false;
+		m_session->bin_prefix_valid = false;
+	}
+}
+
+void ThdSesData::resolve_command() const
+{
+	m_CmdName = retrieve_command (m_pThd, m_isSqlCmd, &m_cmdId);
+}
+
+void ThdSesData::resolve_user()
 {
-	m_CmdName = retrieve_command (m_pThd, m_isSqlCmd);
 	m_UserName = retrieve_user (m_pThd);
+}
 
-	m_peerInfo = retrieve_peerinfo(m_pThd);
+void ThdSesData::resolve_peer() const
+{
+	m_peerResolved = true;
+	m_peerInfo = retrieve_peerinfo(m_pThd, m_session);
 	if (m_peerInfo && m_peerInfo->pid == 0)
 	{
 		// not UDS, get remote port
@@ -1034,7 +2389,7 @@ bool ThdSesData::startGetObjects()
 	m_tables = NULL;
 	m_firstTable = true;
 	m_index = 0;
-	m_tableInf = Audit_formatter::getQueryCacheTableList1(getTHD());
+	m_tableInf = m_session ? m_session->query_cache_tables : NULL;
 	int command = Audit_formatter::thd_inst_command(getTHD());
 	LEX *pLex = Audit_formatter::thd_lex(getTHD());
 	// query cache case
@@ -1140,16 +2495,28 @@ bool ThdSesData::getNextObject(const char **db_name, const char **obj_name, cons
 
 const unsigned long ThdSesData::getPeerPid() const
 {
+	if (! m_peerResolved)
+	{
+		resolve_peer();
+	}
 	return (m_peerInfo != NULL ? m_peerInfo->pid : 0L);
 }
 
 const char *ThdSesData::getAppName() const
 {
+	if (! m_peerResolved)
+	{
+		resolve_peer();
+	}
 	return (m_peerInfo != NULL ? m_peerInfo->appName : NULL);
 }
 
 const char *ThdSesData::getOsUser() const
 {
+	if (! m_peerResolved)
+	{
+		resolve_peer();
+	}
 	return (m_peerInfo != NULL ? m_peerInfo->osUser : NULL);
 }
 
@@ -1169,26 +2536,83 @@ pcre *Audit_json_formatter::regex_compile(const char *str)
 	return re;
 }
 
-bool Audit_json_formatter::compile_password_masking_regex(const char *str)
+void Audit_json_formatter::password_regex_free(Password_regex *regex)
 {
-	// first free existing
-	if (m_password_mask_regex_compiled)
+	if (regex)
 	{
-		m_password_mask_regex_compiled = false;
-		// small sleep to let threads complete regexec
-		my_sleep(10 * 1000);
-		pcre_free(m_password_mask_regex_preg);
+		if (regex->extra)
+		{
+			pcre_free_study(regex->extra);
+		}
+		pcre_free(regex->preg);
+		free(regex);
 	}
+}
 
+bool Audit_json_formatter::compile_password_masking_regex(const char *str)
+{
 	bool success = false; // default is error (case of empty string)
+	Password_regex *regex = NULL;
 	if (NULL != str && str[0] != '\0')
 	{
-		m_password_mask_regex_preg = regex_compile(str);
-		if (m_password_mask_regex_preg)
+		pcre *preg = regex_compile(str);
+		if (preg)
 		{
-			m_password_mask_regex_compiled = true;
+			regex = (Password_regex *) calloc(1, sizeof(Password_regex));
+			if (regex == NULL)
+			{
+				sql_print_error("%s unable to allocate password masking regex.", AUDIT_LOG_PREFIX);
+				pcre_free(preg);
+			}
+		}
+		if (regex)
+		{
+			regex->preg = preg;
+			// study and JIT compile the regex (if the pcre build supports JIT)
+			const char *error = NULL;
+			regex->extra = pcre_study(preg, PCRE_STUDY_JIT_COMPILE, &error);
+			int jit = 0;
+			if (regex->extra)
+			{
+				pcre_fullinfo(preg, regex->extra, PCRE_INFO_JIT, &jit);
+				if (jit)
+				{
+					pcre_assign_jit_stack(regex->extra, thread_jit_stack, NULL);
+				}
+			}
+			else if (error)
+			{
+				sql_print_error("%s unable to study password masking regex. message: [%s].",
+						AUDIT_LOG_PREFIX, error);
+			}
+			sql_print_information("%s Password masking regex JIT: %d", AUDIT_LOG_PREFIX, jit);
 			success = true;
 		}
 	}
+
+	// publish the new regex (NULL on error) once it is fully built
+	Password_regex *old = m_password_mask_regex;
+	audit_mb();
+	m_password_mask_regex = regex;
+	audit_mb();
+	if (old)
+	{
+		// wait for the threads still running the old regex (and its JIT code)
+		m_prefilter_epoch.synchronize();
+		password_regex_free(old);
+	}
 	return success;
 }
+
+void Audit_json_formatter::set_password_masking_prefilter(Audit_word_set *words)
+{
+	Audit_word_set *old = m_password_mask_prefilter;
+	m_password_mask_prefilter = words;
+	audit_mb();
+	if (old)
+	{
+		// wait for the threads still searching the old set
+		m_prefilter_epoch.synchronize();
+		Audit_word_set::destroy(old);
+	}
+}
@@ -0,0 +1,315 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_json.cc
+ */
+
+#include "audit_json.h"
+
+/**
+ * Escape of each byte: 0 - no escape, 'u' - \u00XX, otherwise the char
+ * following the backslash. Same escaping as yajl_string_encode.
+ */
+static const char json_escape_table[256] = {
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+	// the rest are 0
+};
+
+/**
+ * Scan functions return the number of leading bytes which can be copied
+ * as is: bytes which don't need escaping and, if ascii_only, are ascii.
+ *
+ * There is a scalar version, an SSE2 version (baseline on x86_64) and an
+ * AVX2 version selected at runtime if the cpu supports it.
+ */
+typedef size_t (*json_scan_func)(const unsigned char *s, size_t len, bool ascii_only);
+
+static size_t json_scan_scalar(const unsigned char *s, size_t len, bool ascii_only)
+{
+	size_t i = 0;
+	if (ascii_only)
+	{
+		while (i < len && ! json_escape_table[s[i]] && s[i] < 0x80)
+		{
+			i++;
+		}
+	}
+	else
+	{
+		while (i < len && ! json_escape_table[s[i]])
+		{
+			i++;
+		}
+	}
+	return i;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static size_t json_scan_sse2(const unsigned char *s, size_t len, bool ascii_only)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i ctrl = _mm_set1_epi8(0x1F);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		// v <= 0x1F unsigned is: max(v, 0x1F) == 0x1F
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+			_mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+		int bits = _mm_movemask_epi8(m);
+		if (ascii_only)
+		{
+			// high bit set means non ascii
+			bits |= _mm_movemask_epi8(v);
+		}
+		if (bits)
+		{
+			return i + __builtin_ctz(bits);
+		}
+	}
+	return i + json_scan_scalar(s + i, len - i, ascii_only);
+}
+#endif
+
+// target attribute for intrinsics requires gcc 4.9
+#if defined(__SSE2__) && defined(__GNUC__) && ! defined(__clang__) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_JSON_SCAN_AVX2 1
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static size_t json_scan_avx2(const unsigned char *s, size_t len, bool ascii_only)
+{
+	size_t i = 0;
+	if (len >= 32)
+	{
+		const __m256i quote = _mm256_set1_epi8('"');
+		const __m256i bslash = _mm256_set1_epi8('\\');
+		const __m256i ctrl = _mm256_set1_epi8(0x1F);
+		for (; i + 32 <= len; i += 32)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+			__m256i m = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)),
+				_mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl));
+			unsigned int bits = (unsigned int) _mm256_movemask_epi8(m);
+			if (ascii_only)
+			{
+				bits |= (unsigned int) _mm256_movemask_epi8(v);
+			}
+			if (bits)
+			{
+				return i + __builtin_ctz(bits);
+			}
+		}
+		// the sse2 code isn't vex encoded: running it with dirty upper
+		// halves of the ymm registers stalls on every call
+		_mm256_zeroupper();
+	}
+	return i + json_scan_sse2(s + i, len - i, ascii_only);
+}
+#endif
+
+struct json_scan_impl {
+	const char *name;
+	json_scan_func func;
+};
+
+static const json_scan_impl json_scan_impls[] = {
+	{ "scalar", json_scan_scalar },
+#ifdef __SSE2__
+	{ "sse2", json_scan_sse2 },
+#endif
+#ifdef HAVE_JSON_SCAN_AVX2
+	{ "avx2", json_scan_avx2 },
+#endif
+};
+
+static const size_t json_scan_num_impls = sizeof(json_scan_impls) / sizeof(json_scan_impls[0]);
+
+static bool json_scan_supported(const json_scan_impl *impl)
+{
+#ifdef HAVE_JSON_SCAN_AVX2
+	if (impl->func == json_scan_avx2)
+	{
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+	return true;
+}
+
+// the last supported one is the fastest
+static json_scan_func json_scan_select()
+{
+	size_t i = json_scan_num_impls - 1;
+	while (i > 0 && ! json_scan_supported(&json_scan_impls[i]))
+	{
+		i--;
+	}
+	return json_scan_impls[i].func;
+}
+
+static json_scan_func json_scan = json_scan_select();
+
+bool Audit_json_writer::scan_select(const char *name)
+{
+	for (size_t i = 0; i < json_scan_num_impls; i++)
+	{
+		if (strcmp(json_scan_impls[i].name, name) == 0 && json_scan_supported(&json_scan_impls[i]))
+		{
+			json_scan = json_scan_impls[i].func;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *Audit_json_writer::scan_name(size_t i)
+{
+	return i < json_scan_num_impls ? json_scan_impls[i].name : NULL;
+}
+
+/**
+ * Length of the well formed utf8 sequence (RFC 3629) at s.
+ * Returns 0 if the sequence is malformed (including overlong forms,
+ * surrogates and code points above U+10FFFF).
+ */
+static size_t utf8_seq_len(const unsigned char *s, size_t len)
+{
+	unsigned char c = s[0];
+	unsigned char lo = 0x80;
+	unsigned char hi = 0xBF;
+	size_t n;
+	if (c >= 0xC2 && c <= 0xDF)
+	{
+		n = 2;
+	}
+	else if (c >= 0xE0 && c <= 0xEF)
+	{
+		n = 3;
+		if (c == 0xE0)
+		{
+			lo = 0xA0;
+		}
+		else if (c == 0xED)
+		{
+			hi = 0x9F;
+		}
+	}
+	else if (c >= 0xF0 && c <= 0xF4)
+	{
+		n = 4;
+		if (c == 0xF0)
+		{
+			lo = 0x90;
+		}
+		else if (c == 0xF4)
+		{
+			hi = 0x8F;
+		}
+	}
+	else
+	{
+		return 0;
+	}
+	if (len < n || s[1] < lo || s[1] > hi)
+	{
+		return 0;
+	}
+	for (size_t i = 2; i < n; i++)
+	{
+		if ((s[i] & 0xC0) != 0x80)
+		{
+			return 0;
+		}
+	}
+	return n;
+}
+
+void Audit_json_writer::escape(const char *str, size_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	// worst case every byte becomes \u00XX. Reserving up front for short
+	// strings saves growing while escaping.
+	if (len <= 1024)
+	{
+		m_buf->reserve(len * 6);
+	}
+	const unsigned char *s = (const unsigned char *) str;
+	size_t pos = 0;
+	while (pos < len)
+	{
+		size_t run = json_scan(s + pos, len - pos, m_validate_utf8);
+		raw(str + pos, run);
+		pos += run;
+		if (pos >= len)
+		{
+			break;
+		}
+		unsigned char c = s[pos];
+		if (c >= 0x80)
+		{
+			// only stopped on non ascii when validating utf8
+			size_t n = utf8_seq_len(s + pos, len - pos);
+			if (n > 0)
+			{
+				raw(str + pos, n);
+				pos += n;
+			}
+			else
+			{
+				// replace the malformed byte with U+FFFD
+				raw(AUDIT_JSON_LIT("\xEF\xBF\xBD"));
+				pos++;
+			}
+			continue;
+		}
+		char esc = json_escape_table[c];
+		if (esc == 'u')
+		{
+			char buf[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0F] };
+			raw(buf, sizeof(buf));
+		}
+		else
+		{
+			char buf[2] = { '\\', esc };
+			raw(buf, sizeof(buf));
+		}
+		pos++;
+	}
+}
+
+void Audit_json_writer::number(unsigned long long num)
+{
+	char buf[21];
+	char *pos = buf + sizeof(buf);
+	do
+	{
+		*--pos = '0' + (char) (num % 10);
+		num /= 10;
+	} while (num != 0);
+	raw(pos, buf + sizeof(buf) - pos);
+}
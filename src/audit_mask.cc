@@ -0,0 +1,230 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_mask.cc
+ */
+
+#include "audit_mask.h"
+#include "audit_sql_lexer.h"
+#include <strings.h>
+
+static inline bool word_is(const Audit_sql_token *tok, const char *word, size_t len)
+{
+	return tok->type == AUDIT_TOK_WORD && tok->len == len && strncasecmp(tok->start, word, len) == 0;
+}
+
+#define WORD_IS(tok, word) word_is(tok, word, sizeof(word) - 1)
+
+/**
+ * Argument of a function which is a secret. -1 if the word is not such
+ * a function.
+ */
+static int secret_func_arg(const Audit_sql_token *tok)
+{
+	if (tok->type != AUDIT_TOK_WORD)
+	{
+		return -1;
+	}
+	if (WORD_IS(tok, "PASSWORD") || WORD_IS(tok, "OLD_PASSWORD"))
+	{
+		return 0;
+	}
+	if (WORD_IS(tok, "AES_ENCRYPT") || WORD_IS(tok, "AES_DECRYPT")
+		|| WORD_IS(tok, "DES_ENCRYPT") || WORD_IS(tok, "DES_DECRYPT")
+		|| WORD_IS(tok, "ENCODE") || WORD_IS(tok, "DECODE"))
+	{
+		return 1;
+	}
+	return -1;
+}
+
+// what we expect next
+enum mask_state {
+	ST_NONE = 0,
+	ST_IDENTIFIED,	// after IDENTIFIED: WITH, BY or AS
+	ST_IDENTIFIED_WITH,	// after IDENTIFIED WITH: the plugin name
+	ST_PASSWORD,	// after PASSWORD: FOR, = or the secret
+	ST_PASSWORD_FOR,	// in PASSWORD FOR user: skip till =
+	ST_SECRET,	// the secret (or PASSWORD)
+	ST_AFTER_SECRET	// after IDENTIFIED BY 'secret': REPLACE 'old secret'
+};
+
+// max nesting of secret functions we track
+#define MAX_MASK_FUNCS 8
+
+struct mask_func {
+	int depth;	// paren depth of the arguments
+	int arg;	// current argument
+	int secret_arg;
+};
+
+int audit_mask_secrets(const char *query, size_t len, Audit_buffer *out)
+{
+	Audit_sql_lexer lexer(query, len);
+	Audit_sql_token tok;
+	int state = ST_NONE;
+	mask_func funcs[MAX_MASK_FUNCS];
+	int num_funcs = 0;
+	int depth = 0;
+	// secret argument of the function named by the previous token
+	int func_arg = -1;
+	int masked = 0;
+	// end of the text copied to out
+	const char *copied = query;
+
+	for (lexer.next(&tok); tok.type != AUDIT_TOK_END; lexer.next(&tok))
+	{
+		bool secret = false;
+		int next_state = ST_NONE;
+		switch (tok.type)
+		{
+		case AUDIT_TOK_WORD:
+			if (state == ST_IDENTIFIED && (WORD_IS(&tok, "BY") || WORD_IS(&tok, "AS")))
+			{
+				next_state = ST_SECRET;
+			}
+			else if (state == ST_IDENTIFIED && WORD_IS(&tok, "WITH"))
+			{
+				next_state = ST_IDENTIFIED_WITH;
+			}
+			else if (state == ST_IDENTIFIED_WITH)
+			{
+				next_state = ST_IDENTIFIED;
+			}
+			else if (state == ST_PASSWORD && WORD_IS(&tok, "FOR"))
+			{
+				next_state = ST_PASSWORD_FOR;
+			}
+			else if (state == ST_PASSWORD_FOR)
+			{
+				next_state = ST_PASSWORD_FOR;
+			}
+			else if (state == ST_AFTER_SECRET && WORD_IS(&tok, "REPLACE"))
+			{
+				next_state = ST_SECRET;
+			}
+			else if (WORD_IS(&tok, "PASSWORD") || WORD_IS(&tok, "MASTER_PASSWORD"))
+			{
+				next_state = ST_PASSWORD;
+			}
+			else if (WORD_IS(&tok, "IDENTIFIED"))
+			{
+				next_state = ST_IDENTIFIED;
+			}
+			break;
+		case AUDIT_TOK_IDENT:
+			if (state == ST_IDENTIFIED_WITH)
+			{
+				next_state = ST_IDENTIFIED;
+			}
+			else if (state == ST_PASSWORD_FOR)
+			{
+				next_state = ST_PASSWORD_FOR;
+			}
+			break;
+		case AUDIT_TOK_STRING:
+			if (state == ST_SECRET || state == ST_PASSWORD)
+			{
+				secret = true;
+				next_state = ST_AFTER_SECRET;
+			}
+			else if (state == ST_IDENTIFIED_WITH)
+			{
+				next_state = ST_IDENTIFIED;
+			}
+			else if (state == ST_PASSWORD_FOR)
+			{
+				next_state = ST_PASSWORD_FOR;
+			}
+			else if (num_funcs > 0 && funcs[num_funcs - 1].depth <= depth
+				&& funcs[num_funcs - 1].arg >= funcs[num_funcs - 1].secret_arg)
+			{
+				// also strings of expressions in the argument: CONCAT('a', 'b')
+				secret = true;
+			}
+			break;
+		case AUDIT_TOK_CHAR:
+			switch (*tok.start)
+			{
+			case '(':
+				depth++;
+				if (func_arg >= 0 && num_funcs < MAX_MASK_FUNCS)
+				{
+					funcs[num_funcs].depth = depth;
+					funcs[num_funcs].arg = 0;
+					funcs[num_funcs].secret_arg = func_arg;
+					num_funcs++;
+				}
+				break;
+			case ')':
+				if (num_funcs > 0 && funcs[num_funcs - 1].depth == depth)
+				{
+					num_funcs--;
+				}
+				if (depth > 0)
+				{
+					depth--;
+				}
+				break;
+			case ',':
+				if (num_funcs > 0 && funcs[num_funcs - 1].depth == depth)
+				{
+					funcs[num_funcs - 1].arg++;
+				}
+				break;
+			case '=':
+				if (state == ST_PASSWORD || state == ST_PASSWORD_FOR)
+				{
+					next_state = ST_SECRET;
+				}
+				break;
+			case '@':
+				if (state == ST_PASSWORD_FOR)
+				{
+					next_state = ST_PASSWORD_FOR;
+				}
+				break;
+			default:
+				break;
+			}
+			break;
+		default:
+			break;
+		}
+
+		if (secret)
+		{
+			// copy till the secret and replace it
+			if (! out->append(copied, tok.text - copied) || ! out->append("***", 3))
+			{
+				return -1;
+			}
+			copied = tok.text + tok.text_len;
+			masked++;
+		}
+		state = next_state;
+		func_arg = secret_func_arg(&tok);
+	}
+
+	if (masked > 0)
+	{
+		if (! out->append(copied, (query + len) - copied) || ! out->append("", 1))
+		{
+			return -1;
+		}
+	}
+	return masked;
+}
@@ -0,0 +1,263 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+
+/*
+ * audit_peer_cache.cc
+ */
+
+#include "mysql_inc.h"
+#include "audit_peer_cache.h"
+#include "audit_clock.h"
+
+struct Audit_peer_cache_entry {
+	unsigned long key;
+	unsigned int hash;
+	unsigned long long stamp;
+	// audit_clock_us() time the entry is valid till
+	unsigned long long expires;
+	// hash chain and LRU list, as entry indexes (-1 for none)
+	int next;
+	int lru_prev;
+	int lru_next;
+	bool found;
+	char value[AUDIT_PEER_CACHE_VALUE_LEN + 1];
+};
+
+/**
+ * A shard is allocated with its buckets and entries following it.
+ */
+struct Audit_peer_cache_shard {
+	pthread_mutex_t lock;
+	int size;
+	// entries [0, used) are in use
+	int used;
+	// most and least recently used
+	int lru_head;
+	int lru_tail;
+	int *buckets;
+	Audit_peer_cache_entry *entries;
+};
+
+// shard sizes are rounded up to a multiple of 8, so the entries are aligned
+#define SHARD_ALIGN 8
+
+static inline size_t shard_alloc_size(int size)
+{
+	return sizeof(Audit_peer_cache_shard) + size * sizeof(int)
+		+ size * sizeof(Audit_peer_cache_entry);
+}
+
+static inline Audit_peer_cache_shard *shard_at(Audit_peer_cache_shard *shards, int size, unsigned int i)
+{
+	return (Audit_peer_cache_shard *) ((char *) shards + i * shard_alloc_size(size));
+}
+
+int Audit_peer_cache::init()
+{
+	if (m_shards || m_max_entries == 0)
+	{
+		return 0;
+	}
+	int size = (m_max_entries + NUM_SHARDS - 1) / NUM_SHARDS;
+	size = (size + SHARD_ALIGN - 1) / SHARD_ALIGN * SHARD_ALIGN;
+	Audit_peer_cache_shard *shards = (Audit_peer_cache_shard *) calloc(NUM_SHARDS, shard_alloc_size(size));
+	if (shards == NULL)
+	{
+		return 1;
+	}
+	for (unsigned int i = 0; i < NUM_SHARDS; i++)
+	{
+		Audit_peer_cache_shard *s = shard_at(shards, size, i);
+		pthread_mutex_init(&s->lock, MY_MUTEX_INIT_FAST);
+		s->size = size;
+		s->used = 0;
+		s->lru_head = -1;
+		s->lru_tail = -1;
+		s->buckets = (int *) (s + 1);
+		s->entries = (Audit_peer_cache_entry *) (s->buckets + size);
+		for (int b = 0; b < size; b++)
+		{
+			s->buckets[b] = -1;
+		}
+	}
+	m_shards = shards;
+	return 0;
+}
+
+void Audit_peer_cache::deinit()
+{
+	if (m_shards == NULL)
+	{
+		return;
+	}
+	int size = m_shards->size;
+	for (unsigned int i = 0; i < NUM_SHARDS; i++)
+	{
+		pthread_mutex_destroy(&shard_at(m_shards, size, i)->lock);
+	}
+	free(m_shards);
+	m_shards = NULL;
+}
+
+Audit_peer_cache_shard *Audit_peer_cache::shard(unsigned long key, unsigned int *hash)
+{
+	// multiplicative hashing, as pids and uids are mostly sequential
+	unsigned int h = (unsigned int) ((unsigned long long) key * 0x9E3779B97F4A7C15ULL >> 32);
+	*hash = h / NUM_SHARDS;
+	return shard_at(m_shards, m_shards->size, h % NUM_SHARDS);
+}
+
+static void lru_unlink(Audit_peer_cache_shard *s, int i)
+{
+	Audit_peer_cache_entry *e = &s->entries[i];
+	if (e->lru_prev >= 0)
+	{
+		s->entries[e->lru_prev].lru_next = e->lru_next;
+	}
+	else
+	{
+		s->lru_head = e->lru_next;
+	}
+	if (e->lru_next >= 0)
+	{
+		s->entries[e->lru_next].lru_prev = e->lru_prev;
+	}
+	else
+	{
+		s->lru_tail = e->lru_prev;
+	}
+}
+
+static void lru_push_head(Audit_peer_cache_shard *s, int i)
+{
+	Audit_peer_cache_entry *e = &s->entries[i];
+	e->lru_prev = -1;
+	e->lru_next = s->lru_head;
+	if (s->lru_head >= 0)
+	{
+		s->entries[s->lru_head].lru_prev = i;
+	}
+	else
+	{
+		s->lru_tail = i;
+	}
+	s->lru_head = i;
+}
+
+// index of the entry of key. -1 if none
+static int shard_find(Audit_peer_cache_shard *s, unsigned int hash, unsigned long key)
+{
+	int i = s->buckets[hash % s->size];
+	while (i >= 0 && s->entries[i].key != key)
+	{
+		i = s->entries[i].next;
+	}
+	return i;
+}
+
+// take the entry out of its hash chain
+static void shard_unhash(Audit_peer_cache_shard *s, int i)
+{
+	int *link = &s->buckets[s->entries[i].hash % s->size];
+	while (*link != i)
+	{
+		link = &s->entries[*link].next;
+	}
+	*link = s->entries[i].next;
+}
+
+int Audit_peer_cache::get(unsigned long key, unsigned long long stamp, char *value)
+{
+	if (m_shards == NULL)
+	{
+		return MISS;
+	}
+	unsigned int hash;
+	Audit_peer_cache_shard *s = shard(key, &hash);
+	int res = MISS;
+	pthread_mutex_lock(&s->lock);
+	int i = shard_find(s, hash, key);
+	if (i >= 0)
+	{
+		Audit_peer_cache_entry *e = &s->entries[i];
+		if (e->stamp == stamp && e->expires > audit_clock_us())
+		{
+			if (e->found)
+			{
+				memcpy(value, e->value, sizeof(e->value));
+				res = FOUND;
+			}
+			else
+			{
+				res = NEGATIVE;
+			}
+			if (s->lru_head != i)
+			{
+				lru_unlink(s, i);
+				lru_push_head(s, i);
+			}
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return res;
+}
+
+void Audit_peer_cache::put(unsigned long key, unsigned long long stamp, const char *value)
+{
+	if (m_shards == NULL)
+	{
+		return;
+	}
+	unsigned int hash;
+	Audit_peer_cache_shard *s = shard(key, &hash);
+	unsigned long long expires = audit_clock_us() + m_ttl * 1000000ULL;
+	pthread_mutex_lock(&s->lock);
+	int i = shard_find(s, hash, key);
+	if (i >= 0)
+	{
+		lru_unlink(s, i);
+	}
+	else
+	{
+		if (s->used < s->size)
+		{
+			i = s->used++;
+		}
+		else
+		{
+			// evict the least recently used
+			i = s->lru_tail;
+			lru_unlink(s, i);
+			shard_unhash(s, i);
+		}
+		Audit_peer_cache_entry *e = &s->entries[i];
+		e->key = key;
+		e->hash = hash;
+		e->next = s->buckets[hash % s->size];
+		s->buckets[hash % s->size] = i;
+	}
+	Audit_peer_cache_entry *e = &s->entries[i];
+	e->stamp = stamp;
+	e->expires = expires;
+	e->found = value != NULL;
+	if (value)
+	{
+		strncpy(e->value, value, AUDIT_PEER_CACHE_VALUE_LEN);
+		e->value[AUDIT_PEER_CACHE_VALUE_LEN] = '\0';
+	}
+	lru_push_head(s, i);
+	pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,377 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+
+/*
+ * audit_peer_resolver.cc
+ */
+
+#include "audit_handler.h"
+#include "audit_peer_resolver.h"
+#include "audit_atomic.h"
+#include <pwd.h>
+
+/**
+ * Names of a peer being resolved. Referenced by the session which asked
+ * and by the resolver till it is done.
+ */
+struct Audit_peer_request {
+	Audit_peer_request *next;
+	volatile int refs;
+	volatile int done;
+	uid_t uid;
+	pid_t pid;
+	char os_user[PeerInfo::MAX_USER_NAME_LEN + 1];
+	char app_name[PeerInfo::MAX_APP_NAME_LEN + 1];
+};
+
+void Audit_peer_resolver::release(Audit_peer_request *req)
+{
+	if (audit_atomic_sub(&req->refs, 1) == 1)
+	{
+		free(req);
+	}
+}
+
+bool Audit_peer_resolver::poll(Audit_peer_request *req, PeerInfo *peer)
+{
+	if (! req->done)
+	{
+		return false;
+	}
+	// the names were written before done
+	audit_mb();
+	memcpy(peer->osUser, req->os_user, sizeof(peer->osUser));
+	memcpy(peer->appName, req->app_name, sizeof(peer->appName));
+	release(req);
+	return true;
+}
+
+// user name of a uid without a name
+static void uid_name(uid_t uid, char *os_user)
+{
+	snprintf(os_user, PeerInfo::MAX_USER_NAME_LEN, "%lu", (unsigned long) uid);
+}
+
+// app name of a pid whose name isn't known
+static void pid_name(pid_t pid, char *app_name)
+{
+	snprintf(app_name, PeerInfo::MAX_APP_NAME_LEN, "pid:%d", (int) pid);
+}
+
+// names to use till they are resolved
+static void fallback_names(uid_t uid, pid_t pid, char *os_user, char *app_name)
+{
+	uid_name(uid, os_user);
+	pid_name(pid, app_name);
+}
+
+/**
+ * OS user name of uid, from the uid cache or getpwuid_r (which may go to
+ * NSS/LDAP). The uid as a number if it has no name.
+ */
+void Audit_peer_resolver::os_user(uid_t uid, char *name)
+{
+	int cached = m_uid_cache.get(uid, 0, name);
+	if (cached == Audit_peer_cache::MISS)
+	{
+		char buf[BUFSIZ];
+		struct passwd pwd, *pwbuf = NULL;
+		getpwuid_r(uid, & pwd, buf, sizeof(buf), & pwbuf);
+		m_uid_cache.put(uid, 0, pwbuf ? pwd.pw_name : NULL);
+		if (pwbuf)
+		{
+			strncpy(name, pwd.pw_name, PeerInfo::MAX_USER_NAME_LEN);
+			name[PeerInfo::MAX_USER_NAME_LEN] = '\0';
+			return;
+		}
+	}
+	else if (cached == Audit_peer_cache::FOUND)
+	{
+		return;
+	}
+	// no name, send UID
+	uid_name(uid, name);
+}
+
+/**
+ * Start time of the process (in clock ticks since boot), from
+ * /proc/<pid>/stat. 0 if it can't be read.
+ */
+static unsigned long long proc_start_time(pid_t pid)
+{
+	char buf[1024];
+	snprintf(buf, sizeof(buf), "/proc/%d/stat", (int) pid);
+	int fd = open(buf, O_RDONLY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+	ssize_t count = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (count <= 0)
+	{
+		return 0;
+	}
+	buf[count] = '\0';
+	// the program name (2nd field) may have spaces and parens. starttime
+	// is the 20th field after it
+	char *cp = strrchr(buf, ')');
+	for (int field = 0; cp && field < 20; field++)
+	{
+		cp = strchr(cp + 1, ' ');
+	}
+	return cp ? strtoull(cp + 1, NULL, 10) : 0;
+}
+
+/**
+ * Program name of pid, from the pid cache (if the process start time
+ * matches) or /proc/<pid>/cmdline.
+ */
+void Audit_peer_resolver::app_name(pid_t pid, char *name)
+{
+	unsigned long long start = proc_start_time(pid);
+	if (start != 0 && m_pid_cache.get(pid, start, name) == Audit_peer_cache::FOUND)
+	{
+		return;
+	}
+
+	name[0] = '\0';
+	// Get the progran name out of /proc
+	char buf[64];
+	snprintf(buf, sizeof(buf) - 1, "/proc/%d/cmdline", (int) pid);
+	int fd = open(buf, O_RDONLY);
+	if (fd >= 0)
+	{
+		char data[PATH_MAX+1];
+
+		ssize_t count = read(fd, data, sizeof(data) - 1);
+		if (count > 0)
+		{
+			data[count] = '\0';	// just in case
+
+			if (strlen(data) <= PeerInfo::MAX_APP_NAME_LEN)
+			{
+				strcpy(name, data);
+			}
+			else
+			{
+				// take last 128 characters, typically will be
+				// .../x/y/appname
+				char *cp = data + strlen(data) - PeerInfo::MAX_APP_NAME_LEN;
+
+				strncpy(name, cp, PeerInfo::MAX_APP_NAME_LEN);
+				name[PeerInfo::MAX_APP_NAME_LEN] = '\0';
+			}
+		}
+
+		close(fd);
+	}
+
+	// in case of errors:
+	if (name[0] == '\0')
+	{
+		snprintf(name, PeerInfo::MAX_APP_NAME_LEN, "pid:%d", (int) pid);
+	}
+	else if (start != 0)
+	{
+		m_pid_cache.put(pid, start, name);
+	}
+}
+
+int Audit_peer_resolver::init()
+{
+	if (m_initialized)
+	{
+		return 0;
+	}
+	int res = m_uid_cache.init();
+	if (res == 0)
+	{
+		res = m_pid_cache.init();
+	}
+	pthread_mutex_init(&LOCK_resolve, MY_MUTEX_INIT_FAST);
+	pthread_cond_init(&COND_request, NULL);
+	pthread_cond_init(&COND_resolved, NULL);
+	m_stop = false;
+	m_initialized = true;
+	unsigned int threads = m_threads < MAX_THREADS ? m_threads : MAX_THREADS;
+	for (m_num_started = 0; m_num_started < threads; m_num_started++)
+	{
+		int err = pthread_create(&m_resolve_threads[m_num_started], NULL, resolve_thread_func, this);
+		if (err != 0)
+		{
+			return err;
+		}
+	}
+	return res;
+}
+
+void Audit_peer_resolver::deinit()
+{
+	if (! m_initialized)
+	{
+		return;
+	}
+	pthread_mutex_lock(&LOCK_resolve);
+	m_stop = true;
+	pthread_cond_broadcast(&COND_request);
+	pthread_mutex_unlock(&LOCK_resolve);
+	for (unsigned int i = 0; i < m_num_started; i++)
+	{
+		pthread_join(m_resolve_threads[i], NULL);
+	}
+	m_num_started = 0;
+	// sessions may still poll the requests
+	while (m_queue_head)
+	{
+		Audit_peer_request *req = m_queue_head;
+		m_queue_head = req->next;
+		fallback_names(req->uid, req->pid, req->os_user, req->app_name);
+		audit_mb();
+		req->done = 1;
+		release(req);
+	}
+	m_queue_tail = NULL;
+	pthread_cond_destroy(&COND_resolved);
+	pthread_cond_destroy(&COND_request);
+	pthread_mutex_destroy(&LOCK_resolve);
+	m_pid_cache.deinit();
+	m_uid_cache.deinit();
+	m_initialized = false;
+}
+
+Audit_peer_request *Audit_peer_resolver::resolve(uid_t uid, pid_t pid, PeerInfo *peer, bool async)
+{
+	// cached names don't need a thread
+	unsigned long long start = proc_start_time(pid);
+	int user = m_uid_cache.get(uid, 0, peer->osUser);
+	if (user == Audit_peer_cache::NEGATIVE)
+	{
+		uid_name(uid, peer->osUser);
+	}
+	bool have_app = start != 0
+		&& m_pid_cache.get(pid, start, peer->appName) == Audit_peer_cache::FOUND;
+	if (user != Audit_peer_cache::MISS && have_app)
+	{
+		return NULL;
+	}
+
+	Audit_peer_request *req = NULL;
+	if (async && m_num_started > 0)
+	{
+		req = (Audit_peer_request *) calloc(1, sizeof(Audit_peer_request));
+	}
+	// below only the names which missed the caches are filled
+	if (req == NULL)
+	{
+		if (user == Audit_peer_cache::MISS)
+		{
+			os_user(uid, peer->osUser);
+		}
+		if (! have_app)
+		{
+			app_name(pid, peer->appName);
+		}
+		return NULL;
+	}
+
+	// one reference for us and one for the resolver thread
+	req->refs = 2;
+	req->uid = uid;
+	req->pid = pid;
+	pthread_mutex_lock(&LOCK_resolve);
+	if (m_queue_tail)
+	{
+		m_queue_tail->next = req;
+	}
+	else
+	{
+		m_queue_head = req;
+	}
+	m_queue_tail = req;
+	pthread_cond_signal(&COND_request);
+	unsigned int timeout = m_timeout;
+	if (timeout > 0)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		unsigned long long ns = deadline.tv_nsec + (timeout % 1000) * 1000000ULL;
+		deadline.tv_sec += timeout / 1000 + ns / 1000000000ULL;
+		deadline.tv_nsec = ns % 1000000000ULL;
+		while (! req->done)
+		{
+			if (pthread_cond_timedwait(&COND_resolved, &LOCK_resolve, &deadline) == ETIMEDOUT)
+			{
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&LOCK_resolve);
+
+	if (poll(req, peer))
+	{
+		return NULL;
+	}
+	if (user == Audit_peer_cache::MISS)
+	{
+		uid_name(uid, peer->osUser);
+	}
+	if (! have_app)
+	{
+		pid_name(pid, peer->appName);
+	}
+	return req;
+}
+
+void *Audit_peer_resolver::resolve_thread_func(void *arg)
+{
+	// needed for using mysys functions in our thread
+	my_thread_init();
+	((Audit_peer_resolver *) arg)->resolve_run();
+	my_thread_end();
+	return NULL;
+}
+
+void Audit_peer_resolver::resolve_run()
+{
+	pthread_mutex_lock(&LOCK_resolve);
+	while (! m_stop)
+	{
+		Audit_peer_request *req = m_queue_head;
+		if (req == NULL)
+		{
+			pthread_cond_wait(&COND_request, &LOCK_resolve);
+			continue;
+		}
+		m_queue_head = req->next;
+		if (m_queue_head == NULL)
+		{
+			m_queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&LOCK_resolve);
+
+		os_user(req->uid, req->os_user);
+		app_name(req->pid, req->app_name);
+		// the names must be visible before done
+		audit_mb();
+		req->done = 1;
+
+		pthread_mutex_lock(&LOCK_resolve);
+		pthread_cond_broadcast(&COND_resolved);
+		release(req);
+	}
+	pthread_mutex_unlock(&LOCK_resolve);
+}
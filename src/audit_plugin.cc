@@ -16,9 +16,15 @@
 #include "hot_patch.h"
 #include <stdlib.h>
 #include <ctype.h>
-#include <pwd.h>
 
 #include "audit_handler.h"
+#include "audit_filter.h"
+#include "audit_mask.h"
+#include "audit_rules.h"
+#include "audit_aggregate.h"
+#include "audit_peer_resolver.h"
+#include "audit_slab.h"
+#include "audit_clock.h"
 #include <string.h>
 #include <sys/mman.h>
 #if MYSQL_VERSION_ID >= 50600
@@ -44,6 +50,31 @@ static Audit_socket_handler json_socket_handler;
 
 // formatters
 static Audit_json_formatter json_formatter;
+static Audit_binary_formatter binary_formatter(&json_formatter);
+
+// accumulates the events of aggregate_cmds
+static Audit_aggregator aggregator;
+// names of Unix domain socket peers
+static Audit_peer_resolver peer_resolver;
+#ifdef HAVE_AUDIT_SESSION
+static Audit_slab session_pool(sizeof(Audit_session));
+// sessions pooled beyond max_connections, for connections changing it
+#define SESSION_POOL_EXTRA 16
+#endif
+
+// record format of the handlers
+enum record_format { RECORD_FORMAT_JSON = 0, RECORD_FORMAT_BINARY };
+static ulong json_file_format = RECORD_FORMAT_JSON;
+static ulong json_socket_format = RECORD_FORMAT_JSON;
+
+static Audit_formatter *record_formatter(ulong format)
+{
+	if (format == RECORD_FORMAT_BINARY)
+	{
+		return &binary_formatter;
+	}
+	return &json_formatter;
+}
 
 // flags to hold if audit handlers are enabled
 static my_bool json_file_handler_enable = FALSE;
@@ -57,6 +88,10 @@ static my_bool validate_offsets_extended_enable = FALSE;
 static char *offsets_string = NULL;
 static char *checksum_string = NULL;
 static int delay_ms_val = 0;
+static ulong min_exec_time_val = 0;
+static ulong min_rows_val = 0;
+static unsigned int peer_cache_size = Audit_peer_cache::DEF_MAX_ENTRIES;
+static unsigned int peer_cache_ttl = Audit_peer_cache::DEF_TTL;
 static char *delay_cmds_string = NULL;
 static char delay_cmds_buff[4096] = {0};
 static char *whitelist_cmds_string = NULL;
@@ -65,26 +100,67 @@ static char *record_cmds_string = NULL;
 static char record_cmds_buff[4096] = {0};
 static char *password_masking_cmds_string = NULL;
 static char password_masking_cmds_buff[4096] = {0};
+static char *aggregate_cmds_string = NULL;
+static char aggregate_cmds_buff[4096] = {0};
 static char *record_objs_string = NULL;
-static char record_objs_buff[4096] = {0};
+// copy of the record_objs value (not limited in size)
+static char *record_objs_buff = NULL;
+static char *record_objs_file_string = NULL;
+static char record_objs_file_buff[FN_REFLEN] = {0};
+static char *rules_file_string = NULL;
+static char rules_file_buff[FN_REFLEN] = {0};
 static char *whitelist_users_string = NULL;
-static char whitelist_users_buff[4096] = {0};
+// copy of the whitelist_users value (not limited in size)
+static char *whitelist_users_buff = NULL;
 
 static char delay_cmds_array [SQLCOM_END + 2][MAX_COMMAND_CHAR_NUMBERS] = {{0}};
 static char whitelist_cmds_array [SQLCOM_END + 2][MAX_COMMAND_CHAR_NUMBERS] = {{0}};
 static char record_cmds_array [SQLCOM_END + 2][MAX_COMMAND_CHAR_NUMBERS] = {{0}};
 static char password_masking_cmds_array [SQLCOM_END + 2][MAX_COMMAND_CHAR_NUMBERS] = {{0}};
-static char record_objs_array [MAX_NUM_OBJECT_ELEM + 2][MAX_OBJECT_CHAR_NUMBERS] = {{0}};
-static char whitelist_users_array [MAX_NUM_USER_ELEM + 2][MAX_USER_CHAR_NUMBERS] = {{0}};
-static bool record_empty_objs_set = true;
+static char aggregate_cmds_array [SQLCOM_END + 2][MAX_COMMAND_CHAR_NUMBERS] = {{0}};
 static int num_delay_cmds = 0;
 static int num_whitelist_cmds = 0;
 static int num_record_cmds = 0;
 static int num_password_masking_cmds = 0;
-static int num_record_objs = 0;
-static int num_whitelist_users = 0;
+static int num_aggregate_cmds = 0;
 static SHOW_VAR com_status_vars_array [MAX_COM_STATUS_VARS_RECORDS] = {{0}};
 
+// command list resolved to the matching command ids
+#define CMD_SET_WORDS ((AUDIT_CMD_COUNT + 63) / 64)
+struct cmd_set_t {
+	int num;	// number of entries in the list
+	unsigned long long bits[CMD_SET_WORDS];
+};
+
+/**
+ * Filter configuration compiled from the filter sysvars. A published
+ * configuration is never modified: an update builds a new one and swaps
+ * the filter_config pointer, so each event is checked against a single
+ * consistent configuration. The obj and user sets are reference counted
+ * and shared with the following configurations till their list changes.
+ */
+struct filter_config_t {
+	cmd_set_t delay_cmds;
+	cmd_set_t whitelist_cmds;
+	cmd_set_t record_cmds;
+	cmd_set_t password_masking_cmds;
+	cmd_set_t aggregate_cmds;
+	// compiled record_objs and record_objs_file. NULL if not set
+	Audit_obj_set *record_objs;
+	// compiled whitelist_users. NULL if not set
+	Audit_user_set *whitelist_users;
+	// compiled rules_file. NULL if not set
+	Audit_rules *rules;
+};
+// configuration before any filter is set
+static filter_config_t default_filter_config;
+// current configuration. Read within filter_epoch
+static filter_config_t *volatile filter_config = &default_filter_config;
+// lets us free a replaced configuration once no thread uses it
+static Audit_epoch filter_epoch;
+// generation of the last whitelist_users set. Sessions cache their result for it
+static unsigned long whitelist_users_gen = 0;
+
 enum before_after_enum {
 	AUDIT_AFTER = 0,	// default
 	AUDIT_BEFORE,
@@ -97,22 +173,10 @@ static ulong before_after_mode = AUDIT_AFTER;
 static char password_masking_regex_check_buff[4096] = {0};
 static char * password_masking_regex_string = NULL;
 static char password_masking_regex_buff[4096] = {0};
-
-#define _COMMENT_SPACE_ "(?:/\\*.*?\\*/|\\s)*?"
-#define _QUOTED_PSW_ "[\'|\"](?<psw>.*?)(?<!\\\\)[\'|\"]"
-
-static const char default_pw_masking_regex[] =
-	// identified by [password] '***'
-	"identified"_COMMENT_SPACE_"by"_COMMENT_SPACE_"(?:password)?"_COMMENT_SPACE_ _QUOTED_PSW_
-	// password function
-	"|password"_COMMENT_SPACE_"\\("_COMMENT_SPACE_ _QUOTED_PSW_ _COMMENT_SPACE_"\\)"
-	// Used at: CHANGE MASTER TO MASTER_PASSWORD='new3cret', SET PASSWORD [FOR user] = 'hash', password 'user_pass';
-	"|password"_COMMENT_SPACE_"(?:for"_COMMENT_SPACE_"\\S+?)?"_COMMENT_SPACE_"="_COMMENT_SPACE_ _QUOTED_PSW_
-	"|password"_COMMENT_SPACE_ _QUOTED_PSW_
-	// federated engine create table with connection. See: http://dev.mysql.com/doc/refman/5.5/en/federated-create-connection.html
-	// commented out as federated engine is disabled by default
-	// "|ENGINE"_COMMENT_SPACE_"="_COMMENT_SPACE_"FEDERATED"_COMMENT_SPACE_".*CONNECTION"_COMMENT_SPACE_"="_COMMENT_SPACE_"[\'|\"]\\S+?://\\S+?:(?<psw>.*)@\\S+[\'|\"]"
-	;
+static char *password_masking_prefilter_string = NULL;
+static char password_masking_prefilter_buff[1024] = {0};
+static const char default_pw_masking_prefilter[] = AUDIT_PW_MASKING_DEFAULT_PREFILTER;
+static const char default_pw_masking_regex[] = AUDIT_PW_MASKING_DEFAULT_REGEX;
 
 // socket name
 static char json_socket_name_buff[1024] = {0};
@@ -142,20 +206,10 @@ static bool (*trampoline_acl_authenticate)(THD *thd, uint connect_errors, uint c
 static unsigned int trampoline_acl_authenticate_size = 0;
 #endif
 
-static MYSQL_THDVAR_ULONG(is_thd_printed_list,
+#ifdef HAVE_AUDIT_SESSION
+static MYSQL_THDVAR_ULONG(session,
 	PLUGIN_VAR_READONLY | PLUGIN_VAR_NOSYSVAR | PLUGIN_VAR_NOCMDOPT,
-	"avoid duplicate printing",
-	NULL, NULL,0,0,
-#ifdef __x86_64__
-	0xffffffffffffff,
-#else
-	0xffffffff,
-#endif
-	1);
-
-static MYSQL_THDVAR_ULONG(query_cache_table_list,
-	PLUGIN_VAR_READONLY | PLUGIN_VAR_NOSYSVAR | PLUGIN_VAR_NOCMDOPT,
-	"Pointer to query cache table list.",
+	"Pointer to plugin session state",
 	NULL, NULL, 0, 0,
 #ifdef __x86_64__
 	0xffffffffffffff,
@@ -163,97 +217,94 @@ static MYSQL_THDVAR_ULONG(query_cache_table_list,
 	0xffffffff,
 #endif
 	1);
-
-
-static MYSQL_THDVAR_BOOL(set_peer_cred,
-	PLUGIN_VAR_READONLY | PLUGIN_VAR_NOSYSVAR | PLUGIN_VAR_NOCMDOPT,
-	"track if peer credential information is set",
-	NULL, NULL, 0);
-
-static MYSQL_THDVAR_BOOL(peer_is_uds,
-	PLUGIN_VAR_READONLY | PLUGIN_VAR_NOSYSVAR | PLUGIN_VAR_NOCMDOPT,
-	"track if client is connected on Unix Domain Socket",
-	NULL, NULL, 0);
-
-// We use a THDVAR_STR to store the PeerInfo struct for this thread.
+#else
+// Without a disconnect hook we use a THDVAR_STR to store the session
+// state, so the server frees it with the THD.
 // In order to get MySQL to allocate storage correctly, we have to
 // fool it into thinking that the storage holds a C string. To do so,
 // we create a char array of the right size and use that as the initial
 // value. Then in the constructor routines, below, we initialize the
 // contents to look like a C string with a bunch of '0' characters,
 // terminated by a final '\0'.
-char peer_info_init_value[sizeof(struct PeerInfo) + 4];
+char session_init_value[sizeof(struct Audit_session) + 4];
 
-#if defined(MARIADB_BASE_VERSION)
-static MYSQL_THDVAR_ULONG(peer_info,
-	PLUGIN_VAR_READONLY | PLUGIN_VAR_NOSYSVAR | PLUGIN_VAR_NOCMDOPT,
-	"Pointer to peer info data",
-	NULL, NULL, 0, 0,
-#ifdef __x86_64__
-	0xffffffffffffff,
-#else
-	0xffffffff,
-#endif
-	1);
-#else	// NOT mariadb
-static MYSQL_THDVAR_STR(peer_info,
+static MYSQL_THDVAR_STR(session,
 	PLUGIN_VAR_NOSYSVAR | PLUGIN_VAR_READONLY |
 			PLUGIN_VAR_MEMALLOC,
-	"Info related to client process",
-	NULL, NULL, peer_info_init_value);
+	"Plugin session state",
+	NULL, NULL, session_init_value);
 #endif
 
-
-THDPRINTED *GetThdPrintedList(THD *thd)
+Audit_session *Audit_formatter::thd_session(THD *thd)
 {
-	THDPRINTED *pThdPrintedList= (THDPRINTED*) THDVAR(thd, is_thd_printed_list);
-	if (pThdPrintedList)
+#ifdef HAVE_AUDIT_SESSION
+	Audit_session *session = (Audit_session *) THDVAR(thd, session);
+	if (session == NULL)
 	{
-		return pThdPrintedList;
+		session = (Audit_session *) session_pool.alloc();
+		if (session)
+		{
+			session->magic = AUDIT_SESSION_MAGIC;
+			THDVAR(thd, session) = (ulong) session;
+		}
 	}
-	THDVAR(thd, is_thd_printed_list) = 0;
-	return NULL;
+	return session;
+#else
+	// the server's copy of session_init_value till we initialize it
+	Audit_session *session = (Audit_session *) THDVAR(thd, session);
+	if (session && session->magic != AUDIT_SESSION_MAGIC)
+	{
+		memset(session, 0, sizeof(Audit_session));
+		session->magic = AUDIT_SESSION_MAGIC;
+	}
+	return session;
+#endif
 }
 
-static void initializePeerCredentials(THD *pThd)
+// called on connect and change user so the session info is read again
+static void session_invalidate(THD *thd)
 {
-	int sock;
-	struct stat sbuf;
-	struct ucred cred;
-	socklen_t cred_len = sizeof(cred);
-	char buf[BUFSIZ];
-	struct passwd pwd, *pwbuf = NULL;
-	char *username = NULL;
-	int fd;
-	PeerInfo *peer;
+	// allocates the session of a new connection
+	Audit_session *session = Audit_formatter::thd_session(thd);
+	if (session)
+	{
+		session->prefix_valid = false;
+		session->bin_prefix_valid = false;
+		// user may have changed
+		session->user_filter_gen = 0;
+	}
+}
 
-#if defined(MARIADB_BASE_VERSION)
-	if (THDVAR(pThd, peer_info) == 0)
+#ifdef HAVE_AUDIT_SESSION
+// called on disconnect
+static void session_free(THD *thd)
+{
+	Audit_session *session = (Audit_session *) THDVAR(thd, session);
+	if (session)
 	{
-		peer = (PeerInfo *) malloc(sizeof(PeerInfo));
-		if (peer)
-		{
-			memset(peer, 0, sizeof(PeerInfo));
-			THDVAR(pThd, peer_info) = (ulong) peer;
-		}
-		else
+		if (session->peer_request)
 		{
-			goto done;
+			Audit_peer_resolver::release(session->peer_request);
 		}
+		session->prefix.release();
+		session->bin_prefix.release();
+		session->printed.release();
+		session_pool.release(session);
+		THDVAR(thd, session) = 0;
 	}
-	else
-	{
-		peer = (PeerInfo *) THDVAR(pThd, peer_info);
-	}
-#else
-	// zero out thread local copy of PeerInfo
-	peer = (PeerInfo *) THDVAR(pThd, peer_info);
-	if (peer != NULL)
-	{
-		memset(peer, 0, sizeof(PeerInfo));
-	}
+}
 #endif
 
+static void initializePeerCredentials(THD *pThd, Audit_session *session)
+{
+	int sock;
+	struct stat sbuf;
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	PeerInfo *peer = &session->peer;
+
+	memset(peer, 0, sizeof(PeerInfo));
+
 	// get the NET structure
 	sock = Audit_formatter::thd_client_fd(pThd);
 	// These tests are not chained so that we can add
@@ -277,10 +328,8 @@ static void initializePeerCredentials(THD *pThd)
 	// At this point, we know we have a Unix domain socket.
 	if (! json_formatter.m_write_socket_creds)
 	{
-		// We need to set this, so that we don't send the
-		// client port, but we don't bother getting the command
-		// name and user name, since they won't be sent.
-		THDVAR(pThd, peer_is_uds) = TRUE;
+		// We don't bother getting the command name and user name,
+		// since they won't be sent.
 		goto done;
 	}
 
@@ -295,93 +344,47 @@ static void initializePeerCredentials(THD *pThd)
 		goto done;
 	}
 
-	if (peer == NULL)
-	{
-		goto done;
-	}
-
 	// Set PID
 	peer->pid = cred.pid;
 
-	// Get OS user name
-	getpwuid_r(cred.uid, & pwd, buf, sizeof(buf), & pwbuf);
-	if (pwbuf == NULL)
-	{
-		// no name, send UID
-		snprintf(buf, sizeof(buf) - 1, "%lu", (unsigned long) cred.uid);
-		username = buf;
-	}
-	else
-	{
-		username = pwd.pw_name;
-	}
-
-	strncpy(peer->osUser, username, PeerInfo::MAX_USER_NAME_LEN);
-	peer->osUser[PeerInfo::MAX_USER_NAME_LEN] = '\0';
-
-	// Get the progran name out of /proc
-	snprintf(buf, sizeof(buf) - 1, "/proc/%d/cmdline", cred.pid);
-	fd = open(buf, O_RDONLY);
-	if (fd >= 0)
-	{
-		char data[PATH_MAX+1];
-
-		ssize_t count = read(fd, data, sizeof(data) - 1);
-		if (count > 0)
-		{
-			data[count] = '\0';	// just in case
-
-			if (strlen(data) <= PeerInfo::MAX_APP_NAME_LEN)
-			{
-				strcpy(peer->appName, data);
-			}
-			else
-			{
-				// take last 128 characters, typically will be
-				// .../x/y/appname
-				char *cp = data + strlen(data) - PeerInfo::MAX_APP_NAME_LEN;
-
-				strncpy(peer->appName, cp, PeerInfo::MAX_APP_NAME_LEN);
-				peer->appName[PeerInfo::MAX_APP_NAME_LEN] = '\0';
-			}
-		}
-
-		close(fd);
-	}
-
-	// in case of errors:
-	if (peer->appName[0] == '\0')
-	{
-		snprintf(peer->appName, sizeof(peer->appName) - 1, "pid:%d", cred.pid);
-	}
-
-	// set that we have a UDS, so that THD vars will be used
-	THDVAR(pThd, peer_is_uds) = TRUE;
+#ifdef HAVE_AUDIT_SESSION
+	// the names may be resolved later. See ThdSesData
+	session->peer_request = peer_resolver.resolve(cred.uid, cred.pid, peer, true);
+#else
+	// can't release a pending request on disconnect
+	peer_resolver.resolve(cred.uid, cred.pid, peer, false);
+#endif
 
 done:
-	THDVAR(pThd, set_peer_cred) = TRUE;
+	session->peer_set = true;
 }
 
-PeerInfo *retrieve_peerinfo(THD *thd)
+PeerInfo *retrieve_peerinfo(THD *thd, Audit_session *session)
 {
-	if (! THDVAR(thd, set_peer_cred))
+	if (session == NULL)
 	{
-		initializePeerCredentials(thd);
+		return NULL;
 	}
 
-	if (json_formatter.m_write_socket_creds)
+	if (! session->peer_set)
 	{
-		PeerInfo *peer = (PeerInfo *) THDVAR(thd, peer_info);
+		initializePeerCredentials(thd, session);
+	}
 
-		if (THDVAR(thd, peer_is_uds) && peer != NULL);
-		{
-			return peer;
-		}
+	// pid is 0 if not a Unix domain socket
+	if (json_formatter.m_write_socket_creds)
+	{
+		return &session->peer;
 	}
 
 	return NULL;
 }
 
+static inline bool cmd_set_test(const cmd_set_t &set, int cmd_id)
+{
+	return (set.bits[cmd_id / 64] >> (cmd_id % 64)) & 1;
+}
+
 static int check_array(const char *cmds[],const char *array, int length)
 {
 	for (int k = 0; array[k * length] !='\0';k++)
@@ -404,148 +407,257 @@ static int check_array(const char *cmds[],const char *array, int length)
 	return 0;
 }
 
-// utility method checks if the passed db object is part of record_objs_array
-static bool check_db_obj(const char *db, const char *name)
+/**
+ * Check if the user of the event is in whitelist_users. The result is
+ * kept in the session till the user or the list changes, so most events
+ * only compare the generation.
+ */
+static bool check_whitelist_users(const Audit_user_set *users, ThdSesData *pThdData)
 {
-	char db_obj[MAX_OBJECT_CHAR_NUMBERS] = {0};
-	char wildcard_obj[MAX_OBJECT_CHAR_NUMBERS] = {0};
-	char db_wildcard[MAX_OBJECT_CHAR_NUMBERS] = {0};
-	if (db && name &&
-		((strlen(db) + strlen(name)) < MAX_OBJECT_CHAR_NUMBERS - 2))
+	THD *thd = pThdData->getTHD();
+	Audit_session *session = pThdData->getSession();
+	if (session && session->user_filter_gen == users->generation())
 	{
-		strcpy(db_obj, db);
-		strcat(db_obj, ".");
-		strcat(db_obj, name);
-		strcpy(wildcard_obj, "*.");
-		strcat(wildcard_obj, name);
-		strcpy(db_wildcard, db);
-		strcat(db_wildcard, ".*");
-		const char *objects[4];
-		objects[0] = db_obj;
-		objects[1] = wildcard_obj;
-		objects[2] = db_wildcard;
-		objects[3] = NULL;
-		return check_array(objects, (char *) record_objs_array, MAX_OBJECT_CHAR_NUMBERS);
+		return session->user_whitelisted;
 	}
-	return false;
-}
-
-// callback function returns if password masking is required according to cmd type
-static my_bool check_do_password_masking(const char * cmd)
-{
-	if (num_password_masking_cmds > 0)
+	bool res = false;
+	if (users->count() > 0)
 	{
-		const char *cmds[2];
-		cmds[0] = cmd;
-		cmds[1] = NULL;
-		return check_array(cmds, (const char *) password_masking_cmds_array, sizeof(password_masking_cmds_array[0]));
+		res = users->match(pThdData->getUserName(),
+				Audit_formatter::thd_inst_main_security_ctx_host(thd),
+				Audit_formatter::thd_inst_main_security_ctx_ip(thd));
 	}
-	return false;
+	if (session)
+	{
+		session->user_whitelisted = res;
+		session->user_filter_gen = users->generation();
+	}
+	return res;
 }
 
-static void do_delay(ThdSesData *pThdData)
+// check if the objects of the event match record_objs
+static bool check_record_objs(const Audit_obj_set *objs, ThdSesData *pThdData)
 {
-	if (delay_ms_val > 0)
+	bool matched = true;
+	if (objs->count() > 0)
 	{
-		const char *cmd = pThdData->getCmdName();
-		const char *cmds[2];
-		cmds[0] = cmd;
-		cmds[1] = NULL;
-		int delay = check_array(cmds, (char *) delay_cmds_array, MAX_COMMAND_CHAR_NUMBERS);
-		if (delay)
+		matched = false;
+		if (pThdData->startGetObjects())
 		{
-			// Audit_file_handler::print_sleep(thd,delay_ms_val);
-			my_sleep(delay_ms_val *1000);
+			const char *db_name = NULL;
+			const char *obj_name = NULL;
+			while(!matched && pThdData->getNextObject(&db_name, &obj_name, NULL))
+			{
+				matched = db_name && obj_name && objs->match(db_name, obj_name);
+			}
+		}
+		else // no objects
+		{
+			matched = objs->match_empty();
 		}
 	}
+	return matched;
 }
 
-static void audit(ThdSesData *pThdData)
-{
-	THDPRINTED *pThdPrintedList = GetThdPrintedList(pThdData->getTHD());
+/**
+ * Event values for the rules, taken from the thd
+ */
+class Audit_rules_thd_event: public Audit_rules_event {
+public:
+	Audit_rules_thd_event(ThdSesData *pThdData)
+		: m_data(pThdData), m_have_rows(false), m_rows(0)
+	{
+	}
 
-	if (num_whitelist_cmds > 0)
+	unsigned long long rows()
 	{
-		const char * cmd = pThdData->getCmdName();
-		const char *cmds[2];
-		cmds[0] = cmd;
-		cmds[1] = NULL;
-		if (check_array(cmds, (char *) whitelist_cmds_array, MAX_COMMAND_CHAR_NUMBERS))
+		if (! m_have_rows)
 		{
-			return;
+			m_rows = Audit_formatter::thd_event_rows(m_data);
+			m_have_rows = true;
 		}
+		return m_rows;
 	}
 
-	if (num_whitelist_users > 0)
+	const char *db()
 	{
-		const char *user = pThdData->getUserName(); // If name is present, then no need to log the query
-		const char *users[2];
-		if (NULL == user || '\0' == user[0]) // empty user use special symbol: "{}"
-		{
-			user = "{}";
-		}
-		users[0] = user;
-		users[1] = NULL;
-		if (check_array(users, (char *) whitelist_users_array, MAX_USER_CHAR_NUMBERS))
-		{
-			return;
-		}
+		return Audit_formatter::thd_db(m_data->getTHD());
+	}
+
+	const char *user()
+	{
+		return m_data->getUserName();
+	}
+
+	const char *host()
+	{
+		return Audit_formatter::thd_inst_main_security_ctx_host(m_data->getTHD());
+	}
+
+	const char *ip()
+	{
+		return Audit_formatter::thd_inst_main_security_ctx_ip(m_data->getTHD());
+	}
+
+	bool start_objects()
+	{
+		return m_data->startGetObjects();
+	}
+
+	bool next_object(const char **db_name, const char **obj_name)
+	{
+		return m_data->getNextObject(db_name, obj_name, NULL);
+	}
+
+	const char *query(size_t *len)
+	{
+		return Audit_formatter::thd_query(m_data->getTHD(), len);
+	}
+
+private:
+	ThdSesData *m_data;
+	bool m_have_rows;
+	ulonglong m_rows;
+};
+
+/**
+ * Check the event against the filters of cfg.
+ * Return true if the event should be logged.
+ */
+static bool check_filters(const filter_config_t *cfg, ThdSesData *pThdData)
+{
+	if (cfg->whitelist_cmds.num > 0 && cmd_set_test(cfg->whitelist_cmds, pThdData->getCmdId()))
+	{
+		return false;
+	}
+
+	if (cfg->whitelist_users != NULL && check_whitelist_users(cfg->whitelist_users, pThdData))
+	{
+		return false;
 	}
 
 	bool do_objs_cmds_check = true;
 	if (force_record_logins_enable)
 	{
-		const char *cmd = pThdData->getCmdName();
-		if (strcasecmp(cmd, "Connect") == 0
-			|| strcasecmp(cmd, "Quit") == 0
-			|| strcasecmp(cmd, "Failed Login") == 0)
+		int cmd_id = pThdData->getCmdId();
+		if (cmd_id == AUDIT_CMD_SERVER_BASE + COM_CONNECT
+			|| cmd_id == AUDIT_CMD_SERVER_BASE + COM_QUIT
+			|| cmd_id == AUDIT_CMD_FAILED_LOGIN)
 		{
 			do_objs_cmds_check = false;
 		}
 	}
 
-	if (num_record_cmds > 0 && do_objs_cmds_check)
+	// the rules replace record_cmds and record_objs
+	if (cfg->rules != NULL)
 	{
-		const char *cmd = pThdData->getCmdName();
-		const char *cmds[2];
-		cmds[0] = cmd;
-		cmds[1] = NULL;
-		if (! check_array(cmds, (char *) record_cmds_array, MAX_COMMAND_CHAR_NUMBERS))
-		{
-			return;
-		}
+		Audit_rules_thd_event ev(pThdData);
+		return ! do_objs_cmds_check || cfg->rules->match(&ev, pThdData->getCmdId());
 	}
 
-	if (num_record_objs > 0 && do_objs_cmds_check)
+	if (cfg->record_cmds.num > 0 && do_objs_cmds_check
+		&& ! cmd_set_test(cfg->record_cmds, pThdData->getCmdId()))
 	{
-		bool matched = false;
-		if (pThdData->startGetObjects())
-		{
-			const char *db_name = NULL;
-			const char *obj_name = NULL;
-			while(!matched && pThdData->getNextObject(&db_name, &obj_name, NULL))
-			{
-				matched = check_db_obj(db_name, obj_name);
-			}
-		}
-		else // no objects
+		return false;
+	}
+
+	if (cfg->record_objs != NULL && do_objs_cmds_check && ! check_record_objs(cfg->record_objs, pThdData))
+	{
+		return false;
+	}
+	return true;
+}
+
+static void do_delay(ThdSesData *pThdData)
+{
+	if (delay_ms_val > 0)
+	{
+		unsigned int token = filter_epoch.enter();
+		bool delay = cmd_set_test(filter_config->delay_cmds, pThdData->getCmdId());
+		filter_epoch.exit(token);
+		if (delay)
 		{
-			matched = record_empty_objs_set;
+			// Audit_file_handler::print_sleep(thd,delay_ms_val);
+			my_sleep(delay_ms_val *1000);
 		}
-		if (! matched)
+	}
+}
+
+/**
+ * Check the event against min_exec_time and min_rows. With both set the
+ * event is logged if it reaches either. Only statements which were timed
+ * (after they executed) are filtered.
+ * Return true if the event should be logged.
+ */
+static bool check_thresholds(ThdSesData *pThdData)
+{
+	if ((min_exec_time_val == 0 && min_rows_val == 0) || ! pThdData->hasExecTime())
+	{
+		return true;
+	}
+	if (min_exec_time_val > 0 && pThdData->getExecTime() >= min_exec_time_val)
+	{
+		return true;
+	}
+	return min_rows_val > 0 && Audit_formatter::thd_event_rows(pThdData) >= min_rows_val;
+}
+
+/**
+ * Log the event, or accumulate it if its command is aggregated. If the
+ * aggregator can't take it, it is logged. Aggregated events are counted
+ * whatever their time and rows.
+ */
+static void log_event(ThdSesData *pThdData, bool aggregate)
+{
+	if (! aggregate && ! check_thresholds(pThdData))
+	{
+		return;
+	}
+	if (aggregate)
+	{
+		THD *thd = pThdData->getTHD();
+		size_t qlen = 0;
+		const char *query = Audit_formatter::thd_query(thd, &qlen);
+		if (aggregator.add(pThdData->getUserName(), Audit_formatter::thd_db(thd),
+				pThdData->getCmdName(), query, qlen, Audit_formatter::thd_event_rows(pThdData),
+				pThdData->getExecTime(), pThdData->hasExecTime()))
 		{
 			return;
 		}
 	}
+	Audit_handler::log_audit_all(pThdData);
+}
+
+static void audit(ThdSesData *pThdData)
+{
+	// nothing to log to. don't resolve anything from the THD
+	if (! Audit_handler::is_any_enabled())
+	{
+		return;
+	}
+
+	Audit_session *session = pThdData->getSession();
+
+	// the whole event is checked against the configuration read here
+	unsigned int token = filter_epoch.enter();
+	const filter_config_t *cfg = filter_config;
+	if (! check_filters(cfg, pThdData))
+	{
+		filter_epoch.exit(token);
+		return;
+	}
+	pThdData->setPasswordMasking(cmd_set_test(cfg->password_masking_cmds, pThdData->getCmdId()));
+	bool aggregate = cfg->aggregate_cmds.num > 0 && cmd_set_test(cfg->aggregate_cmds, pThdData->getCmdId());
+	filter_epoch.exit(token);
 
-	if (before_after_mode != AUDIT_BOTH && pThdPrintedList && pThdPrintedList->cur_index < MAX_NUM_QUEUE_ELEM)
+	if (before_after_mode != AUDIT_BOTH && session && session->printed.depth() > 0)
 	{
 		// audit the event if we haven't done so yet or in the case of prepare_sql
 		// we audit as the test "test select" doesn't go through mysql_execute_command
-		if (pThdPrintedList->is_thd_printed_queue[pThdPrintedList->cur_index] == 0 || strcmp(pThdData->getCmdName(), "prepare_sql") == 0)
+		bool printed = session->printed.test_and_set();
+		if (! printed || strcmp(pThdData->getCmdName(), "prepare_sql") == 0)
 		{
-			Audit_handler::log_audit_all(pThdData);
-			pThdPrintedList->is_thd_printed_queue[pThdPrintedList->cur_index] = 1;
+			log_event(pThdData, aggregate);
 		}
 		else // duplicate no need to audit then simply return
 		{
@@ -554,7 +666,7 @@ static void audit(ThdSesData *pThdData)
 	}
 	else
 	{
-		Audit_handler::log_audit_all(pThdData);
+		log_event(pThdData, aggregate);
 	}
 }
 
@@ -576,11 +688,6 @@ static int (*trampoline_open_tables)(THD *thd, TABLE_LIST **start, uint *counter
 #endif
 
 
-QueryTableInf *Audit_formatter::getQueryCacheTableList1(THD *thd)
-{
-	return (QueryTableInf*)	THDVAR(thd, query_cache_table_list);
-}
-
 static bool (*trampoline_check_table_access)(THD *thd, ulong want_access,TABLE_LIST *tables,
 #if defined(MARIADB_BASE_VERSION) || MYSQL_VERSION_ID >= 50505
 						bool any_combination_of_privileges_will_do,
@@ -602,7 +709,8 @@ static bool audit_check_table_access(THD *thd, ulong want_access,TABLE_LIST *tab
 	if (!res &&  tables)
 	{
 		pTables = tables;
-		QueryTableInf * pQueryTableInf =(QueryTableInf*) THDVAR (thd,query_cache_table_list);
+		Audit_session *session = Audit_formatter::thd_session(thd);
+		QueryTableInf *pQueryTableInf = session ? session->query_cache_tables : NULL;
 		if (pQueryTableInf)
 		{
 			while (pTables)
@@ -635,12 +743,13 @@ static int  audit_send_result_to_client(Query_cache *pthis, THD *thd, const LEX_
 #endif
 {
 	int res;
-	void *pList = thd_alloc(thd, sizeof (QueryTableInf));
+	Audit_session *session = Audit_formatter::thd_session(thd);
+	QueryTableInf *pList = session ? (QueryTableInf *) thd_alloc(thd, sizeof (QueryTableInf)) : NULL;
 
 	if (pList)
 	{
 		memset(pList,0,sizeof (QueryTableInf));
-		THDVAR(thd, query_cache_table_list) =(ulong)pList;
+		session->query_cache_tables = pList;
 	}
 
 #if defined(MARIADB_BASE_VERSION) || MYSQL_VERSION_ID < 50709
@@ -653,7 +762,10 @@ static int  audit_send_result_to_client(Query_cache *pthis, THD *thd, const LEX_
 		ThdSesData thd_data(thd, ThdSesData::SOURCE_QUERY_CACHE);
 		audit(&thd_data);
 	}
-	THDVAR(thd, query_cache_table_list) = 0;
+	if (pList)
+	{
+		session->query_cache_tables = NULL;
+	}
 	return res;
 }
 
@@ -695,7 +807,7 @@ static void audit_post_execute(THD * thd)
 {
 	// only audit non query events
 	// query events are audited by mysql execute command
-	if (Audit_formatter::thd_inst_command(thd) != COM_QUERY)
+	if (Audit_handler::is_any_enabled() && Audit_formatter::thd_inst_command(thd) != COM_QUERY)
 	{
 		ThdSesData ThdData(thd);
 		if (strcasestr(ThdData.getCmdName(), "show_fields") == NULL)
@@ -763,7 +875,8 @@ static int audit_notify(THD *thd, mysql_event_class_t event_class,
 #ifdef ER_ACCOUNT_HAS_BEEN_LOCKED
 			case ER_ACCOUNT_HAS_BEEN_LOCKED:
 #endif
-				ThdData.setCmdName("Failed Login");
+				session_invalidate(thd);
+				ThdData.setCmdName("Failed Login", AUDIT_CMD_FAILED_LOGIN);
 				audit(&ThdData);
 				break;
 			default:
@@ -776,13 +889,17 @@ static int audit_notify(THD *thd, mysql_event_class_t event_class,
 		const struct mysql_event_connection *event_connection =
 			(const struct mysql_event_connection *) event;
 		// only audit for connect and change_user. disconnect is caught by general event
-		if (event_connection->event_subclass != MYSQL_AUDIT_CONNECTION_DISCONNECT
+		if (event_connection->event_subclass == MYSQL_AUDIT_CONNECTION_DISCONNECT)
+		{
+			session_free(thd);
+		}
+		else
 #if !defined(MARIADB_BASE_VERSION) && MYSQL_VERSION_ID >= 50709
-		    // in pre-authenticate, user info etc is empty. don't log it
-		    && event_connection->event_subclass != MYSQL_AUDIT_CONNECTION_PRE_AUTHENTICATE
+		// in pre-authenticate, user info etc is empty. don't log it
+		if (event_connection->event_subclass != MYSQL_AUDIT_CONNECTION_PRE_AUTHENTICATE)
 #endif
-		)
 		{
+			session_invalidate(thd);
 			ThdSesData ThdData(thd);
 			audit(&ThdData);
 		}
@@ -951,36 +1068,21 @@ int is_remove_patches(ThdSesData *pThdData)
  */
 static int audit_mysql_execute_command(THD *thd)
 {
-	bool firstTime = false;
-	THDPRINTED *pThdPrintedList = GetThdPrintedList(thd);
+	ThdSesData thd_data(thd);
+	Audit_session *session = thd_data.getSession();
 
-	if (pThdPrintedList)
+	// level of the statement. Nested ones are run by stored programs
+	if (session)
 	{
-		if (pThdPrintedList->cur_index < (MAX_NUM_QUEUE_ELEM - 1))
-		{
-			pThdPrintedList->cur_index++;
-			pThdPrintedList->is_thd_printed_queue[pThdPrintedList->cur_index] = 0;
-		}
-	}
-	else
-	{
-		firstTime = true;
-		pThdPrintedList = (THDPRINTED *) thd_alloc (thd, sizeof(THDPRINTED));
-		if (pThdPrintedList)
-		{
-			memset(pThdPrintedList, 0, sizeof(THDPRINTED));
-			// pThdPrintedList->cur_index = 0;
-			THDVAR(thd,is_thd_printed_list) = (ulong) pThdPrintedList;
-		}
+		session->printed.push();
 	}
 
-	ThdSesData thd_data(thd);
-	const char *cmd = thd_data.getCmdName();
-
 	do_delay(& thd_data);
 
-	if (before_after_mode == AUDIT_BEFORE || before_after_mode == AUDIT_BOTH)
+	if ((before_after_mode == AUDIT_BEFORE || before_after_mode == AUDIT_BOTH)
+		&& Audit_handler::is_any_enabled())
 	{
+		const char *cmd = thd_data.getCmdName();
 		if (strcasestr(cmd, "alter") != NULL ||
 		    strcasestr(cmd, "drop") != NULL ||
 		    strcasestr(cmd, "create") != NULL ||
@@ -1017,8 +1119,12 @@ static int audit_mysql_execute_command(THD *thd)
 			res = 1;
 			break;
 		default:
+		{
 			// everything else
+			unsigned long long start = audit_clock_us();
 			res = trampoline_mysql_execute_command(thd);
+			thd_data.setExecTime(audit_clock_us() - start);
+		}
 		}
 	}
 
@@ -1028,14 +1134,16 @@ static int audit_mysql_execute_command(THD *thd)
 		audit(&thd_data);
 	}
 
-	if (pThdPrintedList && pThdPrintedList->cur_index > 0)
+	if (session)
 	{
-		pThdPrintedList->cur_index--;
-	}
-
-	if (firstTime)
-	{
-		THDVAR(thd,is_thd_printed_list) = 0;
+		session->printed.pop();
+#ifndef HAVE_AUDIT_SESSION
+		// the session isn't freed on disconnect
+		if (session->printed.depth() == 0)
+		{
+			session->printed.release();
+		}
+#endif
 	}
 	return res;
 
@@ -1055,6 +1163,7 @@ static int audit_check_user(THD *thd, enum enum_server_command command,
 	       bool check_count)
 {
 	int res = trampoline_check_user(thd, command, passwd, passwd_len, db, check_count);
+	session_invalidate(thd);
 	ThdSesData ThdData(thd);
 
 	audit(&ThdData);
@@ -1067,6 +1176,7 @@ static int audit_check_user(THD *thd, enum enum_server_command command,
 static bool audit_acl_authenticate(THD *thd, uint connect_errors, uint com_change_user_pkt_len)
 {
 	bool res = trampoline_acl_authenticate(thd, connect_errors, com_change_user_pkt_len);
+	session_invalidate(thd);
 	ThdSesData ThdData(thd);
 
 	audit(&ThdData);
@@ -1080,15 +1190,10 @@ static void audit_end_connection(THD *thd)
 {
 #if MYSQL_VERSION_ID < 50600
 	ThdSesData thd_data(thd);
-	thd_data.setCmdName("Quit");
+	thd_data.setCmdName("Quit", AUDIT_CMD_SERVER_BASE + COM_QUIT);
 	audit(&thd_data);
 #endif
-	PeerInfo *peer = (PeerInfo *) THDVAR(thd, peer_info);
-	if (peer)
-	{
-		free(peer);
-		THDVAR(thd, peer_info) = 0;
-	}
+	session_free(thd);
 	trampoline_end_connection(thd);
 }
 #endif
@@ -1551,7 +1656,7 @@ static int setup_offsets()
 }
 
 
-const char *retrieve_command(THD *thd, bool &is_sql_cmd)
+const char *retrieve_command(THD *thd, bool &is_sql_cmd, int *cmd_id)
 {
 	const char *cmd = NULL;
 	is_sql_cmd = false;
@@ -1562,8 +1667,10 @@ const char *retrieve_command(THD *thd, bool &is_sql_cmd)
 	}
 
 	// check if from query cache. If so set to select and return
-	if (THDVAR(thd, query_cache_table_list) != 0)
+	Audit_session *session = Audit_formatter::thd_session(thd);
+	if (session && session->query_cache_tables != NULL)
 	{
+		*cmd_id = SQLCOM_SELECT;
 		return "select";
 	}
 
@@ -1579,11 +1686,13 @@ const char *retrieve_command(THD *thd, bool &is_sql_cmd)
 	{
 		is_sql_cmd = true;
 		cmd = com_status_vars_array[sql_command].name;
+		*cmd_id = sql_command;
 	}
 
 	if (! cmd)
 	{
 		cmd = command_name[command].str;
+		*cmd_id = AUDIT_CMD_SERVER_BASE + command;
 	}
 
 #if MYSQL_VERSION_ID < 50600
@@ -1594,6 +1703,7 @@ const char *retrieve_command(THD *thd, bool &is_sql_cmd)
 	    (priv_user == NULL || *priv_user == 0x0)))
 	{
 		cmd = "Failed Login";
+		*cmd_id = AUDIT_CMD_FAILED_LOGIN;
 	}
 #endif
 	return cmd;
@@ -1704,72 +1814,430 @@ static int string_to_array(const void *save, void *array, int rows, int length)
 		}
 		string_array[r * length + 0] = '\0';
 	}
-	return r;
+	return r;
+}
+
+__attribute__ ((noinline)) static void trampoline_dummy_func_for_mem()
+{
+	TRAMPOLINE_NOP_DEF
+}
+
+// holds memory used for trampoline
+static void *trampoline_mem = NULL;
+
+// pointer to current free mem
+static void *trampoline_mem_free = NULL;
+
+/**
+ * Utility method for hot patching
+ */
+static int do_hot_patch(void ** trampoline_func_pp, unsigned int * trampoline_size,
+	void* target_function, void* audit_function,  const char * func_name)
+{
+	// 16 byte align the pointer
+	DATATYPE_ADDRESS addrs = (DATATYPE_ADDRESS)trampoline_mem_free + 15;
+	*trampoline_func_pp = (void*)(addrs & ~0x0F);
+
+	// hot patch functions
+	unsigned int used_size;
+	int res = hot_patch_function(target_function, audit_function,
+			*trampoline_func_pp, trampoline_size, &used_size, true);
+	if (res != 0)
+	{
+		// hot patch failed.
+		sql_print_error("%s unable to hot patch %s (%p). res: %d.",
+				log_prefix, func_name, target_function, res);
+		return 1;
+	}
+	sql_print_information(
+			"%s hot patch for: %s (%p) complete. Audit func: %p, Trampoline address: %p, size: %u, used: %u.",
+			log_prefix, func_name, target_function, audit_function, *trampoline_func_pp, *trampoline_size, used_size);
+	trampoline_mem_free = (void *)(((DATATYPE_ADDRESS)*trampoline_func_pp) + used_size);
+	return 0;
+}
+
+#define DECLARE_STRING_ARR_UPDATE_FUNC(NAME) \
+static void NAME ## _string_update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)\
+{\
+	num_ ## NAME = string_to_array(save, NAME ## _array, array_elements( NAME ## _array), sizeof( NAME ## _array[0]));\
+	/* handle "set global audit_xxx = null;" */ \
+	char *const* save_p = static_cast<char*const*>(save);\
+	if (save_p != NULL && *save_p != NULL)\
+	{\
+		strncpy( NAME ##_buff , *static_cast<char*const*>(save), array_elements( NAME ## _buff) - 1);\
+	}\
+	else\
+	{\
+		NAME ## _buff[0] = '\0';\
+	}\
+	NAME ## _string = NAME ##_buff;\
+	sql_print_information("%s Set " #NAME " num: %d, value: %s", log_prefix, num_ ## NAME, NAME ## _string);\
+}
+
+// name of a command id. NULL if there is no such command
+static const char *cmd_id_name(int cmd_id)
+{
+	if (cmd_id < AUDIT_CMD_SERVER_BASE)
+	{
+		return com_status_vars_array[cmd_id].name;
+	}
+	if (cmd_id < AUDIT_CMD_FAILED_LOGIN)
+	{
+		return command_name[cmd_id - AUDIT_CMD_SERVER_BASE].str;
+	}
+	return "Failed Login";
+}
+
+/**
+ * Resolve a command list to the ids of the commands it matches.
+ * A command matches if its name starts with one of the list entries
+ * (case insensitive), same as check_array.
+ */
+static void cmd_array_to_set(const char *array, int length, int num, cmd_set_t *set)
+{
+	memset(set, 0, sizeof(cmd_set_t));
+	set->num = num;
+	for (int cmd_id = 0; cmd_id < AUDIT_CMD_COUNT; cmd_id++)
+	{
+		const char *cmds[2];
+		cmds[0] = cmd_id_name(cmd_id);
+		cmds[1] = NULL;
+		if (cmds[0] != NULL && check_array(cmds, array, length))
+		{
+			set->bits[cmd_id / 64] |= 1ULL << (cmd_id % 64);
+		}
+	}
+}
+
+/**
+ * Copy of the current filter configuration, to be modified and then
+ * published. NULL on out of memory.
+ * Sysvar updates are serialized by the server, so only a single thread
+ * at a time copies and publishes configurations.
+ */
+static filter_config_t *filter_config_copy()
+{
+	filter_config_t *cfg = (filter_config_t *) malloc(sizeof(filter_config_t));
+	if (cfg)
+	{
+		memcpy(cfg, filter_config, sizeof(filter_config_t));
+		if (cfg->record_objs)
+		{
+			cfg->record_objs->ref();
+		}
+		if (cfg->whitelist_users)
+		{
+			cfg->whitelist_users->ref();
+		}
+		if (cfg->rules)
+		{
+			cfg->rules->ref();
+		}
+	}
+	return cfg;
+}
+
+static void filter_config_free(filter_config_t *cfg)
+{
+	if (cfg != &default_filter_config)
+	{
+		Audit_obj_set::release(cfg->record_objs);
+		Audit_user_set::release(cfg->whitelist_users);
+		Audit_rules::release(cfg->rules);
+		free(cfg);
+	}
+}
+
+/**
+ * Make cfg the current filter configuration. The previous one is freed
+ * after a grace period in which all threads which may still read it are
+ * done. Only the updating thread waits, client threads never block.
+ */
+static void filter_config_publish(filter_config_t *cfg)
+{
+	filter_config_t *old = audit_atomic_swap(&filter_config, cfg);
+	filter_epoch.synchronize();
+	filter_config_free(old);
+}
+
+#define DECLARE_CMDS_UPDATE_FUNC(NAME) \
+DECLARE_STRING_ARR_UPDATE_FUNC(NAME) \
+static void NAME ## _update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)\
+{\
+	NAME ## _string_update(thd, var, tgt, save);\
+	filter_config_t *cfg = filter_config_copy();\
+	if (! cfg)\
+	{\
+		sql_print_error("%s Failed setting " #NAME ". Out of memory.", log_prefix);\
+		return;\
+	}\
+	cmd_array_to_set((const char *) NAME ## _array, sizeof( NAME ## _array[0]), num_ ## NAME, &cfg->NAME);\
+	filter_config_publish(cfg);\
+}
+
+DECLARE_CMDS_UPDATE_FUNC(delay_cmds)
+DECLARE_CMDS_UPDATE_FUNC(whitelist_cmds)
+DECLARE_CMDS_UPDATE_FUNC(record_cmds)
+DECLARE_CMDS_UPDATE_FUNC(password_masking_cmds)
+DECLARE_CMDS_UPDATE_FUNC(aggregate_cmds)
+/**
+ * Compile whitelist_users into a new set and publish it. The previous set
+ * is freed once no thread uses it. On failure the previous set is kept.
+ */
+static void whitelist_users_string_update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)
+{
+	/* handle "set global audit_xxx = null;" */
+	const char *val = *static_cast<const char *const *>(save);
+	char *copy = strdup(val ? val : "");
+	Audit_user_set *set = Audit_user_set::create();
+	filter_config_t *cfg = filter_config_copy();
+	if (! copy || ! set || ! cfg || ! set->add_list(copy, strlen(copy)))
+	{
+		sql_print_error("%s Failed setting whitelist_users. Keeping the previous value.", log_prefix);
+		free(copy);
+		Audit_user_set::release(set);
+		if (cfg)
+		{
+			filter_config_free(cfg);
+		}
+		return;
+	}
+	free(whitelist_users_buff);
+	whitelist_users_buff = copy;
+	whitelist_users_string = whitelist_users_buff;
+
+	// generations start at 1, so new sessions (0) don't match
+	set->set_generation(++whitelist_users_gen);
+	Audit_user_set::release(cfg->whitelist_users);
+	cfg->whitelist_users = set;
+	filter_config_publish(cfg);
+	sql_print_information("%s Set whitelist_users num: %lu, value: %s", log_prefix,
+			(unsigned long) set->count(), whitelist_users_string);
+}
+
+// read the file set in the var_name sysvar into buf. Return false on failure
+static bool load_file(const char *var_name, const char *file_name, Audit_buffer *buf)
+{
+	File fd;
+	if ((fd = my_open(file_name, O_RDONLY, MYF(MY_WME))) < 0)
+	{
+		sql_print_error("%s Failed %s open: [%s], errno: %d.",
+				log_prefix, var_name, file_name, errno);
+		return false;
+	}
+	const size_t buff_size = 16384;
+	char file_buff[buff_size];
+	ssize_t res;
+	do
+	{
+		res = read(fd, file_buff, buff_size);
+		if (res > 0)
+		{
+			buf->append(file_buff, res);
+		}
+	}
+	while (res > 0);
+	my_close(fd, MYF(0));
+	if (buf->is_error() || res < 0)
+	{
+		sql_print_error("%s Failed %s read: [%s], errno: %d.",
+				log_prefix, var_name, file_name, errno);
+		return false;
+	}
+	return true;
+}
+
+// add the entries of record_objs_file to set. Return false on failure
+static bool record_objs_load_file(Audit_obj_set *set, const char *file_name)
+{
+	Audit_buffer buf;
+	return load_file("record_objs_file", file_name, &buf)
+		&& set->add_list(buf.data(), buf.length());
+}
+
+/**
+ * Compile the objs list and the entries of the file file_name into a new
+ * set and publish it. The previous set is freed once no thread uses it.
+ * Return false on failure, keeping the previous set.
+ */
+static bool record_objs_compile(const char *objs, const char *file_name)
+{
+	Audit_obj_set *set = Audit_obj_set::create();
+	filter_config_t *cfg = filter_config_copy();
+	bool res = set != NULL && cfg != NULL;
+	if (res && objs)
+	{
+		res = set->add_list(objs, strlen(objs));
+	}
+	if (res && file_name && *file_name)
+	{
+		res = record_objs_load_file(set, file_name);
+	}
+	if (! res)
+	{
+		sql_print_error("%s Failed setting record_objs. Keeping the previous value.", log_prefix);
+		Audit_obj_set::release(set);
+		if (cfg)
+		{
+			filter_config_free(cfg);
+		}
+		return false;
+	}
+	Audit_obj_set::release(cfg->record_objs);
+	cfg->record_objs = set;
+	filter_config_publish(cfg);
+	sql_print_information("%s Set record_objs num: %lu, record_empty_objs: %d", log_prefix,
+			(unsigned long) set->count(), set->count() == 0 || set->match_empty());
+	return true;
+}
+
+static void record_objs_string_update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)
+{
+	/* handle "set global audit_xxx = null;" */
+	const char *val = *static_cast<const char *const *>(save);
+	char *copy = strdup(val ? val : "");
+	if (! copy)
+	{
+		sql_print_error("%s Failed setting record_objs. Out of memory.", log_prefix);
+		return;
+	}
+	if (! record_objs_compile(copy, record_objs_file_string))
+	{
+		free(copy);
+		// the previous values (none on startup)
+		record_objs_string = record_objs_buff;
+		record_objs_file_string = record_objs_file_buff;
+		return;
+	}
+	free(record_objs_buff);
+	record_objs_buff = copy;
+	record_objs_string = record_objs_buff;
 }
 
-__attribute__ ((noinline)) static void trampoline_dummy_func_for_mem()
+/**
+ * Setting the file (also to the same value) reloads it. On failure the
+ * previous objects and value are kept.
+ */
+static void record_objs_file_update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)
 {
-	TRAMPOLINE_NOP_DEF
+	const char *val = *static_cast<const char *const *>(save);
+	if (val && strlen(val) >= array_elements(record_objs_file_buff))
+	{
+		sql_print_error("%s Failed setting record_objs_file: path too long. Keeping the previous value.",
+				log_prefix);
+		return;
+	}
+	if (! record_objs_compile(record_objs_string, val))
+	{
+		record_objs_file_string = record_objs_file_buff;
+		return;
+	}
+	if (val != record_objs_file_buff)
+	{
+		strcpy(record_objs_file_buff, val ? val : "");
+	}
+	record_objs_file_string = record_objs_file_buff;
 }
 
-// holds memory used for trampoline
-static void *trampoline_mem = NULL;
-
-// pointer to current free mem
-static void *trampoline_mem_free = NULL;
-
 /**
- * Utility method for hot patching
+ * Compile the rules of rules_file and publish them. An empty value
+ * removes the rules. On failure the previous rules and value are kept.
+ * Setting the file (also to the same value) reloads it.
  */
-static int do_hot_patch(void ** trampoline_func_pp, unsigned int * trampoline_size,
-	void* target_function, void* audit_function,  const char * func_name)
+static void rules_file_update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)
 {
-	// 16 byte align the pointer
-	DATATYPE_ADDRESS addrs = (DATATYPE_ADDRESS)trampoline_mem_free + 15;
-	*trampoline_func_pp = (void*)(addrs & ~0x0F);
-
-	// hot patch functions
-	unsigned int used_size;
-	int res = hot_patch_function(target_function, audit_function,
-			*trampoline_func_pp, trampoline_size, &used_size, true);
-	if (res != 0)
+	const char *val = *static_cast<const char *const *>(save);
+	if (! val)
 	{
-		// hot patch failed.
-		sql_print_error("%s unable to hot patch %s (%p). res: %d.",
-				log_prefix, func_name, target_function, res);
-		return 1;
+		val = "";
 	}
-	sql_print_information(
-			"%s hot patch for: %s (%p) complete. Audit func: %p, Trampoline address: %p, size: %u, used: %u.",
-			log_prefix, func_name, target_function, audit_function, *trampoline_func_pp, *trampoline_size, used_size);
-	trampoline_mem_free = (void *)(((DATATYPE_ADDRESS)*trampoline_func_pp) + used_size);
-	return 0;
+	// the previous value (empty on startup)
+	rules_file_string = rules_file_buff;
+	if (strlen(val) >= array_elements(rules_file_buff))
+	{
+		sql_print_error("%s Failed setting rules_file: path too long. Keeping the previous rules.", log_prefix);
+		return;
+	}
+	Audit_rules *rules = NULL;
+	if (*val)
+	{
+		Audit_buffer buf;
+		char error[256];
+		if (! load_file("rules_file", val, &buf))
+		{
+			sql_print_error("%s Failed setting rules_file. Keeping the previous rules.", log_prefix);
+			return;
+		}
+		rules = Audit_rules::create(buf.data(), buf.length(), cmd_id_name, AUDIT_CMD_COUNT,
+				error, sizeof(error));
+		if (! rules)
+		{
+			sql_print_error("%s Failed setting rules_file: [%s]. Keeping the previous rules. Error: %s",
+					log_prefix, val, error);
+			return;
+		}
+	}
+	filter_config_t *cfg = filter_config_copy();
+	if (! cfg)
+	{
+		sql_print_error("%s Failed setting rules_file. Out of memory.", log_prefix);
+		Audit_rules::release(rules);
+		return;
+	}
+	Audit_rules::release(cfg->rules);
+	cfg->rules = rules;
+	filter_config_publish(cfg);
+	if (val != rules_file_buff)
+	{
+		strcpy(rules_file_buff, val);
+	}
+	sql_print_information("%s Set rules_file: [%s], rules: %lu", log_prefix,
+			rules_file_string, rules ? (unsigned long) rules->count() : 0UL);
 }
 
-#define DECLARE_STRING_ARR_UPDATE_FUNC(NAME) \
-static void NAME ## _string_update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)\
-{\
-	num_ ## NAME = string_to_array(save, NAME ## _array, array_elements( NAME ## _array), sizeof( NAME ## _array[0]));\
-	/* handle "set global audit_xxx = null;" */ \
-	char *const* save_p = static_cast<char*const*>(save);\
-	if (save_p != NULL && *save_p != NULL)\
-	{\
-		strncpy( NAME ##_buff , *static_cast<char*const*>(save), array_elements( NAME ## _buff) - 1);\
-	}\
-	else\
-	{\
-		NAME ## _buff[0] = '\0';\
-	}\
-	NAME ## _string = NAME ##_buff;\
-	sql_print_information("%s Set " #NAME " num: %d, value: %s", log_prefix, num_ ## NAME, NAME ## _string);\
+static void password_masking_prefilter_update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)
+{
+	/* handle "set global audit_xxx = null;" */
+	const char *val = *static_cast<const char *const *>(save);
+	if (! val)
+	{
+		val = "";
+	}
+	Audit_word_set *words = Audit_word_set::create();
+	if (! words || ! words->add_list(val, strlen(val)))
+	{
+		sql_print_error("%s Failed setting password_masking_prefilter. Keeping the previous value.", log_prefix);
+		Audit_word_set::destroy(words);
+		return;
+	}
+	size_t num = words->count();
+	if (num == 0)
+	{
+		// no words: always run the regex
+		Audit_word_set::destroy(words);
+		words = NULL;
+	}
+	if (val != password_masking_prefilter_buff)
+	{
+		strncpy(password_masking_prefilter_buff, val, array_elements(password_masking_prefilter_buff) - 1);
+	}
+	password_masking_prefilter_string = password_masking_prefilter_buff;
+	json_formatter.set_password_masking_prefilter(words);
+	sql_print_information("%s Set password_masking_prefilter num: %lu, value: %s", log_prefix,
+			(unsigned long) num, password_masking_prefilter_string);
 }
 
-DECLARE_STRING_ARR_UPDATE_FUNC(delay_cmds)
-DECLARE_STRING_ARR_UPDATE_FUNC(whitelist_cmds)
-DECLARE_STRING_ARR_UPDATE_FUNC(record_cmds)
-DECLARE_STRING_ARR_UPDATE_FUNC(password_masking_cmds)
-DECLARE_STRING_ARR_UPDATE_FUNC(whitelist_users)
-DECLARE_STRING_ARR_UPDATE_FUNC(record_objs)
+// the lexer method doesn't use the regex. warn if one was configured
+static void password_masking_method_check()
+{
+	if (json_formatter.m_password_masking_method == Audit_json_formatter::PASSWORD_MASKING_LEXER
+		&& password_masking_regex_string && password_masking_regex_string[0] != '\0'
+		&& strcmp(password_masking_regex_string, default_pw_masking_regex) != 0)
+	{
+		sql_print_warning("%s password_masking_method is lexer. The configured password_masking_regex is ignored.",
+				log_prefix);
+	}
+}
 
 static void password_masking_regex_string_update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)
 {
@@ -1782,6 +2250,18 @@ static void password_masking_regex_string_update(THD *thd, struct st_mysql_sys_v
 		str_val = *save_p;
 	}
 
+	// the default prefilter only fits the default regex. A custom regex may
+	// match queries without its words, so run it on all queries
+	if (*str_val && strcmp(str_val, default_pw_masking_regex) != 0
+		&& password_masking_prefilter_string
+		&& strcmp(password_masking_prefilter_string, default_pw_masking_prefilter) == 0)
+	{
+		sql_print_information("%s password_masking_regex isn't the default. Resetting password_masking_prefilter.",
+				log_prefix);
+		const char *empty = "";
+		password_masking_prefilter_update(thd, NULL, NULL, &empty);
+	}
+
 	// if a string value supplied, check that it compiles
 	if (*str_val)
 	{
@@ -1815,6 +2295,14 @@ static void password_masking_regex_string_update(THD *thd, struct st_mysql_sys_v
 	}
 
 	sql_print_information("%s Set password_masking_regex  value: [%s]", log_prefix, str_val);
+	password_masking_method_check();
+}
+
+static void peer_cache_ttl_update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)
+{
+	peer_cache_ttl = *static_cast<const unsigned int *>(save);
+	peer_resolver.m_uid_cache.m_ttl = peer_resolver.m_pid_cache.m_ttl = peer_cache_ttl;
+	sql_print_information("%s Set peer_cache_ttl value: [%u]", log_prefix, peer_cache_ttl);
 }
 
 static void replace_char(char *str, const char tofind, const char rplc)
@@ -1919,22 +2407,6 @@ static int password_masking_regex_check(THD *thd, struct st_mysql_sys_var *var,
 	return res;
 }
 
-// extended method to set also record_empty_objs_set
-static void record_objs_string_update_extended(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)
-{
-	record_objs_string_update(thd, var, tgt, save);
-	if (num_record_objs > 0) // check if to record also the empty set of objects
-	{
-		const char *objects[] = {"{}", NULL};
-		record_empty_objs_set = check_array(objects, (const char *) record_objs_array, sizeof(record_objs_array[0]));
-	}
-	else
-	{
-			record_empty_objs_set = true;
-	}
-	sql_print_information("%s Set record_empty_objs: %d", log_prefix, record_empty_objs_set);
-}
-
 /*
  * Initialize the plugin installation.
  *
@@ -1994,43 +2466,67 @@ static int audit_plugin_init(void *p)
 				log_prefix);
 	}
 
+	// command names are needed for resolving the command lists
+	if (set_com_status_vars_array () != 0)
+	{
+		DBUG_RETURN(1);
+	}
+
 	if (delay_cmds_string != NULL)
 	{
-		delay_cmds_string_update(NULL, NULL, NULL, &delay_cmds_string);
+		delay_cmds_update(NULL, NULL, NULL, &delay_cmds_string);
 	}
 	if (whitelist_cmds_string != NULL)
 	{
-		whitelist_cmds_string_update(NULL, NULL, NULL, &whitelist_cmds_string);
+		whitelist_cmds_update(NULL, NULL, NULL, &whitelist_cmds_string);
 	}
 	if (record_cmds_string != NULL)
 	{
-		record_cmds_string_update(NULL, NULL, NULL, &record_cmds_string);
+		record_cmds_update(NULL, NULL, NULL, &record_cmds_string);
 	}
 	if (whitelist_users_string != NULL)
 	{
 		whitelist_users_string_update(NULL, NULL, NULL, &whitelist_users_string);
 	}
-	if (record_objs_string != NULL)
+	if (record_objs_string != NULL || record_objs_file_string != NULL)
+	{
+		record_objs_string_update(NULL, NULL, NULL, &record_objs_string);
+	}
+	if (rules_file_string != NULL && *rules_file_string)
 	{
-		record_objs_string_update_extended(NULL, NULL, NULL, &record_objs_string);
+		rules_file_update(NULL, NULL, NULL, &rules_file_string);
 	}
 	if (password_masking_cmds_string != NULL)
 	{
-		password_masking_cmds_string_update(NULL, NULL, NULL, &password_masking_cmds_string);
+		password_masking_cmds_update(NULL, NULL, NULL, &password_masking_cmds_string);
+	}
+	if (aggregate_cmds_string != NULL)
+	{
+		aggregate_cmds_update(NULL, NULL, NULL, &aggregate_cmds_string);
 	}
 	if (password_masking_regex_string != NULL)
 	{
 		password_masking_regex_string_update(NULL, NULL, NULL, &password_masking_regex_string);
 	}
+	if (password_masking_prefilter_string != NULL)
+	{
+		password_masking_prefilter_update(NULL, NULL, NULL, &password_masking_prefilter_string);
+	}
 
 	// update to generate the default if needed
 	json_socket_name_update(NULL, NULL, NULL, &(json_socket_handler.m_io_dest));
 
-	// set the password masking callback for json formatters
-	json_formatter.m_perform_password_masking = check_do_password_masking;
+	int res = Audit_json_formatter::thread_buffers_init();
+	if (res != 0)
+	{
+		sql_print_error(
+				"%s unable to init formatting buffers. res: %d. Aborting.",
+				log_prefix, res);
+		DBUG_RETURN(1);
+	}
 
 	// setup audit handlers (initially disabled)
-	int res = json_file_handler.init(&json_formatter);
+	res = json_file_handler.init(record_formatter(json_file_format));
 	if (res != 0)
 	{
 		sql_print_error(
@@ -2039,7 +2535,7 @@ static int audit_plugin_init(void *p)
 		DBUG_RETURN(1);
 	}
 
-	res = json_socket_handler.init(&json_formatter);
+	res = json_socket_handler.init(record_formatter(json_socket_format));
 	if (res != 0)
 	{
 		sql_print_error(
@@ -2048,6 +2544,34 @@ static int audit_plugin_init(void *p)
 		DBUG_RETURN(1);
 	}
 
+	res = aggregator.init();
+	if (res != 0)
+	{
+		sql_print_error(
+				"%s unable to start aggregate flush thread. res: %d. aggregate_cmds will be logged as usual.",
+				log_prefix, res);
+	}
+
+	peer_resolver.m_uid_cache.m_max_entries = peer_resolver.m_pid_cache.m_max_entries = peer_cache_size;
+	peer_resolver.m_uid_cache.m_ttl = peer_resolver.m_pid_cache.m_ttl = peer_cache_ttl;
+#ifdef HAVE_AUDIT_SESSION
+	// max_connections + 1 connections are allowed (the last one for SUPER)
+	if (session_pool.init(max_connections + 1 + SESSION_POOL_EXTRA) != 0)
+	{
+		sql_print_error(
+				"%s unable to allocate session pool of %lu sessions. Sessions will be allocated on connect.",
+				log_prefix, (unsigned long) max_connections + 1 + SESSION_POOL_EXTRA);
+	}
+#endif
+
+	res = peer_resolver.init();
+	if (res != 0)
+	{
+		sql_print_error(
+				"%s unable to init peer name resolver. res: %d. Names may be looked up in the connection thread.",
+				log_prefix, res);
+	}
+
 	// enable according to what we have in *file_handler_enable
 	// (this is set accordingly by sysvar functionality)
 	json_file_handler.set_enable(json_file_handler_enable);
@@ -2196,11 +2720,6 @@ static int audit_plugin_init(void *p)
 	}
 #endif
 
-	if (set_com_status_vars_array () != 0)
-	{
-		DBUG_RETURN(1);
-	}
-
 
 	sql_print_information("%s Init completed successfully.", log_prefix);
 	DBUG_RETURN(0);
@@ -2223,6 +2742,22 @@ static int audit_plugin_deinit(void *p)
 	DBUG_ENTER("audit_plugin_deinit");
 	sql_print_information("%s deinit", log_prefix);
 	remove_hot_functions();
+	// log the last summaries while the handlers are still running
+	aggregator.deinit();
+	// stop handlers so async writer threads don't outlive the plugin
+	Audit_handler::stop_all();
+	Audit_json_formatter::thread_buffers_deinit();
+	filter_config_publish(&default_filter_config);
+	free(record_objs_buff);
+	record_objs_buff = NULL;
+	record_objs_string = NULL;
+	free(whitelist_users_buff);
+	whitelist_users_buff = NULL;
+	whitelist_users_string = NULL;
+	peer_resolver.deinit();
+#ifdef HAVE_AUDIT_SESSION
+	session_pool.deinit();
+#endif
 	DBUG_RETURN(0);
 }
 
@@ -2246,6 +2781,29 @@ static struct st_mysql_show_var audit_status[] =
 	, SHOW_SCOPE_GLOBAL
 #endif
 	},
+#ifdef HAVE_AUDIT_SESSION
+{ "Audit_session_pool_size",
+		(char *) &session_pool.m_size,
+		SHOW_LONG
+#if ! defined(MARIADB_BASE_VERSION) && MYSQL_VERSION_ID >= 50709
+	, SHOW_SCOPE_GLOBAL
+#endif
+	},
+{ "Audit_session_pool_used",
+		(char *) &session_pool.m_used,
+		SHOW_LONG
+#if ! defined(MARIADB_BASE_VERSION) && MYSQL_VERSION_ID >= 50709
+	, SHOW_SCOPE_GLOBAL
+#endif
+	},
+{ "Audit_session_pool_high_water",
+		(char *) &session_pool.m_high_water,
+		SHOW_LONG
+#if ! defined(MARIADB_BASE_VERSION) && MYSQL_VERSION_ID >= 50709
+	, SHOW_SCOPE_GLOBAL
+#endif
+	},
+#endif
 // {"called",     (char *)&number_of_calls, SHOW_LONG},
         { 0, 0, (enum_mysql_show_type) 0 } };
 
@@ -2261,6 +2819,35 @@ static void json_log_file_enable(THD *thd, struct st_mysql_sys_var *var,
 	}
 }
 
+static void json_log_file_format_update(THD *thd, struct st_mysql_sys_var *var,
+		void *tgt, const void *save)
+{
+	ulong format = *(ulong *) save;
+	if (format != json_file_format && json_file_handler.is_init()
+		&& json_file_handler.is_enabled())
+	{
+		// the file is reopened in append mode. don't mix formats in one file
+		sql_print_error("%s json_file_format can't be changed while json_file is enabled. Disable json_file and set json_file_name to a new file first.",
+				log_prefix);
+		return;
+	}
+	json_file_format = format;
+	if (json_file_handler.is_init())
+	{
+		json_file_handler.set_formatter(record_formatter(json_file_format));
+	}
+}
+
+static void json_log_socket_format_update(THD *thd, struct st_mysql_sys_var *var,
+		void *tgt, const void *save)
+{
+	json_socket_format = *(ulong *) save;
+	if (json_socket_handler.is_init())
+	{
+		json_socket_handler.set_formatter(record_formatter(json_socket_format));
+	}
+}
+
 static void json_log_file_flush(THD *thd, struct st_mysql_sys_var *var,
 		void *tgt, const void *save)
 {
@@ -2283,26 +2870,51 @@ static void json_log_socket_enable(THD *thd, struct st_mysql_sys_var *var,
 	}
 }
 
+// update of a json formatter option which is part of the per session cached prefix
+static void json_formatter_session_option_update(THD *thd,
+		struct st_mysql_sys_var *var, void *tgt, const void *save)
+{
+	*(my_bool *) tgt = *(my_bool *) save;
+	json_formatter.invalidate_sessions();
+}
+
 // setup sysvars which update directly the relevant plugins
 
 static MYSQL_SYSVAR_BOOL(socket_creds, json_formatter.m_write_socket_creds,
              PLUGIN_VAR_RQCMDARG,
-        "AUDIT log socket credentials from Unix Domain Socket. Enable|Disable. Default enabled.", NULL, NULL, 1);
+        "AUDIT log socket credentials from Unix Domain Socket. Enable|Disable. Default enabled.", NULL, json_formatter_session_option_update, 1);
+
+static MYSQL_SYSVAR_BOOL(digest, json_formatter.m_write_digest,
+             PLUGIN_VAR_RQCMDARG,
+        "AUDIT log a digest of the query: a hash of the query with literals replaced, the same for queries of the same shape. Enable|Disable. Default disabled.", NULL, NULL, 0);
+
+static MYSQL_SYSVAR_BOOL(normalized_query, json_formatter.m_write_normalized_query,
+             PLUGIN_VAR_RQCMDARG,
+        "AUDIT log the normalized query: lower cased, literals replaced with ? and without comments. Enable|Disable. Default disabled.", NULL, NULL, 0);
 
 static MYSQL_SYSVAR_BOOL(client_capabilities, json_formatter.m_write_client_capabilities,
              PLUGIN_VAR_RQCMDARG,
-        "AUDIT log client capabilities. Enable|Disable. Default disabled.", NULL, NULL, 0);
+        "AUDIT log client capabilities. Enable|Disable. Default disabled.", NULL, json_formatter_session_option_update, 0);
   
 #ifdef HAVE_SESS_CONNECT_ATTRS
 static MYSQL_SYSVAR_BOOL(sess_connect_attrs, json_formatter.m_write_sess_connect_attrs,
              PLUGIN_VAR_RQCMDARG,
-        "AUDIT log session connect attributes (see: performance_schema.session_connect_attrs table). Enable|Disable. Default enabled.", NULL, NULL, 1);
+        "AUDIT log session connect attributes (see: performance_schema.session_connect_attrs table). Enable|Disable. Default enabled.", NULL, json_formatter_session_option_update, 1);
 #endif
 		
 static MYSQL_SYSVAR_BOOL(header_msg, json_formatter.m_write_start_msg,
              PLUGIN_VAR_RQCMDARG,
         "AUDIT write header message at start of logging or file flush Enable|Disable. Default enabled.", NULL, NULL, 1);
 
+static MYSQL_SYSVAR_ULONG(buffer_high_water, json_formatter.m_buffer_high_water,
+             PLUGIN_VAR_RQCMDARG,
+        "AUDIT formatting buffer high water mark in bytes. Each thread keeps its formatting buffer for the next event. A buffer which grew larger than this size is freed after use. 0 = always keep. Default 1MB.",
+        NULL, NULL, Audit_json_formatter::DEF_BUFFER_HIGH_WATER, 0, ULONG_MAX, 0);
+
+static MYSQL_SYSVAR_BOOL(validate_utf8, json_formatter.m_validate_utf8,
+             PLUGIN_VAR_RQCMDARG,
+        "AUDIT replace malformed UTF-8 in logged values (such as the query) with U+FFFD so the json is always valid UTF-8. Enable|Disable. Default disabled.", NULL, json_formatter_session_option_update, 0);
+
 static MYSQL_SYSVAR_BOOL(force_record_logins, force_record_logins_enable,
              PLUGIN_VAR_RQCMDARG,
         "AUDIT force record Connect, Quit and Failed Login commands, regardless of the settings in audit_record_cmds and audit_record_objs  Enable|Disable. Default disabled.", NULL, NULL, 0);
@@ -2322,6 +2934,16 @@ static MYSQL_SYSVAR_UINT(json_file_sync, json_file_handler.m_sync_period,
         "AUDIT plugin json log file sync period. If the value of this variable is greater than 0, audit log will sync to disk after every audit_json_file_sync writes.",
         NULL, NULL, 0, 0, UINT_MAX32, 0);
 
+static MYSQL_SYSVAR_BOOL(json_file_sync_group_commit, json_file_handler.m_group_commit,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin json log file group commit of syncs. If enabled and audit_json_file_sync is 1, concurrent writes wait for a single sync covering all of them instead of each write doing its own sync under the io lock. Not used with audit_json_file_async.",
+        NULL, NULL, 0);
+
+static MYSQL_SYSVAR_ULONG(json_file_sync_delay, json_file_handler.m_sync_delay,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin json log file group commit max delay in microseconds. The thread doing the sync waits this long for additional writes to be included in the sync. Default 0.",
+        NULL, NULL, 0, 0, 1000000, 0);
+
 static MYSQL_SYSVAR_UINT(json_file_retry, json_file_handler.m_retry_interval,
         PLUGIN_VAR_RQCMDARG,
         "AUDIT plugin json log file retry interval. If the plugin fails to open/write to the json log file, will retry to open every specified interval in seconds. Set for 0 to disable retrying. Default 60 seconds.",
@@ -2352,6 +2974,76 @@ static MYSQL_SYSVAR_ULONG(json_socket_write_timeout, json_socket_handler.m_write
         NULL, NULL, DEFAULT_WRITE_TIMEOUT,
         0, UINT_MAX32, 0);
 
+static const char *async_overflow_names[] =
+{
+	"block", "drop_newest", "drop_oldest", NullS
+};
+
+TYPELIB async_overflow_typelib =
+{
+	array_elements(async_overflow_names) - 1,
+	"async_overflow_typelib",
+	async_overflow_names,
+	NULL
+};
+
+static MYSQL_SYSVAR_BOOL(json_file_async, json_file_handler.m_async,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin json log file asynchronous writes. If enabled, records are queued and written by a background thread. If changed during runtime need to perform a flush for the new value to take affect.",
+        NULL, NULL, 0);
+
+static MYSQL_SYSVAR_UINT(json_file_async_queue_size, json_file_handler.m_async_queue_size,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin json log file max number of queued records when using asynchronous writes. If changed during runtime need to perform a flush for the new value to take affect.",
+        NULL, NULL, Audit_io_handler::DEF_ASYNC_QUEUE_SIZE, 16, 1024 * 1024, 0);
+
+static MYSQL_SYSVAR_ENUM(json_file_async_overflow, json_file_handler.m_async_overflow,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin json log file action when the asynchronous queue is full: block, drop_newest or drop_oldest. Dropped records are reported with an events-lost record. Default is 'block'",
+        NULL, NULL, Audit_io_handler::ASYNC_OVERFLOW_BLOCK,
+        & async_overflow_typelib);
+
+static MYSQL_SYSVAR_BOOL(json_socket_async, json_socket_handler.m_async,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin json socket asynchronous writes. If enabled, records are queued and written by a background thread. If changed during runtime need to disable and enable the socket for the new value to take affect.",
+        NULL, NULL, 0);
+
+static MYSQL_SYSVAR_UINT(json_socket_async_queue_size, json_socket_handler.m_async_queue_size,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin json socket max number of queued records when using asynchronous writes. If changed during runtime need to disable and enable the socket for the new value to take affect.",
+        NULL, NULL, Audit_io_handler::DEF_ASYNC_QUEUE_SIZE, 16, 1024 * 1024, 0);
+
+static MYSQL_SYSVAR_ENUM(json_socket_async_overflow, json_socket_handler.m_async_overflow,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin json socket action when the asynchronous queue is full: block, drop_newest or drop_oldest. Dropped records are reported with an events-lost record. Default is 'block'",
+        NULL, NULL, Audit_io_handler::ASYNC_OVERFLOW_BLOCK,
+        & async_overflow_typelib);
+
+static const char *record_format_names[] =
+{
+	"json", "binary", NullS
+};
+
+TYPELIB record_format_typelib =
+{
+	array_elements(record_format_names) - 1,
+	"record_format_typelib",
+	record_format_names,
+	NULL
+};
+
+static MYSQL_SYSVAR_ENUM(json_file_format, json_file_format,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin json log file record format: json or binary (decode with audit_decode). Can only be changed while json_file is disabled, so use a new file name for the new format. Default is 'json'",
+        NULL, json_log_file_format_update, RECORD_FORMAT_JSON,
+        & record_format_typelib);
+
+static MYSQL_SYSVAR_ENUM(json_socket_format, json_socket_format,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin json socket record format: json or binary (decode with audit_decode). Changing the format reconnects the socket. Default is 'json'",
+        NULL, json_log_socket_format_update, RECORD_FORMAT_JSON,
+        & record_format_typelib);
+
 static MYSQL_SYSVAR_STR(offsets, offsets_string,
         PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY  | PLUGIN_VAR_MEMALLOC,
         "AUDIT plugin offsets. Comma separated list of offsets to use for extracting data",
@@ -2369,6 +3061,38 @@ static MYSQL_SYSVAR_STR(password_masking_regex, password_masking_regex_string,
 			default_pw_masking_regex
 			);
 
+static const char *password_masking_method_names[] =
+{
+	"lexer", "regex", NullS
+};
+
+TYPELIB password_masking_method_typelib =
+{
+	array_elements(password_masking_method_names) - 1,
+	"password_masking_method_typelib",
+	password_masking_method_names,
+	NULL
+};
+
+static void password_masking_method_update(THD *thd, struct st_mysql_sys_var *var, void *tgt, const void *save)
+{
+	json_formatter.m_password_masking_method = *(ulong *) save;
+	sql_print_information("%s Set password_masking_method value: [%s]", log_prefix,
+			password_masking_method_names[json_formatter.m_password_masking_method]);
+	password_masking_method_check();
+}
+
+static MYSQL_SYSVAR_ENUM(password_masking_method, json_formatter.m_password_masking_method,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin password masking method: lexer masks all the secrets of the query (IDENTIFIED BY, PASSWORD, encryption function keys) and ignores password_masking_regex. regex masks the first match of password_masking_regex. Default is 'regex'",
+        NULL, password_masking_method_update, Audit_json_formatter::PASSWORD_MASKING_REGEX,
+        & password_masking_method_typelib);
+
+static MYSQL_SYSVAR_STR(password_masking_prefilter, password_masking_prefilter_string,
+			PLUGIN_VAR_RQCMDARG,
+			"AUDIT plugin comma separated words. The password masking regex only runs on queries containing one of the words (case insensitive). Should list words the regex requires. Empty runs the regex on all queries. The default lists the words of the default regex and is reset to empty when password_masking_regex is set to another regex.",
+			NULL, password_masking_prefilter_update, default_pw_masking_prefilter);
+
 static MYSQL_SYSVAR_BOOL(uninstall_plugin, uninstall_plugin_enable,
         PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY ,
         "AUDIT uninstall plugin Enable|Disable. Default disabled. If disabled attempts to uninstall the AUDIT plugin via the sql UNINSTALL command will fail.", NULL, NULL, 0);
@@ -2391,6 +3115,16 @@ static MYSQL_SYSVAR_BOOL(json_socket, json_socket_handler_enable,
 			 PLUGIN_VAR_RQCMDARG,
         "AUDIT plugin json log unix socket Enable|Disable", NULL, json_log_socket_enable, 0);
 
+static MYSQL_SYSVAR_ULONG(min_exec_time, min_exec_time_val,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin min execution time in microseconds of recorded statements. Faster statements are recorded only if they reach audit_min_rows. Events which aren't statements (connect, quit, ...) are always recorded. 0 = disabled.",
+        NULL, NULL, 0, 0, ULONG_MAX, 0);
+
+static MYSQL_SYSVAR_ULONG(min_rows, min_rows_val,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin min number of rows of recorded statements. Statements with less rows are recorded only if they reach audit_min_exec_time. Events which aren't statements (connect, quit, ...) are always recorded. 0 = disabled.",
+        NULL, NULL, 0, 0, ULONG_MAX, 0);
+
 static MYSQL_SYSVAR_INT(delay_ms, delay_ms_val,
         PLUGIN_VAR_RQCMDARG,
         "AUDIT plugin delay in miliseconds. Delay amount injection. If 0 or negative then delay is disabled.",
@@ -2399,30 +3133,68 @@ static MYSQL_SYSVAR_INT(delay_ms, delay_ms_val,
 static MYSQL_SYSVAR_STR(delay_cmds, delay_cmds_string,
         PLUGIN_VAR_RQCMDARG,
         "AUDIT plugin delay commands to match against comma separated. If empty then delay is disabled.",
-			NULL, delay_cmds_string_update, NULL);
+			NULL, delay_cmds_update, NULL);
 static MYSQL_SYSVAR_STR(whitelist_cmds, whitelist_cmds_string,
 			PLUGIN_VAR_RQCMDARG,
 			"AUDIT plugin whitelisted commands for which queries are not recorded, comma separated",
-			NULL, whitelist_cmds_string_update, "BEGIN,COMMIT,PING");
+			NULL, whitelist_cmds_update, "BEGIN,COMMIT,PING");
 static MYSQL_SYSVAR_STR(record_cmds, record_cmds_string,
 			PLUGIN_VAR_RQCMDARG,
 			"AUDIT plugin commands for which queries are recorded, comma separated. If set then only queries of these commands will be recorded.",
-			NULL, record_cmds_string_update, NULL);
+			NULL, record_cmds_update, NULL);
 static MYSQL_SYSVAR_STR(password_masking_cmds, password_masking_cmds_string,
 			PLUGIN_VAR_RQCMDARG,
 			"AUDIT plugin commands to apply password masking regex to, comma separated",
-			NULL, password_masking_cmds_string_update,
+			NULL, password_masking_cmds_update,
 			// set password is recorded as set_option
 			"CREATE_USER,GRANT,SET_OPTION,SLAVE_START,CREATE_SERVER,ALTER_SERVER,CHANGE_MASTER,UPDATE");
+static MYSQL_SYSVAR_STR(aggregate_cmds, aggregate_cmds_string,
+			PLUGIN_VAR_RQCMDARG,
+			"AUDIT plugin commands which are aggregated instead of recorded, comma separated. Their events are counted per user, db, query digest and command, and a summary record per key is logged every audit_aggregate_interval seconds. If empty aggregation is disabled.",
+			NULL, aggregate_cmds_update, NULL);
+static MYSQL_SYSVAR_UINT(aggregate_interval, aggregator.m_interval,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin seconds between summary records of aggregated commands. Takes effect from the next interval.",
+        NULL, NULL, Audit_aggregator::DEF_INTERVAL, 1, 86400, 0);
+static MYSQL_SYSVAR_UINT(aggregate_max_entries, aggregator.m_max_entries,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin max number of keys aggregated in an interval. Events of further keys are recorded as usual. Each key takes about 4KB.",
+        NULL, NULL, Audit_aggregator::DEF_MAX_ENTRIES, 0, 1024 * 1024, 0);
+static MYSQL_SYSVAR_UINT(peer_cache_size, peer_cache_size,
+        PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+        "AUDIT plugin number of Unix domain socket peer OS user names and program names cached (each). 0 disables the caches.",
+        NULL, NULL, Audit_peer_cache::DEF_MAX_ENTRIES, 0, 1024 * 1024, 0);
+static MYSQL_SYSVAR_UINT(peer_cache_ttl, peer_cache_ttl,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin seconds a cached peer OS user name or program name is used before it is looked up again. Also applies to uids without a name.",
+        NULL, peer_cache_ttl_update, Audit_peer_cache::DEF_TTL, 0, 86400, 0);
+static MYSQL_SYSVAR_UINT(peer_resolver_threads, peer_resolver.m_threads,
+        PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+        "AUDIT plugin number of threads which look up Unix domain socket peer OS user names and program names. With 0 they are looked up in the connection thread.",
+        NULL, NULL, Audit_peer_resolver::DEF_THREADS, 0, 16, 0);
+static MYSQL_SYSVAR_UINT(peer_resolve_timeout, peer_resolver.m_timeout,
+        PLUGIN_VAR_RQCMDARG,
+        "AUDIT plugin milliseconds the first event of a Unix domain socket connection waits for the peer names. If they aren't resolved by then, events have the uid and pid till they are.",
+        NULL, NULL, Audit_peer_resolver::DEF_TIMEOUT, 0, 10000, 0);
 static MYSQL_SYSVAR_STR(whitelist_users, whitelist_users_string,
 			PLUGIN_VAR_RQCMDARG,
-			"AUDIT plugin whitelisted users whose queries are not recorded, comma separated",
+			"AUDIT plugin whitelisted users whose queries are not recorded, comma separated. Entries are: user, user@host (host may use the % and _ wildcards) or {} for the empty user.",
 			NULL, whitelist_users_string_update, NULL);
 
 static MYSQL_SYSVAR_STR(record_objs, record_objs_string,
 			PLUGIN_VAR_RQCMDARG,
-			"AUDIT plugin objects to record, comma separated. If set then only queries containing these objects will be recorded.",
-			NULL, record_objs_string_update_extended, NULL);
+			"AUDIT plugin objects to record, comma separated. If set then only queries containing these objects will be recorded. Entries are: db.name, *.name, db.* (also just db) or {} for queries without objects.",
+			NULL, record_objs_string_update, NULL);
+
+static MYSQL_SYSVAR_STR(record_objs_file, record_objs_file_string,
+			PLUGIN_VAR_RQCMDARG,
+			"AUDIT plugin file with additional objects to record, one per line or comma separated (# starts a comment). Same format as audit_record_objs. Set again to reload the file.",
+			NULL, record_objs_file_update, NULL);
+
+static MYSQL_SYSVAR_STR(rules_file, rules_file_string,
+			PLUGIN_VAR_RQCMDARG,
+			"AUDIT plugin JSON file with filter rules. When set, the rules decide which events to record instead of audit_record_cmds and audit_record_objs. Set again to reload the file.",
+			NULL, rules_file_update, NULL);
 
 static const char *before_after_names[] =
 {
@@ -2453,12 +3225,18 @@ static struct st_mysql_sys_var* audit_system_variables[] =
 	MYSQL_SYSVAR(sess_connect_attrs),
 #endif	
 	MYSQL_SYSVAR(socket_creds),
+	MYSQL_SYSVAR(digest),
+	MYSQL_SYSVAR(normalized_query),
 	MYSQL_SYSVAR(client_capabilities),
 	MYSQL_SYSVAR(header_msg),
+	MYSQL_SYSVAR(buffer_high_water),
+	MYSQL_SYSVAR(validate_utf8),
 	MYSQL_SYSVAR(force_record_logins),
 	MYSQL_SYSVAR(json_log_file),
 	MYSQL_SYSVAR(json_file_bufsize),
 	MYSQL_SYSVAR(json_file_sync),
+	MYSQL_SYSVAR(json_file_sync_group_commit),
+	MYSQL_SYSVAR(json_file_sync_delay),
 	MYSQL_SYSVAR(json_file_retry),
 	MYSQL_SYSVAR(json_socket_retry),
 	MYSQL_SYSVAR(json_file),
@@ -2470,22 +3248,39 @@ static struct st_mysql_sys_var* audit_system_variables[] =
 	MYSQL_SYSVAR(json_socket_name),
 	MYSQL_SYSVAR(offsets),
 	MYSQL_SYSVAR(json_socket),
-	MYSQL_SYSVAR(query_cache_table_list),
-	MYSQL_SYSVAR(is_thd_printed_list),
 	MYSQL_SYSVAR(delay_ms),
 	MYSQL_SYSVAR(delay_cmds),
 	MYSQL_SYSVAR(whitelist_cmds),
 	MYSQL_SYSVAR(record_cmds),
+	MYSQL_SYSVAR(aggregate_cmds),
+	MYSQL_SYSVAR(aggregate_interval),
+	MYSQL_SYSVAR(aggregate_max_entries),
+	MYSQL_SYSVAR(min_exec_time),
+	MYSQL_SYSVAR(min_rows),
+	MYSQL_SYSVAR(peer_cache_size),
+	MYSQL_SYSVAR(peer_cache_ttl),
+	MYSQL_SYSVAR(peer_resolver_threads),
+	MYSQL_SYSVAR(peer_resolve_timeout),
 	MYSQL_SYSVAR(password_masking_cmds),
 	MYSQL_SYSVAR(whitelist_users),
 	MYSQL_SYSVAR(record_objs),
+	MYSQL_SYSVAR(record_objs_file),
+	MYSQL_SYSVAR(rules_file),
 	MYSQL_SYSVAR(checksum),
 	MYSQL_SYSVAR(password_masking_regex),
-	MYSQL_SYSVAR(set_peer_cred),
-	MYSQL_SYSVAR(peer_is_uds),
-	MYSQL_SYSVAR(peer_info),
+	MYSQL_SYSVAR(password_masking_method),
+	MYSQL_SYSVAR(password_masking_prefilter),
+	MYSQL_SYSVAR(session),
 	MYSQL_SYSVAR(before_after),
 	MYSQL_SYSVAR(json_socket_write_timeout),
+	MYSQL_SYSVAR(json_file_async),
+	MYSQL_SYSVAR(json_file_async_queue_size),
+	MYSQL_SYSVAR(json_file_async_overflow),
+	MYSQL_SYSVAR(json_socket_async),
+	MYSQL_SYSVAR(json_socket_async_queue_size),
+	MYSQL_SYSVAR(json_socket_async_overflow),
+	MYSQL_SYSVAR(json_file_format),
+	MYSQL_SYSVAR(json_socket_format),
 
 	NULL
 };
@@ -2530,8 +3325,10 @@ extern "C" void __attribute__ ((constructor)) audit_plugin_so_init(void)
 				log_prefix, audit_plugin.interface_version >> 8);
 	}
 
-	memset(peer_info_init_value, '0', sizeof(peer_info_init_value)-1);
-	peer_info_init_value[sizeof(peer_info_init_value) - 1] = '\0';
+#ifndef HAVE_AUDIT_SESSION
+	memset(session_init_value, '0', sizeof(session_init_value)-1);
+	session_init_value[sizeof(session_init_value) - 1] = '\0';
+#endif
 }
 #elif MYSQL_VERSION_ID < 50600
 extern struct st_mysql_plugin *mysql_mandatory_plugins[];
@@ -2542,8 +3339,10 @@ extern "C"  void __attribute__ ((constructor)) audit_plugin_so_init(void)
 			log_prefix, audit_plugin.interface_version,
 			audit_plugin.interface_version >> 8);
 
-	memset(peer_info_init_value, '0', sizeof(peer_info_init_value)-1);
-	peer_info_init_value[sizeof(peer_info_init_value) - 1] = '\0';
+#ifndef HAVE_AUDIT_SESSION
+	memset(session_init_value, '0', sizeof(session_init_value)-1);
+	session_init_value[sizeof(session_init_value) - 1] = '\0';
+#endif
 }
 #elif !defined(MARIADB_BASE_VERSION) && MYSQL_VERSION_ID < 50709
 // Interface version for MySQL 5.6 changed in 5.6.14.
@@ -2559,16 +3358,6 @@ extern "C"  void __attribute__ ((constructor)) audit_plugin_so_init(void)
 	{
 		audit_plugin.interface_version = 0x0301;
 	}
-
-	memset(peer_info_init_value, '0', sizeof(peer_info_init_value)-1);
-	peer_info_init_value[sizeof(peer_info_init_value) - 1] = '\0';
-}
-#else
-// 5.7
-extern "C"  void __attribute__ ((constructor)) audit_plugin_so_init(void)
-{
-	memset(peer_info_init_value, '0', sizeof(peer_info_init_value)-1);
-	peer_info_init_value[sizeof(peer_info_init_value) - 1] = '\0';
 }
 #endif
 
@@ -0,0 +1,145 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_queue.cc
+ */
+
+#include "audit_queue.h"
+#include <stddef.h>
+
+AuditRecord *AuditRecord::create(const char *data, size_t len)
+{
+	AuditRecord *rec = (AuditRecord *) malloc(offsetof(AuditRecord, data) + len);
+	if (rec)
+	{
+		rec->len = len;
+		memcpy(rec->data, data, len);
+	}
+	return rec;
+}
+
+void AuditRecord::destroy(AuditRecord *rec)
+{
+	free(rec);
+}
+
+int Audit_record_queue::init(size_t size)
+{
+	size_t n = 2;
+	while (n < size)
+	{
+		n <<= 1;
+	}
+	m_slots = (Slot *) malloc(n * sizeof(Slot));
+	if (! m_slots)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		m_slots[i].seq = i;
+		m_slots[i].rec = NULL;
+	}
+	m_mask = n - 1;
+	m_tail = 0;
+	m_head = 0;
+	return 0;
+}
+
+void Audit_record_queue::destroy()
+{
+	if (m_slots)
+	{
+		AuditRecord *rec;
+		while ((rec = pop()) != NULL)
+		{
+			AuditRecord::destroy(rec);
+		}
+		free(m_slots);
+		m_slots = NULL;
+	}
+}
+
+bool Audit_record_queue::push(AuditRecord *rec)
+{
+	Slot *slot;
+	size_t pos = m_tail;
+	for (;;)
+	{
+		slot = &m_slots[pos & m_mask];
+		size_t seq = slot->seq;
+		audit_compiler_barrier();
+		ssize_t dif = (ssize_t) seq - (ssize_t) pos;
+		if (dif == 0)
+		{
+			// slot is free for this lap. try to claim it
+			if (audit_atomic_cas(&m_tail, pos, pos + 1))
+			{
+				break;
+			}
+			pos = m_tail;
+		}
+		else if (dif < 0)
+		{
+			// slot still holds a record from the previous lap: full
+			return false;
+		}
+		else
+		{
+			// another producer claimed it. reload
+			pos = m_tail;
+		}
+	}
+	slot->rec = rec;
+	audit_compiler_barrier();
+	// publish to the consumer
+	slot->seq = pos + 1;
+	return true;
+}
+
+AuditRecord *Audit_record_queue::pop()
+{
+	Slot *slot;
+	size_t pos = m_head;
+	for (;;)
+	{
+		slot = &m_slots[pos & m_mask];
+		size_t seq = slot->seq;
+		audit_compiler_barrier();
+		ssize_t dif = (ssize_t) seq - (ssize_t) (pos + 1);
+		if (dif == 0)
+		{
+			if (audit_atomic_cas(&m_head, pos, pos + 1))
+			{
+				break;
+			}
+			pos = m_head;
+		}
+		else if (dif < 0)
+		{
+			// empty
+			return NULL;
+		}
+		else
+		{
+			pos = m_head;
+		}
+	}
+	AuditRecord *rec = slot->rec;
+	audit_compiler_barrier();
+	// release the slot for the next lap
+	slot->seq = pos + m_mask + 1;
+	return rec;
+}
@@ -0,0 +1,759 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_rules.cc
+ */
+
+#include "audit_rules.h"
+#include "audit_buffer.h"
+#include <yajl/yajl_parse.h>
+#include <ctype.h>
+#include <stdio.h>
+
+// keys of the rules file
+enum rules_key {
+	KEY_NONE = 0,
+	KEY_RULES,
+	KEY_DEFAULT,
+	KEY_ACTION,
+	KEY_CMDS,
+	KEY_USERS,
+	KEY_HOSTS,
+	KEY_DBS,
+	KEY_OBJS,
+	KEY_MIN_ROWS,
+	KEY_MAX_ROWS,
+	KEY_QUERY
+};
+
+static const struct {
+	const char *name;
+	rules_key key;
+} rules_keys[] = {
+	{ "rules", KEY_RULES },
+	{ "default", KEY_DEFAULT },
+	{ "action", KEY_ACTION },
+	{ "cmds", KEY_CMDS },
+	{ "users", KEY_USERS },
+	{ "hosts", KEY_HOSTS },
+	{ "dbs", KEY_DBS },
+	{ "objs", KEY_OBJS },
+	{ "min_rows", KEY_MIN_ROWS },
+	{ "max_rows", KEY_MAX_ROWS },
+	{ "query", KEY_QUERY },
+	{ NULL, KEY_NONE }
+};
+
+// nesting levels of the rules file
+enum rules_depth {
+	DEPTH_TOP = 1,	// the top map
+	DEPTH_RULES,	// the rules array
+	DEPTH_RULE,	// a rule map
+	DEPTH_LIST	// a list of a rule
+};
+
+// max number of conditions of a rule (one per key)
+static const int MAX_RULE_OPS = 8;
+
+// rule without cmds: applies to all commands
+static const size_t NO_CMDS = (size_t) -1;
+
+// where the ops of a rule start and the offset of its cmds in the parser
+struct rule_info {
+	size_t start;
+	size_t cmds;	// offset in Audit_rules_parser::m_cmds. NO_CMDS if not set
+};
+
+void Audit_rules::op_free(Op *op)
+{
+	switch (op->code)
+	{
+	case OP_DBS:
+	case OP_OBJS:
+		Audit_obj_set::release(op->arg.objs);
+		break;
+	case OP_USERS:
+		Audit_user_set::release(op->arg.users);
+		break;
+	case OP_HOSTS:
+		free(op->arg.hosts);
+		break;
+	case OP_QUERY:
+		if (op->arg.query.extra)
+		{
+			pcre_free_study(op->arg.query.extra);
+		}
+		pcre_free(op->arg.query.re);
+		break;
+	default:
+		break;
+	}
+	op->code = OP_LOG;
+}
+
+void Audit_rules::release(Audit_rules *rules)
+{
+	if (! rules || audit_atomic_sub(&rules->m_refs, 1) != 1)
+	{
+		return;
+	}
+	for (size_t i = 0; i < rules->m_num_ops; i++)
+	{
+		op_free(&rules->m_ops[i]);
+	}
+	free(rules->m_ops);
+	free(rules->m_cmd_index);
+	free(rules->m_cmd_rules);
+	free(rules);
+}
+
+/**
+ * Builds the rules from the yajl parse callbacks.
+ */
+struct Audit_rules_parser {
+	Audit_rules_parser(audit_cmd_name_func cmd_name, int num_cmds,
+			char *error, size_t error_len)
+		: m_cmd_name(cmd_name), m_num_cmds(num_cmds), m_depth(0),
+		  m_key(KEY_NONE), m_num_rule_ops(0), m_rule_keys(0),
+		  m_action(Audit_rules::OP_LOG), m_rule_cmds(NO_CMDS),
+		  m_default_log(false), m_error(error), m_error_len(error_len)
+	{
+		m_error[0] = '\0';
+	}
+
+	~Audit_rules_parser()
+	{
+		free_rule();
+		Audit_rules::Op *ops = (Audit_rules::Op *) m_ops.data();
+		size_t num_ops = m_ops.length() / sizeof(Audit_rules::Op);
+		for (size_t i = 0; i < num_ops; i++)
+		{
+			Audit_rules::op_free(&ops[i]);
+		}
+	}
+
+	// set the error message. Always returns 0 to stop the parse
+	int fail(const char *msg, const char *arg = "")
+	{
+		if (! m_error[0])
+		{
+			snprintf(m_error, m_error_len, msg, arg);
+		}
+		return 0;
+	}
+
+	int out_of_memory()
+	{
+		return fail("out of memory");
+	}
+
+	void free_rule()
+	{
+		for (int i = 0; i < m_num_rule_ops; i++)
+		{
+			Audit_rules::op_free(&m_rule_ops[i]);
+		}
+		m_num_rule_ops = 0;
+	}
+
+	// add a condition to the current rule
+	Audit_rules::Op *add_op(int code)
+	{
+		Audit_rules::Op *op = &m_rule_ops[m_num_rule_ops++];
+		memset(op, 0, sizeof(*op));
+		op->code = code;
+		return op;
+	}
+
+	Audit_rules::Op *cur_op()
+	{
+		return &m_rule_ops[m_num_rule_ops - 1];
+	}
+
+	int start_list();
+	int list_entry(const char *str, size_t len);
+	int end_list();
+	int end_rule();
+	int string_value(const char *str, size_t len);
+	int integer_value(long long val);
+	Audit_rules *build();
+
+	audit_cmd_name_func m_cmd_name;
+	int m_num_cmds;
+	int m_depth;
+	rules_key m_key;
+	// conditions of the rule being parsed
+	Audit_rules::Op m_rule_ops[MAX_RULE_OPS];
+	int m_num_rule_ops;
+	// bit per key seen in the rule being parsed
+	unsigned int m_rule_keys;
+	int m_action;
+	// offset in m_cmds of the cmds of the rule being parsed
+	size_t m_rule_cmds;
+	// hosts list being parsed
+	Audit_buffer m_list;
+	// lower case cmds of all rules. each ends with \0, each list with an empty one
+	Audit_buffer m_cmds;
+	// ops of all rules
+	Audit_buffer m_ops;
+	// rule_info of all rules
+	Audit_buffer m_rules;
+	bool m_default_log;
+	char *m_error;
+	size_t m_error_len;
+};
+
+int Audit_rules_parser::start_list()
+{
+	switch (m_key)
+	{
+	case KEY_CMDS:
+		m_rule_cmds = m_cmds.length();
+		return 1;
+	case KEY_USERS:
+		if (! (add_op(Audit_rules::OP_USERS)->arg.users = Audit_user_set::create()))
+		{
+			return out_of_memory();
+		}
+		return 1;
+	case KEY_DBS:
+	case KEY_OBJS:
+		if (! (add_op(m_key == KEY_DBS ? Audit_rules::OP_DBS : Audit_rules::OP_OBJS)->arg.objs
+			= Audit_obj_set::create()))
+		{
+			return out_of_memory();
+		}
+		return 1;
+	case KEY_HOSTS:
+		m_list.reset(0);
+		add_op(Audit_rules::OP_HOSTS);
+		return 1;
+	default:
+		return fail("unexpected list");
+	}
+}
+
+int Audit_rules_parser::list_entry(const char *str, size_t len)
+{
+	bool res = true;
+	switch (m_key)
+	{
+	case KEY_CMDS:
+	case KEY_HOSTS:
+	{
+		Audit_buffer *buf = (m_key == KEY_CMDS) ? &m_cmds : &m_list;
+		if (len == 0)
+		{
+			// an empty entry would end the list
+			return 1;
+		}
+		for (size_t i = 0; i < len && res; i++)
+		{
+			char c = tolower((unsigned char) str[i]);
+			res = buf->append(&c, 1);
+		}
+		res = res && buf->append("", 1);
+		break;
+	}
+	case KEY_USERS:
+		res = cur_op()->arg.users->add_list(str, len);
+		break;
+	case KEY_OBJS:
+		res = cur_op()->arg.objs->add_list(str, len);
+		break;
+	case KEY_DBS:
+	{
+		// match any object of the db
+		Audit_buffer entry;
+		res = entry.append(str, len) && entry.append(".*", 2)
+			&& cur_op()->arg.objs->add_list(entry.data(), entry.length());
+		break;
+	}
+	default:
+		break;
+	}
+	return res ? 1 : out_of_memory();
+}
+
+int Audit_rules_parser::end_list()
+{
+	switch (m_key)
+	{
+	case KEY_CMDS:
+		return m_cmds.append("", 1) ? 1 : out_of_memory();
+	case KEY_HOSTS:
+	{
+		if (! m_list.append("", 1))
+		{
+			return out_of_memory();
+		}
+		char *hosts = (char *) malloc(m_list.length());
+		if (! hosts)
+		{
+			return out_of_memory();
+		}
+		memcpy(hosts, m_list.data(), m_list.length());
+		cur_op()->arg.hosts = hosts;
+		return 1;
+	}
+	default:
+		return 1;
+	}
+}
+
+int Audit_rules_parser::string_value(const char *str, size_t len)
+{
+	if (m_depth == DEPTH_LIST)
+	{
+		return list_entry(str, len);
+	}
+	bool log = (len == 3 && strncasecmp(str, "log", 3) == 0);
+	bool skip = (len == 4 && strncasecmp(str, "skip", 4) == 0);
+	if (m_depth == DEPTH_TOP && m_key == KEY_DEFAULT)
+	{
+		if (! log && ! skip)
+		{
+			return fail("default should be log or skip");
+		}
+		m_default_log = log;
+		return 1;
+	}
+	if (m_depth != DEPTH_RULE)
+	{
+		return fail("unexpected string");
+	}
+	if (m_key == KEY_ACTION)
+	{
+		if (! log && ! skip)
+		{
+			return fail("action should be log or skip");
+		}
+		m_action = log ? Audit_rules::OP_LOG : Audit_rules::OP_SKIP;
+		return 1;
+	}
+	if (m_key != KEY_QUERY)
+	{
+		return fail("unexpected string");
+	}
+	Audit_buffer pattern;
+	if (! pattern.append(str, len) || ! pattern.append("", 1))
+	{
+		return out_of_memory();
+	}
+	const char *error;
+	int erroffset;
+	// not PCRE_UTF8: the query is in the charset of the connection
+	pcre *re = pcre_compile(pattern.data(), PCRE_DOTALL | PCRE_CASELESS,
+			&error, &erroffset, NULL);
+	if (! re)
+	{
+		return fail("invalid query regex: %s", error);
+	}
+	Audit_rules::Op *op = add_op(Audit_rules::OP_QUERY);
+	op->arg.query.re = re;
+	op->arg.query.extra = pcre_study(re, 0, &error);
+	return 1;
+}
+
+int Audit_rules_parser::integer_value(long long val)
+{
+	if (m_depth != DEPTH_RULE || (m_key != KEY_MIN_ROWS && m_key != KEY_MAX_ROWS))
+	{
+		return fail("unexpected number");
+	}
+	if (val < 0)
+	{
+		return fail("rows should not be negative");
+	}
+	add_op(m_key == KEY_MIN_ROWS ? Audit_rules::OP_MIN_ROWS : Audit_rules::OP_MAX_ROWS)->arg.rows = val;
+	return 1;
+}
+
+int Audit_rules_parser::end_rule()
+{
+	rule_info info;
+	info.start = m_ops.length() / sizeof(Audit_rules::Op);
+	info.cmds = m_rule_cmds;
+	// cheaper conditions first. the codes are in the order of cost
+	for (int i = 1; i < m_num_rule_ops; i++)
+	{
+		Audit_rules::Op op = m_rule_ops[i];
+		int j = i;
+		for (; j > 0 && m_rule_ops[j - 1].code > op.code; j--)
+		{
+			m_rule_ops[j] = m_rule_ops[j - 1];
+		}
+		m_rule_ops[j] = op;
+	}
+	Audit_rules::Op end;
+	memset(&end, 0, sizeof(end));
+	end.code = m_action;
+	if (! m_ops.reserve(sizeof(Audit_rules::Op) * (m_num_rule_ops + 1))
+		|| ! m_rules.append((const char *) &info, sizeof(info)))
+	{
+		return out_of_memory();
+	}
+	m_ops.append((const char *) m_rule_ops, sizeof(Audit_rules::Op) * m_num_rule_ops);
+	m_ops.append((const char *) &end, sizeof(end));
+	// the ops are now owned by m_ops
+	m_num_rule_ops = 0;
+	return 1;
+}
+
+// check if name starts with one of the lower case prefixes of cmds
+static bool cmds_match(const char *cmds, const char *name)
+{
+	for (; *cmds; cmds += strlen(cmds) + 1)
+	{
+		size_t j = 0;
+		while (cmds[j] && name[j] && cmds[j] == tolower((unsigned char) name[j]))
+		{
+			j++;
+		}
+		if (cmds[j] == '\0')
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+Audit_rules *Audit_rules_parser::build()
+{
+	const rule_info *infos = (const rule_info *) m_rules.data();
+	size_t num_rules = m_rules.length() / sizeof(rule_info);
+	size_t num_ops = m_ops.length() / sizeof(Audit_rules::Op);
+	Audit_rules *rules = (Audit_rules *) calloc(1, sizeof(Audit_rules));
+	if (! rules)
+	{
+		out_of_memory();
+		return NULL;
+	}
+	rules->m_refs = 1;
+	rules->m_default_log = m_default_log;
+	rules->m_num_rules = num_rules;
+	rules->m_num_cmds = m_num_cmds;
+	rules->m_cmd_index = (size_t *) malloc(sizeof(size_t) * (m_num_cmds + 1));
+	if (num_ops > 0)
+	{
+		rules->m_ops = (Audit_rules::Op *) malloc(m_ops.length());
+	}
+	if (! rules->m_cmd_index || (num_ops > 0 && ! rules->m_ops))
+	{
+		Audit_rules::release(rules);
+		out_of_memory();
+		return NULL;
+	}
+	// count the rules of each command to lay out the lists
+	size_t total = 0;
+	for (int cmd_id = 0; cmd_id < m_num_cmds; cmd_id++)
+	{
+		rules->m_cmd_index[cmd_id] = total;
+		const char *name = m_cmd_name(cmd_id);
+		for (size_t r = 0; r < num_rules && name; r++)
+		{
+			if (infos[r].cmds == NO_CMDS || cmds_match(m_cmds.data() + infos[r].cmds, name))
+			{
+				total++;
+			}
+		}
+		total++;	// -1 at the end
+	}
+	rules->m_cmd_rules = (long *) malloc(sizeof(long) * total);
+	if (! rules->m_cmd_rules)
+	{
+		Audit_rules::release(rules);
+		out_of_memory();
+		return NULL;
+	}
+	long *pos = rules->m_cmd_rules;
+	for (int cmd_id = 0; cmd_id < m_num_cmds; cmd_id++)
+	{
+		const char *name = m_cmd_name(cmd_id);
+		for (size_t r = 0; r < num_rules && name; r++)
+		{
+			if (infos[r].cmds == NO_CMDS || cmds_match(m_cmds.data() + infos[r].cmds, name))
+			{
+				*pos++ = (long) infos[r].start;
+			}
+		}
+		*pos++ = -1;
+	}
+	// the rules take over the ops
+	memcpy(rules->m_ops, m_ops.data(), m_ops.length());
+	rules->m_num_ops = num_ops;
+	m_ops.reset(0);
+	return rules;
+}
+
+// yajl callbacks
+static int rules_null(void *ctx)
+{
+	return ((Audit_rules_parser *) ctx)->fail("unexpected null");
+}
+
+static int rules_boolean(void *ctx, int val)
+{
+	return ((Audit_rules_parser *) ctx)->fail("unexpected boolean");
+}
+
+static int rules_integer(void *ctx, long long val)
+{
+	return ((Audit_rules_parser *) ctx)->integer_value(val);
+}
+
+static int rules_double(void *ctx, double val)
+{
+	return ((Audit_rules_parser *) ctx)->fail("unexpected number");
+}
+
+static int rules_string(void *ctx, const unsigned char *str, size_t len)
+{
+	return ((Audit_rules_parser *) ctx)->string_value((const char *) str, len);
+}
+
+static int rules_start_map(void *ctx)
+{
+	Audit_rules_parser *p = (Audit_rules_parser *) ctx;
+	if (p->m_depth == 0)
+	{
+		p->m_depth = DEPTH_TOP;
+		return 1;
+	}
+	if (p->m_depth == DEPTH_RULES)
+	{
+		p->m_depth = DEPTH_RULE;
+		p->m_rule_keys = 0;
+		p->m_rule_cmds = NO_CMDS;
+		p->m_action = Audit_rules::OP_LOG;
+		return 1;
+	}
+	return p->fail("unexpected map");
+}
+
+static int rules_map_key(void *ctx, const unsigned char *key, size_t len)
+{
+	Audit_rules_parser *p = (Audit_rules_parser *) ctx;
+	p->m_key = KEY_NONE;
+	for (size_t i = 0; rules_keys[i].name; i++)
+	{
+		if (strlen(rules_keys[i].name) == len
+			&& strncmp(rules_keys[i].name, (const char *) key, len) == 0)
+		{
+			p->m_key = rules_keys[i].key;
+			break;
+		}
+	}
+	bool top_key = (p->m_key == KEY_RULES || p->m_key == KEY_DEFAULT);
+	if (p->m_key == KEY_NONE || (p->m_depth == DEPTH_TOP) != top_key)
+	{
+		Audit_buffer name;
+		name.append((const char *) key, len);
+		name.append("", 1);
+		return p->fail("unknown key: %s", name.is_error() ? "" : name.data());
+	}
+	if (p->m_depth == DEPTH_RULE)
+	{
+		if (p->m_rule_keys & (1U << p->m_key))
+		{
+			return p->fail("duplicate key in rule");
+		}
+		p->m_rule_keys |= 1U << p->m_key;
+	}
+	return 1;
+}
+
+static int rules_end_map(void *ctx)
+{
+	Audit_rules_parser *p = (Audit_rules_parser *) ctx;
+	if (p->m_depth == DEPTH_RULE)
+	{
+		p->m_depth = DEPTH_RULES;
+		return p->end_rule();
+	}
+	p->m_depth = 0;
+	return 1;
+}
+
+static int rules_start_array(void *ctx)
+{
+	Audit_rules_parser *p = (Audit_rules_parser *) ctx;
+	if (p->m_depth == DEPTH_TOP && p->m_key == KEY_RULES)
+	{
+		p->m_depth = DEPTH_RULES;
+		return 1;
+	}
+	if (p->m_depth == DEPTH_RULE)
+	{
+		p->m_depth = DEPTH_LIST;
+		return p->start_list();
+	}
+	return p->fail("unexpected list");
+}
+
+static int rules_end_array(void *ctx)
+{
+	Audit_rules_parser *p = (Audit_rules_parser *) ctx;
+	if (p->m_depth == DEPTH_LIST)
+	{
+		p->m_depth = DEPTH_RULE;
+		return p->end_list();
+	}
+	p->m_depth = DEPTH_TOP;
+	return 1;
+}
+
+static const yajl_callbacks rules_callbacks = {
+	rules_null,
+	rules_boolean,
+	rules_integer,
+	rules_double,
+	NULL,
+	rules_string,
+	rules_start_map,
+	rules_map_key,
+	rules_end_map,
+	rules_start_array,
+	rules_end_array
+};
+
+Audit_rules *Audit_rules::create(const char *json, size_t len,
+		audit_cmd_name_func cmd_name, int num_cmds,
+		char *error, size_t error_len)
+{
+	Audit_rules_parser parser(cmd_name, num_cmds, error, error_len);
+	yajl_handle hand = yajl_alloc(&rules_callbacks, NULL, &parser);
+	if (! hand)
+	{
+		parser.out_of_memory();
+		return NULL;
+	}
+	yajl_config(hand, yajl_allow_comments, 1);
+	yajl_status status = yajl_parse(hand, (const unsigned char *) json, len);
+	if (status == yajl_status_ok)
+	{
+		status = yajl_complete_parse(hand);
+	}
+	if (status == yajl_status_error)
+	{
+		unsigned char *msg = yajl_get_error(hand, 0, (const unsigned char *) json, len);
+		parser.fail("%s", msg ? (const char *) msg : "invalid json");
+		// yajl ends the message with a new line
+		size_t end = strlen(error);
+		while (end > 0 && isspace((unsigned char) error[end - 1]))
+		{
+			error[--end] = '\0';
+		}
+		if (msg)
+		{
+			yajl_free_error(hand, msg);
+		}
+	}
+	yajl_free(hand);
+	if (status != yajl_status_ok)
+	{
+		return NULL;
+	}
+	return parser.build();
+}
+
+static bool objs_match(const Audit_obj_set *objs, Audit_rules_event *ev)
+{
+	if (! ev->start_objects())
+	{
+		return objs->match_empty();
+	}
+	const char *db_name = NULL;
+	const char *obj_name = NULL;
+	while (ev->next_object(&db_name, &obj_name))
+	{
+		if (db_name && obj_name && objs->match(db_name, obj_name))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool op_match(const Audit_rules::Op *op, Audit_rules_event *ev)
+{
+	switch (op->code)
+	{
+	case Audit_rules::OP_MIN_ROWS:
+		return ev->rows() >= op->arg.rows;
+	case Audit_rules::OP_MAX_ROWS:
+		return ev->rows() <= op->arg.rows;
+	case Audit_rules::OP_DBS:
+	{
+		const char *db = ev->db();
+		return db && op->arg.objs->match(db, "*");
+	}
+	case Audit_rules::OP_USERS:
+		return op->arg.users->match(ev->user(), ev->host(), ev->ip());
+	case Audit_rules::OP_HOSTS:
+	{
+		const char *host = ev->host();
+		const char *ip = ev->ip();
+		for (const char *p = op->arg.hosts; *p; p += strlen(p) + 1)
+		{
+			if ((host && audit_wild_match(p, host)) || (ip && audit_wild_match(p, ip)))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+	case Audit_rules::OP_OBJS:
+		return objs_match(op->arg.objs, ev);
+	case Audit_rules::OP_QUERY:
+	{
+		size_t len = 0;
+		const char *query = ev->query(&len);
+		int ovector[3];
+		return query && pcre_exec(op->arg.query.re, op->arg.query.extra,
+				query, len, 0, 0, ovector, 3) >= 0;
+	}
+	default:
+		return false;
+	}
+}
+
+bool Audit_rules::match(Audit_rules_event *ev, int cmd_id) const
+{
+	if (cmd_id < 0 || cmd_id >= m_num_cmds)
+	{
+		return m_default_log;
+	}
+	for (const long *r = m_cmd_rules + m_cmd_index[cmd_id]; *r >= 0; r++)
+	{
+		for (const Op *op = m_ops + *r; ; op++)
+		{
+			if (op->code == OP_LOG)
+			{
+				return true;
+			}
+			if (op->code == OP_SKIP)
+			{
+				return false;
+			}
+			if (! op_match(op, ev))
+			{
+				break;
+			}
+		}
+	}
+	return m_default_log;
+}
@@ -0,0 +1,166 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+
+/*
+ * audit_slab.cc
+ */
+
+#include "mysql_inc.h"
+#include "audit_slab.h"
+#include "audit_atomic.h"
+
+// an object on a free list
+struct Audit_slab_free {
+	Audit_slab_free *next;
+};
+
+struct Audit_slab_shard {
+	pthread_mutex_t lock;
+	Audit_slab_free *head;
+	// pad so shards don't share cache lines
+	char pad[AUDIT_CACHE_LINE_SIZE];
+};
+
+int Audit_slab::init(size_t count)
+{
+	if (m_region || count == 0)
+	{
+		return 0;
+	}
+	// objects hold the free list link and are pointer aligned
+	if (m_obj_size < sizeof(Audit_slab_free))
+	{
+		m_obj_size = sizeof(Audit_slab_free);
+	}
+	m_obj_size = (m_obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	m_region = (char *) malloc(count * m_obj_size);
+	m_shards = (Audit_slab_shard *) calloc(NUM_SHARDS, sizeof(Audit_slab_shard));
+	if (m_region == NULL || m_shards == NULL)
+	{
+		free(m_region);
+		free(m_shards);
+		m_region = NULL;
+		m_shards = NULL;
+		return 1;
+	}
+	m_region_end = m_region + count * m_obj_size;
+	for (unsigned int i = 0; i < NUM_SHARDS; i++)
+	{
+		pthread_mutex_init(&m_shards[i].lock, MY_MUTEX_INIT_FAST);
+	}
+	// spread the objects over the shards
+	for (size_t i = count; i > 0; i--)
+	{
+		Audit_slab_free *obj = (Audit_slab_free *) (m_region + (i - 1) * m_obj_size);
+		Audit_slab_shard *shard = &m_shards[(i - 1) % NUM_SHARDS];
+		obj->next = shard->head;
+		shard->head = obj;
+	}
+	m_size = count;
+	return 0;
+}
+
+void Audit_slab::deinit()
+{
+	// objects in use may still be released. Keep the region for them
+	// (and for the next init)
+	if (m_region == NULL || m_used > 0)
+	{
+		return;
+	}
+	for (unsigned int i = 0; i < NUM_SHARDS; i++)
+	{
+		pthread_mutex_destroy(&m_shards[i].lock);
+	}
+	free(m_shards);
+	free(m_region);
+	m_shards = NULL;
+	m_region = NULL;
+	m_region_end = NULL;
+	m_size = 0;
+}
+
+Audit_slab_shard *Audit_slab::thread_shard()
+{
+	unsigned long long id = (unsigned long long) pthread_self();
+	return &m_shards[(id * 0x9E3779B97F4A7C15ULL >> 32) % NUM_SHARDS];
+}
+
+void *Audit_slab::alloc()
+{
+	void *obj = NULL;
+	if (m_region)
+	{
+		Audit_slab_shard *own = thread_shard();
+		Audit_slab_shard *shard = own;
+		do
+		{
+			pthread_mutex_lock(&shard->lock);
+			Audit_slab_free *head = shard->head;
+			if (head)
+			{
+				shard->head = head->next;
+			}
+			pthread_mutex_unlock(&shard->lock);
+			if (head)
+			{
+				obj = head;
+				break;
+			}
+			// take from the next shard
+			shard = (shard + 1 == m_shards + NUM_SHARDS) ? m_shards : shard + 1;
+		}
+		while (shard != own);
+	}
+	if (obj)
+	{
+		memset(obj, 0, m_obj_size);
+	}
+	else
+	{
+		obj = calloc(1, m_obj_size);
+		if (obj == NULL)
+		{
+			return NULL;
+		}
+	}
+	long used = audit_atomic_add(&m_used, 1) + 1;
+	long high_water = m_high_water;
+	while (used > high_water && ! audit_atomic_cas(&m_high_water, high_water, used))
+	{
+		high_water = m_high_water;
+	}
+	return obj;
+}
+
+void Audit_slab::release(void *obj)
+{
+	if (obj == NULL)
+	{
+		return;
+	}
+	audit_atomic_sub(&m_used, 1);
+	if ((char *) obj < m_region || (char *) obj >= m_region_end)
+	{
+		free(obj);
+		return;
+	}
+	Audit_slab_shard *shard = thread_shard();
+	pthread_mutex_lock(&shard->lock);
+	((Audit_slab_free *) obj)->next = shard->head;
+	shard->head = (Audit_slab_free *) obj;
+	pthread_mutex_unlock(&shard->lock);
+}
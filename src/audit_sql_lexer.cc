@@ -0,0 +1,186 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+
+/*
+ * audit_sql_lexer.cc
+ */
+
+#include "audit_sql_lexer.h"
+#include <string.h>
+
+// the ctype.h functions are locale dependent calls. These are inlined
+
+static inline bool is_digit(unsigned char c)
+{
+	return (unsigned char) (c - '0') < 10;
+}
+
+static inline bool is_space(unsigned char c)
+{
+	return c == ' ' || (unsigned char) (c - '\t') < 5;
+}
+
+static inline bool is_word_char(unsigned char c)
+{
+	return (unsigned char) ((c | 0x20) - 'a') < 26 || is_digit(c)
+		|| c == '_' || c == '$' || c >= 0x80;
+}
+
+void Audit_sql_lexer::skip_space()
+{
+	while (m_pos < m_end)
+	{
+		unsigned char c = *m_pos;
+		size_t left = m_end - m_pos;
+		if (is_space(c))
+		{
+			m_pos++;
+		}
+		else if (c == '#' || (c == '-' && left >= 3 && m_pos[1] == '-'
+				&& ((unsigned char) m_pos[2] <= ' '))
+			|| (c == '-' && left == 2 && m_pos[1] == '-'))
+		{
+			// comment till the end of the line
+			while (m_pos < m_end && *m_pos != '\n')
+			{
+				m_pos++;
+			}
+		}
+		else if (c == '/' && left >= 3 && m_pos[1] == '*' && m_pos[2] == '!')
+		{
+			// executable comment: skip the /*! and version
+			m_pos += 3;
+			while (m_pos < m_end && is_digit(*m_pos))
+			{
+				m_pos++;
+			}
+			m_exec_comment = true;
+		}
+		else if (c == '/' && left >= 2 && m_pos[1] == '*')
+		{
+			const char *pos = m_pos + 2;
+			while (pos + 1 < m_end && ! (pos[0] == '*' && pos[1] == '/'))
+			{
+				pos++;
+			}
+			m_pos = (pos + 1 < m_end) ? pos + 2 : m_end;
+		}
+		else if (m_exec_comment && c == '*' && left >= 2 && m_pos[1] == '/')
+		{
+			m_pos += 2;
+			m_exec_comment = false;
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+const char *Audit_sql_lexer::skip_quoted(const char *pos, Audit_sql_token *tok)
+{
+	char quote = *pos++;
+	tok->text = pos;
+	while (pos < m_end)
+	{
+		if (*pos == '\\' && quote != '`')
+		{
+			pos += 2;
+		}
+		else if (*pos == quote)
+		{
+			if (pos + 1 < m_end && pos[1] == quote)
+			{
+				// doubled quote
+				pos += 2;
+			}
+			else
+			{
+				break;
+			}
+		}
+		else
+		{
+			pos++;
+		}
+	}
+	if (pos > m_end)
+	{
+		// ended with a backslash
+		pos = m_end;
+	}
+	tok->text_len = pos - tok->text;
+	// past the closing quote (if there is one)
+	return pos < m_end ? pos + 1 : m_end;
+}
+
+void Audit_sql_lexer::next(Audit_sql_token *tok)
+{
+	skip_space();
+	tok->start = m_pos;
+	tok->text = NULL;
+	tok->text_len = 0;
+	if (m_pos >= m_end)
+	{
+		tok->type = AUDIT_TOK_END;
+		tok->len = 0;
+		return;
+	}
+	unsigned char c = *m_pos;
+	const char *pos = m_pos;
+	if (c == '\'' || c == '"')
+	{
+		tok->type = AUDIT_TOK_STRING;
+		pos = skip_quoted(pos, tok);
+	}
+	else if (c == '`')
+	{
+		tok->type = AUDIT_TOK_IDENT;
+		pos = skip_quoted(pos, tok);
+	}
+	else if (is_digit(c) || (c == '.' && m_end - m_pos > 1 && is_digit(m_pos[1])))
+	{
+		tok->type = AUDIT_TOK_NUMBER;
+		bool hex = c == '0' && m_end - m_pos > 1 && (m_pos[1] == 'x' || m_pos[1] == 'X');
+		pos++;
+		while (pos < m_end && (is_word_char(*pos) || *pos == '.'
+			|| ((*pos == '+' || *pos == '-') && ! hex && (pos[-1] == 'e' || pos[-1] == 'E'))))
+		{
+			pos++;
+		}
+	}
+	else if (is_word_char(c))
+	{
+		tok->type = AUDIT_TOK_WORD;
+		while (pos < m_end && is_word_char(*pos))
+		{
+			pos++;
+		}
+		// charset introducer (_utf8'str', N'str') or hex/bit string (x'1F', b'01')
+		if (pos < m_end && (*pos == '\'' || *pos == '"')
+			&& (c == '_' || (pos - m_pos == 1 && strchr("nNxXbB", c))))
+		{
+			tok->type = AUDIT_TOK_STRING;
+			pos = skip_quoted(pos, tok);
+		}
+	}
+	else
+	{
+		tok->type = AUDIT_TOK_CHAR;
+		pos++;
+	}
+	tok->len = pos - m_pos;
+	m_pos = pos;
+}
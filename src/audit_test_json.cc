@@ -0,0 +1,246 @@
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA */
+
+/*
+ * audit_test_json.cc
+ *
+ * Differential test of Audit_json_writer::escape against yajl_gen_string
+ * on random strings: ascii, quotes, backslashes, control chars, utf8
+ * sequences and malformed bytes, of lengths around the scan block sizes.
+ *   - without utf8 validation the output should be the same as yajl's
+ *   - with validation, valid utf8 strings should also give yajl's output,
+ *     and for the other strings the output should be valid utf8
+ *
+ * Each escape scan (scalar, sse2, avx2) the cpu supports is tested.
+ *
+ * usage: audit_test_json [-n strings] [-s seed]
+ * Exits with 1 if there are differences.
+ */
+
+#include "audit_json.h"
+#include <yajl/yajl_gen.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static unsigned long long rnd_state = 88172645463325252ULL;
+
+// xorshift64
+static unsigned int rnd(unsigned int n)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return (unsigned int) (rnd_state % n);
+}
+
+// append the utf8 encoding of a random code point (no surrogates)
+static void utf8_append(Audit_buffer *str)
+{
+	unsigned int cp;
+	unsigned char b[4];
+	size_t n;
+	switch (rnd(3))
+	{
+	case 0:
+		cp = 0x80 + rnd(0x800 - 0x80);
+		b[0] = 0xC0 | (cp >> 6);
+		b[1] = 0x80 | (cp & 0x3F);
+		n = 2;
+		break;
+	case 1:
+		do
+		{
+			cp = 0x800 + rnd(0x10000 - 0x800);
+		} while (cp >= 0xD800 && cp <= 0xDFFF);
+		b[0] = 0xE0 | (cp >> 12);
+		b[1] = 0x80 | ((cp >> 6) & 0x3F);
+		b[2] = 0x80 | (cp & 0x3F);
+		n = 3;
+		break;
+	default:
+		cp = 0x10000 + rnd(0x110000 - 0x10000);
+		b[0] = 0xF0 | (cp >> 18);
+		b[1] = 0x80 | ((cp >> 12) & 0x3F);
+		b[2] = 0x80 | ((cp >> 6) & 0x3F);
+		b[3] = 0x80 | (cp & 0x3F);
+		n = 4;
+		break;
+	}
+	str->append((const char *) b, n);
+}
+
+/**
+ * Random string. Lengths are mostly short, some cross the 16/32 byte
+ * blocks of the scan and the 1024 bytes reserved up front.
+ * If valid_utf8, there are no malformed bytes.
+ */
+static void string_build(Audit_buffer *str, bool valid_utf8)
+{
+	static const char special[] = "\"\\/\b\f\n\r\t\x01\x1f\x7f";
+	size_t len;
+	switch (rnd(10))
+	{
+	case 0:
+		len = 1024 + rnd(2048);
+		break;
+	case 1:
+	case 2:
+		len = rnd(100);
+		break;
+	default:
+		len = rnd(40);
+		break;
+	}
+	// some strings are mostly plain ascii, so the escapes fall after long runs
+	unsigned int plain = rnd(2) ? 60 : 98;
+	str->reset(0);
+	while (str->length() < len)
+	{
+		unsigned int kind = rnd(100);
+		if (kind < plain)
+		{
+			char c = (char) (' ' + rnd(95));
+			str->append(&c, 1);
+		}
+		else if (kind < plain + (100 - plain) / 2)
+		{
+			str->append(&special[rnd(sizeof(special) - 1)], 1);
+		}
+		else if (valid_utf8 || rnd(2))
+		{
+			utf8_append(str);
+		}
+		else
+		{
+			// malformed: any byte, including a stray continuation or lead byte
+			char c = (char) (0x80 + rnd(0x80));
+			str->append(&c, 1);
+		}
+	}
+}
+
+// yajl output of the string, without the quotes. false if yajl refused it
+static bool yajl_escape(yajl_gen gen, const Audit_buffer *str, Audit_buffer *out)
+{
+	yajl_gen_clear(gen);
+	yajl_gen_reset(gen, NULL);
+	if (yajl_gen_string(gen, (const unsigned char *) str->data(), str->length()) != yajl_gen_status_ok)
+	{
+		return false;
+	}
+	const unsigned char *text;
+	size_t len;
+	yajl_gen_get_buf(gen, &text, &len);
+	out->reset(0);
+	out->append((const char *) text + 1, len - 2);
+	return true;
+}
+
+static void dump(const char *name, const Audit_buffer *buf)
+{
+	fprintf(stderr, "  %s (%zu):", name, buf->length());
+	for (size_t i = 0; i < buf->length() && i < 64; i++)
+	{
+		fprintf(stderr, " %02x", (unsigned char) buf->data()[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+static bool same(const Audit_buffer *a, const Audit_buffer *b)
+{
+	return a->length() == b->length() && memcmp(a->data(), b->data(), a->length()) == 0;
+}
+
+// run count random strings through the current scan. Return the number of differences
+static unsigned long test_run(unsigned long count, unsigned long long seed)
+{
+	yajl_gen gen = yajl_gen_alloc(NULL);
+	yajl_gen check = yajl_gen_alloc(NULL);
+	yajl_gen_config(check, yajl_gen_validate_utf8, 1);
+	Audit_buffer str;
+	Audit_buffer ours;
+	Audit_buffer theirs;
+	unsigned long diffs = 0;
+	rnd_state = seed;
+	for (unsigned long i = 0; i < count; i++)
+	{
+		bool valid_utf8 = rnd(2);
+		bool validate = rnd(2);
+		string_build(&str, valid_utf8);
+		ours.reset(0);
+		Audit_json_writer w(&ours, validate);
+		w.escape(str.data(), str.length());
+		bool ok;
+		if (! validate || valid_utf8)
+		{
+			ok = yajl_escape(gen, &str, &theirs) && same(&ours, &theirs);
+		}
+		else
+		{
+			// yajl refuses malformed utf8. Our output should pass its check
+			ok = yajl_escape(check, &ours, &theirs);
+		}
+		if (! ok)
+		{
+			if (++diffs <= 10)
+			{
+				fprintf(stderr, "string %lu differs (validate %d, valid utf8 %d)\n", i,
+						validate, valid_utf8);
+				dump("input", &str);
+				dump("escape", &ours);
+				dump("yajl", &theirs);
+			}
+		}
+	}
+	yajl_gen_free(check);
+	yajl_gen_free(gen);
+	return diffs;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long count = 200000;
+	unsigned long long seed = rnd_state;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10) | 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n strings] [-s seed]\n", argv[0]);
+			return 2;
+		}
+	}
+	// each scan the cpu supports, on the same strings
+	unsigned long total = 0;
+	const char *name;
+	for (size_t i = 0; (name = Audit_json_writer::scan_name(i)) != NULL; i++)
+	{
+		if (! Audit_json_writer::scan_select(name))
+		{
+			printf("%-8s not supported by the cpu\n", name);
+			continue;
+		}
+		unsigned long diffs = test_run(count, seed);
+		printf("%-8s %lu strings, %lu differences\n", name, count, diffs);
+		total += diffs;
+	}
+	return total ? 1 : 0;
+}